@@ -0,0 +1,228 @@
+#include "bench_common.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+// the default size sent in each direction of each pair (in MiB)
+constexpr uint64_t BENCH_DEFAULT_SIZE_MB = 32;
+
+static std::atomic<uint64_t> s_newCount{ 0 };
+
+// count all allocations by operator new (e.g. std::vector in the relay loop)
+void* operator new(size_t size)
+{
+    ++s_newCount;
+    auto p = malloc(size ? size : 1);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void* p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+    free(p);
+}
+
+int64_t GetBenchMicroseconds()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void StampBenchChunk(void* chunk)
+{
+    auto now = GetBenchMicroseconds();
+    memcpy(chunk, &now, sizeof(now));
+}
+
+int64_t ReadBenchChunkStamp(const void* chunk)
+{
+    int64_t stamp;
+    memcpy(&stamp, chunk, sizeof(stamp));
+    return stamp;
+}
+
+uint64_t GetBenchNewCount()
+{
+    return s_newCount;
+}
+
+int64_t GetBenchPercentile(std::vector<int64_t>& samples, double percentile)
+{
+    if (samples.empty())
+        return 0;
+    std::sort(samples.begin(), samples.end());
+    auto index = static_cast<size_t>(percentile / 100.0 * static_cast<double>(samples.size() - 1) + 0.5);
+    return samples[std::min(index, samples.size() - 1)];
+}
+
+static bool ParseSize(const char* psz, uint64_t unit, uint64_t* outSize)
+{
+    char* end;
+    auto value = strtoull(psz, &end, 10);
+    if (end == psz)
+        return false;
+    if (*end == 'k' || *end == 'K')
+    {
+        value *= 1024;
+        ++end;
+    }
+    else if (*end == 'm' || *end == 'M')
+    {
+        value *= 1024 * 1024;
+        ++end;
+    }
+    else
+        value *= unit;
+    if (*end || !value)
+        return false;
+    *outSize = value;
+    return true;
+}
+
+const char* GetBenchUsage()
+{
+    return
+        "Usage: relay-bench [core | transfer] [<options>]\n"
+        "  core     : RelayCore (scheduling of '--engine iocp') with in-memory I/O\n"
+        "  transfer : Transfer (relay of '--engine thread') with mock duplexes (Windows only)\n"
+        "  (both are run if omitted)\n"
+        "Options (the matrix of the default values is run for each omitted option):\n"
+        "  --chunk <size>    : size of chunks sent (in bytes; 'k' suffix for KiB) (default: 1k, 16k, 256k)\n"
+        "  --mode <mode>     : 'uni' (client to connector) or 'bi' (both directions) (default: uni, bi)\n"
+        "  --pairs <count>   : count of concurrent pairs (default: 1, 8)\n"
+        "  --coalesce <mode> : (transfer only) 'adaptive', 'latency', or 'throughput' (default: all)\n"
+        "  --size <size>     : size sent in each direction of each pair (in MiB; 'k' suffix for KiB) (default: 32)\n"
+        "  --threads <count> : (core only) count of threads delivering completions (default: count of processors)\n";
+}
+
+bool ParseBenchArguments(int argc, char** argv, std::vector<BenchCase>& outCases, std::string& outMessage)
+{
+    std::vector<BenchTarget> targets;
+    std::vector<size_t> chunkSizes;
+    std::vector<bool> directions;
+    std::vector<unsigned> pairCounts;
+    std::vector<BenchCoalesce> coalesces;
+    uint64_t totalSize = BENCH_DEFAULT_SIZE_MB * 1024 * 1024;
+    unsigned threadCount = 0;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--help" || arg == "-h")
+        {
+            outMessage.clear();
+            return false;
+        }
+        if (arg == "core")
+        {
+            targets.push_back(BenchTarget::Core);
+            continue;
+        }
+        if (arg == "transfer")
+        {
+#ifdef _WIN32
+            targets.push_back(BenchTarget::Transfer);
+            continue;
+#else
+            outMessage = "'transfer' is available only on Windows (Transfer and Duplex depend on Win32 events and overlapped I/O)";
+            return false;
+#endif
+        }
+        if (i + 1 >= argc)
+        {
+            outMessage = "Invalid option or missing value: " + arg;
+            return false;
+        }
+        std::string value = argv[++i];
+        uint64_t n;
+        if (arg == "--chunk" && ParseSize(value.c_str(), 1, &n) && n >= BENCH_MIN_CHUNK_SIZE && n <= 1024 * 1024)
+            chunkSizes.push_back(static_cast<size_t>(n));
+        else if (arg == "--mode" && (value == "uni" || value == "bi"))
+            directions.push_back(value == "bi");
+        else if (arg == "--pairs" && ParseSize(value.c_str(), 1, &n) && n <= 1024)
+            pairCounts.push_back(static_cast<unsigned>(n));
+        else if (arg == "--coalesce" && value == "adaptive")
+            coalesces.push_back(BenchCoalesce::Adaptive);
+        else if (arg == "--coalesce" && value == "latency")
+            coalesces.push_back(BenchCoalesce::Latency);
+        else if (arg == "--coalesce" && value == "throughput")
+            coalesces.push_back(BenchCoalesce::Throughput);
+        else if (arg == "--size" && ParseSize(value.c_str(), 1024 * 1024, &n))
+            totalSize = n;
+        else if (arg == "--threads" && ParseSize(value.c_str(), 1, &n) && n <= 256)
+            threadCount = static_cast<unsigned>(n);
+        else
+        {
+            outMessage = "Invalid option or value: " + arg + " " + value;
+            return false;
+        }
+    }
+    if (targets.empty())
+    {
+        targets.push_back(BenchTarget::Core);
+#ifdef _WIN32
+        targets.push_back(BenchTarget::Transfer);
+#endif
+    }
+    if (chunkSizes.empty())
+        chunkSizes = { 1024, 16 * 1024, 256 * 1024 };
+    if (directions.empty())
+        directions = { false, true };
+    if (pairCounts.empty())
+        pairCounts = { 1, 8 };
+    if (coalesces.empty())
+        coalesces = { BenchCoalesce::Adaptive, BenchCoalesce::Latency, BenchCoalesce::Throughput };
+
+    for (auto target : targets)
+    {
+        for (auto chunkSize : chunkSizes)
+        {
+            for (auto isBidirectional : directions)
+            {
+                for (auto pairCount : pairCounts)
+                {
+                    for (auto coalesce : coalesces)
+                    {
+                        outCases.push_back({ target, chunkSize, totalSize, pairCount, isBidirectional, coalesce, threadCount });
+                        // RelayCore does not coalesce
+                        if (target == BenchTarget::Core)
+                            break;
+                    }
+                }
+            }
+        }
+    }
+    return true;
+}
+
+std::string FormatBenchResult(const BenchCase& benchCase, BenchResult& result)
+{
+    static const char* const s_coalesceNames[] = { "adaptive", "latency", "throughput" };
+    auto megabytes = static_cast<double>(result.deliveredSize) / (1024.0 * 1024.0);
+    auto seconds = static_cast<double>(result.elapsedMicroseconds) / 1000000.0;
+    auto p50 = GetBenchPercentile(result.latencies, 50);
+    auto p99 = GetBenchPercentile(result.latencies, 99);
+    char line[256];
+    snprintf(line, sizeof(line),
+        "%-8s chunk=%-7zu mode=%-3s pairs=%-3u coalesce=%-10s : %9.1f MB/s, p50 %8lld us, p99 %8lld us, %8.2f allocs/MB",
+        benchCase.target == BenchTarget::Core ? "core" : "transfer",
+        benchCase.chunkSize,
+        benchCase.isBidirectional ? "bi" : "uni",
+        benchCase.pairCount,
+        benchCase.target == BenchTarget::Core ? "-" : s_coalesceNames[static_cast<int>(benchCase.coalesce)],
+        seconds > 0 ? megabytes / seconds : 0.0,
+        static_cast<long long>(p50),
+        static_cast<long long>(p99),
+        megabytes > 0 ? static_cast<double>(result.allocationCount) / megabytes : 0.0);
+    return line;
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+// Common parts of relay-bench: the benchmark cases, latency samples, and the report.
+// This file and bench_common.cpp depend only on the C++ standard library.
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+enum class BenchTarget
+{
+    // RelayCore (the scheduling of the iocp engine) with in-memory I/O
+    Core = 0,
+    // Transfer (the relay of the thread engine) with mock duplexes (Windows only)
+    Transfer,
+};
+
+// the coalescing mode passed to Transfer (same as CoalesceMode in options.h)
+enum class BenchCoalesce
+{
+    Adaptive = 0,
+    Latency,
+    Throughput,
+};
+
+struct BenchCase
+{
+    BenchTarget target;
+    // the size of each chunk produced by the sender (at least BENCH_MIN_CHUNK_SIZE)
+    size_t chunkSize;
+    // the size sent in each direction of each pair (in bytes)
+    uint64_t totalSize;
+    // the count of relay pairs running concurrently
+    unsigned pairCount;
+    // true to send in both directions (otherwise only from the client to the connector)
+    bool isBidirectional;
+    // (Transfer only)
+    BenchCoalesce coalesce;
+    // (RelayCore only) the count of threads delivering completions (0 for the count of processors)
+    unsigned threadCount;
+};
+
+// the smallest chunk size (each chunk begins with the time stamp of sending)
+constexpr size_t BENCH_MIN_CHUNK_SIZE = 16;
+
+struct BenchResult
+{
+    // bytes delivered to the receivers in all directions of all pairs
+    uint64_t deliveredSize;
+    // the time from starting the first pair to finishing the last pair
+    int64_t elapsedMicroseconds;
+    // the delay from sending each chunk to delivering it (in microseconds)
+    std::vector<int64_t> latencies;
+    // heap allocations made while running (operator new and the buffers allocated by the relay)
+    uint64_t allocationCount;
+};
+
+// Returns the monotonic time in microseconds
+int64_t GetBenchMicroseconds();
+// Writes the time stamp to the head of the chunk, and reads it
+void StampBenchChunk(void* chunk);
+int64_t ReadBenchChunkStamp(const void* chunk);
+
+// Returns the count of operator new calls made by the process so far
+uint64_t GetBenchNewCount();
+
+// Returns the percentile (0-100) of the samples (sorts the samples)
+int64_t GetBenchPercentile(std::vector<int64_t>& samples, double percentile);
+
+// Parses the command line into the cases to run; returns false (with the message) for invalid arguments
+// (with the empty message for '--help').
+// Without the options for the case, runs the default matrix of chunk sizes, directions, pair counts,
+// and coalescing modes.
+bool ParseBenchArguments(int argc, char** argv, std::vector<BenchCase>& outCases, std::string& outMessage);
+// Returns the usage text of the command line
+const char* GetBenchUsage();
+
+// Runs the case and retrieves the result; returns false (with the message) on failure
+// (RunCoreBench is in core_bench.cpp, and RunTransferBench is in transfer_bench.cpp)
+bool RunCoreBench(const BenchCase& benchCase, BenchResult& outResult, std::string& outMessage);
+#ifdef _WIN32
+bool RunTransferBench(const BenchCase& benchCase, BenchResult& outResult, std::string& outMessage);
+#endif
+
+// Formats one line of the report (MB/s, p50/p99 latency, and allocations per MB)
+std::string FormatBenchResult(const BenchCase& benchCase, BenchResult& result);
@@ -0,0 +1,46 @@
+// relay-bench: measures the relay loops with mock I/O (see GetBenchUsage for the options)
+
+#include "bench_common.h"
+
+#include <cstdio>
+
+int main(int argc, char** argv)
+{
+    std::vector<BenchCase> cases;
+    std::string message;
+    if (!ParseBenchArguments(argc, argv, cases, message))
+    {
+        if (message.empty())
+        {
+            printf("%s", GetBenchUsage());
+            return 0;
+        }
+        fprintf(stderr, "%s\n%s", message.c_str(), GetBenchUsage());
+        return 2;
+    }
+
+    int failedCount = 0;
+    for (auto& benchCase : cases)
+    {
+        BenchResult result = {};
+        bool isSucceeded;
+        if (benchCase.target == BenchTarget::Core)
+            isSucceeded = RunCoreBench(benchCase, result, message);
+#ifdef _WIN32
+        else
+            isSucceeded = RunTransferBench(benchCase, result, message);
+#else
+        else
+            isSucceeded = false;
+#endif
+        if (!isSucceeded)
+        {
+            fprintf(stderr, "%s\n", message.c_str());
+            ++failedCount;
+            continue;
+        }
+        printf("%s\n", FormatBenchResult(benchCase, result).c_str());
+        fflush(stdout);
+    }
+    return failedCount > 0 ? 1 : 0;
+}
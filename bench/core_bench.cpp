@@ -0,0 +1,343 @@
+// Benchmark of RelayCore (the scheduling of the iocp engine) with in-memory I/O.
+// The reads produce time-stamped chunks without copying data, and the writes consume them,
+// so the result shows the cost of the scheduling, not of the actual I/O.
+// Completions are delivered by a fixed count of threads shared by all pairs, as the completion port does.
+
+#include "bench_common.h"
+#include "relay_core.h"
+
+#include <condition_variable>
+#include <cstdlib>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// the status of the cancelled operation
+constexpr RelayStatus BENCH_STATUS_CANCELLED = -1;
+
+struct BenchChunk
+{
+    size_t size;
+    BenchChunk* nextFree;
+    // (data follows)
+
+    unsigned char* GetData() { return reinterpret_cast<unsigned char*>(this + 1); }
+};
+
+class MemoryRelayIo;
+
+enum class CompletionKind
+{
+    Read,
+    Write,
+};
+
+struct Completion
+{
+    MemoryRelayIo* io;
+    CompletionKind kind;
+    int channel;
+};
+
+// the queue of completions shared by all pairs (the stand-in of the completion port)
+class CompletionQueue
+{
+public:
+    explicit CompletionQueue(size_t capacity)
+        : m_ring(capacity)
+        , m_head(0)
+        , m_count(0)
+        , m_isQuitting(false)
+    {
+    }
+
+    void Push(const Completion& completion)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            m_ring[(m_head + m_count) % m_ring.size()] = completion;
+            ++m_count;
+        }
+        m_available.notify_one();
+    }
+
+    // Returns false when quitting
+    bool Pop(Completion& outCompletion)
+    {
+        std::unique_lock<std::mutex> lock(m_lock);
+        m_available.wait(lock, [this]() { return m_count > 0 || m_isQuitting; });
+        if (!m_count)
+            return false;
+        outCompletion = m_ring[m_head];
+        m_head = (m_head + 1) % m_ring.size();
+        --m_count;
+        return true;
+    }
+
+    void Quit()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            m_isQuitting = true;
+        }
+        m_available.notify_all();
+    }
+
+private:
+    std::mutex m_lock;
+    std::condition_variable m_available;
+    // allocated on start, so that pushing never allocates
+    std::vector<Completion> m_ring;
+    size_t m_head;
+    size_t m_count;
+    bool m_isQuitting;
+};
+
+class MemoryRelayIo : public RelayCoreIo
+{
+public:
+    MemoryRelayIo(CompletionQueue* queue, size_t chunkSize, uint64_t totalSize, bool isBidirectional)
+        : m_queue(queue)
+        , m_core(this)
+        , m_chunkSize(chunkSize)
+        , m_remaining{ totalSize, isBidirectional ? totalSize : 0 }
+        , m_isIdle{ false, !isBidirectional }
+        , m_isParked{}
+        , m_isCancelled{}
+        , m_writes{}
+        , m_pFreeChunks(nullptr)
+        , m_allocationCount(0)
+        , m_deliveredSize(0)
+        , m_isFinished(false)
+        , m_result(0)
+    {
+        // reserve the samples before running not to count the allocations
+        m_latencies.reserve(static_cast<size_t>(totalSize / chunkSize + 1) * 2);
+    }
+
+    ~MemoryRelayIo()
+    {
+        while (m_pFreeChunks)
+        {
+            auto next = m_pFreeChunks->nextFree;
+            free(m_pFreeChunks);
+            m_pFreeChunks = next;
+        }
+    }
+
+    void Start() { m_core.Start(); }
+
+    void WaitFinished()
+    {
+        std::unique_lock<std::mutex> lock(m_lock);
+        m_finished.wait(lock, [this]() { return m_isFinished; });
+    }
+
+    RelayStatus GetResult() const { return m_result; }
+    uint64_t GetDeliveredSize() const { return m_deliveredSize; }
+    uint64_t GetAllocationCount() const { return m_allocationCount; }
+    const std::vector<int64_t>& GetLatencies() const { return m_latencies; }
+
+    void Process(const Completion& completion)
+    {
+        auto channel = completion.channel;
+        if (completion.kind == CompletionKind::Read)
+        {
+            BenchChunk* chunk = nullptr;
+            RelayStatus status = 0;
+            {
+                std::lock_guard<std::mutex> lock(m_lock);
+                if (m_isCancelled[channel])
+                    status = BENCH_STATUS_CANCELLED;
+                else if (m_remaining[channel] > 0)
+                {
+                    chunk = AllocateChunkLocked();
+                    if (!chunk)
+                        status = BENCH_STATUS_CANCELLED;
+                    else
+                    {
+                        chunk->size = m_remaining[channel] < m_chunkSize ? static_cast<size_t>(m_remaining[channel]) : m_chunkSize;
+                        m_remaining[channel] -= chunk->size;
+                    }
+                }
+            }
+            if (chunk)
+                StampBenchChunk(chunk->GetData());
+            // (null chunk without the failure for EOF)
+            m_core.OnReadCompleted(channel, status, chunk);
+        }
+        else
+        {
+            auto& write = m_writes[channel];
+            size_t writtenSize = 0;
+            auto now = GetBenchMicroseconds();
+            {
+                std::lock_guard<std::mutex> lock(m_lock);
+                for (size_t i = 0; i < write.count; ++i)
+                {
+                    auto chunk = write.chunks[i];
+                    auto skip = i == 0 ? write.offset : 0;
+                    // the latency is of the chunk written from its head
+                    if (!skip)
+                        m_latencies.push_back(now - ReadBenchChunkStamp(chunk->GetData()));
+                    writtenSize += chunk->size - skip;
+                }
+                m_deliveredSize += writtenSize;
+            }
+            m_core.OnWriteCompleted(channel, 0, writtenSize);
+        }
+    }
+
+    virtual RelayStatus StartRead(int channel)
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        if (m_isIdle[channel])
+        {
+            // nothing is sent in this direction; the read is completed only by CancelAll
+            m_isParked[channel] = true;
+            return 0;
+        }
+        m_queue->Push({ this, CompletionKind::Read, channel });
+        return 0;
+    }
+
+    virtual RelayStatus StartWrite(int channel, void* const* chunks, size_t count, size_t offset)
+    {
+        auto& write = m_writes[channel];
+        for (size_t i = 0; i < count; ++i)
+            write.chunks[i] = static_cast<BenchChunk*>(chunks[i]);
+        write.count = count;
+        write.offset = offset;
+        m_queue->Push({ this, CompletionKind::Write, channel });
+        return 0;
+    }
+
+    virtual void CancelAll()
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        for (int channel = 0; channel < 2; ++channel)
+        {
+            m_isCancelled[channel] = true;
+            if (m_isParked[channel])
+            {
+                m_isParked[channel] = false;
+                m_queue->Push({ this, CompletionKind::Read, channel });
+            }
+        }
+    }
+
+    virtual size_t GetChunkSize(void* chunk) { return static_cast<BenchChunk*>(chunk)->size; }
+
+    virtual void ReleaseChunk(void* chunk)
+    {
+        // keep the chunk for the next read (as RelayBuffer does)
+        std::lock_guard<std::mutex> lock(m_lock);
+        auto p = static_cast<BenchChunk*>(chunk);
+        p->nextFree = m_pFreeChunks;
+        m_pFreeChunks = p;
+    }
+
+    virtual void OnFinished(RelayStatus result)
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_result = result;
+        m_isFinished = true;
+        m_finished.notify_all();
+    }
+
+private:
+    struct PendingWrite
+    {
+        BenchChunk* chunks[RELAY_CORE_MAX_QUEUED_CHUNKS];
+        size_t count;
+        size_t offset;
+    };
+
+    BenchChunk* AllocateChunkLocked()
+    {
+        auto chunk = m_pFreeChunks;
+        if (chunk)
+        {
+            m_pFreeChunks = chunk->nextFree;
+            return chunk;
+        }
+        ++m_allocationCount;
+        return static_cast<BenchChunk*>(malloc(sizeof(BenchChunk) + m_chunkSize));
+    }
+
+    CompletionQueue* m_queue;
+    RelayCore m_core;
+    size_t m_chunkSize;
+    std::mutex m_lock;
+    std::condition_variable m_finished;
+    // bytes left to send from the endpoint read by each channel
+    uint64_t m_remaining[2];
+    // true if nothing is sent on the channel (in the unidirectional case)
+    bool m_isIdle[2];
+    bool m_isParked[2];
+    bool m_isCancelled[2];
+    // (set in StartWrite and read in Process, ordered by the queue)
+    PendingWrite m_writes[2];
+    BenchChunk* m_pFreeChunks;
+    uint64_t m_allocationCount;
+    uint64_t m_deliveredSize;
+    std::vector<int64_t> m_latencies;
+    bool m_isFinished;
+    RelayStatus m_result;
+};
+
+bool RunCoreBench(const BenchCase& benchCase, BenchResult& outResult, std::string& outMessage)
+{
+    auto threadCount = benchCase.threadCount;
+    if (!threadCount)
+        threadCount = std::thread::hardware_concurrency();
+    if (!threadCount)
+        threadCount = 1;
+
+    // each pair has at most one read and one write pending on each channel
+    CompletionQueue queue(benchCase.pairCount * 4);
+    std::vector<MemoryRelayIo*> pairs;
+    for (unsigned i = 0; i < benchCase.pairCount; ++i)
+        pairs.push_back(new MemoryRelayIo(&queue, benchCase.chunkSize, benchCase.totalSize, benchCase.isBidirectional));
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < threadCount; ++i)
+    {
+        threads.emplace_back([&queue]() {
+            Completion completion;
+            while (queue.Pop(completion))
+                completion.io->Process(completion);
+        });
+    }
+
+    auto newCountStart = GetBenchNewCount();
+    auto timeStart = GetBenchMicroseconds();
+    for (auto pair : pairs)
+        pair->Start();
+    for (auto pair : pairs)
+        pair->WaitFinished();
+    auto timeEnd = GetBenchMicroseconds();
+    auto newCount = GetBenchNewCount() - newCountStart;
+
+    queue.Quit();
+    for (auto& thread : threads)
+        thread.join();
+
+    bool isSucceeded = true;
+    outResult.deliveredSize = 0;
+    outResult.elapsedMicroseconds = timeEnd - timeStart;
+    outResult.latencies.clear();
+    outResult.allocationCount = newCount;
+    for (auto pair : pairs)
+    {
+        if (pair->GetResult() < 0)
+        {
+            outMessage = "The relay failed: " + std::to_string(pair->GetResult());
+            isSucceeded = false;
+        }
+        outResult.deliveredSize += pair->GetDeliveredSize();
+        outResult.allocationCount += pair->GetAllocationCount();
+        outResult.latencies.insert(outResult.latencies.end(), pair->GetLatencies().begin(), pair->GetLatencies().end());
+        delete pair;
+    }
+    return isSucceeded;
+}
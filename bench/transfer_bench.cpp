@@ -0,0 +1,233 @@
+// Benchmark of Transfer (the relay of the thread engine) with mock duplexes.
+// Windows only: Transfer waits for the events of Duplex with WaitForMultipleObjects,
+// and RelayBuffer uses the interlocked singly linked lists of Win32.
+
+#include "../source/framework.h"
+#include "../source/options.h"
+
+#include "../source/app/worker.h"
+#include "../source/duplex/duplex.h"
+
+#include "bench_common.h"
+
+// The endpoint of the relay: each read produces one time-stamped chunk immediately,
+// and each write consumes the data and records the latency of the chunks
+class MockDuplex : public Duplex
+{
+public:
+    // isIdle: true if nothing is sent from this endpoint (the read is never finished)
+    MockDuplex(_In_ DWORD chunkSize, _In_ ULONGLONG totalSize, _In_ bool isIdle, _In_ size_t expectedChunkCount)
+        : m_hEvent(nullptr)
+        , m_chunkSize(chunkSize)
+        , m_remaining(isIdle ? 0 : totalSize)
+        , m_isIdle(isIdle)
+        , m_deliveredSize(0)
+    {
+        // reserve the samples before running not to count the allocations
+        m_latencies.reserve(expectedChunkCount);
+    }
+
+    virtual ~MockDuplex()
+    {
+        if (m_hEvent)
+            ::CloseHandle(m_hEvent);
+    }
+
+    _Check_return_
+    HRESULT Initialize()
+    {
+        m_hEvent = ::CreateEventW(nullptr, TRUE, FALSE, nullptr);
+        if (!m_hEvent)
+            return HRESULT_FROM_WIN32(::GetLastError());
+        return S_OK;
+    }
+
+    _Check_return_
+    virtual HRESULT StartRead(_When_(SUCCEEDED(return), _Out_) HANDLE* outEvent)
+    {
+        if (!m_isIdle)
+            ::SetEvent(m_hEvent);
+        *outEvent = m_hEvent;
+        return S_OK;
+    }
+
+    _Check_return_
+    virtual HRESULT FinishRead(
+        _When_(return == S_OK, _Outptr_)
+        _When_(return != S_OK, _Outptr_result_maybenull_)
+        RelayBuffer** outBuffer
+    )
+    {
+        *outBuffer = nullptr;
+        if (!m_remaining)
+            return S_FALSE;
+        RelayBuffer* buffer;
+        auto hr = RelayBuffer::Allocate(&buffer, m_chunkSize);
+        if (FAILED(hr))
+            return hr;
+        auto size = m_remaining < m_chunkSize ? static_cast<DWORD>(m_remaining) : m_chunkSize;
+        buffer->SetSize(size);
+        StampBenchChunk(buffer->GetData());
+        m_remaining -= size;
+        *outBuffer = buffer;
+        return S_OK;
+    }
+
+    virtual HRESULT Write(
+        _In_reads_bytes_(size) const void* buffer,
+        _In_ DWORD size,
+        _When_(SUCCEEDED(return), _Out_opt_) DWORD* outWrittenSize
+    )
+    {
+        UNREFERENCED_PARAMETER(buffer);
+        m_deliveredSize += size;
+        if (outWrittenSize)
+            *outWrittenSize = size;
+        return S_OK;
+    }
+
+    virtual HRESULT WriteBuffers(
+        _In_reads_(count) RelayBuffer* const* buffers,
+        _In_ DWORD count,
+        _When_(SUCCEEDED(return), _Out_opt_) DWORD* outWrittenSize
+    )
+    {
+        auto now = GetBenchMicroseconds();
+        DWORD writtenSize = 0;
+        for (DWORD i = 0; i < count; ++i)
+        {
+            m_latencies.push_back(now - ReadBenchChunkStamp(buffers[i]->GetData()));
+            writtenSize += buffers[i]->GetSize();
+        }
+        m_deliveredSize += writtenSize;
+        if (outWrittenSize)
+            *outWrittenSize = writtenSize;
+        return S_OK;
+    }
+
+    ULONGLONG GetDeliveredSize() const { return m_deliveredSize; }
+    const std::vector<int64_t>& GetLatencies() const { return m_latencies; }
+
+private:
+    HANDLE m_hEvent;
+    DWORD m_chunkSize;
+    ULONGLONG m_remaining;
+    bool m_isIdle;
+    ULONGLONG m_deliveredSize;
+    std::vector<int64_t> m_latencies;
+};
+
+struct TransferPair
+{
+    MockDuplex* client;
+    MockDuplex* server;
+    HANDLE hEventQuit;
+    const RelayOptions* options;
+    HRESULT hrResult;
+};
+
+static DWORD WINAPI TransferThreadProc(_In_ TransferPair* pair)
+{
+    pair->hrResult = Transfer(pair->hEventQuit, pair->client, pair->server, pair->options, nullptr, nullptr);
+    return 0;
+}
+
+static LONG64 GetRelayBufferMissCount()
+{
+    RelayBufferStats stats[RELAY_BUFFER_SIZE_CLASS_COUNT];
+    RelayBuffer::GetStats(stats);
+    LONG64 count = 0;
+    for (auto& s : stats)
+        count += s.misses;
+    return count;
+}
+
+bool RunTransferBench(const BenchCase& benchCase, BenchResult& outResult, std::string& outMessage)
+{
+    static const CoalesceMode s_coalesceModes[] = { CoalesceMode::Adaptive, CoalesceMode::Latency, CoalesceMode::Throughput };
+    RelayOptions options = {
+        RELAY_BUFFER_SIZE,
+        RELAY_BUFFER_DEFAULT_MAX_SIZE,
+        s_coalesceModes[static_cast<int>(benchCase.coalesce)],
+        COALESCE_DEFAULT_SIZE
+    };
+    auto chunkSize = static_cast<DWORD>(benchCase.chunkSize);
+    auto expectedChunkCount = static_cast<size_t>(benchCase.totalSize / benchCase.chunkSize + 1);
+
+    // the quit event is never signalled; each Transfer finishes with EOF of the client (or the server)
+    auto hEventQuit = ::CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    if (!hEventQuit)
+    {
+        outMessage = "Failed to create the event";
+        return false;
+    }
+    std::vector<TransferPair> pairs(benchCase.pairCount);
+    bool isSucceeded = true;
+    for (auto& pair : pairs)
+    {
+        pair.client = new MockDuplex(chunkSize, benchCase.totalSize, false, expectedChunkCount);
+        pair.server = new MockDuplex(chunkSize, benchCase.totalSize, !benchCase.isBidirectional, expectedChunkCount);
+        pair.hEventQuit = hEventQuit;
+        pair.options = &options;
+        pair.hrResult = S_OK;
+        if (FAILED(pair.client->Initialize()) || FAILED(pair.server->Initialize()))
+            isSucceeded = false;
+    }
+
+    std::vector<HANDLE> threads;
+    auto newCountStart = GetBenchNewCount();
+    auto missCountStart = GetRelayBufferMissCount();
+    auto timeStart = GetBenchMicroseconds();
+    for (auto& pair : pairs)
+    {
+        if (!isSucceeded)
+            break;
+        auto hThread = reinterpret_cast<HANDLE>(_beginthreadex(
+            nullptr,
+            0,
+            reinterpret_cast<_beginthreadex_proc_type>(TransferThreadProc),
+            &pair,
+            0,
+            nullptr
+        ));
+        if (!hThread)
+        {
+            isSucceeded = false;
+            break;
+        }
+        threads.push_back(hThread);
+    }
+    for (auto hThread : threads)
+    {
+        ::WaitForSingleObject(hThread, INFINITE);
+        ::CloseHandle(hThread);
+    }
+    auto timeEnd = GetBenchMicroseconds();
+    auto allocationCount = (GetBenchNewCount() - newCountStart) +
+        static_cast<uint64_t>(GetRelayBufferMissCount() - missCountStart);
+    if (!isSucceeded)
+        outMessage = "Failed to start the relay";
+
+    outResult.deliveredSize = 0;
+    outResult.elapsedMicroseconds = timeEnd - timeStart;
+    outResult.latencies.clear();
+    outResult.allocationCount = allocationCount;
+    for (auto& pair : pairs)
+    {
+        if (FAILED(pair.hrResult))
+        {
+            char message[64];
+            sprintf_s(message, "The relay failed: 0x%08lX", pair.hrResult);
+            outMessage = message;
+            isSucceeded = false;
+        }
+        for (auto duplex : { pair.client, pair.server })
+        {
+            outResult.deliveredSize += duplex->GetDeliveredSize();
+            outResult.latencies.insert(outResult.latencies.end(), duplex->GetLatencies().begin(), duplex->GetLatencies().end());
+            delete duplex;
+        }
+    }
+    ::CloseHandle(hEventQuit);
+    return isSucceeded;
+}
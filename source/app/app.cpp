@@ -13,6 +13,7 @@
 #include "../connectors/connector.h"
 #include "../connectors/tcp_socket_connector.h"
 #include "../connectors/pipe_connector.h"
+#include "../connectors/pooled_connector.h"
 #include "../connectors/unix_socket_connector.h"
 #include "../connectors/wsl_tcp_socket_connector.h"
 #include "../connectors/wsl_unix_socket_connector.h"
@@ -20,12 +21,16 @@
 #include "../duplex/duplex.h"
 
 #include "../logger/logger.h"
+#include "../logger/log_ring.h"
 
 #include "../util/event_handler.h"
 #include "../util/functions.h"
 #include "../util/wsl_util.h"
 
 #include "app.h"
+#include "iocp_engine.h"
+#include "metrics.h"
+#include "metrics_server.h"
 #include "worker.h"
 #include "window.h"
 
@@ -47,15 +52,12 @@ class AppLogger : public Logger
 private:
     AppLogger(HANDLE hEvent)
     {
-        ::InitializeCriticalSection(&m_csLog);
         m_hEventLogUpdated = hEvent;
-        RegisterEventHandler(hEvent, OnLogUpdated, this);
     }
 public:
     virtual ~AppLogger()
     {
         ::CloseHandle(m_hEventLogUpdated);
-        ::DeleteCriticalSection(&m_csLog);
     }
     static AppLogger* Instantiate()
     {
@@ -68,24 +70,33 @@ public:
             ::CloseHandle(h);
             return nullptr;
         }
+        if (FAILED(p->m_ring.Initialize()))
+        {
+            delete p;
+            return nullptr;
+        }
+        RegisterEventHandler(h, OnLogUpdated, p);
         return p;
     }
     void Clear()
     {
-        ::EnterCriticalSection(&m_csLog);
-        m_logBuffer.clear();
-        ::LeaveCriticalSection(&m_csLog);
-        ::SetEvent(m_hEventLogUpdated);
+        m_ring.Clear();
+    }
+    ULONGLONG Read(_Inout_ ULONGLONG* inoutCursor, _Inout_ std::wstring& outText)
+    {
+        return m_ring.Read(inoutCursor, outText);
+    }
+
+    virtual bool IsEnabled(_In_ LogLevel level) const
+    {
+        return level <= GetLogLevel();
     }
 
 protected:
     virtual void OnLog(_In_ LogLevel level, _In_z_ PCWSTR pszLog)
     {
-        if (level > GetLogLevel())
-            return;
-        ::EnterCriticalSection(&m_csLog);
-        m_logBuffer += pszLog;
-        ::LeaveCriticalSection(&m_csLog);
+        UNREFERENCED_PARAMETER(level);
+        m_ring.Push(pszLog);
         //::PostMessageW(g_hWnd, MY_WM_UPDATELOG, 0, 0);
         ::SetEvent(m_hEventLogUpdated);
     }
@@ -94,17 +105,15 @@ private:
     static void CALLBACK OnLogUpdated(void* data)
     {
         auto pThis = static_cast<AppLogger*>(data);
-        ::EnterCriticalSection(&pThis->m_csLog);
         ::ResetEvent(pThis->m_hEventLogUpdated);
-        std::wstring str(pThis->m_logBuffer);
-        ::LeaveCriticalSection(&pThis->m_csLog);
-        ::SendMessageW(g_hWnd, MY_WM_UPDATELOG, 0, reinterpret_cast<LPARAM>(str.c_str()));
+        // the window reads the new records by itself (see ReadLogs)
+        ::SendMessageW(g_hWnd, MY_WM_UPDATELOG, 0, 0);
     }
 
 private:
-    CRITICAL_SECTION m_csLog;
     HANDLE m_hEventLogUpdated;
-    std::wstring m_logBuffer;
+    // keeps recent logs with fixed memory (older logs are dropped)
+    LogRing m_ring;
 };
 
 LogLevel GetLogLevel()
@@ -118,6 +127,14 @@ void ClearLogs()
         g_pAppLogger->Clear();
 }
 
+_Use_decl_annotations_
+ULONGLONG ReadLogs(ULONGLONG* inoutCursor, std::wstring& outText)
+{
+    if (!g_pAppLogger)
+        return 0;
+    return g_pAppLogger->Read(inoutCursor, outText);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 DWORD GetWslDefaultTimeout()
@@ -142,6 +159,11 @@ PCWSTR GetWslSocatLogLevel()
     }
 }
 
+bool IsWslPersistentRelayEnabled()
+{
+    return g_pOption && g_pOption->wslRelayMode == WslRelayMode::Persistent;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 static const PCWSTR g_listenerTypeNames[] = {
@@ -155,12 +177,23 @@ static const PCWSTR g_listenerTypeNames[] = {
 static_assert(std::extent<decltype(g_listenerTypeNames)>::value == static_cast<size_t>(ListenerType::_Count), "g_listenerTypeNames is not valid");
 
 std::vector<HANDLE>* g_pThreads = nullptr;
+// guards g_pThreads, as accept handlers run on the listeners' thread pool
+static CRITICAL_SECTION g_csThreads;
 Connector* g_pConnector = nullptr;
 std::vector<Listener*>* g_pListeners = nullptr;
+// indexed by (ListenerData::id - 1)
+ListenerMetrics* g_pListenerMetrics = nullptr;
+MetricsServer* g_pMetricsServer = nullptr;
+
+static ListenerMetrics* GetListenerMetrics(_In_ const ListenerData* data)
+{
+    return g_pListenerMetrics ? &g_pListenerMetrics[data->id - 1] : nullptr;
+}
 
 static void CALLBACK OnFinishHandler(_In_ ListenerData* data, _In_ HRESULT hr)
 {
     auto typeName = g_listenerTypeNames[static_cast<size_t>(data->type)];
+    MetricsOnFinished(GetListenerMetrics(data));
 
     if (FAILED(hr))
     {
@@ -183,28 +216,53 @@ static void CALLBACK OnAcceptHandler(_In_ Duplex* duplex, _In_ ListenerData* dat
 
     auto typeName = g_listenerTypeNames[static_cast<size_t>(data->type)];
     AddLogFormatted(LogLevel::Info, L"[%s %hu] Accepted", typeName, data->id);
+    auto metrics = GetListenerMetrics(data);
+    MetricsOnAccepted(metrics);
 
-    HANDLE hThread;
-    auto hr = StartWorker(&hThread, g_hEventQuit, duplex, data->id, typeName, g_pConnector,
-        reinterpret_cast<PFinishHandler>(OnFinishHandler), data);
+    HRESULT hr;
+    HANDLE hThread = INVALID_HANDLE_VALUE;
+    if (g_pOption->engine == RelayEngine::Iocp)
+    {
+        hr = StartIocpWorker(duplex, data->id, typeName, g_pConnector, &data->relay, metrics,
+            reinterpret_cast<PFinishHandler>(OnFinishHandler), data);
+    }
+    else
+    {
+        hr = StartWorker(&hThread, g_hEventQuit, duplex, data->id, typeName, g_pConnector, &data->relay, metrics,
+            reinterpret_cast<PFinishHandler>(OnFinishHandler), data);
+    }
     if (FAILED(hr))
     {
+        MetricsOnFinished(metrics);
         delete duplex;
         PWSTR psz;
         if (SUCCEEDED(GetErrorString(hr, &psz)))
         {
-            AddLogFormatted(LogLevel::Error, L"[%s %hu] Failed to create thread: [0x%08lX] %s", typeName, data->id,
+            AddLogFormatted(LogLevel::Error, L"[%s %hu] Failed to start worker: [0x%08lX] %s", typeName, data->id,
                 hr, psz);
             free(psz);
         }
         else
         {
-            AddLogFormatted(LogLevel::Error, L"[%s %hu] Failed to create thread: [0x%08lX]", typeName, data->id,
+            AddLogFormatted(LogLevel::Error, L"[%s %hu] Failed to start worker: [0x%08lX]", typeName, data->id,
                 hr);
         }
         return;
     }
-    g_pThreads->push_back(hThread);
+    if (hThread != INVALID_HANDLE_VALUE)
+    {
+        ::EnterCriticalSection(&g_csThreads);
+        try
+        {
+            g_pThreads->push_back(hThread);
+        }
+        catch (...)
+        {
+            // the worker cannot be waited for on exit, but keeps running
+            ::CloseHandle(hThread);
+        }
+        ::LeaveCriticalSection(&g_csThreads);
+    }
 }
 
 static HRESULT MakeListenersAndConnector(const Option& options)
@@ -230,6 +288,10 @@ static HRESULT MakeListenersAndConnector(const Option& options)
     g_pThreads = new std::vector<HANDLE>();
     if (!g_pThreads)
         return E_OUTOFMEMORY;
+    ::InitializeCriticalSection(&g_csThreads);
+    g_pListenerMetrics = static_cast<ListenerMetrics*>(calloc(options.listeners->size(), sizeof(ListenerMetrics)));
+    if (!g_pListenerMetrics)
+        return E_OUTOFMEMORY;
 
     HRESULT hr = S_OK;
     switch (options.connector->type)
@@ -238,7 +300,7 @@ static HRESULT MakeListenersAndConnector(const Option& options)
         {
             auto d = static_cast<TcpSocketConnectorData*>(options.connector);
             auto p = new TcpSocketConnector();
-            hr = p->Initialize(d->pszAddress, d->port);
+            hr = p->Initialize(d->pszAddress, d->port, options.connectTimeout, &d->socketOptions);
             if (FAILED(hr))
             {
                 delete p;
@@ -264,7 +326,7 @@ static HRESULT MakeListenersAndConnector(const Option& options)
         {
             auto d = static_cast<PipeConnectorData*>(options.connector);
             auto p = new PipeConnector();
-            hr = p->Initialize(d->pszPipeName);
+            hr = p->Initialize(d->pszPipeName, options.connectTimeout);
             if (FAILED(hr))
             {
                 delete p;
@@ -304,6 +366,19 @@ static HRESULT MakeListenersAndConnector(const Option& options)
         default:
             return E_UNEXPECTED;
     }
+    if (options.connectorPoolSize > 0)
+    {
+        auto p = new PooledConnector();
+        if (!p)
+            return E_OUTOFMEMORY;
+        hr = p->Initialize(g_pConnector, options.connectorPoolSize);
+        if (FAILED(hr))
+        {
+            delete p;
+            return hr;
+        }
+        g_pConnector = p;
+    }
     for (auto listener : *options.listeners)
     {
         switch (listener->type)
@@ -312,6 +387,8 @@ static HRESULT MakeListenersAndConnector(const Option& options)
             {
                 auto d = static_cast<TcpSocketListenerData*>(listener);
                 auto p = new TcpSocketListener();
+                p->SetSocketOptions(&d->socketOptions);
+                p->SetPendingAcceptCount(d->pendingAcceptCount);
                 USHORT port = 0;
                 hr = p->InitializeSocket(d->port, d->isIPv6, d->pszAddress, reinterpret_cast<PAcceptHandler>(OnAcceptHandler), listener, &port);
                 if (FAILED(hr))
@@ -329,6 +406,7 @@ static HRESULT MakeListenersAndConnector(const Option& options)
             {
                 auto d = static_cast<UnixSocketListenerData*>(listener);
                 auto p = new UnixSocketListener();
+                p->SetPendingAcceptCount(d->pendingAcceptCount);
                 hr = p->InitializeSocket(d->pszPath, d->isAbstract, reinterpret_cast<PAcceptHandler>(OnAcceptHandler), listener);
                 if (FAILED(hr))
                 {
@@ -344,6 +422,7 @@ static HRESULT MakeListenersAndConnector(const Option& options)
             {
                 auto d = static_cast<CygwinSockFileListenerData*>(listener);
                 auto p = new CygwinSockFileListener();
+                p->SetPendingAcceptCount(d->pendingAcceptCount);
                 hr = p->InitializeSocket(d->pszCygwinPath, reinterpret_cast<PAcceptHandler>(OnAcceptHandler), listener);
                 if (FAILED(hr))
                 {
@@ -359,6 +438,7 @@ static HRESULT MakeListenersAndConnector(const Option& options)
             {
                 auto d = static_cast<PipeListenerData*>(listener);
                 auto p = new NamedPipeListener();
+                p->SetInstanceOptions(d->instanceCount, d->maxInstanceCount, d->bufferSize);
                 hr = p->Initialize(d->pszPipeName, reinterpret_cast<PAcceptHandler>(OnAcceptHandler), listener);
                 if (FAILED(hr))
                 {
@@ -430,6 +510,9 @@ void ReportListenersAndConnector(std::wstring& outString)
                     {
                         str += psz;
                     }
+                    str += L" (socket options: ";
+                    FormatTcpSocketOptions(&d->socketOptions, str);
+                    str += L')';
                 }
                 break;
                 case ListenerType::UnixSocket:
@@ -457,7 +540,8 @@ void ReportListenersAndConnector(std::wstring& outString)
                 {
                     auto d = static_cast<PipeListenerData*>(data);
                     PWSTR psz;
-                    if (SUCCEEDED(MakeFormattedString(&psz, L"[pipe %hu] %s", d->id, d->pszPipeName)))
+                    if (SUCCEEDED(MakeFormattedString(&psz, L"[pipe %hu] %s (instances: %lu:%lu, buffer size: %lu)",
+                        d->id, d->pszPipeName, d->instanceCount, d->maxInstanceCount, d->bufferSize)))
                     {
                         str += psz;
                     }
@@ -488,6 +572,12 @@ void ReportListenersAndConnector(std::wstring& outString)
                 }
                 break;
             }
+            if (data->pendingAcceptCount > 0)
+            {
+                WCHAR buf[32];
+                swprintf_s(buf, L" (pending accepts: %lu)", data->pendingAcceptCount);
+                str += buf;
+            }
             str += L'\n';
         }
     }
@@ -505,6 +595,9 @@ void ReportListenersAndConnector(std::wstring& outString)
                 {
                     str += psz;
                 }
+                str += L" (socket options: ";
+                FormatTcpSocketOptions(&d->socketOptions, str);
+                str += L')';
             }
             break;
             case ConnectorType::UnixSocket:
@@ -551,9 +644,137 @@ void ReportListenersAndConnector(std::wstring& outString)
             break;
         }
     }
+    if (g_pOption->metricsListener)
+    {
+        auto d = g_pOption->metricsListener;
+        PWSTR psz;
+        if (SUCCEEDED(MakeFormattedString(&psz, L"\nMetrics: %s:%hu",
+            d->pszAddress ? d->pszAddress : (d->isIPv6 ? L"[::1]" : L"127.0.0.1"), d->port)))
+        {
+            str += psz;
+            free(psz);
+        }
+    }
+    str += L"\n\nEngine: ";
+    str += g_pOption->engine == RelayEngine::Iocp ? L"iocp" : L"thread";
+    if (g_pOption->connectorPoolSize > 0)
+    {
+        PWSTR psz;
+        if (SUCCEEDED(MakeFormattedString(&psz, L"\nConnector pool: %lu", g_pOption->connectorPoolSize)))
+        {
+            str += psz;
+            free(psz);
+        }
+    }
     outString = str;
 }
 
+_Use_decl_annotations_
+void ReportMetrics(std::wstring& outString)
+{
+    outString = L"Statistics:";
+    if (!g_pListenerMetrics || !g_pOption->listeners)
+        return;
+    for (auto data : *g_pOption->listeners)
+    {
+        PWSTR psz;
+        if (SUCCEEDED(MakeFormattedString(&psz, L"\n* [%s %hu] ",
+            g_listenerTypeNames[static_cast<size_t>(data->type)], data->id)))
+        {
+            outString += psz;
+            free(psz);
+        }
+        FormatListenerMetrics(GetListenerMetrics(data), outString);
+    }
+    outString += L"\n* ";
+    FormatRelayBufferStats(outString);
+}
+
+static void CALLBACK WriteMetricsExposition(_Inout_ std::string& outString)
+{
+    if (g_pListenerMetrics && g_pOption->listeners)
+    {
+        std::vector<ListenerMetricsSource> sources;
+        sources.reserve(g_pOption->listeners->size());
+        for (auto data : *g_pOption->listeners)
+        {
+            sources.push_back({ GetListenerMetrics(data), g_listenerTypeNames[static_cast<size_t>(data->type)], data->id });
+        }
+        FormatMetricsExposition(sources.data(), static_cast<DWORD>(sources.size()), outString);
+    }
+    {
+        std::vector<SocketOptionsSource> sources;
+        if (g_pOption->listeners)
+        {
+            for (auto data : *g_pOption->listeners)
+            {
+                if (data->type == ListenerType::TcpSocket)
+                {
+                    sources.push_back({ &static_cast<TcpSocketListenerData*>(data)->socketOptions, "listener",
+                        g_listenerTypeNames[static_cast<size_t>(data->type)], data->id });
+                }
+            }
+        }
+        if (g_pOption->connector && g_pOption->connector->type == ConnectorType::TcpSocket)
+        {
+            sources.push_back({ &static_cast<TcpSocketConnectorData*>(g_pOption->connector)->socketOptions, "connector",
+                L"tcp-socket", 0 });
+        }
+        FormatSocketOptionsExposition(sources.data(), static_cast<DWORD>(sources.size()), outString);
+    }
+    FormatRelayBufferStatsExposition(outString);
+
+    DWORD threadCount, connectionCount;
+    GetIocpEngineStats(&threadCount, &connectionCount);
+    FormatMetricExposition("stream_connector_worker_threads", "gauge",
+        "Running worker threads of the relay engine.", GetWorkerCount() + threadCount, outString);
+    FormatMetricExposition("stream_connector_iocp_connections", "gauge",
+        "Connections handled by the iocp engine.", connectionCount, outString);
+    if (g_pOption->connector && g_pOption->connector->type == ConnectorType::Pipe)
+    {
+        LONG64 busyCount, waitCount, waitTime, timeoutCount;
+        PipeConnectorGetBusyStats(&busyCount, &waitCount, &waitTime, &timeoutCount);
+        FormatMetricExposition("stream_connector_pipe_busy_total", "counter",
+            "Connections with the pipe connector which found all pipe instances busy.", busyCount, outString);
+        FormatMetricExposition("stream_connector_pipe_waits_total", "counter",
+            "Waits for a free pipe instance by the pipe connector.", waitCount, outString);
+        FormatMetricExposition("stream_connector_pipe_wait_microseconds_total", "counter",
+            "Total time waiting for a free pipe instance by the pipe connector.", waitTime, outString);
+        FormatMetricExposition("stream_connector_pipe_wait_timeouts_total", "counter",
+            "Connections with the pipe connector given up because no pipe instance became free.", timeoutCount, outString);
+    }
+#ifdef _WIN64
+    LONG64 spawnCount, spawnTime;
+    WslGetSpawnStats(&spawnCount, &spawnTime);
+    FormatMetricExposition("stream_connector_wsl_spawns_total", "counter",
+        "WSL processes started.", spawnCount, outString);
+    FormatMetricExposition("stream_connector_wsl_spawn_microseconds_total", "counter",
+        "Total time to start WSL processes.", spawnTime, outString);
+#endif
+}
+
+static HRESULT MakeMetricsServer(const Option& options)
+{
+    auto d = options.metricsListener;
+    if (!d)
+        return S_OK;
+    auto p = new MetricsServer();
+    if (!p)
+        return E_OUTOFMEMORY;
+    USHORT port = 0;
+    auto hr = p->Initialize(d->port, d->isIPv6, d->pszAddress, WriteMetricsExposition, &port);
+    if (FAILED(hr))
+    {
+        delete p;
+        return hr;
+    }
+    d->port = port;
+    g_pMetricsServer = p;
+    AddLogFormatted(LogLevel::Info, L"[metrics] Listening on %s:%hu",
+        d->pszAddress ? d->pszAddress : L"", d->port);
+    return S_OK;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 static bool InitInstance(_In_ HINSTANCE hInstance)
@@ -570,6 +791,11 @@ static bool InitInstance(_In_ HINSTANCE hInstance)
     if (!g_pAppLogger)
         return false;
     ::logger = g_pAppLogger;
+    if (g_pOption->engine == RelayEngine::Iocp)
+    {
+        if (FAILED(InitIocpEngine(0)))
+            return false;
+    }
 
     WNDCLASSEXW wc = { 0 };
     wc.cbSize = sizeof(wc);
@@ -612,6 +838,25 @@ static void PreExitInstance()
 {
     if (g_hEventQuit)
         ::SetEvent(g_hEventQuit);
+    if (g_pListeners)
+    {
+        // stop accepting and wait for the accept handlers, so that no worker starts after here
+        for (auto listener : *g_pListeners)
+            listener->Close();
+    }
+    if (g_pMetricsServer)
+    {
+        if (g_pMetricsServer->Close(5000))
+            delete g_pMetricsServer;
+        else
+        {
+            // the metrics are still read by unfinished requests
+            g_pListenerMetrics = nullptr;
+        }
+        g_pMetricsServer = nullptr;
+    }
+    // (waits for all connections, which use the connector and the metrics)
+    ShutdownIocpEngine();
     auto count = g_pThreads ? static_cast<DWORD>(g_pThreads->size()) : 0;
     if (count > 0)
     {
@@ -636,6 +881,9 @@ static void ExitInstance()
     {
         for (auto hThread : *g_pThreads)
             ::CloseHandle(hThread);
+        delete g_pThreads;
+        g_pThreads = nullptr;
+        ::DeleteCriticalSection(&g_csThreads);
     }
     if (g_pListeners)
     {
@@ -649,7 +897,13 @@ static void ExitInstance()
         delete g_pConnector;
         g_pConnector = nullptr;
     }
+    if (g_pListenerMetrics)
+    {
+        free(g_pListenerMetrics);
+        g_pListenerMetrics = nullptr;
+    }
     CleanupEventHandler();
+    RelayBuffer::CleanupPool();
     if (g_pAppLogger)
     {
         delete g_pAppLogger;
@@ -753,6 +1007,17 @@ int AppMain(HINSTANCE hInstance, int nCmdShow, const Option& options)
                 AddLogFormatted(LogLevel::Error, L"Error occurred on initializing listeners: [0x%08lX]",
                     static_cast<DWORD>(hr));
         }
+        hr = MakeMetricsServer(options);
+        if (FAILED(hr))
+        {
+            PWSTR psz = nullptr;
+            if (SUCCEEDED(GetErrorString(hr, &psz)))
+                AddLogFormatted(LogLevel::Error, L"Error occurred on initializing metrics: [0x%08lX] %s",
+                    static_cast<DWORD>(hr), psz);
+            else
+                AddLogFormatted(LogLevel::Error, L"Error occurred on initializing metrics: [0x%08lX]",
+                    static_cast<DWORD>(hr));
+        }
     }
 
     //::ShowWindow(g_hWnd, nCmdShow);
@@ -4,11 +4,16 @@
 #include "../logger/logger.h"
 
 void ReportListenersAndConnector(_Out_ std::wstring& outString);
+void ReportMetrics(_Out_ std::wstring& outString);
 LogLevel GetLogLevel();
 void ClearLogs();
+// Appends the logs written after *inoutCursor and moves the cursor
+// (returns the count of logs dropped before being read)
+ULONGLONG ReadLogs(_Inout_ ULONGLONG* inoutCursor, _Inout_ std::wstring& outText);
 
 DWORD GetWslDefaultTimeout();
 PCWSTR GetWslSocatLogLevel();
+bool IsWslPersistentRelayEnabled();
 
 HINSTANCE GetAppInstance();
 PCWSTR GetAppTitle();
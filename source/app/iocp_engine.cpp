@@ -0,0 +1,421 @@
+#include "../framework.h"
+#include "../util/functions.h"
+
+#include "../connectors/connector.h"
+#include "../duplex/duplex.h"
+
+#include "../logger/logger.h"
+
+#include "iocp_engine.h"
+#include "metrics.h"
+#include "relay_core.h"
+
+struct RelayPair;
+
+// one side of the relay, used as the completion key of its duplex
+struct RelayEndpoint
+{
+    RelayPair* pair;
+    Duplex* duplex;
+    PCWSTR name;
+    // 0 for the client (read by the channel 0), 1 for the connector (read by the channel 1)
+    int index;
+};
+
+// the relay of one connection; reads and writes are scheduled by RelayCore and
+// issued as overlapped operations, so that no thread waits for the peer
+struct RelayPair : public RelayCoreIo
+{
+    RelayPair()
+        : prev(nullptr)
+        , next(nullptr)
+        , core(this)
+        , hrResult(S_OK)
+        , duplexIn(nullptr)
+        , duplexOut(nullptr)
+        , endpoints{}
+        , listenerId(0)
+        , typeName(nullptr)
+        , connector(nullptr)
+        , relayOptions(nullptr)
+        , metrics(nullptr)
+        , pfnFinishHandler(nullptr)
+        , dataHandler(nullptr)
+    {
+    }
+
+    virtual RelayStatus StartRead(int channel)
+    {
+        HANDLE hEvent;
+        return endpoints[channel].duplex->StartRead(&hEvent);
+    }
+    virtual RelayStatus StartWrite(int channel, void* const* chunks, size_t count, size_t offset)
+    {
+        RelayBuffer* buffers[RELAY_CORE_MAX_QUEUED_CHUNKS];
+        for (size_t i = 0; i < count; ++i)
+            buffers[i] = static_cast<RelayBuffer*>(chunks[i]);
+        return endpoints[1 - channel].duplex->StartWrite(buffers, static_cast<DWORD>(count), static_cast<DWORD>(offset));
+    }
+    virtual void CancelAll()
+    {
+        for (auto& endpoint : endpoints)
+        {
+            endpoint.duplex->CancelRead();
+            endpoint.duplex->CancelWrite();
+        }
+    }
+    virtual size_t GetChunkSize(void* chunk) { return static_cast<RelayBuffer*>(chunk)->GetSize(); }
+    virtual void ReleaseChunk(void* chunk) { static_cast<RelayBuffer*>(chunk)->Release(); }
+    virtual void OnFinished(RelayStatus result);
+
+    // linked with g_pPairHead (guarded by g_csPairs)
+    RelayPair* prev;
+    RelayPair* next;
+    RelayCore core;
+    HRESULT hrResult;
+    Duplex* duplexIn;
+    Duplex* duplexOut;
+    RelayEndpoint endpoints[2];
+    WORD listenerId;
+    PCWSTR typeName;
+    const Connector* connector;
+    const RelayOptions* relayOptions;
+    ListenerMetrics* metrics;
+    PFinishHandler pfnFinishHandler;
+    void* dataHandler;
+};
+
+// the interval of logging while waiting for the connections on shutdown
+constexpr DWORD SHUTDOWN_LOG_INTERVAL = 5000;
+
+static HANDLE g_hPort = nullptr;
+static HANDLE g_hEventNoPairs = nullptr;
+static HANDLE* g_phEngineThreads = nullptr;
+static DWORD g_dwEngineThreadCount = 0;
+static CRITICAL_SECTION g_csPairs;
+static RelayPair* g_pPairHead = nullptr;
+static DWORD g_dwPairCount = 0;
+static bool g_isShuttingDown = false;
+
+static void FinishPair(_In_ RelayPair* pair)
+{
+    // pass the relayed data to the peer before it is closed
+    if (pair->core.HasReachedEnd(0))
+        pair->duplexOut->Flush();
+    if (pair->core.HasReachedEnd(1))
+        pair->duplexIn->Flush();
+
+    ::EnterCriticalSection(&g_csPairs);
+    if (pair->prev)
+        pair->prev->next = pair->next;
+    else
+        g_pPairHead = pair->next;
+    if (pair->next)
+        pair->next->prev = pair->prev;
+    ::LeaveCriticalSection(&g_csPairs);
+
+    if (pair->duplexOut)
+        delete pair->duplexOut;
+    delete pair->duplexIn;
+    auto hr = pair->hrResult;
+    auto pfn = pair->pfnFinishHandler;
+    auto d = pair->dataHandler;
+    delete pair;
+    if (pfn)
+        pfn(d, hr);
+
+    ::EnterCriticalSection(&g_csPairs);
+    if (--g_dwPairCount == 0)
+        ::SetEvent(g_hEventNoPairs);
+    ::LeaveCriticalSection(&g_csPairs);
+}
+
+static void CALLBACK FinishCallback(_Inout_ PTP_CALLBACK_INSTANCE instance, _In_ RelayPair* pair)
+{
+    // flushing may wait for the peer to receive the data
+    ::CallbackMayRunLong(instance);
+    FinishPair(pair);
+}
+
+void RelayPair::OnFinished(RelayStatus result)
+{
+    // S_FALSE for EOF
+    hrResult = FAILED(result) ? result : S_OK;
+    // finish on the thread pool not to block the engine thread
+    if (!::TrySubmitThreadpoolCallback(reinterpret_cast<PTP_SIMPLE_CALLBACK>(FinishCallback), this, nullptr))
+        FinishPair(this);
+}
+
+static void OnEndpointCompleted(_In_ RelayEndpoint* endpoint, _In_ LPOVERLAPPED pol)
+{
+    auto pair = endpoint->pair;
+    auto duplex = endpoint->duplex;
+    if (duplex->IsWriteCompletion(pol))
+    {
+        DWORD writtenSize = 0;
+        auto hr = duplex->FinishWrite(&writtenSize);
+        // the data written to the endpoint is read by the other channel
+        pair->core.OnWriteCompleted(1 - endpoint->index, hr, SUCCEEDED(hr) ? writtenSize : 0);
+        return;
+    }
+
+    RelayBuffer* buffer = nullptr;
+    auto hr = duplex->FinishRead(&buffer);
+    auto size = hr == S_OK ? buffer->GetSize() : 0;
+    if (IsLogEnabled(LogLevel::Debug))
+    {
+        WCHAR preview[BUFFER_PREVIEW_LENGTH];
+        MakeBufferPreview(hr == S_OK ? buffer->GetData() : nullptr, size, preview);
+        AddLogFormatted(LogLevel::Debug, L"  [%s] received hr = 0x%08lX, size = %lu <%s>", endpoint->name, hr, size, preview);
+    }
+    if (hr == S_OK)
+        MetricsOnReceived(pair->metrics, endpoint->index == 0, size);
+    // (S_FALSE without the buffer for EOF)
+    pair->core.OnReadCompleted(endpoint->index, hr, hr == S_OK ? buffer : nullptr);
+}
+
+static HRESULT BindEndpoints(_In_ RelayPair* pair)
+{
+    pair->endpoints[0] = { pair, pair->duplexIn, L"from", 0 };
+    pair->endpoints[1] = { pair, pair->duplexOut, L"to", 1 };
+    for (auto& endpoint : pair->endpoints)
+    {
+        auto hr = endpoint.duplex->BindCompletionPort(g_hPort, reinterpret_cast<ULONG_PTR>(&endpoint));
+        if (FAILED(hr))
+            return hr;
+    }
+    return S_OK;
+}
+
+static void LogConnectionError(_In_ RelayPair* pair, _In_ HRESULT hr)
+{
+    PWSTR psz;
+    if (SUCCEEDED(GetErrorString(hr, &psz)))
+    {
+        AddLogFormatted(LogLevel::Error, L"[%s %hu] Failed to make connection: [0x%08lX] %s",
+            pair->typeName, pair->listenerId, hr, psz);
+        free(psz);
+    }
+    else
+    {
+        AddLogFormatted(LogLevel::Error, L"[%s %hu] Failed to make connection: [0x%08lX]",
+            pair->typeName, pair->listenerId, hr);
+    }
+}
+
+static void CALLBACK ConnectCallback(_Inout_ PTP_CALLBACK_INSTANCE instance, _In_ RelayPair* pair)
+{
+    // MakeConnection may take long time (e.g. launching WSL process)
+    ::CallbackMayRunLong(instance);
+
+    Duplex* duplexOut;
+    auto timeStart = GetMicroseconds();
+    auto hr = pair->connector->MakeConnection(&duplexOut);
+    MetricsOnConnected(pair->metrics, SUCCEEDED(hr), GetMicroseconds() - timeStart);
+    if (FAILED(hr))
+    {
+        LogConnectionError(pair, hr);
+        pair->core.Close(hr);
+    }
+    else
+    {
+        pair->duplexOut = duplexOut;
+        ApplyRelayOptions(pair->duplexIn, pair->relayOptions);
+        ApplyRelayOptions(duplexOut, pair->relayOptions);
+        if (!pair->duplexIn->IsCompletionPortSupported() || !duplexOut->IsCompletionPortSupported())
+        {
+            // (all duplexes made by the listeners and the connectors support the completion port)
+            AddLogFormatted(LogLevel::Error, L"[%s %hu] The connection cannot be relayed with the iocp engine",
+                pair->typeName, pair->listenerId);
+            pair->core.Close(E_NOTIMPL);
+        }
+        else
+        {
+            hr = BindEndpoints(pair);
+            if (FAILED(hr))
+                pair->core.Close(hr);
+        }
+    }
+    // starts reading from both endpoints (or finishes the pair if closed)
+    pair->core.Start();
+}
+
+static DWORD WINAPI EngineThreadProc(void*)
+{
+    while (true)
+    {
+        DWORD dw = 0;
+        ULONG_PTR key = 0;
+        LPOVERLAPPED pol = nullptr;
+        // the completion of failed I/O is also handled (FinishRead/FinishWrite return the error)
+        ::GetQueuedCompletionStatus(g_hPort, &dw, &key, &pol, INFINITE);
+        // zero key is posted on shutdown (or the port is closed)
+        if (!key)
+            break;
+        OnEndpointCompleted(reinterpret_cast<RelayEndpoint*>(key), pol);
+    }
+    return 0;
+}
+
+_Use_decl_annotations_
+HRESULT InitIocpEngine(DWORD dwThreadCount)
+{
+    if (!dwThreadCount)
+    {
+        SYSTEM_INFO si;
+        ::GetSystemInfo(&si);
+        dwThreadCount = si.dwNumberOfProcessors;
+    }
+    if (dwThreadCount > MAXIMUM_WAIT_OBJECTS)
+        dwThreadCount = MAXIMUM_WAIT_OBJECTS;
+
+    g_hEventNoPairs = ::CreateEventW(nullptr, TRUE, TRUE, nullptr);
+    if (!g_hEventNoPairs)
+        return HRESULT_FROM_WIN32(::GetLastError());
+    g_hPort = ::CreateIoCompletionPort(INVALID_HANDLE_VALUE, nullptr, 0, dwThreadCount);
+    if (!g_hPort)
+    {
+        auto err = ::GetLastError();
+        ::CloseHandle(g_hEventNoPairs);
+        g_hEventNoPairs = nullptr;
+        return HRESULT_FROM_WIN32(err);
+    }
+    g_phEngineThreads = static_cast<HANDLE*>(malloc(sizeof(HANDLE) * dwThreadCount));
+    if (!g_phEngineThreads)
+    {
+        ::CloseHandle(g_hPort);
+        g_hPort = nullptr;
+        ::CloseHandle(g_hEventNoPairs);
+        g_hEventNoPairs = nullptr;
+        return E_OUTOFMEMORY;
+    }
+    ::InitializeCriticalSection(&g_csPairs);
+    g_isShuttingDown = false;
+    g_dwEngineThreadCount = 0;
+    for (DWORD i = 0; i < dwThreadCount; ++i)
+    {
+        HANDLE hThread = reinterpret_cast<HANDLE>(_beginthreadex(
+            nullptr,
+            0,
+            reinterpret_cast<_beginthreadex_proc_type>(EngineThreadProc),
+            nullptr,
+            0,
+            nullptr
+        ));
+        if (!hThread)
+        {
+            auto err = _doserrno;
+            ShutdownIocpEngine();
+            return HRESULT_FROM_WIN32(err);
+        }
+        g_phEngineThreads[g_dwEngineThreadCount++] = hThread;
+    }
+    return S_OK;
+}
+
+void ShutdownIocpEngine()
+{
+    if (!g_hPort)
+        return;
+
+    ::EnterCriticalSection(&g_csPairs);
+    g_isShuttingDown = true;
+    // cancels pending reads and writes; the pairs still connecting are closed after connected
+    // (Close may finish the pair on this thread if the thread pool is not available,
+    // which unlinks and deletes it, so take the next pair first)
+    for (auto pair = g_pPairHead; pair; )
+    {
+        auto next = pair->next;
+        pair->core.Close(S_OK);
+        pair = next;
+    }
+    ::LeaveCriticalSection(&g_csPairs);
+
+    // the cancelled operations are completed on the engine threads, so stop them after all pairs are finished
+    // (the pairs are never abandoned, because the connector and the metrics are released after here)
+    while (::WaitForSingleObject(g_hEventNoPairs, SHUTDOWN_LOG_INTERVAL) == WAIT_TIMEOUT)
+    {
+        AddLogFormatted(LogLevel::Info, L"[iocp] Waiting for %lu connection(s) to finish...",
+            *static_cast<volatile DWORD*>(&g_dwPairCount));
+    }
+    // wait for FinishPair that has signalled the event to leave the critical section
+    ::EnterCriticalSection(&g_csPairs);
+    ::LeaveCriticalSection(&g_csPairs);
+
+    for (DWORD i = 0; i < g_dwEngineThreadCount; ++i)
+        ::PostQueuedCompletionStatus(g_hPort, 0, 0, nullptr);
+    if (g_dwEngineThreadCount > 0)
+        ::WaitForMultipleObjects(g_dwEngineThreadCount, g_phEngineThreads, TRUE, INFINITE);
+    for (DWORD i = 0; i < g_dwEngineThreadCount; ++i)
+        ::CloseHandle(g_phEngineThreads[i]);
+    free(g_phEngineThreads);
+    g_phEngineThreads = nullptr;
+    g_dwEngineThreadCount = 0;
+
+    ::CloseHandle(g_hPort);
+    g_hPort = nullptr;
+    ::CloseHandle(g_hEventNoPairs);
+    g_hEventNoPairs = nullptr;
+    ::DeleteCriticalSection(&g_csPairs);
+}
+
+_Use_decl_annotations_
+void GetIocpEngineStats(DWORD* outThreadCount, DWORD* outConnectionCount)
+{
+    // read without locking; the values are used only for reporting
+    *outThreadCount = *static_cast<volatile DWORD*>(&g_dwEngineThreadCount);
+    *outConnectionCount = *static_cast<volatile DWORD*>(&g_dwPairCount);
+}
+
+_Use_decl_annotations_
+HRESULT StartIocpWorker(Duplex* duplexIn,
+    WORD listenerId, PCWSTR pszConnectorTypeName, const Connector* connector,
+    const RelayOptions* relayOptions, ListenerMetrics* metrics, PFinishHandler pfnFinishHandler, void* dataHandler)
+{
+    if (!g_hPort)
+        return E_UNEXPECTED;
+    auto pair = new RelayPair();
+    if (!pair)
+        return E_OUTOFMEMORY;
+    pair->duplexIn = duplexIn;
+    pair->listenerId = listenerId;
+    pair->typeName = pszConnectorTypeName;
+    pair->connector = connector;
+    pair->relayOptions = relayOptions;
+    pair->metrics = metrics;
+    pair->pfnFinishHandler = pfnFinishHandler;
+    pair->dataHandler = dataHandler;
+
+    ::EnterCriticalSection(&g_csPairs);
+    if (g_isShuttingDown)
+    {
+        ::LeaveCriticalSection(&g_csPairs);
+        delete pair;
+        return HRESULT_FROM_WIN32(ERROR_SHUTDOWN_IN_PROGRESS);
+    }
+    pair->next = g_pPairHead;
+    if (g_pPairHead)
+        g_pPairHead->prev = pair;
+    g_pPairHead = pair;
+    if (g_dwPairCount++ == 0)
+        ::ResetEvent(g_hEventNoPairs);
+    ::LeaveCriticalSection(&g_csPairs);
+
+    if (!::TrySubmitThreadpoolCallback(reinterpret_cast<PTP_SIMPLE_CALLBACK>(ConnectCallback), pair, nullptr))
+    {
+        auto err = ::GetLastError();
+        ::EnterCriticalSection(&g_csPairs);
+        if (pair->prev)
+            pair->prev->next = pair->next;
+        else
+            g_pPairHead = pair->next;
+        if (pair->next)
+            pair->next->prev = pair->prev;
+        if (--g_dwPairCount == 0)
+            ::SetEvent(g_hEventNoPairs);
+        ::LeaveCriticalSection(&g_csPairs);
+        delete pair;
+        return HRESULT_FROM_WIN32(err);
+    }
+    return S_OK;
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "worker.h"
+
+// Initializes the relay engine driven by the I/O completion port.
+// dwThreadCount: the count of worker threads (0 for the number of processors)
+_Check_return_
+HRESULT InitIocpEngine(_In_ DWORD dwThreadCount);
+// Closes all connections, waits for them to finish, and stops worker threads
+// (connections still being made with the connector are waited for, so the connector can be released after this)
+void ShutdownIocpEngine();
+// Retrieves the count of worker threads and relayed connections (both 0 if the engine is not running)
+void GetIocpEngineStats(_Out_ DWORD* outThreadCount, _Out_ DWORD* outConnectionCount);
+
+// Makes the connection with the connector and relays duplexIn and it on the engine.
+// (pfnFinishHandler is called on any thread when the relay is finished)
+_Check_return_
+HRESULT StartIocpWorker(_In_ Duplex* duplexIn,
+    _In_ WORD listenerId, _In_z_ PCWSTR pszConnectorTypeName, _In_ const Connector* connector,
+    _In_opt_ const RelayOptions* relayOptions, _Inout_opt_ ListenerMetrics* metrics,
+    _In_opt_ PFinishHandler pfnFinishHandler, _In_opt_ void* dataHandler);
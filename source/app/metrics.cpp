@@ -0,0 +1,314 @@
+#include "../framework.h"
+#include "../util/functions.h"
+#include "../util/socket.h"
+
+#include "../duplex/relay_buffer.h"
+
+#include "metrics.h"
+
+_Use_decl_annotations_
+DWORD GetMetricsChunkBucketLimit(DWORD index)
+{
+    if (index >= METRICS_CHUNK_BUCKET_COUNT - 1)
+        return 0;
+    // 64, 256, 1k, ... (multiplied by 4)
+    return 64UL << (index * 2);
+}
+
+_Use_decl_annotations_
+LONGLONG GetMetricsConnectTimeBucketLimit(DWORD index)
+{
+    static const LONGLONG s_limits[METRICS_CONNECT_TIME_BUCKET_COUNT - 1] = {
+        1000, 5000, 10000, 50000, 100000, 500000, 1000000, 5000000
+    };
+    if (index >= METRICS_CONNECT_TIME_BUCKET_COUNT - 1)
+        return 0;
+    return s_limits[index];
+}
+
+_Use_decl_annotations_
+void MetricsOnAccepted(ListenerMetrics* metrics)
+{
+    if (!metrics)
+        return;
+    ::InterlockedIncrement64(&metrics->acceptedCount);
+    ::InterlockedIncrement64(&metrics->activeCount);
+}
+
+_Use_decl_annotations_
+void MetricsOnFinished(ListenerMetrics* metrics)
+{
+    if (!metrics)
+        return;
+    ::InterlockedDecrement64(&metrics->activeCount);
+}
+
+_Use_decl_annotations_
+void MetricsOnConnected(ListenerMetrics* metrics, bool isSucceeded, LONGLONG microseconds)
+{
+    if (!metrics)
+        return;
+    if (!isSucceeded)
+    {
+        ::InterlockedIncrement64(&metrics->connectFailedCount);
+        return;
+    }
+    ::InterlockedIncrement64(&metrics->connectCount);
+    ::InterlockedAdd64(&metrics->connectTimeTotal, microseconds);
+    DWORD index = 0;
+    while (index < METRICS_CONNECT_TIME_BUCKET_COUNT - 1 && microseconds > GetMetricsConnectTimeBucketLimit(index))
+        ++index;
+    ::InterlockedIncrement64(&metrics->connectTimeCounts[index]);
+    auto current = metrics->connectTimeMax;
+    while (microseconds > current)
+    {
+        auto prev = ::InterlockedCompareExchange64(&metrics->connectTimeMax, microseconds, current);
+        if (prev == current)
+            break;
+        current = prev;
+    }
+}
+
+_Use_decl_annotations_
+void MetricsOnReceived(ListenerMetrics* metrics, bool isUpstream, DWORD size)
+{
+    if (!metrics)
+        return;
+    ::InterlockedAdd64(isUpstream ? &metrics->bytesUpstream : &metrics->bytesDownstream, size);
+    DWORD index = 0;
+    while (index < METRICS_CHUNK_BUCKET_COUNT - 1 && size > GetMetricsChunkBucketLimit(index))
+        ++index;
+    ::InterlockedIncrement64(&metrics->chunkCounts[index]);
+}
+
+_Use_decl_annotations_
+void FormatListenerMetrics(const ListenerMetrics* metrics, std::wstring& outString)
+{
+    auto connectCount = metrics->connectCount;
+    PWSTR psz;
+    if (SUCCEEDED(MakeFormattedString(&psz,
+        L"accepted: %lld, active: %lld, connect failed: %lld, received: %lld bytes (client), %lld bytes (connector)\n"
+        L"  connect time: avg. %lld us, max. %lld us\n"
+        L"  received chunks:",
+        metrics->acceptedCount, metrics->activeCount, metrics->connectFailedCount,
+        metrics->bytesUpstream, metrics->bytesDownstream,
+        connectCount > 0 ? metrics->connectTimeTotal / connectCount : 0LL, metrics->connectTimeMax)))
+    {
+        outString += psz;
+        free(psz);
+    }
+    for (DWORD i = 0; i < METRICS_CHUNK_BUCKET_COUNT; ++i)
+    {
+        auto limit = GetMetricsChunkBucketLimit(i);
+        PWSTR p;
+        HRESULT hr;
+        if (limit)
+            hr = MakeFormattedString(&p, L"%s <= %lu: %lld", i > 0 ? L"," : L"", limit, metrics->chunkCounts[i]);
+        else
+            hr = MakeFormattedString(&p, L", > %lu: %lld", GetMetricsChunkBucketLimit(i - 1), metrics->chunkCounts[i]);
+        if (SUCCEEDED(hr))
+        {
+            outString += p;
+            free(p);
+        }
+    }
+}
+
+_Use_decl_annotations_
+void FormatRelayBufferStats(std::wstring& outString)
+{
+    RelayBufferStats stats[RELAY_BUFFER_SIZE_CLASS_COUNT];
+    RelayBuffer::GetStats(stats);
+    LONG64 threadCacheHits = 0, poolHits = 0, misses = 0, discarded = 0;
+    for (auto& s : stats)
+    {
+        threadCacheHits += s.threadCacheHits;
+        poolHits += s.poolHits;
+        misses += s.misses;
+        discarded += s.discarded;
+    }
+    PWSTR psz;
+    if (SUCCEEDED(MakeFormattedString(&psz,
+        L"buffers: reused %lld (thread cache), %lld (pool), allocated: %lld, freed: %lld",
+        threadCacheHits, poolHits, misses, discarded)))
+    {
+        outString += psz;
+        free(psz);
+    }
+}
+
+static void AppendFormatted(_Inout_ std::string& outString, _In_z_ _Printf_format_string_ PCSTR pszFormat, ...)
+{
+    char buffer[256];
+    va_list args;
+    va_start(args, pszFormat);
+    auto r = _vsnprintf_s(buffer, _TRUNCATE, pszFormat, args);
+    va_end(args);
+    if (r > 0)
+        outString.append(buffer, static_cast<size_t>(r));
+}
+
+static void AppendHeader(_Inout_ std::string& outString, _In_z_ PCSTR pszName, _In_z_ PCSTR pszType, _In_z_ PCSTR pszHelp)
+{
+    AppendFormatted(outString, "# HELP %s %s\n# TYPE %s %s\n", pszName, pszHelp, pszName, pszType);
+}
+
+// appends 'name{listener="...",id="..."} value' (pszSuffix is appended to the name)
+static void AppendListenerSample(_Inout_ std::string& outString, _In_z_ PCSTR pszName, _In_z_ PCSTR pszSuffix,
+    _In_ const ListenerMetricsSource* source, _In_opt_z_ PCSTR pszExtraLabel, _In_ LONGLONG value)
+{
+    // type names consist of ASCII characters
+    AppendFormatted(outString, "%s%s{listener=\"%ls\",id=\"%hu\"%s%s} %lld\n",
+        pszName, pszSuffix, source->pszTypeName, source->id,
+        pszExtraLabel ? "," : "", pszExtraLabel ? pszExtraLabel : "", value);
+}
+
+_Use_decl_annotations_
+void FormatMetricsExposition(const ListenerMetricsSource* sources, DWORD count, std::string& outString)
+{
+    static const struct
+    {
+        PCSTR pszName;
+        PCSTR pszType;
+        PCSTR pszHelp;
+        size_t offset;
+    } s_simpleMetrics[] = {
+        { "stream_connector_accepted_total", "counter", "Connections accepted by the listener.",
+            offsetof(ListenerMetrics, acceptedCount) },
+        { "stream_connector_active_connections", "gauge", "Connections currently relayed.",
+            offsetof(ListenerMetrics, activeCount) },
+        { "stream_connector_connect_failures_total", "counter", "Failed connects with the connector.",
+            offsetof(ListenerMetrics, connectFailedCount) },
+        { "stream_connector_upstream_bytes_total", "counter", "Bytes received from the client.",
+            offsetof(ListenerMetrics, bytesUpstream) },
+        { "stream_connector_downstream_bytes_total", "counter", "Bytes received from the connector.",
+            offsetof(ListenerMetrics, bytesDownstream) },
+    };
+    for (auto& m : s_simpleMetrics)
+    {
+        AppendHeader(outString, m.pszName, m.pszType, m.pszHelp);
+        for (DWORD i = 0; i < count; ++i)
+        {
+            auto value = *reinterpret_cast<const volatile LONG64*>(
+                reinterpret_cast<const BYTE*>(sources[i].metrics) + m.offset);
+            AppendListenerSample(outString, m.pszName, "", &sources[i], nullptr, value);
+        }
+    }
+
+    // buckets are cumulative in the exposition format
+    AppendHeader(outString, "stream_connector_connect_duration_seconds", "histogram",
+        "Time to make connections with the connector.");
+    for (DWORD i = 0; i < count; ++i)
+    {
+        auto metrics = sources[i].metrics;
+        LONGLONG cumulative = 0;
+        for (DWORD b = 0; b < METRICS_CONNECT_TIME_BUCKET_COUNT; ++b)
+        {
+            cumulative += metrics->connectTimeCounts[b];
+            auto limit = GetMetricsConnectTimeBucketLimit(b);
+            char label[32];
+            if (limit)
+                _snprintf_s(label, _TRUNCATE, "le=\"%g\"", static_cast<double>(limit) / 1000000.0);
+            else
+                strcpy_s(label, "le=\"+Inf\"");
+            AppendListenerSample(outString, "stream_connector_connect_duration_seconds", "_bucket",
+                &sources[i], label, cumulative);
+        }
+        AppendFormatted(outString, "stream_connector_connect_duration_seconds_sum{listener=\"%ls\",id=\"%hu\"} %.6f\n",
+            sources[i].pszTypeName, sources[i].id, static_cast<double>(metrics->connectTimeTotal) / 1000000.0);
+        AppendListenerSample(outString, "stream_connector_connect_duration_seconds", "_count",
+            &sources[i], nullptr, cumulative);
+    }
+
+    AppendHeader(outString, "stream_connector_received_chunk_bytes", "histogram",
+        "Sizes of data chunks received by one read.");
+    for (DWORD i = 0; i < count; ++i)
+    {
+        auto metrics = sources[i].metrics;
+        LONGLONG cumulative = 0;
+        for (DWORD b = 0; b < METRICS_CHUNK_BUCKET_COUNT; ++b)
+        {
+            cumulative += metrics->chunkCounts[b];
+            auto limit = GetMetricsChunkBucketLimit(b);
+            char label[32];
+            if (limit)
+                _snprintf_s(label, _TRUNCATE, "le=\"%lu\"", limit);
+            else
+                strcpy_s(label, "le=\"+Inf\"");
+            AppendListenerSample(outString, "stream_connector_received_chunk_bytes", "_bucket",
+                &sources[i], label, cumulative);
+        }
+        AppendListenerSample(outString, "stream_connector_received_chunk_bytes", "_sum",
+            &sources[i], nullptr, metrics->bytesUpstream + metrics->bytesDownstream);
+        AppendListenerSample(outString, "stream_connector_received_chunk_bytes", "_count",
+            &sources[i], nullptr, cumulative);
+    }
+}
+
+_Use_decl_annotations_
+void FormatSocketOptionsExposition(const SocketOptionsSource* sources, DWORD count, std::string& outString)
+{
+    AppendHeader(outString, "stream_connector_socket_options", "gauge",
+        "Options applied to TCP sockets (0 for the system default).");
+    for (DWORD i = 0; i < count; ++i)
+    {
+        auto& s = sources[i];
+        const struct
+        {
+            PCSTR pszOption;
+            DWORD value;
+        } values[] = {
+            { "nodelay", s.options->isNoDelay ? 1UL : 0UL },
+            { "keepalive_milliseconds", s.options->keepAliveTime },
+            { "receive_buffer_bytes", s.options->receiveBufferSize },
+            { "send_buffer_bytes", s.options->sendBufferSize },
+        };
+        for (auto& v : values)
+        {
+            AppendFormatted(outString, "stream_connector_socket_options{endpoint=\"%s\",type=\"%ls\",id=\"%hu\",option=\"%s\"} %lu\n",
+                s.pszEndpoint, s.pszTypeName, s.id, v.pszOption, v.value);
+        }
+    }
+    FormatMetricExposition("stream_connector_socket_option_failures_total", "counter",
+        "Sockets for which the socket options could not be applied.", GetTcpSocketOptionFailedCount(), outString);
+}
+
+_Use_decl_annotations_
+void FormatRelayBufferStatsExposition(std::string& outString)
+{
+    RelayBufferStats stats[RELAY_BUFFER_SIZE_CLASS_COUNT];
+    RelayBuffer::GetStats(stats);
+    static const struct
+    {
+        PCSTR pszSource;
+        size_t offset;
+    } s_sources[] = {
+        { "thread_cache", offsetof(RelayBufferStats, threadCacheHits) },
+        { "pool", offsetof(RelayBufferStats, poolHits) },
+        { "heap", offsetof(RelayBufferStats, misses) },
+    };
+    AppendHeader(outString, "stream_connector_relay_buffer_allocations_total", "counter",
+        "Relay buffers allocated, by the capacity and where the buffer came from.");
+    for (auto& s : stats)
+    {
+        for (auto& src : s_sources)
+        {
+            AppendFormatted(outString, "stream_connector_relay_buffer_allocations_total{capacity=\"%lu\",source=\"%s\"} %lld\n",
+                s.capacity, src.pszSource, *reinterpret_cast<const LONG64*>(reinterpret_cast<const BYTE*>(&s) + src.offset));
+        }
+    }
+    AppendHeader(outString, "stream_connector_relay_buffer_discarded_total", "counter",
+        "Released relay buffers freed because the pool is full.");
+    for (auto& s : stats)
+    {
+        AppendFormatted(outString, "stream_connector_relay_buffer_discarded_total{capacity=\"%lu\"} %lld\n",
+            s.capacity, s.discarded);
+    }
+}
+
+_Use_decl_annotations_
+void FormatMetricExposition(PCSTR pszName, PCSTR pszType, PCSTR pszHelp, LONGLONG value, std::string& outString)
+{
+    AppendHeader(outString, pszName, pszType, pszHelp);
+    AppendFormatted(outString, "%s %lld\n", pszName, value);
+}
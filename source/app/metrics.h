@@ -0,0 +1,76 @@
+#pragma once
+
+struct TcpSocketOptions;
+
+// the count of buckets for the histogram of received chunk sizes
+// (<= 64, <= 256, <= 1k, <= 4k, <= 16k, <= 64k, and larger)
+constexpr DWORD METRICS_CHUNK_BUCKET_COUNT = 7;
+// the count of buckets for the histogram of connect times
+// (<= 1ms, <= 5ms, <= 10ms, <= 50ms, <= 100ms, <= 500ms, <= 1s, <= 5s, and longer)
+constexpr DWORD METRICS_CONNECT_TIME_BUCKET_COUNT = 9;
+
+// Counters of one listener; all members are updated with interlocked operations
+// and can be read at any time without locking (zero-initialized on start)
+struct ListenerMetrics
+{
+    volatile LONG64 acceptedCount;
+    volatile LONG64 activeCount;
+    volatile LONG64 connectFailedCount;
+    // received from the client (sent to the connector), and vice versa
+    volatile LONG64 bytesUpstream;
+    volatile LONG64 bytesDownstream;
+    // successful connects with the connector and their time (in microseconds)
+    volatile LONG64 connectCount;
+    volatile LONG64 connectTimeTotal;
+    volatile LONG64 connectTimeMax;
+    volatile LONG64 connectTimeCounts[METRICS_CONNECT_TIME_BUCKET_COUNT];
+    volatile LONG64 chunkCounts[METRICS_CHUNK_BUCKET_COUNT];
+};
+
+// Returns the upper bound of the bucket (0 for the last bucket, which has no bound)
+DWORD GetMetricsChunkBucketLimit(_In_ DWORD index);
+// Returns the upper bound of the bucket in microseconds (0 for the last bucket)
+LONGLONG GetMetricsConnectTimeBucketLimit(_In_ DWORD index);
+
+void MetricsOnAccepted(_Inout_opt_ ListenerMetrics* metrics);
+void MetricsOnFinished(_Inout_opt_ ListenerMetrics* metrics);
+void MetricsOnConnected(_Inout_opt_ ListenerMetrics* metrics, _In_ bool isSucceeded, _In_ LONGLONG microseconds);
+void MetricsOnReceived(_Inout_opt_ ListenerMetrics* metrics, _In_ bool isUpstream, _In_ DWORD size);
+
+// Appends the human-readable text of the metrics (without the trailing new line)
+void FormatListenerMetrics(_In_ const ListenerMetrics* metrics, _Inout_ std::wstring& outString);
+
+// Appends the human-readable summary of relay buffer allocations (without the trailing new line)
+void FormatRelayBufferStats(_Inout_ std::wstring& outString);
+
+// the source of the metrics for FormatMetricsExposition
+struct ListenerMetricsSource
+{
+    const ListenerMetrics* metrics;
+    PCWSTR pszTypeName;
+    WORD id;
+};
+
+// Appends the metrics of all listeners in the Prometheus text exposition format
+void FormatMetricsExposition(_In_reads_(count) const ListenerMetricsSource* sources, _In_ DWORD count,
+    _Inout_ std::string& outString);
+// the TCP socket options of a listener or the connector for FormatSocketOptionsExposition
+struct SocketOptionsSource
+{
+    const TcpSocketOptions* options;
+    // "listener" or "connector"
+    PCSTR pszEndpoint;
+    PCWSTR pszTypeName;
+    // (0 for the connector)
+    WORD id;
+};
+
+// Appends the socket options and the count of failures applying them in the Prometheus text exposition format
+void FormatSocketOptionsExposition(_In_reads_(count) const SocketOptionsSource* sources, _In_ DWORD count,
+    _Inout_ std::string& outString);
+// Appends the relay buffer statistics in the Prometheus text exposition format
+void FormatRelayBufferStatsExposition(_Inout_ std::string& outString);
+// Appends one metric without labels in the Prometheus text exposition format
+// (pszType: "counter" or "gauge")
+void FormatMetricExposition(_In_z_ PCSTR pszName, _In_z_ PCSTR pszType, _In_z_ PCSTR pszHelp, _In_ LONGLONG value,
+    _Inout_ std::string& outString);
@@ -0,0 +1,241 @@
+#include "../framework.h"
+
+#include "../duplex/duplex.h"
+#include "../listeners/tcp_socket_listener.h"
+
+#include "../logger/logger.h"
+
+#include "metrics_server.h"
+
+// the time to wait for the request header (in milliseconds)
+constexpr DWORD METRICS_REQUEST_TIMEOUT = 5000;
+// the maximum size of the request header; larger requests are rejected
+constexpr size_t METRICS_REQUEST_MAX_SIZE = 8192;
+
+MetricsServer::MetricsServer()
+    : m_listener(nullptr)
+    , m_pfnWriter(nullptr)
+    , m_hEventQuit(nullptr)
+    , m_hEventIdle(nullptr)
+    , m_requestCount(0)
+{
+    ::InitializeCriticalSection(&m_csRequests);
+}
+
+MetricsServer::~MetricsServer()
+{
+    Close(INFINITE);
+    if (m_hEventIdle)
+        ::CloseHandle(m_hEventIdle);
+    if (m_hEventQuit)
+        ::CloseHandle(m_hEventQuit);
+    ::DeleteCriticalSection(&m_csRequests);
+}
+
+_Use_decl_annotations_
+HRESULT MetricsServer::Initialize(USHORT port, bool isIPv6, PCWSTR pszBindAddress, PMetricsWriter pfnWriter, USHORT* outPort)
+{
+    if (m_listener)
+        return E_UNEXPECTED;
+    if (!m_hEventQuit)
+    {
+        m_hEventQuit = ::CreateEventW(nullptr, TRUE, FALSE, nullptr);
+        if (!m_hEventQuit)
+            return HRESULT_FROM_WIN32(::GetLastError());
+    }
+    if (!m_hEventIdle)
+    {
+        m_hEventIdle = ::CreateEventW(nullptr, TRUE, TRUE, nullptr);
+        if (!m_hEventIdle)
+            return HRESULT_FROM_WIN32(::GetLastError());
+    }
+    m_pfnWriter = pfnWriter;
+
+    auto p = new TcpSocketListener();
+    if (!p)
+        return E_OUTOFMEMORY;
+    auto hr = p->InitializeSocket(port, isIPv6, pszBindAddress, reinterpret_cast<PAcceptHandler>(OnAccept), this, outPort);
+    if (FAILED(hr))
+    {
+        delete p;
+        return hr;
+    }
+    ::ResetEvent(m_hEventQuit);
+    m_listener = p;
+    return S_OK;
+}
+
+_Use_decl_annotations_
+bool MetricsServer::Close(DWORD dwTimeout)
+{
+    if (m_listener)
+    {
+        delete m_listener;
+        m_listener = nullptr;
+    }
+    if (!m_hEventIdle)
+        return true;
+    ::SetEvent(m_hEventQuit);
+    return ::WaitForSingleObject(m_hEventIdle, dwTimeout) == WAIT_OBJECT_0;
+}
+
+_Use_decl_annotations_
+void CALLBACK MetricsServer::OnAccept(Duplex* duplex, MetricsServer* pThis)
+{
+    auto data = static_cast<RequestData*>(malloc(sizeof(RequestData)));
+    if (!data)
+    {
+        delete duplex;
+        return;
+    }
+    data->server = pThis;
+    data->duplex = duplex;
+
+    ::EnterCriticalSection(&pThis->m_csRequests);
+    if (pThis->m_requestCount++ == 0)
+        ::ResetEvent(pThis->m_hEventIdle);
+    ::LeaveCriticalSection(&pThis->m_csRequests);
+
+    if (!::TrySubmitThreadpoolCallback(reinterpret_cast<PTP_SIMPLE_CALLBACK>(RequestCallback), data, nullptr))
+    {
+        AddLogFormatted(LogLevel::Error, L"[metrics] Failed to start handling request: [0x%08lX]",
+            HRESULT_FROM_WIN32(::GetLastError()));
+        free(data);
+        delete duplex;
+        pThis->FinishRequest();
+    }
+}
+
+_Use_decl_annotations_
+void CALLBACK MetricsServer::RequestCallback(PTP_CALLBACK_INSTANCE instance, RequestData* data)
+{
+    // waiting for the request from the client may take long time
+    ::CallbackMayRunLong(instance);
+
+    auto pThis = data->server;
+    auto duplex = data->duplex;
+    free(data);
+    pThis->HandleRequest(duplex);
+    delete duplex;
+    pThis->FinishRequest();
+}
+
+void MetricsServer::FinishRequest()
+{
+    ::EnterCriticalSection(&m_csRequests);
+    if (--m_requestCount == 0)
+        ::SetEvent(m_hEventIdle);
+    ::LeaveCriticalSection(&m_csRequests);
+}
+
+static HRESULT WriteAll(_In_ Duplex* duplex, _In_reads_bytes_(size) const char* buffer, _In_ size_t size)
+{
+    while (size > 0)
+    {
+        DWORD written = 0;
+        auto hr = duplex->Write(buffer, size > MAXDWORD ? MAXDWORD : static_cast<DWORD>(size), &written);
+        if (FAILED(hr))
+            return hr;
+        if (!written)
+            return HRESULT_FROM_WIN32(ERROR_WRITE_FAULT);
+        buffer += written;
+        size -= written;
+    }
+    return S_OK;
+}
+
+_Use_decl_annotations_
+void MetricsServer::HandleRequest(Duplex* duplex)
+{
+    std::string request;
+    auto timeEnd = ::GetTickCount64() + METRICS_REQUEST_TIMEOUT;
+    while (request.find("\r\n\r\n") == std::string::npos && request.find("\n\n") == std::string::npos)
+    {
+        if (request.size() >= METRICS_REQUEST_MAX_SIZE)
+            return;
+        auto now = ::GetTickCount64();
+        if (now >= timeEnd)
+            return;
+        HANDLE hEventRead;
+        auto hr = duplex->StartRead(&hEventRead);
+        if (FAILED(hr))
+            return;
+        HANDLE handles[] = { hEventRead, m_hEventQuit };
+        auto r = ::WaitForMultipleObjects(2, handles, FALSE, static_cast<DWORD>(timeEnd - now));
+        if (r != WAIT_OBJECT_0)
+        {
+            // the completion is notified even if cancelled
+            duplex->CancelRead();
+            ::WaitForSingleObject(hEventRead, INFINITE);
+            RelayBuffer* buffer;
+            if (duplex->FinishRead(&buffer) == S_OK)
+                buffer->Release();
+            return;
+        }
+        RelayBuffer* buffer;
+        hr = duplex->FinishRead(&buffer);
+        if (hr != S_OK)
+            return;
+        try
+        {
+            request.append(reinterpret_cast<const char*>(buffer->GetData()), buffer->GetSize());
+        }
+        catch (...)
+        {
+            buffer->Release();
+            return;
+        }
+        buffer->Release();
+    }
+
+    PCSTR pszStatus;
+    std::string body;
+    auto isGet = strncmp(request.c_str(), "GET ", 4) == 0;
+    auto isHead = !isGet && strncmp(request.c_str(), "HEAD ", 5) == 0;
+    if (isGet || isHead)
+    {
+        auto start = request.find(' ') + 1;
+        auto end = request.find_first_of(" ?\r\n", start);
+        auto path = request.substr(start, end == std::string::npos ? std::string::npos : end - start);
+        if (path == "/" || path == "/metrics")
+        {
+            pszStatus = "200 OK";
+            try
+            {
+                m_pfnWriter(body);
+            }
+            catch (...)
+            {
+                pszStatus = "500 Internal Server Error";
+                body.clear();
+            }
+        }
+        else
+        {
+            pszStatus = "404 Not Found";
+        }
+    }
+    else
+    {
+        pszStatus = "405 Method Not Allowed";
+    }
+
+    char header[256];
+    auto len = _snprintf_s(header, _TRUNCATE,
+        "HTTP/1.0 %s\r\n"
+        "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+        "Content-Length: %zu\r\n"
+        "Connection: close\r\n"
+        "\r\n",
+        pszStatus, body.size());
+    if (len <= 0)
+        return;
+    if (FAILED(WriteAll(duplex, header, static_cast<size_t>(len))))
+        return;
+    if (!isHead && !body.empty())
+    {
+        if (FAILED(WriteAll(duplex, body.c_str(), body.size())))
+            return;
+    }
+    duplex->Flush();
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+class Duplex;
+class TcpSocketListener;
+
+// Serves the statistics in the Prometheus text exposition format via HTTP;
+// each request is handled on the thread pool, not on the main thread
+class MetricsServer
+{
+public:
+    // writes the whole exposition text (called on any thread)
+    typedef void (CALLBACK* PMetricsWriter)(_Inout_ std::string& outString);
+
+    MetricsServer();
+    ~MetricsServer();
+
+    _Check_return_
+    HRESULT Initialize(
+        _In_ USHORT port,
+        _In_ bool isIPv6,
+        _In_opt_z_ PCWSTR pszBindAddress,
+        _In_ PMetricsWriter pfnWriter,
+        _When_(return == S_OK, _Out_opt_) USHORT* outPort
+    );
+    // Stops accepting and waits for the requests being handled;
+    // returns false if some requests are not finished in dwTimeout
+    bool Close(_In_ DWORD dwTimeout);
+
+private:
+    struct RequestData
+    {
+        MetricsServer* server;
+        Duplex* duplex;
+    };
+
+    static void CALLBACK OnAccept(_In_ Duplex* duplex, _In_ MetricsServer* pThis);
+    static void CALLBACK RequestCallback(_Inout_ PTP_CALLBACK_INSTANCE instance, _In_ RequestData* data);
+    void HandleRequest(_In_ Duplex* duplex);
+    // must be called for each finished request
+    void FinishRequest();
+
+    TcpSocketListener* m_listener;
+    PMetricsWriter m_pfnWriter;
+    HANDLE m_hEventQuit;
+    // signalled while no requests are being handled
+    HANDLE m_hEventIdle;
+    CRITICAL_SECTION m_csRequests;
+    DWORD m_requestCount;
+};
@@ -0,0 +1,198 @@
+#include "relay_core.h"
+
+RelayCore::RelayCore(RelayCoreIo* io)
+    : m_io(io)
+    , m_channels{}
+    , m_pendingCount(0)
+    , m_result(0)
+    , m_isStarted(false)
+    , m_isClosing(false)
+    , m_isFinished(false)
+{
+}
+
+RelayCore::~RelayCore()
+{
+    for (auto& channel : m_channels)
+    {
+        for (size_t i = 0; i < channel.chunkCount; ++i)
+            m_io->ReleaseChunk(channel.chunks[i]);
+        channel.chunkCount = 0;
+    }
+}
+
+void RelayCore::Start()
+{
+    std::unique_lock<std::mutex> lock(m_lock);
+    m_isStarted = true;
+    if (!m_isClosing)
+        StartReadLocked(0);
+    if (!m_isClosing)
+        StartReadLocked(1);
+    if (CheckFinishedLocked())
+    {
+        auto finalResult = m_result;
+        lock.unlock();
+        m_io->OnFinished(finalResult);
+    }
+}
+
+void RelayCore::Close(RelayStatus result)
+{
+    std::unique_lock<std::mutex> lock(m_lock);
+    CloseLocked(result);
+    if (CheckFinishedLocked())
+    {
+        auto finalResult = m_result;
+        lock.unlock();
+        m_io->OnFinished(finalResult);
+    }
+}
+
+void RelayCore::OnReadCompleted(int channel, RelayStatus status, void* chunk)
+{
+    std::unique_lock<std::mutex> lock(m_lock);
+    auto& c = m_channels[channel];
+    c.isReading = false;
+    --m_pendingCount;
+    if (chunk && (m_isClosing || status < 0))
+    {
+        m_io->ReleaseChunk(chunk);
+        chunk = nullptr;
+    }
+    if (!m_isClosing)
+    {
+        if (status < 0)
+            CloseLocked(status);
+        else if (!chunk)
+        {
+            c.isEnd = true;
+            // close after all received data is written
+            if (!c.chunkCount)
+                CloseLocked(status);
+        }
+        else if (m_io->GetChunkSize(chunk) == 0)
+        {
+            // (nothing to write)
+            m_io->ReleaseChunk(chunk);
+            StartReadLocked(channel);
+        }
+        else
+        {
+            c.chunks[c.chunkCount++] = chunk;
+            if (!c.isWriting)
+                StartWriteLocked(channel);
+            // read ahead while the queue has room (otherwise the write completion restarts reading)
+            if (c.chunkCount < RELAY_CORE_MAX_QUEUED_CHUNKS)
+                StartReadLocked(channel);
+        }
+    }
+    if (CheckFinishedLocked())
+    {
+        auto finalResult = m_result;
+        lock.unlock();
+        m_io->OnFinished(finalResult);
+    }
+}
+
+void RelayCore::OnWriteCompleted(int channel, RelayStatus status, size_t writtenSize)
+{
+    std::unique_lock<std::mutex> lock(m_lock);
+    auto& c = m_channels[channel];
+    c.isWriting = false;
+    --m_pendingCount;
+    if (!m_isClosing)
+    {
+        if (status < 0 || writtenSize == 0)
+        {
+            // (nothing written means that the peer does not accept data any more)
+            CloseLocked(status);
+        }
+        else
+        {
+            // release the chunks written entirely (the write may stop at the middle of a chunk)
+            while (c.chunkCount > 0 && writtenSize > 0)
+            {
+                auto rest = m_io->GetChunkSize(c.chunks[0]) - c.offset;
+                if (writtenSize < rest)
+                {
+                    c.offset += writtenSize;
+                    break;
+                }
+                writtenSize -= rest;
+                m_io->ReleaseChunk(c.chunks[0]);
+                for (size_t i = 1; i < c.chunkCount; ++i)
+                    c.chunks[i - 1] = c.chunks[i];
+                --c.chunkCount;
+                c.offset = 0;
+            }
+            if (c.chunkCount > 0)
+                StartWriteLocked(channel);
+            else if (c.isEnd)
+                CloseLocked(0);
+            if (!m_isClosing && !c.isEnd && !c.isReading && c.chunkCount < RELAY_CORE_MAX_QUEUED_CHUNKS)
+                StartReadLocked(channel);
+        }
+    }
+    if (CheckFinishedLocked())
+    {
+        auto finalResult = m_result;
+        lock.unlock();
+        m_io->OnFinished(finalResult);
+    }
+}
+
+void RelayCore::StartReadLocked(int channel)
+{
+    auto& c = m_channels[channel];
+    c.isReading = true;
+    ++m_pendingCount;
+    auto status = m_io->StartRead(channel);
+    if (status < 0)
+    {
+        c.isReading = false;
+        --m_pendingCount;
+        CloseLocked(status);
+    }
+}
+
+void RelayCore::StartWriteLocked(int channel)
+{
+    auto& c = m_channels[channel];
+    c.isWriting = true;
+    ++m_pendingCount;
+    auto status = m_io->StartWrite(channel, c.chunks, c.chunkCount, c.offset);
+    if (status < 0)
+    {
+        c.isWriting = false;
+        --m_pendingCount;
+        CloseLocked(status);
+    }
+}
+
+void RelayCore::CloseLocked(RelayStatus result)
+{
+    if (m_isClosing)
+        return;
+    m_isClosing = true;
+    m_result = result;
+    // the completions of the cancelled operations are still reported
+    if (m_pendingCount > 0)
+        m_io->CancelAll();
+}
+
+bool RelayCore::CheckFinishedLocked()
+{
+    if (m_isFinished || !m_isStarted || !m_isClosing || m_pendingCount > 0)
+        return false;
+    m_isFinished = true;
+    // release the chunks before OnFinished, which may destroy the endpoints
+    for (auto& channel : m_channels)
+    {
+        for (size_t i = 0; i < channel.chunkCount; ++i)
+            m_io->ReleaseChunk(channel.chunks[i]);
+        channel.chunkCount = 0;
+        channel.offset = 0;
+    }
+    return true;
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+// Scheduling of reads and writes of one relay pair, used by the iocp engine.
+// This file and relay_core.cpp depend only on the C++ standard library, so that the scheduling
+// can be tested and benchmarked on other platforms (see tests/ and bench/).
+
+#include <cstddef>
+#include <mutex>
+
+// the status of operations passed through RelayCore (HRESULT values on Windows; negative for failures)
+typedef long RelayStatus;
+
+// the maximum count of received chunks queued for writing on each channel;
+// reading from the sender is paused while the queue is full, so a slow receiver costs no thread
+constexpr size_t RELAY_CORE_MAX_QUEUED_CHUNKS = 4;
+
+// I/O operations requested by RelayCore (implemented by the engine or by the tests).
+// Channel 0 reads from endpoint 0 and writes to endpoint 1, and channel 1 is the reverse.
+// Each StartRead/StartWrite call returning a non-negative status must be reported back with
+// RelayCore::OnReadCompleted/OnWriteCompleted exactly once (also when cancelled), on any thread.
+// The operations are requested while RelayCore holds its lock, so the completion must not be
+// reported on the calling thread before returning.
+class RelayCoreIo
+{
+public:
+    virtual ~RelayCoreIo() {}
+
+    // Starts reading one chunk from the endpoint of the channel
+    virtual RelayStatus StartRead(int channel) = 0;
+    // Starts writing the chunks in order to the other endpoint, skipping 'offset' bytes of the first chunk
+    // (the array is valid only during the call, but the chunks are kept until the write is completed;
+    // the write may be completed with a part of the data)
+    virtual RelayStatus StartWrite(int channel, void* const* chunks, size_t count, size_t offset) = 0;
+    // Cancels all pending reads and writes of both endpoints
+    virtual void CancelAll() = 0;
+    // Returns the size of the data in the chunk
+    virtual size_t GetChunkSize(void* chunk) = 0;
+    virtual void ReleaseChunk(void* chunk) = 0;
+    // Called once after the relay is closed and all operations are completed;
+    // RelayCore is not touched after this call, so it can be destroyed in this call
+    virtual void OnFinished(RelayStatus result) = 0;
+};
+
+class RelayCore
+{
+public:
+    explicit RelayCore(RelayCoreIo* io);
+    ~RelayCore();
+
+    RelayCore(const RelayCore&) = delete;
+    RelayCore& operator=(const RelayCore&) = delete;
+
+    // Finishes the setup and starts reading from both endpoints
+    // (if Close has been called, only finishes the setup, and OnFinished may be called)
+    void Start();
+    // Closes the relay and cancels pending operations (only the result of the first call is kept)
+    void Close(RelayStatus result);
+
+    // Reports the completed read; chunk is null for EOF (status >= 0) or for the failure (status < 0),
+    // and is owned by RelayCore otherwise
+    void OnReadCompleted(int channel, RelayStatus status, void* chunk);
+    // Reports the completed write with the size actually written
+    void OnWriteCompleted(int channel, RelayStatus status, size_t writtenSize);
+
+    // Returns true if the channel has reached EOF (the written endpoint can be flushed)
+    // (call only after RelayCoreIo::OnFinished is called)
+    bool HasReachedEnd(int channel) const { return m_channels[channel].isEnd; }
+
+private:
+    struct Channel
+    {
+        // received chunks not written yet (chunks[0] is the oldest)
+        void* chunks[RELAY_CORE_MAX_QUEUED_CHUNKS];
+        size_t chunkCount;
+        // the written size of chunks[0]
+        size_t offset;
+        bool isReading;
+        bool isWriting;
+        bool isEnd;
+    };
+
+    void StartReadLocked(int channel);
+    void StartWriteLocked(int channel);
+    void CloseLocked(RelayStatus result);
+    // Returns true if OnFinished should be called by the caller (after unlocking)
+    bool CheckFinishedLocked();
+
+    RelayCoreIo* m_io;
+    std::mutex m_lock;
+    Channel m_channels[2];
+    // count of started reads and writes not completed yet
+    size_t m_pendingCount;
+    RelayStatus m_result;
+    bool m_isStarted;
+    bool m_isClosing;
+    bool m_isFinished;
+};
@@ -8,6 +8,14 @@
 #include "simple_dialog.h"
 
 constexpr UINT ID_NOTIFYICON = 1;
+constexpr UINT_PTR ID_TIMER_STATUS = 1;
+// interval of refreshing the status (statistics) while the window is visible
+constexpr UINT STATUS_REFRESH_INTERVAL = 1000;
+constexpr UINT_PTR ID_TIMER_LOG = 2;
+// minimum interval of rendering new logs (about 30 times per second)
+constexpr ULONGLONG LOG_UPDATE_INTERVAL = 33;
+// maximum length of the text in the log field (the oldest lines are removed)
+constexpr int LOG_TEXT_MAX_LENGTH = 65535;
 
 constexpr auto PADDING_CHILDREN = 10;
 constexpr auto PADDING_BETWEEN_LABEL_AND_FIELD = 2;
@@ -22,6 +30,10 @@ struct WindowData
     HWND hWndLog;
     HWND hWndLastFocus;
     int textHeight;
+    // the position in the logs already rendered
+    ULONGLONG logCursor;
+    ULONGLONG lastLogUpdateTime;
+    bool isLogUpdatePending;
 };
 
 static WNDPROC s_pfnEditProc = nullptr;
@@ -32,6 +44,18 @@ static void OnRefreshFont(_In_ HWND hWnd, _In_ WindowData* data, _In_ bool skipR
 static void OnResize(_In_ HWND hWnd, _In_ WindowData* data);
 static void OnCommand(_In_ HWND hWnd, _In_ WindowData* data, _In_ UINT uCmdID);
 static void OnIconNotify(_In_ HWND hWnd, _In_ WindowData* data, _In_ WPARAM wParam, _In_ LPARAM lParam);
+static void OnRefreshStatus(_In_ HWND hWnd, _In_ WindowData* data);
+static void OnUpdateLog(_In_ HWND hWnd, _In_ WindowData* data);
+
+static void MakeStatusString(_Out_ std::wstring& outString)
+{
+    std::wstring strMetrics;
+    ReportListenersAndConnector(outString);
+    ReportMetrics(strMetrics);
+    outString += L"\n\n";
+    outString += strMetrics;
+    ReplaceReturnChars(outString);
+}
 
 static HWND GetControlFocus(_In_ HWND hWnd)
 {
@@ -78,26 +102,91 @@ static void RemoveNotifyIcon(_In_ HWND hWnd)
     ::Shell_NotifyIconW(NIM_DELETE, &nid);
 }
 
-static void OnUpdateLog(_In_ HWND hWndLog, _In_z_ PCWSTR pszLog)
+// appends the text to the end of the log field, without re-setting the whole text
+static void AppendLogText(_In_ HWND hWndLog, _Inout_ std::wstring& str)
 {
-    std::wstring str(pszLog);
-    ReplaceReturnChars(str);
-    if (str.size() > 65535)
+    if (str.size() > static_cast<size_t>(LOG_TEXT_MAX_LENGTH))
+        str.erase(0, str.size() - LOG_TEXT_MAX_LENGTH);
+    auto addLen = static_cast<int>(str.size());
+
+    DWORD selStart = 0, selEnd = 0;
+    ::SendMessageW(hWndLog, EM_GETSEL, reinterpret_cast<WPARAM>(&selStart), reinterpret_cast<LPARAM>(&selEnd));
+    auto curTextLen = ::GetWindowTextLengthW(hWndLog);
+    auto isAtEnd = (selStart == selEnd && static_cast<int>(selEnd) == curTextLen);
+    auto firstLine = Edit_GetFirstVisibleLine(hWndLog);
+
+    SetWindowRedraw(hWndLog, FALSE);
+    int removedLen = 0;
+    int removedLines = 0;
+    if (curTextLen + addLen > LOG_TEXT_MAX_LENGTH)
+    {
+        // remove whole lines including the line at the excess position
+        auto excess = curTextLen + addLen - LOG_TEXT_MAX_LENGTH;
+        removedLines = Edit_LineFromChar(hWndLog, excess) + 1;
+        removedLen = Edit_LineIndex(hWndLog, removedLines);
+        if (removedLen < 0)
+        {
+            removedLines = Edit_GetLineCount(hWndLog);
+            removedLen = curTextLen;
+        }
+        Edit_SetSel(hWndLog, 0, removedLen);
+        Edit_ReplaceSel(hWndLog, L"");
+        curTextLen -= removedLen;
+    }
+    Edit_SetSel(hWndLog, curTextLen, curTextLen);
+    Edit_ReplaceSel(hWndLog, str.c_str());
+    if (isAtEnd)
+    {
+        // follow the new logs
+        curTextLen += addLen;
+        Edit_SetSel(hWndLog, curTextLen, curTextLen);
+        Edit_ScrollCaret(hWndLog);
+    }
+    else
     {
-        str.replace(0, str.size() - 65535, L"");
+        // keep the selection and the scroll position
+        auto start = static_cast<int>(selStart) > removedLen ? static_cast<int>(selStart) - removedLen : 0;
+        auto end = static_cast<int>(selEnd) > removedLen ? static_cast<int>(selEnd) - removedLen : 0;
+        Edit_SetSel(hWndLog, start, end);
+        firstLine = firstLine > removedLines ? firstLine - removedLines : 0;
+        Edit_Scroll(hWndLog, firstLine - Edit_GetFirstVisibleLine(hWndLog), 0);
+    }
+    SetWindowRedraw(hWndLog, TRUE);
+    ::InvalidateRect(hWndLog, nullptr, TRUE);
+}
+
+_Use_decl_annotations_
+static void OnUpdateLog(HWND hWnd, WindowData* data)
+{
+    // rate-limit rendering so that logging never delays other events on this thread
+    // (logs are kept in the logger until they are read)
+    auto now = ::GetTickCount64();
+    if (now - data->lastLogUpdateTime < LOG_UPDATE_INTERVAL)
+    {
+        if (!data->isLogUpdatePending)
+        {
+            data->isLogUpdatePending = true;
+            ::SetTimer(hWnd, ID_TIMER_LOG, static_cast<UINT>(LOG_UPDATE_INTERVAL - (now - data->lastLogUpdateTime)), nullptr);
+        }
+        return;
     }
+    data->lastLogUpdateTime = now;
 
-    auto dw = Edit_GetSel(hWndLog);
-    auto selStart = LOWORD(dw);
-    auto selEnd = HIWORD(dw);
-    auto curTextLen = GetWindowTextLengthW(hWndLog);
-    if (selStart == selEnd && selEnd == curTextLen)
+    std::wstring str;
+    auto dropped = ReadLogs(&data->logCursor, str);
+    if (dropped > 0)
     {
-        selStart = selEnd = static_cast<WORD>(str.size());
+        PWSTR psz;
+        if (SUCCEEDED(MakeFormattedString(&psz, L"(%llu lines dropped)\n", dropped)))
+        {
+            str.insert(0, psz);
+            free(psz);
+        }
     }
-    SetWindowTextW(hWndLog, str.c_str());
-    Edit_SetSel(hWndLog, selStart, selEnd);
-    Edit_ScrollCaret(hWndLog);
+    if (str.empty())
+        return;
+    ReplaceReturnChars(str);
+    AppendLogText(data->hWndLog, str);
 }
 
 _Use_decl_annotations_
@@ -115,8 +204,7 @@ _Use_decl_annotations_
 static bool OnCreate(HWND hWnd, WindowData* data)
 {
     std::wstring str;
-    ReportListenersAndConnector(str);
-    ReplaceReturnChars(str);
+    MakeStatusString(str);
 
     data->hWndLabelStatus = ::CreateWindowExW(0, L"Static", L"Status:",
         WS_CHILD | WS_VISIBLE,
@@ -142,6 +230,8 @@ static bool OnCreate(HWND hWnd, WindowData* data)
         hWnd, nullptr, nullptr, nullptr);
     if (!data->hWndLog)
         return false;
+    // the length is limited by AppendLogText instead
+    Edit_LimitText(data->hWndLog, 0);
 
     s_pfnEditProc = reinterpret_cast<WNDPROC>(::SetWindowLongPtrW(data->hWndStatus, GWLP_WNDPROC, reinterpret_cast<LONG_PTR>(&EditWndProc)));
     ::SetWindowLongPtrW(data->hWndLog, GWLP_WNDPROC, reinterpret_cast<LONG_PTR>(&EditWndProc));
@@ -153,10 +243,26 @@ static bool OnCreate(HWND hWnd, WindowData* data)
 
     AddNotifyIcon(hWnd);
     OnRefreshFont(hWnd, data);
+    ::SetTimer(hWnd, ID_TIMER_STATUS, STATUS_REFRESH_INTERVAL, nullptr);
 
     return true;
 }
 
+_Use_decl_annotations_
+static void OnRefreshStatus(HWND hWnd, WindowData* data)
+{
+    if (!::IsWindowVisible(hWnd))
+        return;
+    std::wstring str;
+    MakeStatusString(str);
+    // keep the selection and the scroll position
+    auto dw = Edit_GetSel(data->hWndStatus);
+    auto firstLine = Edit_GetFirstVisibleLine(data->hWndStatus);
+    ::SetWindowTextW(data->hWndStatus, str.c_str());
+    Edit_SetSel(data->hWndStatus, LOWORD(dw), HIWORD(dw));
+    Edit_Scroll(data->hWndStatus, firstLine, 0);
+}
+
 _Use_decl_annotations_
 static void OnRefreshFont(HWND hWnd, WindowData* data, bool skipResize)
 {
@@ -233,6 +339,7 @@ static void OnCommand(HWND hWnd, WindowData* data, UINT uCmdID)
     {
         case ID_FILE_CLEARLOGS:
             ClearLogs();
+            ::SetWindowTextW(data->hWndLog, L"");
             break;
         case ID_FILE_EXIT:
             //::SendMessageW(hWnd, WM_CLOSE, 0, 0);
@@ -331,7 +438,23 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
         case WM_CLOSE:
             ::ShowWindow(hWnd, SW_HIDE);
             return 0;
+        case WM_TIMER:
+            if (wParam == ID_TIMER_STATUS)
+            {
+                OnRefreshStatus(hWnd, data);
+                return 0;
+            }
+            else if (wParam == ID_TIMER_LOG)
+            {
+                ::KillTimer(hWnd, ID_TIMER_LOG);
+                data->isLogUpdatePending = false;
+                OnUpdateLog(hWnd, data);
+                return 0;
+            }
+            break;
         case WM_DESTROY:
+            ::KillTimer(hWnd, ID_TIMER_STATUS);
+            ::KillTimer(hWnd, ID_TIMER_LOG);
             RemoveNotifyIcon(hWnd);
             ::PostQuitMessage(0);
             break;
@@ -363,7 +486,7 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
                 ProcessShutdown();
             break;
         case MY_WM_UPDATELOG:
-            OnUpdateLog(data->hWndLog, reinterpret_cast<PCWSTR>(lParam));
+            OnUpdateLog(hWnd, data);
             return 0;
         case MY_WM_ICONNOTIFY:
             OnIconNotify(hWnd, data, wParam, lParam);
@@ -1,4 +1,5 @@
 #include "../framework.h"
+#include "../options.h"
 #include "../util/functions.h"
 
 #include "../connectors/connector.h"
@@ -6,9 +7,23 @@
 
 #include "../logger/logger.h"
 
+#include "metrics.h"
 #include "worker.h"
 
-constexpr DWORD TIMEOUT_FOR_CONTINUOUS_READ = 10;
+// the smoothed inter-arrival time regarded as continuous traffic in adaptive mode (in microseconds)
+constexpr LONGLONG ADAPTIVE_CONTINUOUS_INTERVAL = 1000;
+// the initial inter-arrival time in adaptive mode (starting as non-continuous traffic)
+constexpr LONGLONG ADAPTIVE_INITIAL_INTERVAL = ADAPTIVE_CONTINUOUS_INTERVAL * 4;
+
+// the state for gathering received data of one direction
+struct CoalesceState
+{
+    CoalesceMode mode;
+    DWORD threshold;
+    // the time of the last arrival and the smoothed inter-arrival time (in microseconds)
+    LONGLONG lastArrival;
+    LONGLONG avgInterval;
+};
 
 struct WorkerData
 {
@@ -17,71 +32,133 @@ struct WorkerData
     WORD listenerId;
     PCWSTR typeName;
     const Connector* connector;
+    const RelayOptions* relayOptions;
+    ListenerMetrics* metrics;
     PFinishHandler pfnFinishHandler;
     void* dataHandler;
 };
 
-struct BufferData
-{
-    void* buffer;
-    DWORD size;
-};
+// the count of running worker threads
+static volatile LONG s_workerCount = 0;
 
-static PWSTR MakeBufferString(const void* buffer, DWORD size)
+_Use_decl_annotations_
+void MakeBufferPreview(const void* buffer, DWORD size, PWSTR outString)
 {
-    std::wstring str;
-    WCHAR buf[4];
+    static const WCHAR s_hex[] = L"0123456789ABCDEF";
     bool isMany = false;
-    if (size > 16)
+    if (size > BUFFER_PREVIEW_BYTES)
     {
-        size = 16;
+        size = BUFFER_PREVIEW_BYTES;
         isMany = true;
     }
     auto p = static_cast<const BYTE*>(buffer);
-    while (size--)
+    auto out = outString;
+    for (DWORD i = 0; i < size; ++i)
     {
-        if (p != buffer)
-            swprintf_s(buf, L" %02X", static_cast<UINT>(*p));
-        else
-            swprintf_s(buf, L"%02X", static_cast<UINT>(*p));
-        str += buf;
-        ++p;
+        if (i > 0)
+            *out++ = L' ';
+        *out++ = s_hex[p[i] >> 4];
+        *out++ = s_hex[p[i] & 0x0F];
     }
     if (isMany)
-        str += L"...";
-    return _wcsdup(str.c_str());
+    {
+        *out++ = L'.';
+        *out++ = L'.';
+        *out++ = L'.';
+    }
+    *out = L'\0';
 }
 
-static HRESULT ConcatBufferAndRelease(_Inout_ std::vector<BufferData>& allReceived, _Out_ void** outBuffer, _Out_ DWORD* outSize)
+_Use_decl_annotations_
+void ApplyRelayOptions(Duplex* duplex, const RelayOptions* options)
 {
-    *outBuffer = nullptr;
-    *outSize = 0;
-    DWORD totalSize = 0;
-    for (auto& it : allReceived)
-        totalSize += it.size;
-    auto ptr = static_cast<BYTE*>(malloc(totalSize));
-    if (!ptr)
-        return E_OUTOFMEMORY;
-    *outBuffer = ptr;
-    *outSize = totalSize;
-    for (auto& it : allReceived)
+    if (!options)
+        return;
+    duplex->SetReadBufferRange(options->bufferMinSize, options->bufferMaxSize);
+}
+
+static void InitCoalesceState(_Out_ CoalesceState* state, _In_opt_ const RelayOptions* options)
+{
+    state->mode = options ? options->coalesceMode : CoalesceMode::Adaptive;
+    state->threshold = options ? options->coalesceSize : COALESCE_DEFAULT_SIZE;
+    state->lastArrival = 0;
+    state->avgInterval = ADAPTIVE_INITIAL_INTERVAL;
+}
+
+static void OnDataArrived(_Inout_ CoalesceState* state)
+{
+    if (state->mode != CoalesceMode::Adaptive)
+        return;
+    auto now = GetMicroseconds();
+    if (state->lastArrival)
     {
-        memcpy(ptr, it.buffer, it.size);
-        free(it.buffer);
-        ptr += it.size;
+        // smoothing factor is 1/8 (as TCP's SRTT)
+        state->avgInterval += (now - state->lastArrival - state->avgInterval) / 8;
     }
+    state->lastArrival = now;
+}
+
+// returns true if already-received data should be gathered before writing
+static bool ShouldCoalesce(_In_ const CoalesceState* state, _In_ DWORD pendingSize)
+{
+    switch (state->mode)
+    {
+        case CoalesceMode::Latency:
+            return false;
+        case CoalesceMode::Throughput:
+            return pendingSize < state->threshold;
+        default:
+            return pendingSize < state->threshold && state->avgInterval < ADAPTIVE_CONTINUOUS_INTERVAL;
+    }
+}
+
+static void ReleaseBuffers(_Inout_ std::vector<RelayBuffer*>& allReceived)
+{
+    for (auto it : allReceived)
+        it->Release();
     allReceived.clear();
-    return S_OK;
+}
+
+// writes all received buffers to 'to' and releases them
+static HRESULT WriteAndRelease(_In_ Duplex* to, _Inout_ std::vector<RelayBuffer*>& allReceived,
+    _In_z_ PCWSTR pszFromName, _In_z_ PCWSTR pszToName, _In_opt_ PAddLogFormatted logger)
+{
+    if (logger && IsLogEnabled(LogLevel::Debug))
+    {
+        // gather the head of data for logging (one more byte than shown to mark the data as truncated)
+        BYTE head[17];
+        DWORD headSize = 0;
+        DWORD totalSize = 0;
+        for (auto it : allReceived)
+        {
+            auto copySize = static_cast<DWORD>(sizeof(head)) - headSize;
+            if (copySize > it->GetSize())
+                copySize = it->GetSize();
+            memcpy(head + headSize, it->GetData(), copySize);
+            headSize += copySize;
+            totalSize += it->GetSize();
+        }
+        WCHAR preview[BUFFER_PREVIEW_LENGTH];
+        MakeBufferPreview(head, headSize, preview);
+        logger(LogLevel::Debug, L"  [%s] sending to '%s' size = %lu <%s>", pszFromName, pszToName, totalSize, preview);
+    }
+    auto hr = to->WriteBuffers(allReceived.data(), static_cast<DWORD>(allReceived.size()), nullptr);
+    ReleaseBuffers(allReceived);
+    return hr;
 }
 
 _Use_decl_annotations_
-HRESULT Transfer(HANDLE hEventQuit, Duplex* from, Duplex* to, PAddLogFormatted logger)
+HRESULT Transfer(HANDLE hEventQuit, Duplex* from, Duplex* to, const RelayOptions* options, ListenerMetrics* metrics,
+    PAddLogFormatted logger)
 {
     HRESULT hr;
-    void* buffer;
-    DWORD size;
+    RelayBuffer* buffer;
     HANDLE handleArray[3];
-    std::vector<BufferData> allReceived;
+    std::vector<RelayBuffer*> allReceived;
+    DWORD pendingSize;
+    CoalesceState coalesceFrom, coalesceTo;
+    InitCoalesceState(&coalesceFrom, options);
+    InitCoalesceState(&coalesceTo, options);
     handleArray[0] = hEventQuit;
     bool readFinishedFrom = true;
     bool readFinishedTo = true;
@@ -121,42 +198,41 @@ HRESULT Transfer(HANDLE hEventQuit, Duplex* from, Duplex* to, PAddLogFormatted l
         // 'from' duplex
         else if (hFrom != INVALID_HANDLE_VALUE && r == WAIT_OBJECT_0 + fromIndex)
         {
+            pendingSize = 0;
             while (true)
             {
                 buffer = nullptr;
-                size = 0;
-                hr = from->FinishRead(&buffer, &size);
+                hr = from->FinishRead(&buffer);
                 if (FAILED(hr))
                     break;
-                auto p = MakeBufferString(buffer, size);
-                if (logger)
-                    logger(LogLevel::Debug, L"  [from] received hr = 0x%08lX, size = %lu <%s>", hr, size, p);
-                free(p);
+                auto size = buffer ? buffer->GetSize() : 0;
+                if (logger && IsLogEnabled(LogLevel::Debug))
+                {
+                    WCHAR preview[BUFFER_PREVIEW_LENGTH];
+                    MakeBufferPreview(buffer ? buffer->GetData() : nullptr, size, preview);
+                    logger(LogLevel::Debug, L"  [from] received hr = 0x%08lX, size = %lu <%s>", hr, size, preview);
+                }
                 if (hr != S_OK)
                 {
                     hFrom = INVALID_HANDLE_VALUE;
                     break;
                 }
-                allReceived.push_back({ buffer, size });
+                allReceived.push_back(buffer);
+                pendingSize += size;
+                MetricsOnReceived(metrics, true, size);
+                OnDataArrived(&coalesceFrom);
                 hr = from->StartRead(&hFrom);
                 if (FAILED(hr))
                     break;
-                if (::WaitForSingleObject(hFrom, TIMEOUT_FOR_CONTINUOUS_READ) != WAIT_OBJECT_0)
+                // gather only the data which has already been received (never wait for more data)
+                if (!ShouldCoalesce(&coalesceFrom, pendingSize) || ::WaitForSingleObject(hFrom, 0) != WAIT_OBJECT_0)
                     break;
             }
             if (hr != S_OK && (FAILED(hr) || allReceived.size() == 0))
                 break;
             if (allReceived.size() > 0)
             {
-                hr = ConcatBufferAndRelease(allReceived, &buffer, &size);
-                if (FAILED(hr))
-                    break;
-                auto p = MakeBufferString(buffer, size);
-                if (logger)
-                    logger(LogLevel::Debug, L"  [from] sending to 'to' size = %lu <%s>", size, p);
-                free(p);
-                hr = to->Write(buffer, size, nullptr);
-                free(buffer);
+                hr = WriteAndRelease(to, allReceived, L"from", L"to", logger);
                 if (FAILED(hr))
                     break;
             }
@@ -164,42 +240,40 @@ HRESULT Transfer(HANDLE hEventQuit, Duplex* from, Duplex* to, PAddLogFormatted l
         // 'to' duplex
         else if (hTo != INVALID_HANDLE_VALUE && r == WAIT_OBJECT_0 + toIndex)
         {
+            pendingSize = 0;
             while (true)
             {
                 buffer = nullptr;
-                size = 0;
-                hr = to->FinishRead(&buffer, &size);
+                hr = to->FinishRead(&buffer);
                 if (FAILED(hr))
                     break;
-                auto p = MakeBufferString(buffer, size);
-                if (logger)
-                    logger(LogLevel::Debug, L"  [to] received hr = 0x%08lX, size = %lu <%s>", hr, size, p);
-                free(p);
+                auto size = buffer ? buffer->GetSize() : 0;
+                if (logger && IsLogEnabled(LogLevel::Debug))
+                {
+                    WCHAR preview[BUFFER_PREVIEW_LENGTH];
+                    MakeBufferPreview(buffer ? buffer->GetData() : nullptr, size, preview);
+                    logger(LogLevel::Debug, L"  [to] received hr = 0x%08lX, size = %lu <%s>", hr, size, preview);
+                }
                 if (hr != S_OK)
                 {
                     hTo = INVALID_HANDLE_VALUE;
                     break;
                 }
-                allReceived.push_back({ buffer, size });
+                allReceived.push_back(buffer);
+                pendingSize += size;
+                MetricsOnReceived(metrics, false, size);
+                OnDataArrived(&coalesceTo);
                 hr = to->StartRead(&hTo);
                 if (FAILED(hr))
                     break;
-                if (::WaitForSingleObject(hTo, TIMEOUT_FOR_CONTINUOUS_READ) != WAIT_OBJECT_0)
+                if (!ShouldCoalesce(&coalesceTo, pendingSize) || ::WaitForSingleObject(hTo, 0) != WAIT_OBJECT_0)
                     break;
             }
             if (hr != S_OK && (FAILED(hr) || allReceived.size() == 0))
                 break;
             if (allReceived.size() > 0)
             {
-                hr = ConcatBufferAndRelease(allReceived, &buffer, &size);
-                if (FAILED(hr))
-                    break;
-                auto p = MakeBufferString(buffer, size);
-                if (logger)
-                    logger(LogLevel::Debug, L"  [to] sending to 'from' size = %lu <%s>", size, p);
-                free(p);
-                hr = from->Write(buffer, size, nullptr);
-                free(buffer);
+                hr = WriteAndRelease(from, allReceived, L"to", L"from", logger);
                 if (FAILED(hr))
                     break;
             }
@@ -207,21 +281,28 @@ HRESULT Transfer(HANDLE hEventQuit, Duplex* from, Duplex* to, PAddLogFormatted l
         else if (r == WAIT_FAILED)
             return HRESULT_FROM_WIN32(::GetLastError());
     }
-    for (auto& it : allReceived)
+    ReleaseBuffers(allReceived);
+    if (SUCCEEDED(hr) && (hFrom == INVALID_HANDLE_VALUE || hTo == INVALID_HANDLE_VALUE))
     {
-        if (it.buffer)
-            free(it.buffer);
+        // reached EOF; pass the relayed data to the peers before they are closed
+        from->Flush();
+        to->Flush();
     }
     return hr;
 }
 
 static DWORD WINAPI WorkerThreadProc(WorkerData* data)
 {
+    ::InterlockedIncrement(&s_workerCount);
     Duplex* duplexOut;
+    auto timeStart = GetMicroseconds();
     auto hr = data->connector->MakeConnection(&duplexOut);
+    MetricsOnConnected(data->metrics, SUCCEEDED(hr), GetMicroseconds() - timeStart);
     if (SUCCEEDED(hr))
     {
-        hr = Transfer(data->hEventQuit, data->duplexIn, duplexOut, AddLogFormatted);
+        ApplyRelayOptions(data->duplexIn, data->relayOptions);
+        ApplyRelayOptions(duplexOut, data->relayOptions);
+        hr = Transfer(data->hEventQuit, data->duplexIn, duplexOut, data->relayOptions, data->metrics, AddLogFormatted);
         delete duplexOut;
     }
     else
@@ -244,13 +325,19 @@ static DWORD WINAPI WorkerThreadProc(WorkerData* data)
     auto d = data->dataHandler;
     free(data);
     pfn(d, hr);
+    ::InterlockedDecrement(&s_workerCount);
     return static_cast<DWORD>(hr);
 }
 
+DWORD GetWorkerCount()
+{
+    return static_cast<DWORD>(s_workerCount);
+}
+
 _Use_decl_annotations_
 HRESULT StartWorker(HANDLE* outThread, HANDLE hEventQuit, Duplex* duplexIn,
     WORD listenerId, PCWSTR pszConnectorTypeName, const Connector* connector,
-    PFinishHandler pfnFinishHandler, void* dataHandler)
+    const RelayOptions* relayOptions, ListenerMetrics* metrics, PFinishHandler pfnFinishHandler, void* dataHandler)
 {
     *outThread = INVALID_HANDLE_VALUE;
     auto data = static_cast<WorkerData*>(malloc(sizeof(WorkerData)));
@@ -261,6 +348,8 @@ HRESULT StartWorker(HANDLE* outThread, HANDLE hEventQuit, Duplex* duplexIn,
     data->listenerId = listenerId;
     data->typeName = pszConnectorTypeName;
     data->connector = connector;
+    data->relayOptions = relayOptions;
+    data->metrics = metrics;
     data->pfnFinishHandler = pfnFinishHandler;
     data->dataHandler = dataHandler;
 
@@ -2,14 +2,36 @@
 
 class Connector;
 class Duplex;
+struct RelayOptions;
+struct ListenerMetrics;
 
 typedef void (CALLBACK* PFinishHandler)(_In_ void* data, _In_ HRESULT hr);
 
 typedef void (__cdecl* PAddLogFormatted)(_In_ LogLevel level, _In_z_ _Printf_format_string_ PCWSTR pszLog, ...);
 
-HRESULT Transfer(_In_ HANDLE hEventQuit, _In_ Duplex* from, _In_ Duplex* to, _In_opt_ PAddLogFormatted logger);
+// the count of bytes shown by MakeBufferPreview
+constexpr DWORD BUFFER_PREVIEW_BYTES = 16;
+// the length of the string made by MakeBufferPreview ('XX XX ... XX...' and the null character)
+constexpr DWORD BUFFER_PREVIEW_LENGTH = BUFFER_PREVIEW_BYTES * 3 - 1 + 3 + 1;
+
+// Makes the hex string of the head of the buffer for logging, without allocating memory
+// (call only if the log is enabled; see IsLogEnabled)
+void MakeBufferPreview(_In_reads_bytes_(size) const void* buffer, _In_ DWORD size,
+    _Out_writes_z_(BUFFER_PREVIEW_LENGTH) PWSTR outString);
+
+// Applies relay options to the duplex (the duplex is not changed if options is null)
+void ApplyRelayOptions(_In_ Duplex* duplex, _In_opt_ const RelayOptions* options);
+
+// Relays data between 'from' and 'to' until either reaches EOF or hEventQuit is signalled
+// (the default options are used if options is null; data from 'from' is counted as upstream in metrics)
+HRESULT Transfer(_In_ HANDLE hEventQuit, _In_ Duplex* from, _In_ Duplex* to,
+    _In_opt_ const RelayOptions* options, _Inout_opt_ ListenerMetrics* metrics, _In_opt_ PAddLogFormatted logger);
 
 _Check_return_
 HRESULT StartWorker(_Out_ HANDLE* outThread, _In_ HANDLE hEventQuit, _In_ Duplex* duplexIn,
     _In_ WORD listenerId, _In_z_ PCWSTR pszConnectorTypeName, _In_ const Connector* connector,
+    _In_opt_ const RelayOptions* relayOptions, _Inout_opt_ ListenerMetrics* metrics,
     _In_opt_ PFinishHandler pfnFinishHandler, _In_opt_ void* dataHandler);
+
+// Returns the count of running worker threads started by StartWorker
+DWORD GetWorkerCount();
@@ -3,12 +3,17 @@
 
 #include "../duplex/pipe_duplex.h"
 #include "../logger/logger.h"
+#include "../util/functions.h"
 
-constexpr int RETRY_COUNT = 5;
-constexpr DWORD RETRY_MILLISEC = 500;
+// statistics of MakeConnection while the pipe is busy (the time is spent by WaitNamedPipeW, in microseconds)
+static volatile LONG64 s_busyCount = 0;
+static volatile LONG64 s_waitCount = 0;
+static volatile LONG64 s_waitTimeTotal = 0;
+static volatile LONG64 s_timeoutCount = 0;
 
 PipeConnector::PipeConnector()
     : m_pszPipeName(nullptr)
+    , m_dwConnectTimeout(0)
 {
 }
 
@@ -19,7 +24,7 @@ PipeConnector::~PipeConnector()
 }
 
 _Use_decl_annotations_
-HRESULT PipeConnector::Initialize(PCWSTR pszPipeName)
+HRESULT PipeConnector::Initialize(PCWSTR pszPipeName, DWORD dwConnectTimeout)
 {
     if (m_pszPipeName)
         return E_UNEXPECTED;
@@ -27,6 +32,7 @@ HRESULT PipeConnector::Initialize(PCWSTR pszPipeName)
     if (!psz)
         return E_OUTOFMEMORY;
     m_pszPipeName = psz;
+    m_dwConnectTimeout = dwConnectTimeout;
     return S_OK;
 }
 
@@ -37,7 +43,7 @@ HRESULT PipeConnector::MakeConnection(Duplex** outDuplex) const
     if (!m_pszPipeName)
         return E_UNEXPECTED;
     HANDLE hPipe;
-    int retryCount = 1;
+    ULONGLONG deadline = 0;
     while (true)
     {
         hPipe = ::CreateFileW(
@@ -55,15 +61,33 @@ HRESULT PipeConnector::MakeConnection(Duplex** outDuplex) const
         auto err = ::GetLastError();
         if (err != ERROR_PIPE_BUSY)
             return HRESULT_FROM_WIN32(err);
-        ++retryCount;
-        if (retryCount == RETRY_COUNT)
+        auto now = ::GetTickCount64();
+        if (deadline == 0)
+        {
+            ::InterlockedIncrement64(&s_busyCount);
+            deadline = now + m_dwConnectTimeout;
+            AddLogFormatted(LogLevel::Info, L"[pipe] '%s' is busy; waiting for a free instance...", m_pszPipeName);
+        }
+        if (now >= deadline)
+        {
+            ::InterlockedIncrement64(&s_timeoutCount);
             return HRESULT_FROM_WIN32(ERROR_PIPE_BUSY);
-        AddLogFormatted(LogLevel::Info, L"[pipe] '%s' is busy; retry... (%d/%d)",
-            m_pszPipeName, retryCount, RETRY_COUNT);
-        ::Sleep(RETRY_MILLISEC);
+        }
+
+        // returns as soon as an instance is available (another client may take it before CreateFileW)
+        auto timeStart = GetMicroseconds();
+        auto isAvailable = ::WaitNamedPipeW(m_pszPipeName, static_cast<DWORD>(deadline - now));
+        err = isAvailable ? ERROR_SUCCESS : ::GetLastError();
+        ::InterlockedIncrement64(&s_waitCount);
+        ::InterlockedAdd64(&s_waitTimeTotal, GetMicroseconds() - timeStart);
+        if (!isAvailable)
+        {
+            if (err != ERROR_SEM_TIMEOUT)
+                return HRESULT_FROM_WIN32(err);
+            ::InterlockedIncrement64(&s_timeoutCount);
+            return HRESULT_FROM_WIN32(ERROR_PIPE_BUSY);
+        }
     }
-    if (hPipe == INVALID_HANDLE_VALUE)
-        return HRESULT_FROM_WIN32(ERROR_PIPE_BUSY);
     auto duplex = new PipeDuplex(hPipe, hPipe);
     if (!duplex)
     {
@@ -73,3 +97,12 @@ HRESULT PipeConnector::MakeConnection(Duplex** outDuplex) const
     *outDuplex = duplex;
     return S_OK;
 }
+
+_Use_decl_annotations_
+void PipeConnectorGetBusyStats(LONG64* outBusyCount, LONG64* outWaitCount, LONG64* outWaitTotalMicroseconds, LONG64* outTimeoutCount)
+{
+    *outBusyCount = s_busyCount;
+    *outWaitCount = s_waitCount;
+    *outWaitTotalMicroseconds = s_waitTimeTotal;
+    *outTimeoutCount = s_timeoutCount;
+}
@@ -9,10 +9,17 @@ public:
     virtual ~PipeConnector();
 
     _Check_return_
-    HRESULT Initialize(_In_z_ PCWSTR pszPipeName);
+    HRESULT Initialize(_In_z_ PCWSTR pszPipeName, _In_ DWORD dwConnectTimeout);
     _Check_return_
     virtual HRESULT MakeConnection(_When_(return == S_OK, _Outptr_) Duplex** outDuplex) const;
 
 private:
     PWSTR m_pszPipeName;
+    // the time to wait for a free pipe instance while the pipe is busy (in milliseconds)
+    DWORD m_dwConnectTimeout;
 };
+
+// retrieves the count of connections which found the pipe busy, the count and total time of waiting
+// for a free pipe instance (in microseconds), and the count of connections given up by the timeout
+void PipeConnectorGetBusyStats(_Out_ LONG64* outBusyCount, _Out_ LONG64* outWaitCount,
+    _Out_ LONG64* outWaitTotalMicroseconds, _Out_ LONG64* outTimeoutCount);
@@ -0,0 +1,209 @@
+#include "../framework.h"
+#include "../logger/logger.h"
+
+#include "pooled_connector.h"
+
+#include "../duplex/duplex.h"
+
+// interval of checking the pooled connections closed by the peer
+constexpr DWORD POOL_CHECK_INTERVAL = 5000;
+// interval of retrying when the connector failed (doubled for each consecutive failure)
+constexpr DWORD POOL_RETRY_INTERVAL_MIN = 1000;
+constexpr DWORD POOL_RETRY_INTERVAL_MAX = 60000;
+
+PooledConnector::PooledConnector()
+    : m_connector(nullptr)
+    , m_poolSize(0)
+    , m_hThread(INVALID_HANDLE_VALUE)
+    , m_hEventQuit(nullptr)
+    , m_hEventTaken(nullptr)
+    , m_pool(nullptr)
+    , m_poolCount(0)
+{
+    ::InitializeCriticalSection(&m_csPool);
+}
+
+PooledConnector::~PooledConnector()
+{
+    if (m_hThread != INVALID_HANDLE_VALUE)
+    {
+        ::SetEvent(m_hEventQuit);
+        ::WaitForSingleObject(m_hThread, INFINITE);
+        ::CloseHandle(m_hThread);
+    }
+    if (m_pool)
+    {
+        for (DWORD i = 0; i < m_poolCount; ++i)
+            delete m_pool[i];
+        free(m_pool);
+    }
+    if (m_hEventTaken)
+        ::CloseHandle(m_hEventTaken);
+    if (m_hEventQuit)
+        ::CloseHandle(m_hEventQuit);
+    ::DeleteCriticalSection(&m_csPool);
+    if (m_connector)
+        delete m_connector;
+}
+
+_Use_decl_annotations_
+HRESULT PooledConnector::Initialize(Connector* connector, DWORD poolSize)
+{
+    if (m_connector)
+        return E_UNEXPECTED;
+    if (poolSize == 0 || poolSize > CONNECTOR_POOL_MAX_SIZE)
+        return E_INVALIDARG;
+
+    auto pool = static_cast<Duplex**>(malloc(sizeof(Duplex*) * poolSize));
+    if (!pool)
+        return E_OUTOFMEMORY;
+    auto hEventQuit = ::CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    if (!hEventQuit)
+    {
+        auto hr = HRESULT_FROM_WIN32(::GetLastError());
+        free(pool);
+        return hr;
+    }
+    auto hEventTaken = ::CreateEventW(nullptr, FALSE, FALSE, nullptr);
+    if (!hEventTaken)
+    {
+        auto hr = HRESULT_FROM_WIN32(::GetLastError());
+        ::CloseHandle(hEventQuit);
+        free(pool);
+        return hr;
+    }
+    m_pool = pool;
+    m_poolSize = poolSize;
+    m_hEventQuit = hEventQuit;
+    m_hEventTaken = hEventTaken;
+    m_connector = connector;
+
+    auto hThread = reinterpret_cast<HANDLE>(
+        _beginthreadex(nullptr, 0, reinterpret_cast<_beginthreadex_proc_type>(_ThreadProc), this, 0, nullptr)
+    );
+    if (!hThread)
+    {
+        // the caller deletes 'connector' on failure
+        m_connector = nullptr;
+        return HRESULT_FROM_WIN32(_doserrno);
+    }
+    m_hThread = hThread;
+    return S_OK;
+}
+
+_Use_decl_annotations_
+HRESULT PooledConnector::MakeConnection(Duplex** outDuplex) const
+{
+    *outDuplex = nullptr;
+    if (!m_connector)
+        return E_UNEXPECTED;
+
+    Duplex* duplex = nullptr;
+    ::EnterCriticalSection(&m_csPool);
+    while (m_poolCount > 0)
+    {
+        // use the newest one, which is the least likely to be closed by the peer
+        auto p = m_pool[--m_poolCount];
+        if (p->IsPeerAlive())
+        {
+            duplex = p;
+            break;
+        }
+        delete p;
+    }
+    ::LeaveCriticalSection(&m_csPool);
+    ::SetEvent(m_hEventTaken);
+
+    if (duplex)
+    {
+        AddLogFormatted(LogLevel::Debug, L"[pool] use the pooled connection");
+        *outDuplex = duplex;
+        return S_OK;
+    }
+    AddLogFormatted(LogLevel::Debug, L"[pool] no pooled connection is available; connecting");
+    return m_connector->MakeConnection(outDuplex);
+}
+
+DWORD WINAPI PooledConnector::_ThreadProc(void* data)
+{
+    auto pThis = static_cast<PooledConnector*>(data);
+    pThis->RefillPool();
+    return 0;
+}
+
+void PooledConnector::RefillPool()
+{
+    HANDLE handles[] = { m_hEventQuit, m_hEventTaken };
+    // the count of consecutive failures of the connector, and the time to retry
+    DWORD failureCount = 0;
+    ULONGLONG retryTime = 0;
+    while (true)
+    {
+        ::EnterCriticalSection(&m_csPool);
+        DiscardClosedConnections();
+        auto isFull = m_poolCount >= m_poolSize;
+        ::LeaveCriticalSection(&m_csPool);
+
+        DWORD dwTimeout = POOL_CHECK_INTERVAL;
+        auto now = ::GetTickCount64();
+        if (!isFull && now < retryTime)
+        {
+            // backing off (taking a pooled connection does not retry earlier)
+            dwTimeout = static_cast<DWORD>(retryTime - now);
+        }
+        else if (!isFull)
+        {
+            Duplex* duplex;
+            auto hr = m_connector->MakeConnection(&duplex);
+            if (hr == S_OK)
+            {
+                ::EnterCriticalSection(&m_csPool);
+                if (m_poolCount < m_poolSize)
+                {
+                    m_pool[m_poolCount++] = duplex;
+                    duplex = nullptr;
+                }
+                ::LeaveCriticalSection(&m_csPool);
+                if (duplex)
+                    delete duplex;
+                if (failureCount > 0)
+                    AddLogFormatted(LogLevel::Info, L"[pool] made the connection for the pool after %lu failure(s)", failureCount);
+                failureCount = 0;
+                retryTime = 0;
+                // continue filling without waiting
+                dwTimeout = 0;
+            }
+            else
+            {
+                // log only the first failure not to flood the log while the target is down
+                if (failureCount == 0)
+                    AddLogFormatted(LogLevel::Info, L"[pool] failed to make the connection for the pool (will retry): 0x%08lX", hr);
+                dwTimeout = POOL_RETRY_INTERVAL_MAX;
+                if (failureCount < 6 && (POOL_RETRY_INTERVAL_MIN << failureCount) < dwTimeout)
+                    dwTimeout = POOL_RETRY_INTERVAL_MIN << failureCount;
+                ++failureCount;
+                retryTime = now + dwTimeout;
+            }
+        }
+        auto r = ::WaitForMultipleObjects(2, handles, FALSE, dwTimeout);
+        if (r == WAIT_OBJECT_0 || r == WAIT_FAILED)
+            break;
+    }
+}
+
+void PooledConnector::DiscardClosedConnections() const
+{
+    DWORD count = 0;
+    for (DWORD i = 0; i < m_poolCount; ++i)
+    {
+        auto p = m_pool[i];
+        if (p->IsPeerAlive())
+            m_pool[count++] = p;
+        else
+        {
+            AddLogFormatted(LogLevel::Debug, L"[pool] the pooled connection has been closed by the peer");
+            delete p;
+        }
+    }
+    m_poolCount = count;
+}
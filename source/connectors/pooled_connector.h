@@ -0,0 +1,39 @@
+#pragma once
+
+#include "connector.h"
+
+// the maximum count of connections kept by PooledConnector
+constexpr DWORD CONNECTOR_POOL_MAX_SIZE = 64;
+
+// Keeps connections made by another connector in advance, so that accepted clients
+// do not wait for connecting (the pool is topped up by the background thread)
+class PooledConnector : public Connector
+{
+public:
+    PooledConnector();
+    virtual ~PooledConnector();
+
+    // 'connector' is owned (and deleted) by this object on success
+    _Check_return_
+    HRESULT Initialize(_In_ Connector* connector, _In_ DWORD poolSize);
+
+    _Check_return_
+    virtual HRESULT MakeConnection(_When_(return == S_OK, _Outptr_) Duplex** outDuplex) const;
+
+private:
+    static DWORD WINAPI _ThreadProc(void* data);
+    void RefillPool();
+    // must be called in m_csPool
+    void DiscardClosedConnections() const;
+
+    Connector* m_connector;
+    DWORD m_poolSize;
+    HANDLE m_hThread;
+    HANDLE m_hEventQuit;
+    // signaled when a pooled connection is taken
+    HANDLE m_hEventTaken;
+    mutable CRITICAL_SECTION m_csPool;
+    // pooled connections (the last one is the newest)
+    Duplex** m_pool;
+    mutable DWORD m_poolCount;
+};
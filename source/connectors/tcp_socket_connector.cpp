@@ -5,20 +5,174 @@
 
 #include "../duplex/socket_duplex.h"
 
+// how long the resolved addresses are reused
+constexpr ULONGLONG ADDRESS_CACHE_TTL = 30000;
+// delay before starting the next connection attempt while the previous one is in progress
+// ('Connection Attempt Delay' in RFC 8305)
+constexpr ULONGLONG CONNECTION_ATTEMPT_DELAY = 250;
+
+static int GetSockAddrLength(_In_ const SOCKADDR_INET* address)
+{
+    return address->si_family == AF_INET6 ? static_cast<int>(sizeof(address->Ipv6)) : static_cast<int>(sizeof(address->Ipv4));
+}
+
+// Connects to the addresses in the order, starting the next attempt if the previous one does not
+// finish in CONNECTION_ATTEMPT_DELAY, and returns the first connected socket (in blocking mode)
+_Check_return_
+static HRESULT ConnectToAddresses(
+    _In_reads_(count) const SOCKADDR_INET* addresses,
+    _In_ DWORD count,
+    _In_ DWORD dwTimeout,
+    _In_ const TcpSocketOptions* socketOptions,
+    _Out_ SOCKET* outSocket
+)
+{
+    SOCKET socks[TCP_CONNECTOR_MAX_ADDRESSES];
+    DWORD activeCount = 0;
+    DWORD nextIndex = 0;
+    HRESULT hrLast = HRESULT_FROM_WIN32(WSAETIMEDOUT);
+    SOCKET sockConnected = INVALID_SOCKET;
+
+    auto now = ::GetTickCount64();
+    auto deadline = now + dwTimeout;
+    auto nextAttemptTime = now;
+    while (sockConnected == INVALID_SOCKET)
+    {
+        if (now >= deadline)
+        {
+            hrLast = HRESULT_FROM_WIN32(WSAETIMEDOUT);
+            break;
+        }
+        if (nextIndex < count && (now >= nextAttemptTime || activeCount == 0))
+        {
+            auto address = &addresses[nextIndex++];
+            auto sock = ::socket(address->si_family, SOCK_STREAM, IPPROTO_TCP);
+            if (sock == INVALID_SOCKET)
+            {
+                hrLast = GetLastWSAErrorAsHResult();
+                continue;
+            }
+            // (the buffer sizes must be set before connecting; the failure is only counted
+            // and the connection is made with the default options)
+            (void)ApplyTcpSocketOptions(sock, socketOptions);
+            u_long nonBlocking = 1;
+            if (::ioctlsocket(sock, FIONBIO, &nonBlocking) == SOCKET_ERROR)
+            {
+                hrLast = GetLastWSAErrorAsHResult();
+                ::closesocket(sock);
+                continue;
+            }
+            if (::connect(sock, reinterpret_cast<const sockaddr*>(address), GetSockAddrLength(address)) == 0)
+            {
+                sockConnected = sock;
+                break;
+            }
+            auto err = ::WSAGetLastError();
+            if (err != WSAEWOULDBLOCK)
+            {
+                // try the next address immediately
+                hrLast = GetWSAErrorAsHResult(err);
+                ::closesocket(sock);
+                continue;
+            }
+            socks[activeCount++] = sock;
+            nextAttemptTime = now + CONNECTION_ATTEMPT_DELAY;
+        }
+        if (activeCount == 0)
+        {
+            // all attempts have failed
+            break;
+        }
+
+        // wait until any attempt finishes, the next attempt starts, or the deadline
+        auto waitUntil = (nextIndex < count && nextAttemptTime < deadline) ? nextAttemptTime : deadline;
+        auto waitTime = waitUntil > now ? waitUntil - now : 0;
+        fd_set fdsWrite, fdsExcept;
+        FD_ZERO(&fdsWrite);
+        FD_ZERO(&fdsExcept);
+        for (DWORD i = 0; i < activeCount; ++i)
+        {
+            FD_SET(socks[i], &fdsWrite);
+            FD_SET(socks[i], &fdsExcept);
+        }
+        timeval t;
+        t.tv_sec = static_cast<long>(waitTime / 1000);
+        t.tv_usec = static_cast<long>((waitTime % 1000) * 1000);
+        auto r = ::select(0, nullptr, &fdsWrite, &fdsExcept, &t);
+        if (r == SOCKET_ERROR)
+        {
+            hrLast = GetLastWSAErrorAsHResult();
+            break;
+        }
+        now = ::GetTickCount64();
+        if (r == 0)
+            continue;
+
+        for (DWORD i = 0; i < activeCount;)
+        {
+            auto sock = socks[i];
+            if (sockConnected == INVALID_SOCKET && FD_ISSET(sock, &fdsWrite))
+            {
+                sockConnected = sock;
+            }
+            else if (FD_ISSET(sock, &fdsExcept))
+            {
+                int err = 0;
+                int len = sizeof(err);
+                ::getsockopt(sock, SOL_SOCKET, SO_ERROR, reinterpret_cast<char*>(&err), &len);
+                hrLast = GetWSAErrorAsHResult(err);
+                ::closesocket(sock);
+                // (start the next attempt immediately)
+                nextAttemptTime = now;
+            }
+            else
+            {
+                ++i;
+                continue;
+            }
+            socks[i] = socks[--activeCount];
+        }
+    }
+
+    // cancel the other attempts
+    for (DWORD i = 0; i < activeCount; ++i)
+        ::closesocket(socks[i]);
+
+    if (sockConnected == INVALID_SOCKET)
+        return hrLast;
+
+    // SocketDuplex uses blocking send/WSASend
+    u_long nonBlocking = 0;
+    if (::ioctlsocket(sockConnected, FIONBIO, &nonBlocking) == SOCKET_ERROR)
+    {
+        auto hr = GetLastWSAErrorAsHResult();
+        ::closesocket(sockConnected);
+        return hr;
+    }
+    *outSocket = sockConnected;
+    return S_OK;
+}
+
 TcpSocketConnector::TcpSocketConnector()
     : m_pszAddress(nullptr)
     , m_szPortString{ 0 }
+    , m_dwConnectTimeout(0)
+    , m_socketOptions{}
+    , m_addressCount(0)
+    , m_addressesExpiry(0)
 {
+    ::InitializeCriticalSection(&m_csAddresses);
 }
 
 TcpSocketConnector::~TcpSocketConnector()
 {
     if (m_pszAddress)
         free(m_pszAddress);
+    ::DeleteCriticalSection(&m_csAddresses);
 }
 
 _Use_decl_annotations_
-HRESULT TcpSocketConnector::Initialize(PCWSTR pszAddress, USHORT port)
+HRESULT TcpSocketConnector::Initialize(PCWSTR pszAddress, USHORT port, DWORD dwConnectTimeout, const TcpSocketOptions* socketOptions)
 {
     if (m_pszAddress)
         return E_UNEXPECTED;
@@ -27,12 +181,25 @@ HRESULT TcpSocketConnector::Initialize(PCWSTR pszAddress, USHORT port)
         return E_OUTOFMEMORY;
     m_pszAddress = psz;
     swprintf_s(m_szPortString, L"%hu", port);
+    m_dwConnectTimeout = dwConnectTimeout;
+    if (socketOptions)
+        m_socketOptions = *socketOptions;
     return S_OK;
 }
 
 _Use_decl_annotations_
-HRESULT TcpSocketConnector::MakeConnection(Duplex** outDuplex) const
+HRESULT TcpSocketConnector::GetAddresses(SOCKADDR_INET* outAddresses, DWORD* outCount) const
 {
+    ::EnterCriticalSection(&m_csAddresses);
+    if (m_addressCount > 0 && ::GetTickCount64() < m_addressesExpiry)
+    {
+        memcpy(outAddresses, m_addresses, sizeof(SOCKADDR_INET) * m_addressCount);
+        *outCount = m_addressCount;
+        ::LeaveCriticalSection(&m_csAddresses);
+        return S_OK;
+    }
+    ::LeaveCriticalSection(&m_csAddresses);
+
     ADDRINFOW addrinfo = { 0 };
     PADDRINFOW p;
     addrinfo.ai_family = AF_UNSPEC;
@@ -42,22 +209,76 @@ HRESULT TcpSocketConnector::MakeConnection(Duplex** outDuplex) const
 
     auto r = ::GetAddrInfoW(m_pszAddress, m_szPortString, &addrinfo, &p);
     if (r != 0)
+    {
+        *outCount = 0;
         return GetWSAErrorAsHResult(r);
+    }
 
-    auto sock = ::socket(p->ai_family, p->ai_socktype, p->ai_protocol);
-    if (sock == INVALID_SOCKET)
+    // interleave the address families, starting with the family of the first (most preferred) address
+    // (RFC 8305 section 4)
+    auto firstFamily = p->ai_family;
+    PADDRINFOW nextOfFamily[2] = { p, p };
+    DWORD count = 0;
+    for (auto useFirstFamily = true; count < TCP_CONNECTOR_MAX_ADDRESSES; useFirstFamily = !useFirstFamily)
     {
-        auto hr = GetLastWSAErrorAsHResult();
-        ::FreeAddrInfoW(p);
-        return hr;
+        auto& it = nextOfFamily[useFirstFamily ? 0 : 1];
+        while (it && ((it->ai_family == firstFamily) != useFirstFamily ||
+            (it->ai_family != AF_INET && it->ai_family != AF_INET6)))
+        {
+            it = it->ai_next;
+        }
+        if (!it)
+        {
+            if (!nextOfFamily[0] && !nextOfFamily[1])
+                break;
+            continue;
+        }
+        auto& address = outAddresses[count++];
+        ZeroMemory(&address, sizeof(address));
+        memcpy(&address, it->ai_addr, it->ai_addrlen < sizeof(address) ? it->ai_addrlen : sizeof(address));
+        it = it->ai_next;
     }
-    if (::connect(sock, p->ai_addr, static_cast<int>(p->ai_addrlen)) == SOCKET_ERROR)
+    ::FreeAddrInfoW(p);
+    if (count == 0)
     {
-        auto hr = GetLastWSAErrorAsHResult();
-        ::FreeAddrInfoW(p);
+        *outCount = 0;
+        return HRESULT_FROM_WIN32(WSAHOST_NOT_FOUND);
+    }
+
+    ::EnterCriticalSection(&m_csAddresses);
+    memcpy(m_addresses, outAddresses, sizeof(SOCKADDR_INET) * count);
+    m_addressCount = count;
+    m_addressesExpiry = ::GetTickCount64() + ADDRESS_CACHE_TTL;
+    ::LeaveCriticalSection(&m_csAddresses);
+
+    *outCount = count;
+    return S_OK;
+}
+
+void TcpSocketConnector::InvalidateAddresses() const
+{
+    ::EnterCriticalSection(&m_csAddresses);
+    m_addressCount = 0;
+    ::LeaveCriticalSection(&m_csAddresses);
+}
+
+_Use_decl_annotations_
+HRESULT TcpSocketConnector::MakeConnection(Duplex** outDuplex) const
+{
+    SOCKADDR_INET addresses[TCP_CONNECTOR_MAX_ADDRESSES];
+    DWORD count;
+    auto hr = GetAddresses(addresses, &count);
+    if (FAILED(hr))
+        return hr;
+
+    SOCKET sock;
+    hr = ConnectToAddresses(addresses, count, m_dwConnectTimeout, &m_socketOptions, &sock);
+    if (FAILED(hr))
+    {
+        // the addresses may have been changed
+        InvalidateAddresses();
         return hr;
     }
-    ::FreeAddrInfoW(p);
 
     auto duplex = new SocketDuplex(sock);
     if (!duplex)
@@ -1,6 +1,10 @@
 #pragma once
 
 #include "connector.h"
+#include "../util/socket.h"
+
+// the maximum count of resolved addresses tried by TcpSocketConnector
+constexpr DWORD TCP_CONNECTOR_MAX_ADDRESSES = 16;
 
 class TcpSocketConnector : public Connector
 {
@@ -9,11 +13,31 @@ public:
     virtual ~TcpSocketConnector();
 
     _Check_return_
-    HRESULT Initialize(_In_z_ PCWSTR pszAddress, _Pre_satisfies_(port > 0) USHORT port);
+    HRESULT Initialize(
+        _In_z_ PCWSTR pszAddress,
+        _Pre_satisfies_(port > 0) USHORT port,
+        _In_ DWORD dwConnectTimeout,
+        _In_opt_ const TcpSocketOptions* socketOptions
+    );
     _Check_return_
     virtual HRESULT MakeConnection(_When_(return == S_OK, _Outptr_) Duplex** outDuplex) const;
 
 private:
+    // copies the (cached) resolved addresses in the order to try
+    _Check_return_
+    HRESULT GetAddresses(
+        _Out_writes_to_(TCP_CONNECTOR_MAX_ADDRESSES, *outCount) SOCKADDR_INET* outAddresses,
+        _Out_ DWORD* outCount
+    ) const;
+    void InvalidateAddresses() const;
+
     PWSTR m_pszAddress;
     WCHAR m_szPortString[6];
+    DWORD m_dwConnectTimeout;
+    TcpSocketOptions m_socketOptions;
+    mutable CRITICAL_SECTION m_csAddresses;
+    // resolved addresses (valid until m_addressesExpiry)
+    mutable SOCKADDR_INET m_addresses[TCP_CONNECTOR_MAX_ADDRESSES];
+    mutable DWORD m_addressCount;
+    mutable ULONGLONG m_addressesExpiry;
 };
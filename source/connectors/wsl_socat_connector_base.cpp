@@ -1,21 +1,190 @@
 #include "../framework.h"
+#include <bcrypt.h>
 #include "wsl_socat_connector_base.h"
 #include "../util/functions.h"
 #include "../util/wsl_util.h"
 
+#include "../util/socket.h"
+#include "../logger/logger.h"
+
 #include "../app/app.h"
 #include "../duplex/file_duplex.h"
+#include "../duplex/socket_duplex.h"
 
 #ifdef _WIN64
 
+// time to wait for the relay to accept the first connection
+constexpr DWORD RELAY_READY_TIMEOUT = 5000;
+// interval of connection retries while the relay is starting
+constexpr DWORD RELAY_READY_INTERVAL = 50;
+// interval to retry starting the relay after the failure (doubled for each consecutive failure)
+constexpr DWORD RELAY_RETRY_INTERVAL_MIN = 1000;
+constexpr DWORD RELAY_RETRY_INTERVAL_MAX = 60000;
+// the count of loopback ports tried by the relay in WSL (each is free on Windows when picked)
+constexpr DWORD RELAY_PORT_CANDIDATES = 8;
+// time to watch socat started for each connection; if it fails within this time,
+// the cached paths of the distribution may be stale
+constexpr DWORD SOCAT_EARLY_EXIT_TIME = 1000;
+
+struct SocatProcessWatch
+{
+    HANDLE hProcess;
+    PWSTR pszDistributionName;
+};
+
+static HRESULT PickLoopbackPort(_Out_ USHORT* outPort)
+{
+    *outPort = 0;
+    auto sock = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (sock == INVALID_SOCKET)
+        return GetLastWSAErrorAsHResult();
+    sockaddr_in addr = { 0 };
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int len = sizeof(addr);
+    if (::bind(sock, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) == SOCKET_ERROR ||
+        ::getsockname(sock, reinterpret_cast<sockaddr*>(&addr), &len) == SOCKET_ERROR)
+    {
+        auto hr = GetLastWSAErrorAsHResult();
+        ::closesocket(sock);
+        return hr;
+    }
+    ::closesocket(sock);
+    *outPort = ntohs(addr.sin_port);
+    return S_OK;
+}
+
+static HRESULT ConnectLoopback(_In_ USHORT port, _Out_ SOCKET* outSocket)
+{
+    *outSocket = INVALID_SOCKET;
+    auto sock = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (sock == INVALID_SOCKET)
+        return GetLastWSAErrorAsHResult();
+    sockaddr_in addr = { 0 };
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (::connect(sock, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) == SOCKET_ERROR)
+    {
+        auto hr = GetLastWSAErrorAsHResult();
+        ::closesocket(sock);
+        return hr;
+    }
+    *outSocket = sock;
+    return S_OK;
+}
+
+// Makes the random token in hexadecimal characters, followed by '\n'
+static HRESULT MakeRelayToken(_Out_writes_z_(tokenLength + 2) char* outToken, _In_ DWORD tokenLength)
+{
+    outToken[0] = 0;
+    BYTE bytes[64];
+    auto size = tokenLength / 2;
+    if (size > sizeof(bytes))
+        return E_INVALIDARG;
+    auto status = ::BCryptGenRandom(nullptr, bytes, size, BCRYPT_USE_SYSTEM_PREFERRED_RNG);
+    if (status < 0)
+        return HRESULT_FROM_NT(status);
+    for (DWORD i = 0; i < size; ++i)
+        sprintf_s(outToken + i * 2, 3, "%02x", bytes[i]);
+    outToken[size * 2] = '\n';
+    outToken[size * 2 + 1] = 0;
+    SecureZeroMemory(bytes, sizeof(bytes));
+    return S_OK;
+}
+
+static HRESULT SendRelayToken(_In_ SOCKET sock, _In_z_ const char* pszToken)
+{
+    auto len = static_cast<int>(strlen(pszToken));
+    int sent = 0;
+    while (sent < len)
+    {
+        auto r = ::send(sock, pszToken + sent, len - sent, 0);
+        if (r == SOCKET_ERROR)
+            return GetLastWSAErrorAsHResult();
+        sent += r;
+    }
+    return S_OK;
+}
+
+static void CALLBACK SocatProcessWatchCallback(PTP_CALLBACK_INSTANCE instance, void* context, PTP_WAIT wait, TP_WAIT_RESULT waitResult)
+{
+    UNREFERENCED_PARAMETER(instance);
+    auto watch = static_cast<SocatProcessWatch*>(context);
+    DWORD dwExitCode;
+    if (waitResult == WAIT_OBJECT_0 && ::GetExitCodeProcess(watch->hProcess, &dwExitCode) && dwExitCode != 0)
+    {
+        // (also happens if the target refuses the connection; invalidating the cache is harmless then)
+        AddLogFormatted(LogLevel::Info, L"[wsl-socat] socat exited immediately (exit code = %lu); invalidating the cache", dwExitCode);
+        WslInvalidateCache(watch->pszDistributionName);
+    }
+    ::CloseHandle(watch->hProcess);
+    if (watch->pszDistributionName)
+        free(watch->pszDistributionName);
+    free(watch);
+    ::CloseThreadpoolWait(wait);
+}
+
+// Watches the process for SOCAT_EARLY_EXIT_TIME in the thread pool (hProcess is closed by this function)
+static void WatchSocatProcess(_In_opt_z_ PCWSTR pszDistributionName, _In_ HANDLE hProcess)
+{
+    auto watch = static_cast<SocatProcessWatch*>(calloc(1, sizeof(SocatProcessWatch)));
+    if (!watch)
+    {
+        ::CloseHandle(hProcess);
+        return;
+    }
+    watch->hProcess = hProcess;
+    if (pszDistributionName)
+    {
+        watch->pszDistributionName = _wcsdup(pszDistributionName);
+        if (!watch->pszDistributionName)
+        {
+            ::CloseHandle(hProcess);
+            free(watch);
+            return;
+        }
+    }
+    auto wait = ::CreateThreadpoolWait(SocatProcessWatchCallback, watch, nullptr);
+    if (!wait)
+    {
+        ::CloseHandle(hProcess);
+        if (watch->pszDistributionName)
+            free(watch->pszDistributionName);
+        free(watch);
+        return;
+    }
+    // (negative for the relative time, in 100-nanosecond units)
+    LARGE_INTEGER timeout;
+    timeout.QuadPart = -static_cast<LONGLONG>(SOCAT_EARLY_EXIT_TIME) * 10000;
+    FILETIME ftTimeout;
+    ftTimeout.dwLowDateTime = timeout.LowPart;
+    ftTimeout.dwHighDateTime = static_cast<DWORD>(timeout.HighPart);
+    ::SetThreadpoolWait(wait, hProcess, &ftTimeout);
+}
+
 WslSocatConnectorBase::WslSocatConnectorBase()
     : m_pszDistributionName(nullptr)
     , m_pszConnect(nullptr)
+    , m_relayState(RelayState::Stopped)
+    , m_relay()
+    , m_relayFailureCount(0)
+    , m_relayRetryTime(0)
+    , m_warmUpWork(nullptr)
 {
+    ::InitializeCriticalSection(&m_csRelay);
+    ::InitializeConditionVariable(&m_cvRelay);
 }
 
 WslSocatConnectorBase::~WslSocatConnectorBase()
 {
+    if (m_warmUpWork)
+    {
+        ::WaitForThreadpoolWorkCallbacks(m_warmUpWork, FALSE);
+        ::CloseThreadpoolWork(m_warmUpWork);
+    }
+    StopRelay(&m_relay);
+    ::DeleteCriticalSection(&m_csRelay);
     if (m_pszDistributionName)
         free(m_pszDistributionName);
     if (m_pszConnect)
@@ -45,9 +214,43 @@ HRESULT WslSocatConnectorBase::InitializeImpl(PCWSTR pszDistributionName, PCWSTR
     }
     m_pszDistributionName = pszD;
     m_pszConnect = pszC;
+
+    // start the relay (or resolve socat) in advance so that the first connection does not wait for WSL;
+    // done in the thread pool not to block starting the program
+    m_warmUpWork = ::CreateThreadpoolWork(WarmUpCallback, this, nullptr);
+    if (m_warmUpWork)
+        ::SubmitThreadpoolWork(m_warmUpWork);
     return S_OK;
 }
 
+_Use_decl_annotations_
+void CALLBACK WslSocatConnectorBase::WarmUpCallback(PTP_CALLBACK_INSTANCE instance, PVOID context, PTP_WORK work)
+{
+    UNREFERENCED_PARAMETER(work);
+    // starting WSL takes long time
+    ::CallbackMayRunLong(instance);
+    auto pThis = static_cast<WslSocatConnectorBase*>(context);
+    if (IsWslPersistentRelayEnabled())
+    {
+        // (connections made meanwhile wait for the relay)
+        USHORT port;
+        char szToken[RELAY_TOKEN_LENGTH + 2];
+        auto hr = pThis->AcquireRelay(&port, szToken);
+        SecureZeroMemory(szToken, sizeof(szToken));
+        if (FAILED(hr))
+            AddLogFormatted(LogLevel::Info, L"[wsl-relay] failed to start the relay (will retry on connection): 0x%08lX", hr);
+    }
+    else
+    {
+        PWSTR pszSocatFileName;
+        auto hr = WslWhichCached(pThis->m_pszDistributionName, L"socat", GetWslDefaultTimeout(), &pszSocatFileName);
+        if (hr == S_OK)
+            free(pszSocatFileName);
+        else
+            AddLogFormatted(LogLevel::Info, L"[wsl-socat] failed to find socat (will retry on connection): 0x%08lX", hr);
+    }
+}
+
 _Use_decl_annotations_
 HRESULT WslSocatConnectorBase::MakeConnection(Duplex** outDuplex) const
 {
@@ -55,14 +258,30 @@ HRESULT WslSocatConnectorBase::MakeConnection(Duplex** outDuplex) const
     if (!m_pszConnect)
         return E_UNEXPECTED;
 
+    if (IsWslPersistentRelayEnabled())
+    {
+        auto hr = MakeRelayConnection(outDuplex);
+        if (SUCCEEDED(hr))
+            return hr;
+        if (hr != E_NOT_VALID_STATE)
+            AddLogFormatted(LogLevel::Info, L"[wsl-relay] failed to connect to the relay; using a new process: 0x%08lX", hr);
+    }
+    return MakeProcessConnection(outDuplex);
+}
+
+_Use_decl_annotations_
+HRESULT WslSocatConnectorBase::MakeProcessConnection(Duplex** outDuplex) const
+{
+    *outDuplex = nullptr;
+
     HRESULT hr;
     PWSTR pszSocatFileName;
-    hr = WslWhich(m_pszDistributionName, L"socat", GetWslDefaultTimeout(), &pszSocatFileName);
+    hr = WslWhichCached(m_pszDistributionName, L"socat", GetWslDefaultTimeout(), &pszSocatFileName);
     if (FAILED(hr))
         return hr;
 
     PWSTR pszCommandLine;
-    hr = MakeFormattedString(&pszCommandLine, L"%s %sstdio %s", GetWslSocatLogLevel(), pszSocatFileName, m_pszConnect);
+    hr = MakeFormattedString(&pszCommandLine, L"%s %sstdio %s", pszSocatFileName, GetWslSocatLogLevel(), m_pszConnect);
     free(pszSocatFileName);
     if (FAILED(hr))
         return hr;
@@ -80,7 +299,11 @@ HRESULT WslSocatConnectorBase::MakeConnection(Duplex** outDuplex) const
     );
     free(pszCommandLine);
     if (FAILED(hr))
+    {
+        // wsl.exe, the distribution, or socat may have been changed
+        WslInvalidateCache(m_pszDistributionName);
         return hr;
+    }
     ::CloseHandle(pipeStdIn.hRead);
     ::CloseHandle(pipeStdOut.hWrite);
     
@@ -93,9 +316,275 @@ HRESULT WslSocatConnectorBase::MakeConnection(Duplex** outDuplex) const
         ::CloseHandle(hProcess);
         return E_OUTOFMEMORY;
     }
-    ::CloseHandle(hProcess);
+    WatchSocatProcess(m_pszDistributionName, hProcess);
+    *outDuplex = duplex;
+    return S_OK;
+}
+
+_Use_decl_annotations_
+HRESULT WslSocatConnectorBase::MakeRelayConnection(Duplex** outDuplex) const
+{
+    *outDuplex = nullptr;
+
+    USHORT port;
+    char szToken[RELAY_TOKEN_LENGTH + 2];
+    auto hr = AcquireRelay(&port, szToken);
+    if (FAILED(hr))
+        return hr;
+    SOCKET sock;
+    hr = ConnectLoopback(port, &sock);
+    if (SUCCEEDED(hr))
+    {
+        // the relay connects to the target only after receiving the token
+        hr = SendRelayToken(sock, szToken);
+        if (FAILED(hr))
+            ::closesocket(sock);
+    }
+    SecureZeroMemory(szToken, sizeof(szToken));
+    if (FAILED(hr))
+        return hr;
+
+    auto duplex = new SocketDuplex(sock);
+    if (!duplex)
+    {
+        ::closesocket(sock);
+        return E_OUTOFMEMORY;
+    }
     *outDuplex = duplex;
     return S_OK;
 }
 
+_Use_decl_annotations_
+HRESULT WslSocatConnectorBase::AcquireRelay(USHORT* outPort, char* outToken) const
+{
+    *outPort = 0;
+    outToken[0] = 0;
+
+    RelayInstance exitedRelay = {};
+    ::EnterCriticalSection(&m_csRelay);
+    // wait for the other thread starting the relay
+    while (m_relayState == RelayState::Starting)
+        ::SleepConditionVariableCS(&m_cvRelay, &m_csRelay, INFINITE);
+    if (m_relayState == RelayState::Ready && ::WaitForSingleObject(m_relay.hProcess, 0) == WAIT_OBJECT_0)
+    {
+        AddLogFormatted(LogLevel::Info, L"[wsl-relay] the relay has exited; restarting");
+        exitedRelay = m_relay;
+        ZeroMemory(&m_relay, sizeof(m_relay));
+        m_relayState = RelayState::Stopped;
+        // socat may have been removed from the distribution
+        WslInvalidateCache(m_pszDistributionName);
+    }
+    if (m_relayState == RelayState::Ready)
+    {
+        *outPort = m_relay.port;
+        memcpy(outToken, m_relay.szToken, sizeof(m_relay.szToken));
+        ::LeaveCriticalSection(&m_csRelay);
+        return S_OK;
+    }
+    if (::GetTickCount64() < m_relayRetryTime)
+    {
+        ::LeaveCriticalSection(&m_csRelay);
+        StopRelay(&exitedRelay);
+        return E_NOT_VALID_STATE;
+    }
+    // start the relay without m_csRelay, because starting WSL and waiting for socat take a while
+    m_relayState = RelayState::Starting;
+    ::LeaveCriticalSection(&m_csRelay);
+
+    StopRelay(&exitedRelay);
+    RelayInstance relay;
+    auto hr = StartRelay(&relay);
+
+    ::EnterCriticalSection(&m_csRelay);
+    if (SUCCEEDED(hr))
+    {
+        m_relay = relay;
+        m_relayState = RelayState::Ready;
+        m_relayFailureCount = 0;
+        m_relayRetryTime = 0;
+        *outPort = m_relay.port;
+        memcpy(outToken, m_relay.szToken, sizeof(m_relay.szToken));
+    }
+    else
+    {
+        auto interval = RELAY_RETRY_INTERVAL_MAX;
+        if (m_relayFailureCount < 6 && (RELAY_RETRY_INTERVAL_MIN << m_relayFailureCount) < interval)
+            interval = RELAY_RETRY_INTERVAL_MIN << m_relayFailureCount;
+        ++m_relayFailureCount;
+        m_relayRetryTime = ::GetTickCount64() + interval;
+        m_relayState = RelayState::Stopped;
+        AddLogFormatted(LogLevel::Error, L"[wsl-relay] failed to start the relay; using one process per connection for %lu ms: 0x%08lX", interval, hr);
+    }
+    ::WakeAllConditionVariable(&m_cvRelay);
+    ::LeaveCriticalSection(&m_csRelay);
+    SecureZeroMemory(&relay, sizeof(relay));
+    return hr;
+}
+
+_Use_decl_annotations_
+HRESULT WslSocatConnectorBase::StartRelay(RelayInstance* outRelay) const
+{
+    ZeroMemory(outRelay, sizeof(*outRelay));
+
+    RelayInstance relay = {};
+    auto hr = MakeRelayToken(relay.szToken, RELAY_TOKEN_LENGTH);
+    if (FAILED(hr))
+        return hr;
+    // the port must be free both on Windows (reached via the localhost forwarding on WSL2) and in WSL
+    // (another network namespace on WSL2), so pick the candidates free on Windows and let the relay
+    // use the first one it can listen on; the port actually used is read back from the relay
+    USHORT ports[RELAY_PORT_CANDIDATES];
+    WCHAR szPorts[RELAY_PORT_CANDIDATES * 6];
+    szPorts[0] = 0;
+    for (DWORD i = 0; i < RELAY_PORT_CANDIDATES; ++i)
+    {
+        hr = PickLoopbackPort(&ports[i]);
+        if (FAILED(hr))
+            return hr;
+        auto len = wcslen(szPorts);
+        swprintf_s(szPorts + len, _countof(szPorts) - len, i == 0 ? L"%hu" : L" %hu", ports[i]);
+    }
+
+    PWSTR pszSocatFileName;
+    hr = WslWhichCached(m_pszDistributionName, L"socat", GetWslDefaultTimeout(), &pszSocatFileName);
+    if (FAILED(hr))
+        return hr;
+
+    PWSTR pszCommand;
+    // the token is read from stdin (not to appear in the command line), and each forked socat
+    // connects to the target only if the first line received from the client matches the token;
+    // socat exits immediately if it cannot listen on the port, so the next candidate is tried:
+    // execute wsl -d <distro> -e sh -c "read -r T; export T S='<socat>' L='<log-level>' C=\"<connect>\";
+    //   for P in <ports>; do '<socat>' \"tcp4-listen:$P,bind=127.0.0.1,reuseaddr,fork\"
+    //   'system:set -f; read -r t; test x$t = x$T && exec $S $L - $C' & R=$!; sleep 0.2;
+    //   if kill -0 $R 2>/dev/null; then echo $R $P; wait $R; exit $?; fi; done; exit 1"
+    hr = MakeFormattedString(&pszCommand,
+        L"sh -c \"read -r T; export T S='%s' L='%s' C=\\\"%s\\\"; "
+        L"for P in %s; do '%s' %s\\\"tcp4-listen:$P,bind=127.0.0.1,reuseaddr,fork\\\" "
+        L"'system:set -f; read -r t; test x$t = x$T && exec $S $L - $C' & R=$!; sleep 0.2; "
+        L"if kill -0 $R 2>/dev/null; then echo $R $P; wait $R; exit $?; fi; done; exit 1\"",
+        pszSocatFileName, GetWslSocatLogLevel(), m_pszConnect,
+        szPorts, pszSocatFileName, GetWslSocatLogLevel());
+    free(pszSocatFileName);
+    if (FAILED(hr))
+        return hr;
+
+    auto hEvent = ::CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    if (!hEvent)
+    {
+        hr = HRESULT_FROM_WIN32(::GetLastError());
+        free(pszCommand);
+        return hr;
+    }
+
+    PipeData pipeStdIn, pipeStdOut;
+    hr = WslExecute(m_pszDistributionName, pszCommand, true, &relay.hProcess, &pipeStdIn, &pipeStdOut, nullptr);
+    free(pszCommand);
+    if (FAILED(hr))
+    {
+        ::CloseHandle(hEvent);
+        // wsl.exe or the distribution may have been changed
+        WslInvalidateCache(m_pszDistributionName);
+        return hr;
+    }
+    ::CloseHandle(pipeStdIn.hRead);
+    ::CloseHandle(pipeStdOut.hWrite);
+
+    OVERLAPPED ol = { 0 };
+    ol.hEvent = hEvent;
+    hr = WriteFileTimeout(pipeStdIn.hWrite, relay.szToken, static_cast<DWORD>(strlen(relay.szToken)), nullptr, &ol, GetWslDefaultTimeout());
+    ::CloseHandle(pipeStdIn.hWrite);
+    // the first line is the PID of socat (used for terminating) and the port it listens on
+    PSTR pszLine = nullptr;
+    if (SUCCEEDED(hr))
+        hr = ReadFileLineUtf8(pipeStdOut.hRead, &pszLine, &ol, GetWslDefaultTimeout());
+    ::CloseHandle(pipeStdOut.hRead);
+    ::CloseHandle(hEvent);
+    if (SUCCEEDED(hr))
+    {
+        relay.dwPid = static_cast<DWORD>(atol(pszLine));
+        auto pszPort = strchr(pszLine, ' ');
+        auto port = pszPort ? atol(pszPort + 1) : 0;
+        free(pszLine);
+        // (accept only the candidates, in case the output is unexpected)
+        for (DWORD i = 0; i < RELAY_PORT_CANDIDATES; ++i)
+        {
+            if (port == ports[i])
+                relay.port = ports[i];
+        }
+        if (relay.dwPid == 0 || relay.port == 0)
+            hr = E_UNEXPECTED;
+    }
+    if (FAILED(hr))
+    {
+        ::TerminateProcess(relay.hProcess, static_cast<UINT>(-1));
+        ::CloseHandle(relay.hProcess);
+        SecureZeroMemory(&relay, sizeof(relay));
+        // socat may have been removed from the distribution
+        WslInvalidateCache(m_pszDistributionName);
+        return hr;
+    }
+    AddLogFormatted(LogLevel::Info, L"[wsl-relay] started the relay (pid = %lu, port = %hu)", relay.dwPid, relay.port);
+
+    // socat may not be listening yet (or the port may not be forwarded yet on WSL2),
+    // so retry until it accepts the connection or exits; the connection is closed without
+    // sending the token, so the relay does not connect to the target for it
+    auto timeEnd = ::GetTickCount64() + RELAY_READY_TIMEOUT;
+    while (true)
+    {
+        SOCKET sock;
+        hr = ConnectLoopback(relay.port, &sock);
+        if (SUCCEEDED(hr))
+        {
+            ::closesocket(sock);
+            break;
+        }
+        if (::GetTickCount64() >= timeEnd)
+            break;
+        if (::WaitForSingleObject(relay.hProcess, RELAY_READY_INTERVAL) == WAIT_OBJECT_0)
+            break;
+    }
+    if (FAILED(hr))
+    {
+        AddLogFormatted(LogLevel::Error, L"[wsl-relay] the relay did not become ready: 0x%08lX", hr);
+        StopRelay(&relay);
+        WslInvalidateCache(m_pszDistributionName);
+        return hr;
+    }
+    AddLogFormatted(LogLevel::Info, L"[wsl-relay] the relay is ready on port %hu", relay.port);
+    *outRelay = relay;
+    SecureZeroMemory(&relay, sizeof(relay));
+    return S_OK;
+}
+
+_Use_decl_annotations_
+void WslSocatConnectorBase::StopRelay(RelayInstance* relay) const
+{
+    if (!relay->hProcess)
+        return;
+    if (relay->dwPid != 0 && ::WaitForSingleObject(relay->hProcess, 0) != WAIT_OBJECT_0)
+    {
+        PWSTR p;
+        if (SUCCEEDED(::MakeFormattedString(&p, L"sh -c \"kill -INT %lu\"", relay->dwPid)))
+        {
+            HANDLE h;
+            if (SUCCEEDED(::WslExecute(m_pszDistributionName, p, false, &h, nullptr, nullptr, nullptr)))
+            {
+                if (::WaitForSingleObject(h, 3000) != WAIT_OBJECT_0)
+                {
+                    ::TerminateProcess(h, static_cast<UINT>(-1));
+                }
+                ::CloseHandle(h);
+            }
+            free(p);
+        }
+    }
+    if (::WaitForSingleObject(relay->hProcess, 3000) != WAIT_OBJECT_0)
+    {
+        ::TerminateProcess(relay->hProcess, static_cast<UINT>(-1));
+    }
+    ::CloseHandle(relay->hProcess);
+    SecureZeroMemory(relay, sizeof(*relay));
+}
+
 #endif
@@ -18,8 +18,60 @@ protected:
     HRESULT InitializeImpl(_In_opt_z_ PCWSTR pszDistributionName, _In_z_ PCWSTR pszConnect);
 
 private:
+    // the length of the token sent on each connection to the relay (hexadecimal characters)
+    static constexpr DWORD RELAY_TOKEN_LENGTH = 32;
+
+    enum class RelayState
+    {
+        // no relay is running (or the last start failed; retried after m_relayRetryTime)
+        Stopped,
+        // a thread is starting the relay outside m_csRelay; others wait for m_cvRelay
+        Starting,
+        // the relay is accepting connections
+        Ready,
+    };
+
+    struct RelayInstance
+    {
+        HANDLE hProcess;
+        DWORD dwPid;
+        USHORT port;
+        // the token checked by the relay before connecting to the target (with '\n')
+        char szToken[RELAY_TOKEN_LENGTH + 2];
+    };
+
+    _Check_return_
+    HRESULT MakeProcessConnection(_When_(return == S_OK, _Outptr_) Duplex** outDuplex) const;
+    _Check_return_
+    HRESULT MakeRelayConnection(_When_(return == S_OK, _Outptr_) Duplex** outDuplex) const;
+    // Returns the running relay, starting it if necessary (must not be called in m_csRelay);
+    // returns E_NOT_VALID_STATE while waiting to retry after the failure
+    _Check_return_
+    HRESULT AcquireRelay(_Out_ USHORT* outPort, _Out_writes_z_(RELAY_TOKEN_LENGTH + 2) char* outToken) const;
+    // Starts the relay and waits until it accepts connections (called without m_csRelay)
+    _Check_return_
+    HRESULT StartRelay(_Out_ RelayInstance* outRelay) const;
+    // Stops the relay (called without m_csRelay)
+    void StopRelay(_Inout_ RelayInstance* relay) const;
+    // Starts the relay (or resolves socat) on initializing
+    static void CALLBACK WarmUpCallback(
+        _Inout_ PTP_CALLBACK_INSTANCE instance,
+        _Inout_opt_ PVOID context,
+        _Inout_ PTP_WORK work
+    );
+
     PWSTR m_pszDistributionName;
     PWSTR m_pszConnect;
+    // the persistent relay (socat listening on the loopback port in WSL)
+    mutable CRITICAL_SECTION m_csRelay;
+    mutable CONDITION_VARIABLE m_cvRelay;
+    mutable RelayState m_relayState;
+    mutable RelayInstance m_relay;
+    // the count of consecutive failures to start the relay, and the time to retry
+    mutable DWORD m_relayFailureCount;
+    mutable ULONGLONG m_relayRetryTime;
+    // the work running WarmUpCallback (waited on destruction)
+    PTP_WORK m_warmUpWork;
 };
 
 #endif
@@ -0,0 +1,70 @@
+#include "../framework.h"
+
+#include "duplex.h"
+
+// the interval treated as 'idle' (the capacity is reset to the minimum after this)
+constexpr ULONGLONG READ_IDLE_TIME = 500;
+
+Duplex::Duplex()
+    : m_readMinCapacity(RELAY_BUFFER_SIZE)
+    , m_readMaxCapacity(RELAY_BUFFER_DEFAULT_MAX_SIZE)
+    , m_readCapacity(RELAY_BUFFER_SIZE)
+    , m_lastReadTime(0)
+{
+}
+
+_Use_decl_annotations_
+void Duplex::SetReadBufferRange(DWORD minSize, DWORD maxSize)
+{
+    minSize = RelayBuffer::RoundCapacity(minSize);
+    maxSize = RelayBuffer::RoundCapacity(maxSize);
+    if (maxSize < minSize)
+        maxSize = minSize;
+    m_readMinCapacity = minSize;
+    m_readMaxCapacity = maxSize;
+    m_readCapacity = minSize;
+}
+
+_Use_decl_annotations_
+void Duplex::UpdateReadCapacity(DWORD receivedSize, DWORD bufferCapacity)
+{
+    auto now = ::GetTickCount64();
+    auto isIdle = m_lastReadTime != 0 && now - m_lastReadTime >= READ_IDLE_TIME;
+    m_lastReadTime = now;
+    if (isIdle)
+    {
+        m_readCapacity = m_readMinCapacity;
+    }
+    else if (receivedSize >= bufferCapacity)
+    {
+        // the buffer is filled, so more data may be pending
+        if (bufferCapacity < m_readMaxCapacity)
+            m_readCapacity = bufferCapacity * 2;
+    }
+    else if (receivedSize <= bufferCapacity / 4)
+    {
+        if (bufferCapacity > m_readMinCapacity)
+            m_readCapacity = bufferCapacity / 2;
+    }
+    if (m_readCapacity > m_readMaxCapacity)
+        m_readCapacity = m_readMaxCapacity;
+    else if (m_readCapacity < m_readMinCapacity)
+        m_readCapacity = m_readMinCapacity;
+}
+
+_Use_decl_annotations_
+HRESULT Duplex::WriteBuffers(RelayBuffer* const* buffers, DWORD count, DWORD* outWrittenSize)
+{
+    DWORD writtenSize = 0;
+    for (DWORD i = 0; i < count; ++i)
+    {
+        DWORD dw = 0;
+        auto hr = Write(buffers[i]->GetData(), buffers[i]->GetSize(), &dw);
+        if (FAILED(hr))
+            return hr;
+        writtenSize += dw;
+    }
+    if (outWrittenSize)
+        *outWrittenSize = writtenSize;
+    return S_OK;
+}
@@ -1,18 +1,26 @@
 #pragma once
 
+#include "relay_buffer.h"
+
 class Duplex
 {
 public:
+    Duplex();
     virtual ~Duplex() {}
 
+    // Sets the range of the read buffer capacity; the capacity grows while reads fill the buffer,
+    // and shrinks while reads are small or the traffic is idle
+    void SetReadBufferRange(_In_ DWORD minSize, _In_ DWORD maxSize);
+
     _Check_return_
     virtual HRESULT StartRead(_When_(SUCCEEDED(return), _Out_) HANDLE* outEvent) = 0;
+    // Hands out the filled buffer without copying;
+    // on S_OK, the caller owns one reference of *outBuffer (S_FALSE for EOF)
     _Check_return_
     virtual HRESULT FinishRead(
-        _When_(return == S_OK, _Outptr_result_bytebuffer_(*outSize))
+        _When_(return == S_OK, _Outptr_)
         _When_(return != S_OK, _Outptr_result_maybenull_)
-        void** outBuffer,
-        _When_(SUCCEEDED(return), _Out_) DWORD* outSize
+        RelayBuffer** outBuffer
     ) = 0;
 
     virtual HRESULT Write(
@@ -20,4 +28,76 @@ public:
         _In_ DWORD size,
         _When_(SUCCEEDED(return), _Out_opt_) DWORD* outWrittenSize
     ) = 0;
+    // Writes the data of all buffers in order, without concatenating them
+    // (the default implementation calls Write for each buffer)
+    virtual HRESULT WriteBuffers(
+        _In_reads_(count) RelayBuffer* const* buffers,
+        _In_ DWORD count,
+        _When_(SUCCEEDED(return), _Out_opt_) DWORD* outWrittenSize
+    );
+    // Waits until all written data is passed to the peer
+    // (Write and WriteBuffers may return before the data is actually written)
+    virtual HRESULT Flush() { return S_OK; }
+
+    // Returns true if BindCompletionPort is available for this duplex
+    virtual bool IsCompletionPortSupported() const { return false; }
+    // Associates the reading and writing handles with the I/O completion port.
+    // After binding, each succeeded StartRead call results in exactly one completion packet
+    // with 'key' (also when the read is finished synchronously or reaches EOF).
+    _Check_return_
+    virtual HRESULT BindCompletionPort(_In_ HANDLE hPort, _In_ ULONG_PTR key)
+    {
+        UNREFERENCED_PARAMETER(hPort);
+        UNREFERENCED_PARAMETER(key);
+        return E_NOTIMPL;
+    }
+    // Cancels the pending read started by StartRead (the completion is still notified)
+    virtual void CancelRead() {}
+
+    // Starts writing the data of the buffers in order (skipping 'offset' bytes of the first buffer)
+    // without blocking; available after BindCompletionPort. Each succeeded call results in exactly one
+    // completion packet with the bound key, and the buffers must be kept until it is received.
+    // The write may finish with a part of the data (see FinishWrite).
+    _Check_return_
+    virtual HRESULT StartWrite(
+        _In_reads_(count) RelayBuffer* const* buffers,
+        _In_ DWORD count,
+        _In_ DWORD offset
+    )
+    {
+        UNREFERENCED_PARAMETER(buffers);
+        UNREFERENCED_PARAMETER(count);
+        UNREFERENCED_PARAMETER(offset);
+        return E_NOTIMPL;
+    }
+    // Retrieves the result of the write started by StartWrite, after its completion packet is received
+    _Check_return_
+    virtual HRESULT FinishWrite(_When_(SUCCEEDED(return), _Out_) DWORD* outWrittenSize)
+    {
+        UNREFERENCED_PARAMETER(outWrittenSize);
+        return E_NOTIMPL;
+    }
+    // Returns true if the completion packet with the OVERLAPPED is for StartWrite (otherwise for StartRead)
+    virtual bool IsWriteCompletion(_In_ const OVERLAPPED* pol) const
+    {
+        UNREFERENCED_PARAMETER(pol);
+        return false;
+    }
+    // Cancels the pending write started by StartWrite (the completion is still notified)
+    virtual void CancelWrite() {}
+    // Returns false if the peer is known to have closed the connection
+    // (must not be called after StartRead; received data is kept for the next read)
+    virtual bool IsPeerAlive() { return true; }
+
+protected:
+    // Returns the capacity for the next read buffer
+    DWORD GetReadCapacity() const { return m_readCapacity; }
+    // Updates the capacity for the next read buffer from the size of the finished read
+    void UpdateReadCapacity(_In_ DWORD receivedSize, _In_ DWORD bufferCapacity);
+
+private:
+    DWORD m_readMinCapacity;
+    DWORD m_readMaxCapacity;
+    DWORD m_readCapacity;
+    ULONGLONG m_lastReadTime;
 };
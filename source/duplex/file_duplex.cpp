@@ -3,22 +3,31 @@
 
 #include "file_duplex.h"
 
-constexpr DWORD BUFFER_SIZE = 1024;
+// the time to wait for outstanding writes on disposing
+constexpr DWORD WRITE_DRAIN_TIMEOUT = 3000;
 
 _Use_decl_annotations_
 FileDuplex::FileDuplex(HANDLE hFileIn, HANDLE hFileOut, bool closeOnDispose)
     : m_hFileIn(hFileIn)
     , m_hFileOut(hFileOut)
+    , m_hPort(nullptr)
+    , m_completionKey(0)
     , m_ol{ 0 }
-    , m_olWrite{ 0 }
-    , m_workBuffer(nullptr)
-    , m_dwBufferSize(0)
+    , m_writes{}
+    , m_writeHead(0)
+    , m_writeCount(0)
+    , m_hrWrite(S_OK)
+    , m_buffer(nullptr)
     , m_dwReceived(0)
+    , m_olWrite{ 0 }
+    , m_dwWritten(0)
     , m_closeOnDispose(closeOnDispose)
     , m_isReceived(false)
+    , m_isWritten(false)
 {
     m_ol.hEvent = INVALID_HANDLE_VALUE;
-    m_olWrite.hEvent = INVALID_HANDLE_VALUE;
+    for (auto& write : m_writes)
+        write.hEvent = INVALID_HANDLE_VALUE;
     if (::GetFileType(hFileIn) == FILE_TYPE_PIPE)
     {
         // determine if hFileIn is not an actual pipe (e.g. socket)
@@ -39,6 +48,20 @@ FileDuplex::FileDuplex(HANDLE hFileIn, HANDLE hFileOut, bool closeOnDispose)
 
 FileDuplex::~FileDuplex()
 {
+    if (m_writeCount > 0)
+    {
+        // give the peer a chance to receive the written data before closing
+        HANDLE handles[FILE_DUPLEX_MAX_PENDING_WRITES];
+        for (DWORD i = 0; i < m_writeCount; ++i)
+            handles[i] = m_writes[(m_writeHead + i) % FILE_DUPLEX_MAX_PENDING_WRITES].hEvent;
+        auto r = ::WaitForMultipleObjects(m_writeCount, handles, TRUE, WRITE_DRAIN_TIMEOUT);
+        if (r == WAIT_TIMEOUT || r == WAIT_FAILED)
+        {
+            for (DWORD i = 0; i < m_writeCount; ++i)
+                ::CancelIoEx(m_hFileOut, &m_writes[(m_writeHead + i) % FILE_DUPLEX_MAX_PENDING_WRITES].ol);
+        }
+        WaitAllWrites();
+    }
     ::CancelIo(m_hFileIn);
     if (m_closeOnDispose)
     {
@@ -46,13 +69,14 @@ FileDuplex::~FileDuplex()
         if (m_hFileIn != m_hFileOut && m_hFileOut != INVALID_HANDLE_VALUE)
             ::CloseHandle(m_hFileOut);
     }
-    if (m_workBuffer != nullptr)
+    if (m_buffer != nullptr)
     {
-        free(m_workBuffer);
+        m_buffer->Release();
     }
-    if (m_olWrite.hEvent != INVALID_HANDLE_VALUE)
+    for (auto& write : m_writes)
     {
-        ::CloseHandle(m_olWrite.hEvent);
+        if (write.hEvent != INVALID_HANDLE_VALUE)
+            ::CloseHandle(write.hEvent);
     }
     if (m_ol.hEvent != INVALID_HANDLE_VALUE)
     {
@@ -71,38 +95,51 @@ HRESULT FileDuplex::StartRead(HANDLE* outEvent)
         m_ol.hEvent = hEvent;
         ResetOverlapped(&m_ol);
     }
-    if (!m_workBuffer)
+    if (!m_buffer)
     {
-        auto ptr = static_cast<decltype(m_workBuffer)>(malloc(BUFFER_SIZE));
-        if (!ptr)
-            return E_OUTOFMEMORY;
-        m_workBuffer = ptr;
+        // the previous buffer has been handed out by FinishRead
+        auto hr = RelayBuffer::Allocate(&m_buffer, GetReadCapacity());
+        if (FAILED(hr))
+            return hr;
     }
 
     ::ResetEvent(m_ol.hEvent);
-    m_dwBufferSize = BUFFER_SIZE;
     m_dwReceived = 0;
     m_isReceived = false;
-    DWORD dwFlags = 0;
-    if (::ReadFile(m_hFileIn, m_workBuffer, m_dwBufferSize, &m_dwReceived, &m_ol))
+    auto hEvent = m_ol.hEvent;
+    // with the completion port, the packet is queued even if finished immediately, and FinishRead
+    // may run on another thread before ReadFile returns; so the members are not touched after calling
+    // (FinishRead retrieves the result from m_ol)
+    if (::ReadFile(m_hFileIn, m_buffer->GetData(), m_buffer->GetCapacity(), m_hPort ? nullptr : &m_dwReceived, &m_ol))
     {
-        m_isReceived = true;
-        ::SetEvent(m_ol.hEvent);
-        *outEvent = m_ol.hEvent;
+        if (!m_hPort)
+        {
+            m_isReceived = true;
+            ::SetEvent(hEvent);
+        }
+        *outEvent = hEvent;
         return S_OK;
     }
     auto err = ::GetLastError();
     if (err == ERROR_IO_PENDING)
     {
-        *outEvent = m_ol.hEvent;
+        *outEvent = hEvent;
         return S_OK;
     }
     else if (err == ERROR_BROKEN_PIPE)
     {
         m_dwReceived = 0;
         m_isReceived = true;
-        ::SetEvent(m_ol.hEvent);
-        *outEvent = m_ol.hEvent;
+        // no completion packet is queued for the failure, so post it manually
+        // (the members are not touched after posting, as above)
+        if (m_hPort)
+        {
+            if (!::PostQueuedCompletionStatus(m_hPort, 0, m_completionKey, &m_ol))
+                return HRESULT_FROM_WIN32(::GetLastError());
+        }
+        else
+            ::SetEvent(hEvent);
+        *outEvent = hEvent;
         return S_OK;
     }
     else
@@ -112,15 +149,19 @@ HRESULT FileDuplex::StartRead(HANDLE* outEvent)
 }
 
 _Use_decl_annotations_
-HRESULT FileDuplex::FinishRead(void** outBuffer, DWORD* outSize)
+HRESULT FileDuplex::FinishRead(RelayBuffer** outBuffer)
 {
     DWORD dw = 0;
+    if (!m_buffer)
+    {
+        *outBuffer = nullptr;
+        return E_UNEXPECTED;
+    }
     if (m_isReceived)
     {
         if (!m_dwReceived)
         {
             *outBuffer = nullptr;
-            *outSize = 0;
             return S_FALSE;
         }
         dw = m_dwReceived;
@@ -133,7 +174,6 @@ HRESULT FileDuplex::FinishRead(void** outBuffer, DWORD* outSize)
             if (err == ERROR_BROKEN_PIPE)
             {
                 *outBuffer = nullptr;
-                *outSize = 0;
                 return S_FALSE;
             }
             return HRESULT_FROM_WIN32(err);
@@ -141,24 +181,19 @@ HRESULT FileDuplex::FinishRead(void** outBuffer, DWORD* outSize)
         if (!dw)
         {
             *outBuffer = nullptr;
-            *outSize = 0;
             return S_FALSE;
         }
-        if (dw > m_dwBufferSize)
+        if (dw > m_buffer->GetCapacity())
         {
             return E_UNEXPECTED;
         }
         m_dwReceived = dw;
         m_isReceived = true;
     }
-    auto ptr = malloc(dw);
-    if (!ptr)
-    {
-        return E_OUTOFMEMORY;
-    }
-    memcpy(ptr, m_workBuffer, dw);
-    *outBuffer = ptr;
-    *outSize = dw;
+    UpdateReadCapacity(dw, m_buffer->GetCapacity());
+    m_buffer->SetSize(dw);
+    *outBuffer = m_buffer;
+    m_buffer = nullptr;
     return S_OK;
 }
 
@@ -172,42 +207,213 @@ HRESULT FileDuplex::Write(const void* buffer, DWORD size, DWORD* outWrittenSize)
             *outWrittenSize = size;
         return S_OK;
     }
-    auto hr = InitEvent();
-    if (FAILED(hr))
-        return hr;
-    ResetOverlapped(&m_olWrite);
-    ::ResetEvent(m_olWrite.hEvent);
-    if (!::WriteFile(m_hFileOut, buffer, size, outWrittenSize, &m_olWrite))
+    // the data is copied because the caller may reuse the buffer before the write is finished
+    DWORD writtenSize = 0;
+    while (writtenSize < size)
     {
-        auto err = ::GetLastError();
-        if (err != ERROR_IO_PENDING)
-            return HRESULT_FROM_WIN32(err);
-        DWORD dw = 0;
-        if (!::GetOverlappedResult(m_hFileOut, &m_olWrite, &dw, TRUE))
-            return HRESULT_FROM_WIN32(::GetLastError());
-        if (outWrittenSize)
-            *outWrittenSize = dw;
+        auto chunkSize = size - writtenSize;
+        if (chunkSize > RELAY_BUFFER_MAX_CAPACITY)
+            chunkSize = RELAY_BUFFER_MAX_CAPACITY;
+        RelayBuffer* chunk;
+        auto hr = RelayBuffer::Allocate(&chunk, chunkSize);
+        if (FAILED(hr))
+            return hr;
+        memcpy(chunk->GetData(), static_cast<const BYTE*>(buffer) + writtenSize, chunkSize);
+        chunk->SetSize(chunkSize);
+        hr = QueueWrite(chunk);
+        chunk->Release();
+        if (FAILED(hr))
+            return hr;
+        writtenSize += chunkSize;
     }
+    if (outWrittenSize)
+        *outWrittenSize = writtenSize;
+    return S_OK;
+}
+
+_Use_decl_annotations_
+HRESULT FileDuplex::WriteBuffers(RelayBuffer* const* buffers, DWORD count, DWORD* outWrittenSize)
+{
+    DWORD writtenSize = 0;
+    if (m_hFileOut != INVALID_HANDLE_VALUE)
+    {
+        for (DWORD i = 0; i < count; ++i)
+        {
+            auto hr = QueueWrite(buffers[i]);
+            if (FAILED(hr))
+                return hr;
+            writtenSize += buffers[i]->GetSize();
+        }
+    }
+    else
+    {
+        // act as writing to NUL device
+        for (DWORD i = 0; i < count; ++i)
+            writtenSize += buffers[i]->GetSize();
+    }
+    if (outWrittenSize)
+        *outWrittenSize = writtenSize;
+    return S_OK;
+}
+
+HRESULT FileDuplex::Flush()
+{
+    if (m_hFileOut == INVALID_HANDLE_VALUE)
+        return S_OK;
+    auto hr = WaitAllWrites();
+    if (FAILED(hr))
+        return hr;
     ::FlushFileBuffers(m_hFileOut);
     return S_OK;
 }
 
 _Use_decl_annotations_
-HRESULT FileDuplex::InitEvent()
+HRESULT FileDuplex::QueueWrite(RelayBuffer* buffer)
 {
-    if (m_ol.hEvent == INVALID_HANDLE_VALUE)
+    if (FAILED(m_hrWrite))
+        return m_hrWrite;
+    if (m_writeCount == FILE_DUPLEX_MAX_PENDING_WRITES)
+    {
+        auto hr = WaitOldestWrite();
+        if (FAILED(hr))
+            return hr;
+    }
+    auto write = &m_writes[(m_writeHead + m_writeCount) % FILE_DUPLEX_MAX_PENDING_WRITES];
+    // m_ol.hEvent is initialized by StartRead; writing may run on another thread
+    // in parallel with reading, so touch only the events for writing here
+    if (write->hEvent == INVALID_HANDLE_VALUE)
     {
         auto hEvent = ::CreateEventW(nullptr, TRUE, FALSE, nullptr);
         if (hEvent == nullptr)
             return HRESULT_FROM_WIN32(::GetLastError());
-        m_ol.hEvent = hEvent;
+        write->hEvent = hEvent;
     }
-    if (m_olWrite.hEvent == INVALID_HANDLE_VALUE)
+    ZeroMemory(&write->ol, sizeof(write->ol));
+    ::ResetEvent(write->hEvent);
+    write->ol.hEvent = write->hEvent;
+    if (m_hPort)
     {
-        auto hEvent = ::CreateEventW(nullptr, TRUE, FALSE, nullptr);
-        if (hEvent == nullptr)
+        // set the low-order bit not to queue the completion packet for writing
+        write->ol.hEvent = reinterpret_cast<HANDLE>(reinterpret_cast<ULONG_PTR>(write->hEvent) | 1);
+    }
+    if (::WriteFile(m_hFileOut, buffer->GetData(), buffer->GetSize(), nullptr, &write->ol))
+    {
+        // finished synchronously (e.g. for non-overlapped handles)
+        return S_OK;
+    }
+    auto err = ::GetLastError();
+    if (err != ERROR_IO_PENDING)
+        return HRESULT_FROM_WIN32(err);
+    buffer->AddRef();
+    write->buffer = buffer;
+    ++m_writeCount;
+    return S_OK;
+}
+
+HRESULT FileDuplex::WaitOldestWrite()
+{
+    if (!m_writeCount)
+        return m_hrWrite;
+    auto write = &m_writes[m_writeHead];
+    DWORD dw = 0;
+    if (!::GetOverlappedResult(m_hFileOut, &write->ol, &dw, TRUE))
+    {
+        if (SUCCEEDED(m_hrWrite))
+            m_hrWrite = HRESULT_FROM_WIN32(::GetLastError());
+    }
+    write->buffer->Release();
+    write->buffer = nullptr;
+    m_writeHead = (m_writeHead + 1) % FILE_DUPLEX_MAX_PENDING_WRITES;
+    --m_writeCount;
+    return m_hrWrite;
+}
+
+HRESULT FileDuplex::WaitAllWrites()
+{
+    while (m_writeCount > 0)
+        WaitOldestWrite();
+    return m_hrWrite;
+}
+
+_Use_decl_annotations_
+HRESULT FileDuplex::BindCompletionPort(HANDLE hPort, ULONG_PTR key)
+{
+    if (!::CreateIoCompletionPort(m_hFileIn, hPort, key, 0))
+        return HRESULT_FROM_WIN32(::GetLastError());
+    // hFileOut must be opened for overlapped I/O, otherwise StartWrite blocks
+    if (m_hFileOut != m_hFileIn && m_hFileOut != INVALID_HANDLE_VALUE &&
+        !::CreateIoCompletionPort(m_hFileOut, hPort, key, 0))
+    {
+        return HRESULT_FROM_WIN32(::GetLastError());
+    }
+    m_hPort = hPort;
+    m_completionKey = key;
+    return S_OK;
+}
+
+void FileDuplex::CancelRead()
+{
+    ::CancelIoEx(m_hFileIn, &m_ol);
+}
+
+_Use_decl_annotations_
+HRESULT FileDuplex::StartWrite(RelayBuffer* const* buffers, DWORD count, DWORD offset)
+{
+    if (!m_hPort)
+        return E_UNEXPECTED;
+    if (!count)
+        return E_INVALIDARG;
+    auto size = buffers[0]->GetSize() - offset;
+    ZeroMemory(&m_olWrite, sizeof(m_olWrite));
+    m_dwWritten = 0;
+    m_isWritten = false;
+    if (m_hFileOut == INVALID_HANDLE_VALUE)
+    {
+        // act as writing to NUL device
+        m_dwWritten = size;
+        m_isWritten = true;
+        if (!::PostQueuedCompletionStatus(m_hPort, size, m_completionKey, &m_olWrite))
             return HRESULT_FROM_WIN32(::GetLastError());
-        m_olWrite.hEvent = hEvent;
+        return S_OK;
+    }
+    // the completion packet is queued also when WriteFile finishes immediately
+    if (!::WriteFile(m_hFileOut, buffers[0]->GetData() + offset, size, nullptr, &m_olWrite))
+    {
+        auto err = ::GetLastError();
+        if (err != ERROR_IO_PENDING)
+            return HRESULT_FROM_WIN32(err);
+    }
+    return S_OK;
+}
+
+_Use_decl_annotations_
+HRESULT FileDuplex::FinishWrite(DWORD* outWrittenSize)
+{
+    if (m_isWritten)
+    {
+        *outWrittenSize = m_dwWritten;
+        return S_OK;
     }
+    DWORD dw = 0;
+    if (!::GetOverlappedResult(m_hFileOut, &m_olWrite, &dw, FALSE))
+        return HRESULT_FROM_WIN32(::GetLastError());
+    *outWrittenSize = dw;
     return S_OK;
 }
+
+void FileDuplex::CancelWrite()
+{
+    if (m_hFileOut != INVALID_HANDLE_VALUE)
+        ::CancelIoEx(m_hFileOut, &m_olWrite);
+}
+
+bool FileDuplex::IsPeerAlive()
+{
+    // only pipes can be checked
+    if (!m_isPipeInput)
+        return true;
+    if (::PeekNamedPipe(m_hFileIn, nullptr, 0, nullptr, nullptr, nullptr))
+        return true;
+    auto err = ::GetLastError();
+    return err != ERROR_BROKEN_PIPE && err != ERROR_PIPE_NOT_CONNECTED;
+}
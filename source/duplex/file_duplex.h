@@ -2,6 +2,9 @@
 
 #include "duplex.h"
 
+// the maximum count of outstanding writes for each FileDuplex
+constexpr DWORD FILE_DUPLEX_MAX_PENDING_WRITES = 4;
+
 class FileDuplex : public Duplex
 {
 public:
@@ -13,10 +16,9 @@ public:
     virtual HRESULT StartRead(_When_(SUCCEEDED(return), _Out_) HANDLE* outEvent);
     _Check_return_
     virtual HRESULT FinishRead(
-        _When_(return == S_OK, _Outptr_result_bytebuffer_(*outSize))
+        _When_(return == S_OK, _Outptr_)
         _When_(return != S_OK, _Outptr_result_maybenull_)
-        void** outBuffer,
-        _When_(SUCCEEDED(return), _Out_) DWORD* outSize
+        RelayBuffer** outBuffer
     );
 
     virtual HRESULT Write(
@@ -24,19 +26,67 @@ public:
         _In_ DWORD size,
         _When_(SUCCEEDED(return), _Out_opt_) DWORD* outWrittenSize
     );
+    virtual HRESULT WriteBuffers(
+        _In_reads_(count) RelayBuffer* const* buffers,
+        _In_ DWORD count,
+        _When_(SUCCEEDED(return), _Out_opt_) DWORD* outWrittenSize
+    );
+    virtual HRESULT Flush();
+
+    virtual bool IsCompletionPortSupported() const { return true; }
+    _Check_return_
+    virtual HRESULT BindCompletionPort(_In_ HANDLE hPort, _In_ ULONG_PTR key);
+    virtual void CancelRead();
+    // (writes only the first buffer at once)
+    _Check_return_
+    virtual HRESULT StartWrite(
+        _In_reads_(count) RelayBuffer* const* buffers,
+        _In_ DWORD count,
+        _In_ DWORD offset
+    );
+    _Check_return_
+    virtual HRESULT FinishWrite(_When_(SUCCEEDED(return), _Out_) DWORD* outWrittenSize);
+    virtual bool IsWriteCompletion(_In_ const OVERLAPPED* pol) const { return pol == &m_olWrite; }
+    virtual void CancelWrite();
+    virtual bool IsPeerAlive();
 
 private:
+    struct PendingWrite
+    {
+        OVERLAPPED ol;
+        // the event without the low-order bit (ol.hEvent may have the bit)
+        HANDLE hEvent;
+        // the buffer being written (one reference is held until the write is finished)
+        RelayBuffer* buffer;
+    };
+
+    // Starts writing the buffer asynchronously (waits for the oldest write if the queue is full)
     _Check_return_
-    HRESULT InitEvent();
+    HRESULT QueueWrite(_In_ RelayBuffer* buffer);
+    // Waits for the oldest outstanding write
+    HRESULT WaitOldestWrite();
+    // Waits for all outstanding writes
+    HRESULT WaitAllWrites();
 
     HANDLE m_hFileIn;
     HANDLE m_hFileOut;
+    HANDLE m_hPort;
+    ULONG_PTR m_completionKey;
     OVERLAPPED m_ol;
-    OVERLAPPED m_olWrite;
-    void* m_workBuffer;
-    DWORD m_dwBufferSize;
+    // ring of outstanding writes (m_writeHead is the oldest)
+    PendingWrite m_writes[FILE_DUPLEX_MAX_PENDING_WRITES];
+    DWORD m_writeHead;
+    DWORD m_writeCount;
+    // the error of the finished write, reported on the next Write/Flush call
+    HRESULT m_hrWrite;
+    RelayBuffer* m_buffer;
     DWORD m_dwReceived;
+    // for StartWrite (without the event; the completion is notified only with the completion port)
+    OVERLAPPED m_olWrite;
+    // the written size when the completion of StartWrite is posted manually
+    DWORD m_dwWritten;
     bool m_closeOnDispose;
     bool m_isPipeInput;
     bool m_isReceived;
+    bool m_isWritten;
 };
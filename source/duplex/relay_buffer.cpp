@@ -0,0 +1,179 @@
+#include "../framework.h"
+
+#include "relay_buffer.h"
+
+constexpr DWORD SIZE_CLASS_COUNT = RELAY_BUFFER_SIZE_CLASS_COUNT;
+static_assert((RELAY_BUFFER_MIN_CAPACITY << (SIZE_CLASS_COUNT - 1)) == RELAY_BUFFER_MAX_CAPACITY, "invalid SIZE_CLASS_COUNT");
+
+// the maximum count of buffers kept in each pool
+constexpr USHORT MAX_POOLED_BUFFERS = 256;
+// the maximum total bytes kept in each pool (applied for large size classes)
+constexpr DWORD MAX_POOLED_BYTES = 2 * 1024 * 1024;
+
+// the count of size classes cached per thread (up to 64 KiB)
+constexpr DWORD THREAD_CACHE_CLASS_COUNT = 9;
+static_assert(THREAD_CACHE_CLASS_COUNT <= SIZE_CLASS_COUNT, "invalid THREAD_CACHE_CLASS_COUNT");
+// the maximum count of buffers kept in each size class of the per-thread cache
+constexpr BYTE THREAD_CACHE_MAX_BUFFERS = 2;
+
+// zero-initialized SLIST_HEADER is an empty list
+static SLIST_HEADER g_poolHeads[SIZE_CLASS_COUNT];
+// non-zero after CleanupPool; buffers returned after that are freed instead of pooled
+static volatile LONG g_isPoolCleanedUp = 0;
+
+struct SizeClassCounters
+{
+    volatile LONG64 threadCacheHits;
+    volatile LONG64 poolHits;
+    volatile LONG64 misses;
+    volatile LONG64 discarded;
+};
+static SizeClassCounters g_counters[SIZE_CLASS_COUNT];
+
+static USHORT GetMaxPooledCount(_In_ DWORD sizeClass)
+{
+    auto count = MAX_POOLED_BYTES / (RELAY_BUFFER_MIN_CAPACITY << sizeClass);
+    if (count > MAX_POOLED_BUFFERS)
+        return MAX_POOLED_BUFFERS;
+    return static_cast<USHORT>(count);
+}
+
+// Pushes the released buffer to the shared pool, or frees it if the pool is full (or cleaned up)
+// (RelayBuffer::m_entry is the first member, so the entry is the address of the allocated block)
+static void ReturnToPool(_In_ PSLIST_ENTRY entry, _In_ DWORD sizeClass)
+{
+    auto head = &g_poolHeads[sizeClass];
+    if (!g_isPoolCleanedUp && ::QueryDepthSList(head) < GetMaxPooledCount(sizeClass))
+    {
+        ::InterlockedPushEntrySList(head, entry);
+        return;
+    }
+    ::InterlockedIncrement64(&g_counters[sizeClass].discarded);
+    _aligned_free(entry);
+}
+
+// Buffers released on this thread, reused without touching the shared pool heads
+// (linked with SLIST_ENTRY::Next; returned to the shared pool on thread exit)
+struct ThreadCache
+{
+    PSLIST_ENTRY heads[THREAD_CACHE_CLASS_COUNT];
+    BYTE counts[THREAD_CACHE_CLASS_COUNT];
+
+    ~ThreadCache() { Flush(); }
+
+    void Flush()
+    {
+        for (DWORD i = 0; i < THREAD_CACHE_CLASS_COUNT; ++i)
+        {
+            while (heads[i])
+            {
+                auto entry = heads[i];
+                heads[i] = entry->Next;
+                ReturnToPool(entry, i);
+            }
+            counts[i] = 0;
+        }
+    }
+};
+static thread_local ThreadCache t_cache = {};
+
+static DWORD GetSizeClass(_In_ DWORD capacity)
+{
+    DWORD sizeClass = 0;
+    while (sizeClass < SIZE_CLASS_COUNT - 1 && (RELAY_BUFFER_MIN_CAPACITY << sizeClass) < capacity)
+        ++sizeClass;
+    return sizeClass;
+}
+
+_Use_decl_annotations_
+DWORD RelayBuffer::RoundCapacity(DWORD capacity)
+{
+    return RELAY_BUFFER_MIN_CAPACITY << GetSizeClass(capacity);
+}
+
+_Use_decl_annotations_
+HRESULT RelayBuffer::Allocate(RelayBuffer** outBuffer, DWORD capacity)
+{
+    auto sizeClass = GetSizeClass(capacity);
+    PSLIST_ENTRY entry = nullptr;
+    if (sizeClass < THREAD_CACHE_CLASS_COUNT && t_cache.heads[sizeClass])
+    {
+        entry = t_cache.heads[sizeClass];
+        t_cache.heads[sizeClass] = entry->Next;
+        --t_cache.counts[sizeClass];
+        ::InterlockedIncrement64(&g_counters[sizeClass].threadCacheHits);
+    }
+    else
+    {
+        entry = ::InterlockedPopEntrySList(&g_poolHeads[sizeClass]);
+        ::InterlockedIncrement64(entry ? &g_counters[sizeClass].poolHits : &g_counters[sizeClass].misses);
+    }
+    RelayBuffer* p;
+    if (entry)
+    {
+        p = CONTAINING_RECORD(entry, RelayBuffer, m_entry);
+    }
+    else
+    {
+        auto allocSize = RELAY_BUFFER_MIN_CAPACITY << sizeClass;
+        p = static_cast<RelayBuffer*>(_aligned_malloc(sizeof(RelayBuffer) + allocSize, MEMORY_ALLOCATION_ALIGNMENT));
+        if (!p)
+            return E_OUTOFMEMORY;
+        p->m_capacity = allocSize;
+        p->m_sizeClass = sizeClass;
+    }
+    p->m_refCount = 1;
+    p->m_size = 0;
+    *outBuffer = p;
+    return S_OK;
+}
+
+void RelayBuffer::CleanupPool()
+{
+    // the caches of other threads are flushed when the threads exit, which may be after this;
+    // the flag makes them free the buffers instead of pushing to the cleaned-up pool
+    ::InterlockedExchange(&g_isPoolCleanedUp, 1);
+    t_cache.Flush();
+    for (auto& head : g_poolHeads)
+    {
+        auto entry = ::InterlockedFlushSList(&head);
+        while (entry)
+        {
+            auto next = entry->Next;
+            _aligned_free(CONTAINING_RECORD(entry, RelayBuffer, m_entry));
+            entry = next;
+        }
+    }
+}
+
+_Use_decl_annotations_
+void RelayBuffer::GetStats(RelayBufferStats* outStats)
+{
+    for (DWORD i = 0; i < SIZE_CLASS_COUNT; ++i)
+    {
+        outStats[i].capacity = RELAY_BUFFER_MIN_CAPACITY << i;
+        outStats[i].threadCacheHits = g_counters[i].threadCacheHits;
+        outStats[i].poolHits = g_counters[i].poolHits;
+        outStats[i].misses = g_counters[i].misses;
+        outStats[i].discarded = g_counters[i].discarded;
+    }
+}
+
+void RelayBuffer::AddRef()
+{
+    ::InterlockedIncrement(&m_refCount);
+}
+
+void RelayBuffer::Release()
+{
+    if (::InterlockedDecrement(&m_refCount) != 0)
+        return;
+    if (m_sizeClass < THREAD_CACHE_CLASS_COUNT && t_cache.counts[m_sizeClass] < THREAD_CACHE_MAX_BUFFERS)
+    {
+        m_entry.Next = t_cache.heads[m_sizeClass];
+        t_cache.heads[m_sizeClass] = &m_entry;
+        ++t_cache.counts[m_sizeClass];
+        return;
+    }
+    ReturnToPool(&m_entry, m_sizeClass);
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+// the default (and the smallest adaptive) capacity of read buffers
+constexpr DWORD RELAY_BUFFER_SIZE = 1024;
+// the default maximum capacity of adaptive read buffers
+constexpr DWORD RELAY_BUFFER_DEFAULT_MAX_SIZE = 256 * 1024;
+// the range of buffer capacities; each capacity is rounded up to the power of two in the range
+constexpr DWORD RELAY_BUFFER_MIN_CAPACITY = 256;
+constexpr DWORD RELAY_BUFFER_MAX_CAPACITY = 1024 * 1024;
+// the count of size classes (RELAY_BUFFER_MIN_CAPACITY << n, up to RELAY_BUFFER_MAX_CAPACITY)
+constexpr DWORD RELAY_BUFFER_SIZE_CLASS_COUNT = 13;
+
+// allocation statistics of one size class
+struct RelayBufferStats
+{
+    DWORD capacity;
+    // buffers reused from the per-thread cache or from the shared pool
+    LONG64 threadCacheHits;
+    LONG64 poolHits;
+    // buffers newly allocated from the heap
+    LONG64 misses;
+    // released buffers freed because the pool is full (or after CleanupPool)
+    LONG64 discarded;
+};
+
+// Reference-counted buffer for relaying received data between duplexes.
+// The buffer is returned to the pool of its size class when the last reference is released,
+// and reused by the next Allocate call. Small buffers are kept in the per-thread cache first,
+// and moved to the shared pool when the cache is full or the thread exits.
+class RelayBuffer
+{
+public:
+    // Allocates the buffer with at least 'capacity' bytes (the reference count is 1)
+    _Check_return_
+    static HRESULT Allocate(_Outptr_ RelayBuffer** outBuffer, _In_ DWORD capacity = RELAY_BUFFER_SIZE);
+    // Frees all pooled buffers (and the buffers cached by the calling thread); buffers released
+    // or flushed from the caches of other threads after this are freed instead of pooled
+    static void CleanupPool();
+    // Retrieves the statistics of all size classes
+    static void GetStats(_Out_writes_(RELAY_BUFFER_SIZE_CLASS_COUNT) RelayBufferStats* outStats);
+    // Returns the capacity actually allocated for the requested capacity
+    static DWORD RoundCapacity(_In_ DWORD capacity);
+
+    void AddRef();
+    void Release();
+
+    _Ret_notnull_
+    BYTE* GetData() { return reinterpret_cast<BYTE*>(this + 1); }
+    DWORD GetCapacity() const { return m_capacity; }
+    // the size of filled data
+    DWORD GetSize() const { return m_size; }
+    void SetSize(_In_ DWORD size) { m_size = size; }
+
+private:
+    RelayBuffer() = delete;
+    ~RelayBuffer() = delete;
+
+    // used for linking in the pool (must be the first member for alignment)
+    SLIST_ENTRY m_entry;
+    volatile LONG m_refCount;
+    DWORD m_size;
+    DWORD m_capacity;
+    // index of the size class (the pool to return)
+    DWORD m_sizeClass;
+    // (data follows)
+};
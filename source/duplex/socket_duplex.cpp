@@ -4,15 +4,16 @@
 
 #include "socket_duplex.h"
 
-constexpr DWORD BUFFER_SIZE = 1024;
-
 _Use_decl_annotations_
 SocketDuplex::SocketDuplex(SOCKET socket)
     : m_socket(socket)
     , m_ol{ 0 }
     , m_buf{ 0 }
+    , m_buffer(nullptr)
     , m_dwReceived(0)
     , m_isReceived(false)
+    , m_isPortBound(false)
+    , m_olWrite{ 0 }
 {
     m_ol.hEvent = INVALID_HANDLE_VALUE;
 }
@@ -21,9 +22,9 @@ SocketDuplex::~SocketDuplex()
 {
     ::shutdown(m_socket, 0);
     ::closesocket(m_socket);
-    if (m_buf.buf != nullptr)
+    if (m_buffer != nullptr)
     {
-        free(m_buf.buf);
+        m_buffer->Release();
     }
     if (m_ol.hEvent != INVALID_HANDLE_VALUE)
     {
@@ -42,25 +43,33 @@ HRESULT SocketDuplex::StartRead(HANDLE* outEvent)
         m_ol.hEvent = hEvent;
         ResetOverlapped(&m_ol);
     }
-    if (!m_buf.buf)
+    if (!m_buffer)
     {
-        auto ptr = static_cast<decltype(m_buf.buf)>(malloc(BUFFER_SIZE));
-        if (!ptr)
-            return E_OUTOFMEMORY;
-        m_buf.buf = ptr;
+        // the previous buffer has been handed out by FinishRead
+        auto hr = RelayBuffer::Allocate(&m_buffer, GetReadCapacity());
+        if (FAILED(hr))
+            return hr;
     }
 
     ::ResetEvent(m_ol.hEvent);
-    m_buf.len = BUFFER_SIZE;
+    m_buf.buf = reinterpret_cast<decltype(m_buf.buf)>(m_buffer->GetData());
+    m_buf.len = m_buffer->GetCapacity();
     m_dwReceived = 0;
     m_isReceived = false;
     DWORD dwFlags = 0;
-    auto r = ::WSARecv(m_socket, &m_buf, 1, &m_dwReceived, &dwFlags, &m_ol, nullptr);
+    auto hEvent = m_ol.hEvent;
+    // with the completion port, the packet is queued even if finished immediately, and FinishRead
+    // may run on another thread before WSARecv returns; so the members are not touched after calling
+    // (FinishRead retrieves the result from m_ol)
+    auto r = ::WSARecv(m_socket, &m_buf, 1, m_isPortBound ? nullptr : &m_dwReceived, &dwFlags, &m_ol, nullptr);
     if (r == 0)
     {
-        m_isReceived = true;
-        ::SetEvent(m_ol.hEvent);
-        *outEvent = m_ol.hEvent;
+        if (!m_isPortBound)
+        {
+            m_isReceived = true;
+            ::SetEvent(hEvent);
+        }
+        *outEvent = hEvent;
         return S_OK;
     }
     else if (r != SOCKET_ERROR)
@@ -70,7 +79,7 @@ HRESULT SocketDuplex::StartRead(HANDLE* outEvent)
     auto err = ::WSAGetLastError();
     if (err == WSA_IO_PENDING)
     {
-        *outEvent = m_ol.hEvent;
+        *outEvent = hEvent;
         return S_OK;
     }
     else
@@ -80,15 +89,19 @@ HRESULT SocketDuplex::StartRead(HANDLE* outEvent)
 }
 
 _Use_decl_annotations_
-HRESULT SocketDuplex::FinishRead(void** outBuffer, DWORD* outSize)
+HRESULT SocketDuplex::FinishRead(RelayBuffer** outBuffer)
 {
     DWORD dw = 0;
+    if (!m_buffer)
+    {
+        *outBuffer = nullptr;
+        return E_UNEXPECTED;
+    }
     if (m_isReceived)
     {
         if (!m_dwReceived)
         {
             *outBuffer = nullptr;
-            *outSize = 0;
             return S_FALSE;
         }
         dw = m_dwReceived;
@@ -103,7 +116,6 @@ HRESULT SocketDuplex::FinishRead(void** outBuffer, DWORD* outSize)
         if (!dw)
         {
             *outBuffer = nullptr;
-            *outSize = 0;
             return S_FALSE;
         }
         if (dw > m_buf.len)
@@ -113,14 +125,10 @@ HRESULT SocketDuplex::FinishRead(void** outBuffer, DWORD* outSize)
         m_dwReceived = dw;
         m_isReceived = true;
     }
-    auto ptr = malloc(dw);
-    if (!ptr)
-    {
-        return E_OUTOFMEMORY;
-    }
-    memcpy(ptr, m_buf.buf, dw);
-    *outBuffer = ptr;
-    *outSize = dw;
+    UpdateReadCapacity(dw, m_buffer->GetCapacity());
+    m_buffer->SetSize(dw);
+    *outBuffer = m_buffer;
+    m_buffer = nullptr;
     return S_OK;
 }
 
@@ -148,3 +156,116 @@ HRESULT SocketDuplex::Write(const void* buffer, DWORD size, DWORD* outWrittenSiz
         *outWrittenSize = writtenSize;
     return S_OK;
 }
+
+_Use_decl_annotations_
+HRESULT SocketDuplex::WriteBuffers(RelayBuffer* const* buffers, DWORD count, DWORD* outWrittenSize)
+{
+    // the maximum count of WSABUF passed to one WSASend call
+    constexpr DWORD MAX_SEND_BUFFERS = 16;
+    WSABUF bufs[MAX_SEND_BUFFERS];
+    DWORD writtenSize = 0;
+    DWORD index = 0;
+    DWORD offset = 0;
+    while (index < count)
+    {
+        DWORD bufCount = 0;
+        for (auto i = index; i < count && bufCount < MAX_SEND_BUFFERS; ++i)
+        {
+            auto skip = (i == index ? offset : 0);
+            bufs[bufCount].buf = reinterpret_cast<decltype(bufs[0].buf)>(buffers[i]->GetData() + skip);
+            bufs[bufCount].len = buffers[i]->GetSize() - skip;
+            ++bufCount;
+        }
+        DWORD dwSent = 0;
+        if (::WSASend(m_socket, bufs, bufCount, &dwSent, 0, nullptr, nullptr) == SOCKET_ERROR)
+            return GetLastWSAErrorAsHResult();
+        if (!dwSent)
+            break;
+        writtenSize += dwSent;
+        // skip the sent data (may stop at the middle of a buffer)
+        while (index < count && dwSent >= buffers[index]->GetSize() - offset)
+        {
+            dwSent -= buffers[index]->GetSize() - offset;
+            offset = 0;
+            ++index;
+        }
+        offset += dwSent;
+    }
+    if (outWrittenSize)
+        *outWrittenSize = writtenSize;
+    return S_OK;
+}
+
+_Use_decl_annotations_
+HRESULT SocketDuplex::BindCompletionPort(HANDLE hPort, ULONG_PTR key)
+{
+    if (!::CreateIoCompletionPort(reinterpret_cast<HANDLE>(m_socket), hPort, key, 0))
+        return HRESULT_FROM_WIN32(::GetLastError());
+    m_isPortBound = true;
+    return S_OK;
+}
+
+void SocketDuplex::CancelRead()
+{
+    ::CancelIoEx(reinterpret_cast<HANDLE>(m_socket), &m_ol);
+}
+
+_Use_decl_annotations_
+HRESULT SocketDuplex::StartWrite(RelayBuffer* const* buffers, DWORD count, DWORD offset)
+{
+    // the maximum count of WSABUF passed to one WSASend call
+    constexpr DWORD MAX_SEND_BUFFERS = 16;
+    WSABUF bufs[MAX_SEND_BUFFERS];
+    if (!count)
+        return E_INVALIDARG;
+    if (count > MAX_SEND_BUFFERS)
+        count = MAX_SEND_BUFFERS;
+    for (DWORD i = 0; i < count; ++i)
+    {
+        auto skip = (i == 0 ? offset : 0);
+        bufs[i].buf = reinterpret_cast<decltype(bufs[0].buf)>(buffers[i]->GetData() + skip);
+        bufs[i].len = buffers[i]->GetSize() - skip;
+    }
+    ZeroMemory(&m_olWrite, sizeof(m_olWrite));
+    // the completion packet is queued also when WSASend finishes immediately
+    if (::WSASend(m_socket, bufs, count, nullptr, 0, &m_olWrite, nullptr) == SOCKET_ERROR)
+    {
+        auto err = ::WSAGetLastError();
+        if (err != WSA_IO_PENDING)
+            return GetWSAErrorAsHResult(err);
+    }
+    return S_OK;
+}
+
+_Use_decl_annotations_
+HRESULT SocketDuplex::FinishWrite(DWORD* outWrittenSize)
+{
+    DWORD dw = 0;
+    DWORD dwFlags;
+    if (!::WSAGetOverlappedResult(m_socket, &m_olWrite, &dw, FALSE, &dwFlags))
+        return GetLastWSAErrorAsHResult();
+    *outWrittenSize = dw;
+    return S_OK;
+}
+
+void SocketDuplex::CancelWrite()
+{
+    ::CancelIoEx(reinterpret_cast<HANDLE>(m_socket), &m_olWrite);
+}
+
+bool SocketDuplex::IsPeerAlive()
+{
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(m_socket, &fds);
+    timeval tv = { 0 };
+    auto r = ::select(0, &fds, nullptr, nullptr, &tv);
+    if (r == SOCKET_ERROR)
+        return false;
+    if (r == 0)
+        return true;
+    // readable: either data has arrived (e.g. a greeting from the server) or the peer has closed
+    char c;
+    r = ::recv(m_socket, &c, 1, MSG_PEEK);
+    return r > 0;
+}
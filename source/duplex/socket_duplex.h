@@ -12,10 +12,9 @@ public:
     virtual HRESULT StartRead(_When_(SUCCEEDED(return), _Out_) HANDLE* outEvent);
     _Check_return_
     virtual HRESULT FinishRead(
-        _When_(return == S_OK, _Outptr_result_bytebuffer_(*outSize))
+        _When_(return == S_OK, _Outptr_)
         _When_(return != S_OK, _Outptr_result_maybenull_)
-        void** outBuffer,
-        _When_(SUCCEEDED(return), _Out_) DWORD* outSize
+        RelayBuffer** outBuffer
     );
 
     virtual HRESULT Write(
@@ -23,11 +22,37 @@ public:
         _In_ DWORD size,
         _When_(SUCCEEDED(return), _Out_opt_) DWORD* outWrittenSize
     );
+    virtual HRESULT WriteBuffers(
+        _In_reads_(count) RelayBuffer* const* buffers,
+        _In_ DWORD count,
+        _When_(SUCCEEDED(return), _Out_opt_) DWORD* outWrittenSize
+    );
+
+    virtual bool IsCompletionPortSupported() const { return true; }
+    _Check_return_
+    virtual HRESULT BindCompletionPort(_In_ HANDLE hPort, _In_ ULONG_PTR key);
+    virtual void CancelRead();
+    _Check_return_
+    virtual HRESULT StartWrite(
+        _In_reads_(count) RelayBuffer* const* buffers,
+        _In_ DWORD count,
+        _In_ DWORD offset
+    );
+    _Check_return_
+    virtual HRESULT FinishWrite(_When_(SUCCEEDED(return), _Out_) DWORD* outWrittenSize);
+    virtual bool IsWriteCompletion(_In_ const OVERLAPPED* pol) const { return pol == &m_olWrite; }
+    virtual void CancelWrite();
+    virtual bool IsPeerAlive();
 
 private:
     SOCKET m_socket;
     WSAOVERLAPPED m_ol;
     WSABUF m_buf;
+    RelayBuffer* m_buffer;
     DWORD m_dwReceived;
     bool m_isReceived;
+    // true after BindCompletionPort (the read completion is always delivered to the port)
+    bool m_isPortBound;
+    // for StartWrite (without the event; the completion is notified only with the completion port)
+    WSAOVERLAPPED m_olWrite;
 };
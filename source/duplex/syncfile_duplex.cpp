@@ -3,7 +3,19 @@
 
 #include "syncfile_duplex.h"
 
-constexpr DWORD BUFFER_SIZE = 256;
+// Returns true if hFile is an actual pipe (sockets are also FILE_TYPE_PIPE, but read zero bytes only on EOF)
+static bool IsActualPipe(_In_ HANDLE hFile)
+{
+    if (::GetFileType(hFile) != FILE_TYPE_PIPE)
+        return false;
+    DWORD dwDummy = 0;
+    if (!::GetNamedPipeInfo(hFile, &dwDummy, nullptr, nullptr, nullptr))
+    {
+        ::SetLastError(0);
+        return false;
+    }
+    return true;
+}
 
 _Use_decl_annotations_
 SyncFileDuplex::SyncFileDuplex(HANDLE hFileIn, HANDLE hFileOut, bool closeOnDispose)
@@ -12,9 +24,10 @@ SyncFileDuplex::SyncFileDuplex(HANDLE hFileIn, HANDLE hFileOut, bool closeOnDisp
     , m_hFileOut(hFileOut)
     , m_hEventRead(INVALID_HANDLE_VALUE)
     , m_hEventBufferAvailable(INVALID_HANDLE_VALUE)
-    , m_workBuffer(nullptr)
-    , m_dwBufferSize(0)
-    , m_dwReceived(0)
+    , m_buffer(nullptr)
+    , m_spareBuffer(nullptr)
+    , m_hrRead(S_OK)
+    , m_isPipeInput(IsActualPipe(hFileIn))
     , m_closeOnDispose(closeOnDispose)
     , m_isClosing(false)
 {
@@ -45,9 +58,13 @@ SyncFileDuplex::~SyncFileDuplex()
         }
         ::CloseHandle(m_hThread);
     }
-    if (m_workBuffer != nullptr)
+    if (m_buffer != nullptr)
     {
-        free(m_workBuffer);
+        m_buffer->Release();
+    }
+    if (m_spareBuffer != nullptr)
+    {
+        m_spareBuffer->Release();
     }
     if (m_hEventBufferAvailable != INVALID_HANDLE_VALUE)
     {
@@ -68,7 +85,7 @@ HRESULT SyncFileDuplex::StartRead(HANDLE* outEvent)
         return hr;
     ::EnterCriticalSection(&m_csRead);
     ::ResetEvent(m_hEventRead);
-    if (m_dwReceived > 0 || ::WaitForSingleObject(m_hThread, 0) == WAIT_OBJECT_0)
+    if (m_buffer != nullptr || ::WaitForSingleObject(m_hThread, 0) == WAIT_OBJECT_0)
         ::SetEvent(m_hEventRead);
     ::LeaveCriticalSection(&m_csRead);
     *outEvent = m_hEventRead;
@@ -76,36 +93,40 @@ HRESULT SyncFileDuplex::StartRead(HANDLE* outEvent)
 }
 
 _Use_decl_annotations_
-HRESULT SyncFileDuplex::FinishRead(void** outBuffer, DWORD* outSize)
+HRESULT SyncFileDuplex::FinishRead(RelayBuffer** outBuffer)
 {
-    if (::WaitForSingleObject(m_hThread, 0) == WAIT_OBJECT_0)
+    // the filled buffer is handed out, so prepare the new one for the reader thread
+    RelayBuffer* newBuffer;
+    auto hr = RelayBuffer::Allocate(&newBuffer, GetReadCapacity());
+    if (FAILED(hr))
     {
         *outBuffer = nullptr;
-        *outSize = 0;
-        return S_FALSE;
+        return hr;
     }
     ::EnterCriticalSection(&m_csRead);
-    if (!m_dwReceived)
+    auto buffer = m_buffer;
+    if (!buffer)
     {
+        // the reader thread has finished (EOF or error) without remaining data
+        hr = FAILED(m_hrRead) ? m_hrRead : S_FALSE;
         ::LeaveCriticalSection(&m_csRead);
+        newBuffer->Release();
         *outBuffer = nullptr;
-        *outSize = 0;
-        return S_FALSE;
+        return hr;
     }
-    auto size = m_dwReceived;
-    auto ptr = malloc(size);
-    if (!ptr)
+    m_buffer = nullptr;
+    UpdateReadCapacity(buffer->GetSize(), buffer->GetCapacity());
+    if (!m_spareBuffer)
     {
-        ::LeaveCriticalSection(&m_csRead);
-        return E_OUTOFMEMORY;
+        m_spareBuffer = newBuffer;
+        newBuffer = nullptr;
     }
-    memcpy(ptr, m_workBuffer, size);
-    m_dwReceived = 0;
     ::SetEvent(m_hEventBufferAvailable);
     ::LeaveCriticalSection(&m_csRead);
+    if (newBuffer)
+        newBuffer->Release();
 
-    *outBuffer = ptr;
-    *outSize = size;
+    *outBuffer = buffer;
     return S_OK;
 }
 
@@ -127,13 +148,11 @@ HRESULT SyncFileDuplex::Write(const void* buffer, DWORD size, DWORD* outWrittenS
 _Use_decl_annotations_
 HRESULT SyncFileDuplex::InitEvent()
 {
-    if (m_workBuffer == nullptr)
+    if (m_buffer == nullptr && m_spareBuffer == nullptr && m_hThread == INVALID_HANDLE_VALUE)
     {
-        auto ptr = malloc(BUFFER_SIZE);
-        if (!ptr)
-            return E_OUTOFMEMORY;
-        m_workBuffer = ptr;
-        m_dwBufferSize = BUFFER_SIZE;
+        auto hr = RelayBuffer::Allocate(&m_spareBuffer, GetReadCapacity());
+        if (FAILED(hr))
+            return hr;
     }
     if (m_hEventRead == INVALID_HANDLE_VALUE)
     {
@@ -172,22 +191,43 @@ DWORD WINAPI SyncFileDuplex::_ThreadProc(void* data)
         ::WaitForSingleObject(pThis->m_hEventBufferAvailable, INFINITE);
         if (pThis->m_isClosing)
             break;
-        BYTE b;
-        DWORD dw;
-        if (!::ReadFile(pThis->m_hFileIn, &b, 1, &dw, nullptr))
+        ::EnterCriticalSection(&pThis->m_csRead);
+        auto buffer = pThis->m_spareBuffer;
+        pThis->m_spareBuffer = nullptr;
+        ::ResetEvent(pThis->m_hEventBufferAvailable);
+        ::LeaveCriticalSection(&pThis->m_csRead);
+
+        // read as much as possible without the lock; ReadFile for pipes (and consoles) returns
+        // with available data, so this never waits for filling the buffer
+        DWORD dw = 0;
+        if (!::ReadFile(pThis->m_hFileIn, buffer->GetData(), buffer->GetCapacity(), &dw, nullptr))
         {
             auto err = ::GetLastError();
             if (err != ERROR_BROKEN_PIPE)
+            {
                 dwExitCode = static_cast<DWORD>(HRESULT_FROM_WIN32(err));
+                // (reported by FinishRead after the remaining data)
+                ::EnterCriticalSection(&pThis->m_csRead);
+                pThis->m_hrRead = HRESULT_FROM_WIN32(err);
+                ::LeaveCriticalSection(&pThis->m_csRead);
+            }
+            buffer->Release();
             break;
         }
         ::EnterCriticalSection(&pThis->m_csRead);
-        static_cast<BYTE*>(pThis->m_workBuffer)[pThis->m_dwReceived] = b;
-        ++pThis->m_dwReceived;
-        if (pThis->m_dwReceived < pThis->m_dwBufferSize)
-            ::SetEvent(pThis->m_hEventBufferAvailable);
-        else
-            ::ResetEvent(pThis->m_hEventBufferAvailable);
+        if (!dw)
+        {
+            // zero-byte write for pipes (otherwise EOF, including sockets)
+            pThis->m_spareBuffer = buffer;
+            if (pThis->m_isPipeInput)
+                ::SetEvent(pThis->m_hEventBufferAvailable);
+            ::LeaveCriticalSection(&pThis->m_csRead);
+            if (!pThis->m_isPipeInput)
+                break;
+            continue;
+        }
+        buffer->SetSize(dw);
+        pThis->m_buffer = buffer;
         ::SetEvent(pThis->m_hEventRead);
         ::LeaveCriticalSection(&pThis->m_csRead);
     }
@@ -13,10 +13,9 @@ public:
     virtual HRESULT StartRead(_When_(SUCCEEDED(return), _Out_) HANDLE* outEvent);
     _Check_return_
     virtual HRESULT FinishRead(
-        _When_(return == S_OK, _Outptr_result_bytebuffer_(*outSize))
+        _When_(return == S_OK, _Outptr_)
         _When_(return != S_OK, _Outptr_result_maybenull_)
-        void** outBuffer,
-        _When_(SUCCEEDED(return), _Out_) DWORD* outSize
+        RelayBuffer** outBuffer
     );
 
     virtual HRESULT Write(
@@ -36,11 +35,17 @@ private:
     HANDLE m_hFileIn;
     HANDLE m_hFileOut;
     HANDLE m_hEventRead;
+    // signalled while m_spareBuffer is available for the reader thread
     HANDLE m_hEventBufferAvailable;
-    void* m_workBuffer;
-    DWORD m_dwBufferSize;
-    DWORD m_dwReceived;
+    // the buffer filled by the reader thread (null until filled)
+    RelayBuffer* m_buffer;
+    // the buffer the reader thread reads into next (swapped with the handed-out buffer)
+    RelayBuffer* m_spareBuffer;
     CRITICAL_SECTION m_csRead;
+    // the read error of the reader thread (set in m_csRead; S_OK for EOF)
+    HRESULT m_hrRead;
+    // true if m_hFileIn is an actual pipe (a zero-byte read is not EOF)
+    bool m_isPipeInput;
     bool m_closeOnDispose;
     bool m_isClosing;
 };
@@ -0,0 +1,69 @@
+#include "../framework.h"
+
+#include "accept_executor.h"
+
+AcceptExecutor::AcceptExecutor()
+    : m_cleanupGroup(nullptr)
+{
+    ::InitializeThreadpoolEnvironment(&m_env);
+}
+
+AcceptExecutor::~AcceptExecutor()
+{
+    Shutdown();
+    ::DestroyThreadpoolEnvironment(&m_env);
+}
+
+HRESULT AcceptExecutor::Initialize()
+{
+    if (m_cleanupGroup)
+        return S_OK;
+    auto group = ::CreateThreadpoolCleanupGroup();
+    if (!group)
+        return HRESULT_FROM_WIN32(::GetLastError());
+    ::SetThreadpoolCallbackCleanupGroup(&m_env, group, nullptr);
+    m_cleanupGroup = group;
+    return S_OK;
+}
+
+_Use_decl_annotations_
+HRESULT AcceptExecutor::Submit(PAcceptWorkCallback pfnCallback, void* context)
+{
+    if (!m_cleanupGroup)
+        return E_UNEXPECTED;
+    auto data = static_cast<WorkData*>(malloc(sizeof(WorkData)));
+    if (!data)
+        return E_OUTOFMEMORY;
+    data->pfnCallback = pfnCallback;
+    data->context = context;
+    if (!::TrySubmitThreadpoolCallback(reinterpret_cast<PTP_SIMPLE_CALLBACK>(WorkCallback), data, &m_env))
+    {
+        auto err = ::GetLastError();
+        free(data);
+        return HRESULT_FROM_WIN32(err);
+    }
+    return S_OK;
+}
+
+void AcceptExecutor::Shutdown()
+{
+    if (!m_cleanupGroup)
+        return;
+    // waits for the callbacks, including ones not started yet
+    ::CloseThreadpoolCleanupGroupMembers(m_cleanupGroup, FALSE, nullptr);
+    ::CloseThreadpoolCleanupGroup(m_cleanupGroup);
+    m_cleanupGroup = nullptr;
+    ::SetThreadpoolCallbackCleanupGroup(&m_env, nullptr, nullptr);
+}
+
+_Use_decl_annotations_
+void CALLBACK AcceptExecutor::WorkCallback(PTP_CALLBACK_INSTANCE instance, WorkData* data)
+{
+    // handshakes wait for the client
+    ::CallbackMayRunLong(instance);
+
+    auto pfn = data->pfnCallback;
+    auto context = data->context;
+    free(data);
+    pfn(context);
+}
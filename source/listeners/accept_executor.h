@@ -0,0 +1,32 @@
+#pragma once
+
+typedef void (CALLBACK* PAcceptWorkCallback)(_In_ void* context);
+
+// Runs the work for accepted connections (handshakes and accept handlers) on the thread pool,
+// so that the thread dispatching listener events is never blocked by a slow client
+class AcceptExecutor
+{
+public:
+    AcceptExecutor();
+    ~AcceptExecutor();
+
+    _Check_return_
+    HRESULT Initialize();
+    // Calls pfnCallback on the thread pool (the callback may run long)
+    _Check_return_
+    HRESULT Submit(_In_ PAcceptWorkCallback pfnCallback, _In_opt_ void* context);
+    // Waits for all submitted work to finish; Submit must not be called after this
+    void Shutdown();
+
+private:
+    struct WorkData
+    {
+        PAcceptWorkCallback pfnCallback;
+        void* context;
+    };
+
+    static void CALLBACK WorkCallback(_Inout_ PTP_CALLBACK_INSTANCE instance, _In_ WorkData* data);
+
+    TP_CALLBACK_ENVIRON m_env;
+    PTP_CLEANUP_GROUP m_cleanupGroup;
+};
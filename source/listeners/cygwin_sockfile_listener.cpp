@@ -4,11 +4,56 @@
 
 #include "cygwin_sockfile_listener.h"
 
+// time limit for the whole handshake of one connection
+constexpr DWORD HANDSHAKE_TIMEOUT = 3000;
+
+enum class HandshakeState : BYTE
+{
+    // receiving the socket's ID (16 bytes) from the client
+    ReadSecret,
+    // sending back the socket's ID
+    WriteSecret,
+    // receiving [pid, uid, gid] from the client
+    ReadCredentials,
+    // sending [pid, uid, gid] to the client
+    WriteCredentials,
+};
+
+struct CygwinSockFileListener::Handshake
+{
+    Handshake* pPrev;
+    Handshake* pNext;
+    CygwinSockFileListener* pThis;
+    SOCKET sock;
+    PTP_WAIT wait;
+    OVERLAPPED ol;
+    // absolute time (UTC) at which the handshake is aborted
+    FILETIME deadline;
+    HandshakeState state;
+    // bytes transferred / to transfer in the current state
+    DWORD offset;
+    DWORD size;
+    DWORD data[4];
+};
+
 //_Use_decl_annotations_
 CygwinSockFileListener::CygwinSockFileListener()
     : m_pszSocketFile(nullptr)
+    , m_pHandshakes(nullptr)
+    , m_handshakeCount(0)
+    , m_isClosing(false)
+    , m_hEventIdle(nullptr)
 {
     GenerateRandom16Bytes(reinterpret_cast<BYTE*>(m_idSocket));
+    ::InitializeCriticalSection(&m_csHandshakes);
+}
+
+CygwinSockFileListener::~CygwinSockFileListener()
+{
+    Close();
+    if (m_hEventIdle)
+        ::CloseHandle(m_hEventIdle);
+    ::DeleteCriticalSection(&m_csHandshakes);
 }
 
 _Use_decl_annotations_
@@ -113,6 +158,22 @@ HRESULT CygwinSockFileListener::InitializeSocket(LPCWSTR pszSocketFilePath, PAcc
     }
     ::CloseHandle(hFile);
 
+    if (!m_hEventIdle)
+    {
+        // (signaled as no handshake is in progress)
+        m_hEventIdle = ::CreateEventW(nullptr, TRUE, TRUE, nullptr);
+        if (!m_hEventIdle)
+        {
+            dw = ::GetLastError();
+            ::SetFileAttributesW(pszSocketFilePathDup, 0);
+            ::DeleteFileW(pszSocketFilePathDup);
+            free(pszSocketFilePathDup);
+            ::closesocket(socket);
+            return HRESULT_FROM_WIN32(dw);
+        }
+    }
+    m_isClosing = false;
+
     {
         auto hr = InitSocketImpl(socket, pfnOnAccept, callbackData);
         if (FAILED(hr))
@@ -140,52 +201,212 @@ void CygwinSockFileListener::Close()
         m_pszSocketFile = nullptr;
     }
     _Analysis_assume_(m_pszSocketFile == nullptr);
+    // (no more handshakes are started after this)
     SocketListener::Close();
+    CancelHandshakes();
 }
 
 _Use_decl_annotations_
 HRESULT CygwinSockFileListener::CheckAcceptedSocket(SOCKET sock)
 {
-    // check data
-    DWORD recvData[4];
-    static_assert(sizeof(recvData) == sizeof(m_idSocket), "size of 'recvId' is not equal to size of 'm_idSocket'");
-    auto len = ::recvTimeout(sock, reinterpret_cast<char*>(recvData), sizeof(recvData), 0, 3000);
-    if (len == SOCKET_ERROR)
+    // the handshake is done with overlapped I/O, so that a slow client does not occupy a thread
+    auto handshake = static_cast<Handshake*>(calloc(1, sizeof(Handshake)));
+    if (!handshake)
+        return E_OUTOFMEMORY;
+    handshake->ol.hEvent = ::CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    if (!handshake->ol.hEvent)
     {
-        return GetLastWSAErrorAsHResult();
+        auto err = ::GetLastError();
+        free(handshake);
+        return HRESULT_FROM_WIN32(err);
     }
-    // (first, the cygwin-based client must send socket's ID)
-    if (len < sizeof(recvData) || memcmp(recvData, m_idSocket, sizeof(m_idSocket)) != 0)
+    handshake->wait = ::CreateThreadpoolWait(HandshakeCallback, handshake, nullptr);
+    if (!handshake->wait)
     {
-        // invalid data received or no data available
-        return S_FALSE;
+        auto err = ::GetLastError();
+        ::CloseHandle(handshake->ol.hEvent);
+        free(handshake);
+        return HRESULT_FROM_WIN32(err);
     }
-    if (::send(sock, reinterpret_cast<char*>(recvData), sizeof(recvData), 0) == SOCKET_ERROR)
+    handshake->pThis = this;
+    handshake->sock = sock;
+    // (first, the cygwin-based client must send socket's ID)
+    handshake->state = HandshakeState::ReadSecret;
+    handshake->offset = 0;
+    handshake->size = sizeof(m_idSocket);
+    static_assert(sizeof(handshake->data) == sizeof(m_idSocket), "size of 'data' is not equal to size of 'm_idSocket'");
+
+    ULARGE_INTEGER deadline;
+    ::GetSystemTimeAsFileTime(reinterpret_cast<FILETIME*>(&deadline));
+    // (in 100-nanosecond units)
+    deadline.QuadPart += static_cast<ULONGLONG>(HANDSHAKE_TIMEOUT) * 10000;
+    handshake->deadline.dwLowDateTime = deadline.LowPart;
+    handshake->deadline.dwHighDateTime = deadline.HighPart;
+
+    ::EnterCriticalSection(&m_csHandshakes);
+    handshake->pNext = m_pHandshakes;
+    if (m_pHandshakes)
+        m_pHandshakes->pPrev = handshake;
+    m_pHandshakes = handshake;
+    if (m_handshakeCount++ == 0)
+        ::ResetEvent(m_hEventIdle);
+    ::LeaveCriticalSection(&m_csHandshakes);
+
+    auto hr = StartHandshakeIo(handshake);
+    if (FAILED(hr))
+        FinishHandshake(nullptr, handshake, hr);
+    // the result is passed to CompleteAcceptedSocket
+    return E_PENDING;
+}
+
+_Use_decl_annotations_
+HRESULT CygwinSockFileListener::StartHandshakeIo(Handshake* handshake)
+{
+    WSABUF buf;
+    buf.buf = reinterpret_cast<char*>(handshake->data) + handshake->offset;
+    buf.len = handshake->size - handshake->offset;
+    ::ResetEvent(handshake->ol.hEvent);
+
+    // post the I/O under the lock so that CancelHandshakes does not miss it
+    HRESULT hr = S_OK;
+    ::EnterCriticalSection(&m_csHandshakes);
+    if (m_isClosing)
+        hr = E_ABORT;
+    else
     {
-        return GetLastWSAErrorAsHResult();
+        int r;
+        if (handshake->state == HandshakeState::ReadSecret || handshake->state == HandshakeState::ReadCredentials)
+        {
+            DWORD flags = 0;
+            r = ::WSARecv(handshake->sock, &buf, 1, nullptr, &flags, &handshake->ol, nullptr);
+        }
+        else
+        {
+            r = ::WSASend(handshake->sock, &buf, 1, nullptr, 0, &handshake->ol, nullptr);
+        }
+        if (r == SOCKET_ERROR && ::WSAGetLastError() != WSA_IO_PENDING)
+            hr = GetLastWSAErrorAsHResult();
     }
+    ::LeaveCriticalSection(&m_csHandshakes);
+    if (FAILED(hr))
+        return hr;
+
+    // (the event is signaled even if the I/O has completed immediately)
+    ::SetThreadpoolWait(handshake->wait, handshake->ol.hEvent, &handshake->deadline);
+    return S_OK;
+}
 
-    // retrieve client info
-    static_assert(sizeof(recvData) > sizeof(DWORD) * 3, "Unexpected");
-    len = ::recvTimeout(sock, reinterpret_cast<char*>(recvData), sizeof(DWORD) * 3, 0, 3000);
-    if (len == SOCKET_ERROR)
+_Use_decl_annotations_
+void CALLBACK CygwinSockFileListener::HandshakeCallback(
+    PTP_CALLBACK_INSTANCE instance,
+    PVOID context,
+    PTP_WAIT wait,
+    TP_WAIT_RESULT waitResult
+)
+{
+    auto handshake = static_cast<Handshake*>(context);
+    auto pThis = handshake->pThis;
+
+    DWORD transferred = 0;
+    DWORD flags = 0;
+    if (waitResult == WAIT_TIMEOUT)
+    {
+        // cancel and wait for the I/O to release the buffer
+        ::CancelIoEx(reinterpret_cast<HANDLE>(handshake->sock), &handshake->ol);
+        ::WSAGetOverlappedResult(handshake->sock, &handshake->ol, &transferred, TRUE, &flags);
+        pThis->FinishHandshake(instance, handshake, HRESULT_FROM_WIN32(ERROR_TIMEOUT));
+        return;
+    }
+    if (!::WSAGetOverlappedResult(handshake->sock, &handshake->ol, &transferred, FALSE, &flags))
     {
-        return GetLastWSAErrorAsHResult();
+        pThis->FinishHandshake(instance, handshake, GetLastWSAErrorAsHResult());
+        return;
     }
-    // (second, the cygwin-based client must send three DWORD data [pid, uid, gid])
-    if (len < sizeof(DWORD) * 3)
+    if (transferred == 0)
     {
-        // invalid data received or no data available
-        return S_FALSE;
+        // the client closed the connection before the handshake finished
+        pThis->FinishHandshake(instance, handshake, S_FALSE);
+        return;
     }
-    // send my [pid, uid, gid]
-    // (reuse uid and gid)
-    recvData[0] = ::GetProcessId(::GetCurrentProcess());
-    if (::send(sock, reinterpret_cast<char*>(recvData), sizeof(DWORD) * 3, 0) == SOCKET_ERROR)
+    handshake->offset += transferred;
+    if (handshake->offset == handshake->size)
     {
-        return GetLastWSAErrorAsHResult();
+        handshake->offset = 0;
+        switch (handshake->state)
+        {
+            case HandshakeState::ReadSecret:
+                if (memcmp(handshake->data, pThis->m_idSocket, sizeof(pThis->m_idSocket)) != 0)
+                {
+                    // invalid data received
+                    pThis->FinishHandshake(instance, handshake, S_FALSE);
+                    return;
+                }
+                // send back the received data as is
+                handshake->state = HandshakeState::WriteSecret;
+                break;
+            case HandshakeState::WriteSecret:
+                // (second, the cygwin-based client must send three DWORD data [pid, uid, gid])
+                handshake->state = HandshakeState::ReadCredentials;
+                handshake->size = sizeof(DWORD) * 3;
+                break;
+            case HandshakeState::ReadCredentials:
+                // send my [pid, uid, gid]
+                // (reuse uid and gid)
+                handshake->data[0] = ::GetProcessId(::GetCurrentProcess());
+                handshake->state = HandshakeState::WriteCredentials;
+                break;
+            case HandshakeState::WriteCredentials:
+            default:
+                // all done
+                pThis->FinishHandshake(instance, handshake, S_OK);
+                return;
+        }
     }
+    auto hr = pThis->StartHandshakeIo(handshake);
+    if (FAILED(hr))
+        pThis->FinishHandshake(instance, handshake, hr);
+}
 
-    // all done
-    return S_OK;
+_Use_decl_annotations_
+void CygwinSockFileListener::FinishHandshake(PTP_CALLBACK_INSTANCE instance, Handshake* handshake, HRESULT hr)
+{
+    ::EnterCriticalSection(&m_csHandshakes);
+    if (handshake->pPrev)
+        handshake->pPrev->pNext = handshake->pNext;
+    else
+        m_pHandshakes = handshake->pNext;
+    if (handshake->pNext)
+        handshake->pNext->pPrev = handshake->pPrev;
+    ::LeaveCriticalSection(&m_csHandshakes);
+
+    auto sock = handshake->sock;
+    // (may be called from the callback of the wait itself)
+    ::CloseThreadpoolWait(handshake->wait);
+    ::CloseHandle(handshake->ol.hEvent);
+    free(handshake);
+
+    CompleteAcceptedSocket(sock, hr);
+
+    ::EnterCriticalSection(&m_csHandshakes);
+    if (--m_handshakeCount == 0)
+    {
+        if (instance)
+            ::SetEventWhenCallbackReturns(instance, m_hEventIdle);
+        else
+            ::SetEvent(m_hEventIdle);
+    }
+    ::LeaveCriticalSection(&m_csHandshakes);
+}
+
+void CygwinSockFileListener::CancelHandshakes()
+{
+    if (!m_hEventIdle)
+        return;
+    ::EnterCriticalSection(&m_csHandshakes);
+    m_isClosing = true;
+    // the callbacks finish the handshakes with the aborted I/O
+    for (auto p = m_pHandshakes; p; p = p->pNext)
+        ::CancelIoEx(reinterpret_cast<HANDLE>(p->sock), &p->ol);
+    ::LeaveCriticalSection(&m_csHandshakes);
+    ::WaitForSingleObject(m_hEventIdle, INFINITE);
 }
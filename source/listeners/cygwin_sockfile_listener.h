@@ -6,7 +6,7 @@ class CygwinSockFileListener : public SocketListener
 {
 public:
     CygwinSockFileListener();
-    virtual ~CygwinSockFileListener() { Close(); }
+    virtual ~CygwinSockFileListener();
 
     _Check_return_
     HRESULT InitializeSocket(
@@ -17,10 +17,32 @@ public:
     virtual void Close();
 
 protected:
+    // Starts the handshake asynchronously and returns E_PENDING
     _Check_return_
     virtual HRESULT CheckAcceptedSocket(_In_ SOCKET socket);
 
+private:
+    struct Handshake;
+
+    _Check_return_
+    HRESULT StartHandshakeIo(_Inout_ Handshake* handshake);
+    void FinishHandshake(_In_opt_ PTP_CALLBACK_INSTANCE instance, _In_ Handshake* handshake, _In_ HRESULT hr);
+    void CancelHandshakes();
+    static void CALLBACK HandshakeCallback(
+        _Inout_ PTP_CALLBACK_INSTANCE instance,
+        _Inout_opt_ PVOID context,
+        _Inout_ PTP_WAIT wait,
+        _In_ TP_WAIT_RESULT waitResult
+    );
+
 private:
     DWORD m_idSocket[4];
     WCHAR* m_pszSocketFile;
+    // handshakes in progress (guarded by m_csHandshakes)
+    CRITICAL_SECTION m_csHandshakes;
+    Handshake* m_pHandshakes;
+    DWORD m_handshakeCount;
+    bool m_isClosing;
+    // signaled when no handshake is in progress
+    HANDLE m_hEventIdle;
 };
@@ -2,31 +2,61 @@
 
 #include "namedpipe_listener.h"
 
-#include "../util/event_handler.h"
+#include "../logger/logger.h"
 #include "../duplex/pipe_duplex.h"
 
+// interval to retry creating the pipe of the instance after the failure
+constexpr DWORD PIPE_INSTANCE_RETRY_INTERVAL = 1000;
+
+struct NamedPipeListener::PipeInstance
+{
+    NamedPipeListener* pThis;
+    // (hEvent is used for the wait)
+    OVERLAPPED ol;
+    // the pipe waiting for the client (INVALID_HANDLE_VALUE if not waiting)
+    HANDLE hPipe;
+    // true if the client has connected before ConnectNamedPipe
+    bool isConnected;
+    // true if the wait is the timer to retry ConnectInstance
+    bool isRetrying;
+    PTP_WAIT wait;
+};
+
+// aborts ConnectNamedPipe and closes the pipe
+static void ClosePendingPipe(_In_ HANDLE hPipe, _Inout_ OVERLAPPED* ol)
+{
+    // wait for the abort so that the system does not write to ol after returning
+    ::CancelIoEx(hPipe, ol);
+    DWORD dw = 0;
+    ::GetOverlappedResult(hPipe, ol, &dw, TRUE);
+    ::CloseHandle(hPipe);
+}
+
 NamedPipeListener::NamedPipeListener()
-    : m_hPipeCurrent(INVALID_HANDLE_VALUE)
-    , m_hEvent(INVALID_HANDLE_VALUE)
-    , m_pszPipeName(nullptr)
+    : m_pszPipeName(nullptr)
     , m_pfnOnAccept(nullptr)
     , m_callbackData(nullptr)
+    , m_instanceCount(NAMED_PIPE_LISTENER_DEFAULT_INSTANCES)
+    , m_maxInstanceCount(NAMED_PIPE_LISTENER_DEFAULT_MAX_INSTANCES)
+    , m_bufferSize(NAMED_PIPE_LISTENER_DEFAULT_BUFFER_SIZE)
+    , m_instances(nullptr)
+    , m_isClosing(false)
+    , m_activeCount(0)
+    , m_waitingCount(0)
 {
+    ::InitializeCriticalSection(&m_csInstances);
+}
+
+NamedPipeListener::~NamedPipeListener()
+{
+    NamedPipeListener::Close();
+    ::DeleteCriticalSection(&m_csInstances);
 }
 
 void NamedPipeListener::Close()
 {
-    if (m_hPipeCurrent != INVALID_HANDLE_VALUE)
-    {
-        ::CloseHandle(m_hPipeCurrent);
-        m_hPipeCurrent = INVALID_HANDLE_VALUE;
-    }
-    if (m_hEvent != INVALID_HANDLE_VALUE)
-    {
-        UnregisterEventHandler(m_hEvent);
-        ::CloseHandle(m_hEvent);
-        m_hEvent = INVALID_HANDLE_VALUE;
-    }
+    // (also waits for the handshakes and accept handlers in progress)
+    StopInstances();
     if (m_pszPipeName)
     {
         free(m_pszPipeName);
@@ -36,6 +66,22 @@ void NamedPipeListener::Close()
     m_callbackData = nullptr;
 }
 
+_Use_decl_annotations_
+void NamedPipeListener::SetInstanceOptions(DWORD instanceCount, DWORD maxInstanceCount, DWORD bufferSize)
+{
+    if (maxInstanceCount < 1)
+        maxInstanceCount = 1;
+    else if (maxInstanceCount > NAMED_PIPE_LISTENER_MAX_INSTANCES)
+        maxInstanceCount = NAMED_PIPE_LISTENER_MAX_INSTANCES;
+    if (instanceCount < 1)
+        instanceCount = 1;
+    else if (instanceCount > maxInstanceCount)
+        instanceCount = maxInstanceCount;
+    m_instanceCount = instanceCount;
+    m_maxInstanceCount = maxInstanceCount;
+    m_bufferSize = bufferSize;
+}
+
 _Use_decl_annotations_
 HRESULT NamedPipeListener::Initialize(
     PCWSTR pszPipeName,
@@ -43,60 +89,114 @@ HRESULT NamedPipeListener::Initialize(
     void* callbackData
 )
 {
-    if (m_hPipeCurrent != INVALID_HANDLE_VALUE)
+    if (m_instances)
         return S_OK;
 
     auto pszPipeNameDup = _wcsdup(pszPipeName);
     if (!pszPipeNameDup)
         return E_OUTOFMEMORY;
+    auto instances = static_cast<PipeInstance**>(calloc(m_maxInstanceCount, sizeof(PipeInstance*)));
+    if (!instances)
+    {
+        free(pszPipeNameDup);
+        return E_OUTOFMEMORY;
+    }
 
-    auto hEvent = ::CreateEventW(nullptr, TRUE, FALSE, nullptr);
-    if (!hEvent)
+    // (the callbacks may run as soon as the first instance is added)
+    m_pszPipeName = pszPipeNameDup;
+    m_pfnOnAccept = pfnOnAccept;
+    m_callbackData = callbackData;
+    m_isClosing = false;
+    m_activeCount = 0;
+    m_waitingCount = 0;
+    m_instances = instances;
+
+    for (DWORD i = 0; i < m_instanceCount; ++i)
+    {
+        auto hr = AddInstance();
+        if (FAILED(hr))
+        {
+            Close();
+            return hr;
+        }
+    }
+    return S_OK;
+}
+
+HRESULT NamedPipeListener::AddInstance()
+{
+    auto instance = static_cast<PipeInstance*>(calloc(1, sizeof(PipeInstance)));
+    if (!instance)
+        return E_OUTOFMEMORY;
+    instance->pThis = this;
+    instance->hPipe = INVALID_HANDLE_VALUE;
+    instance->ol.hEvent = ::CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    if (!instance->ol.hEvent)
     {
         auto err = ::GetLastError();
-        free(pszPipeNameDup);
+        free(instance);
+        return HRESULT_FROM_WIN32(err);
+    }
+    instance->wait = ::CreateThreadpoolWait(WaitCallback, instance, nullptr);
+    if (!instance->wait)
+    {
+        auto err = ::GetLastError();
+        ::CloseHandle(instance->ol.hEvent);
+        free(instance);
         return HRESULT_FROM_WIN32(err);
     }
 
-    HANDLE hPipe;
-    auto hr = _CreatePipe(pszPipeNameDup, hEvent, &hPipe);
-    if (FAILED(hr))
+    // add under the lock so that StopInstances does not miss the instance
+    HRESULT hr = S_OK;
+    ::EnterCriticalSection(&m_csInstances);
+    if (m_isClosing)
+        hr = E_ABORT;
+    else if (m_activeCount >= m_maxInstanceCount)
+        hr = S_FALSE;
+    else
+        m_instances[m_activeCount++] = instance;
+    ::LeaveCriticalSection(&m_csInstances);
+    if (hr != S_OK)
     {
-        ::CloseHandle(hEvent);
-        free(pszPipeNameDup);
+        ::CloseThreadpoolWait(instance->wait);
+        ::CloseHandle(instance->ol.hEvent);
+        free(instance);
         return hr;
     }
 
-    m_hPipeCurrent = hPipe;
-    m_pszPipeName = pszPipeNameDup;
-    m_hEvent = hEvent;
-    m_pfnOnAccept = pfnOnAccept;
-    m_callbackData = callbackData;
-    RegisterEventHandler(hEvent, NamedPipeListener::EventListener, this);
-    return S_OK;
+    // (the instance is released by StopInstances even if failed)
+    return ConnectInstance(instance);
 }
 
 _Use_decl_annotations_
-HRESULT NamedPipeListener::_CreatePipe(PCWSTR pszPipeName, HANDLE hEvent, HANDLE* outPipe)
+HRESULT NamedPipeListener::ConnectInstance(PipeInstance* instance)
 {
     auto hPipe = ::CreateNamedPipeW(
-        pszPipeName,
+        m_pszPipeName,
         PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED,
         PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT,
         PIPE_UNLIMITED_INSTANCES,
-        4096,
-        4096,
+        m_bufferSize,
+        m_bufferSize,
         0,
         nullptr
     );
     if (hPipe == INVALID_HANDLE_VALUE)
-        return HRESULT_FROM_WIN32(::GetLastError());
+    {
+        auto hr = HRESULT_FROM_WIN32(::GetLastError());
+        ScheduleRetry(instance);
+        return hr;
+    }
 
-    OVERLAPPED ol = { 0 };
-    ol.hEvent = hEvent;
-    if (::ConnectNamedPipe(hPipe, &ol))
+    auto hEvent = instance->ol.hEvent;
+    ZeroMemory(&instance->ol, sizeof(instance->ol));
+    instance->ol.hEvent = hEvent;
+    ::ResetEvent(hEvent);
+    instance->isConnected = false;
+    if (::ConnectNamedPipe(hPipe, &instance->ol))
     {
         // (may not reach here)
+        instance->isConnected = true;
         ::SetEvent(hEvent);
     }
     else
@@ -105,55 +205,153 @@ HRESULT NamedPipeListener::_CreatePipe(PCWSTR pszPipeName, HANDLE hEvent, HANDLE
         if (err == ERROR_PIPE_CONNECTED)
         {
             // already connected, so set event signaled
+            instance->isConnected = true;
             ::SetEvent(hEvent);
         }
         else if (err != ERROR_IO_PENDING)
         {
             ::CloseHandle(hPipe);
+            ScheduleRetry(instance);
             return HRESULT_FROM_WIN32(err);
         }
     }
 
-    *outPipe = hPipe;
-    return S_OK;
+    // start waiting under the lock so that StopInstances does not miss the wait
+    HRESULT hr = S_OK;
+    ::EnterCriticalSection(&m_csInstances);
+    if (m_isClosing)
+        hr = E_ABORT;
+    else
+    {
+        instance->hPipe = hPipe;
+        ++m_waitingCount;
+        ::SetThreadpoolWait(instance->wait, hEvent, nullptr);
+    }
+    ::LeaveCriticalSection(&m_csInstances);
+    if (FAILED(hr))
+        ClosePendingPipe(hPipe, &instance->ol);
+    return hr;
 }
 
 _Use_decl_annotations_
-void CALLBACK NamedPipeListener::EventListener(void* data)
+void NamedPipeListener::ScheduleRetry(PipeInstance* instance)
 {
-    auto pThis = static_cast<NamedPipeListener*>(data);
-    ::ResetEvent(pThis->m_hEvent);
+    // (the event is not signaled, so the wait finishes with the timeout)
+    ::ResetEvent(instance->ol.hEvent);
+    // (negative for the relative time, in 100-nanosecond units)
+    LARGE_INTEGER timeout;
+    timeout.QuadPart = -static_cast<LONGLONG>(PIPE_INSTANCE_RETRY_INTERVAL) * 10000;
+    FILETIME ftTimeout;
+    ftTimeout.dwLowDateTime = timeout.LowPart;
+    ftTimeout.dwHighDateTime = static_cast<DWORD>(timeout.HighPart);
 
-    auto hPipeToUse = pThis->m_hPipeCurrent;
+    // start waiting under the lock so that StopInstances does not miss the wait
+    ::EnterCriticalSection(&m_csInstances);
+    if (!m_isClosing)
+    {
+        instance->isRetrying = true;
+        ::SetThreadpoolWait(instance->wait, instance->ol.hEvent, &ftTimeout);
+    }
+    ::LeaveCriticalSection(&m_csInstances);
+}
 
-    PipeDuplex* duplex = nullptr;
-    auto hr = pThis->CheckConnectedPipe(hPipeToUse);
-    if (FAILED(hr))
+void NamedPipeListener::StopInstances()
+{
+    if (!m_instances)
+        return;
+    ::EnterCriticalSection(&m_csInstances);
+    m_isClosing = true;
+    auto count = m_activeCount;
+    ::LeaveCriticalSection(&m_csInstances);
+
+    // stop the waits first, and then wait for the callbacks (and the accept handlers)
+    for (DWORD i = 0; i < count; ++i)
+        ::SetThreadpoolWait(m_instances[i]->wait, nullptr, nullptr);
+    for (DWORD i = 0; i < count; ++i)
+        ::WaitForThreadpoolWaitCallbacks(m_instances[i]->wait, FALSE);
+
+    for (DWORD i = 0; i < count; ++i)
     {
-        // TODO: error
-        ::CloseHandle(hPipeToUse);
+        auto instance = m_instances[i];
+        if (instance->hPipe != INVALID_HANDLE_VALUE)
+            ClosePendingPipe(instance->hPipe, &instance->ol);
+        ::CloseThreadpoolWait(instance->wait);
+        ::CloseHandle(instance->ol.hEvent);
+        free(instance);
     }
-    else
+    free(m_instances);
+    m_instances = nullptr;
+    m_activeCount = 0;
+    m_waitingCount = 0;
+}
+
+_Use_decl_annotations_
+void CALLBACK NamedPipeListener::WaitCallback(
+    PTP_CALLBACK_INSTANCE callbackInstance,
+    PVOID context,
+    PTP_WAIT wait,
+    TP_WAIT_RESULT waitResult
+)
+{
+    UNREFERENCED_PARAMETER(wait);
+    UNREFERENCED_PARAMETER(waitResult);
+    auto instance = static_cast<PipeInstance*>(context);
+    auto pThis = instance->pThis;
+    if (instance->isRetrying)
     {
-        duplex = new PipeDuplex(hPipeToUse, hPipeToUse);
-        if (!duplex)
-        {
-            // TODO: error
-        }
+        // (ConnectInstance schedules the retry again if failed)
+        instance->isRetrying = false;
+        if (SUCCEEDED(pThis->ConnectInstance(instance)))
+            AddLogFormatted(LogLevel::Info, L"[pipe-listener] Re-created pipe instance");
+        return;
+    }
+    auto hPipe = instance->hPipe;
+    instance->hPipe = INVALID_HANDLE_VALUE;
+
+    DWORD dw = 0;
+    auto isConnected = instance->isConnected || ::GetOverlappedResult(hPipe, &instance->ol, &dw, FALSE);
+
+    ::EnterCriticalSection(&pThis->m_csInstances);
+    --pThis->m_waitingCount;
+    // grow if no other instance is waiting, so that parallel clients do not see busy pipes
+    auto shouldGrow = !pThis->m_isClosing && pThis->m_waitingCount == 0 &&
+        pThis->m_activeCount < pThis->m_maxInstanceCount;
+    ::LeaveCriticalSection(&pThis->m_csInstances);
+
+    // renew the pipe first, so that the next client is connected during the handshake
+    // (even if failed to connect)
+    auto hr = pThis->ConnectInstance(instance);
+    if (FAILED(hr) && hr != E_ABORT)
+        AddLogFormatted(LogLevel::Error, L"[pipe-listener] Failed to create pipe instance (will retry): [0x%08lX]", hr);
+    if (shouldGrow)
+    {
+        hr = pThis->AddInstance();
+        if (FAILED(hr) && hr != E_ABORT)
+            AddLogFormatted(LogLevel::Error, L"[pipe-listener] Failed to add pipe instance (will retry): [0x%08lX]", hr);
+    }
+
+    if (!isConnected)
+    {
+        // the client has gone before connected
+        ::CloseHandle(hPipe);
+        return;
     }
 
-    // renew pipe to new connection
-    // (even if failed to create duplex)
-    HANDLE hPipeNew;
-    hr = pThis->_CreatePipe(pThis->m_pszPipeName, pThis->m_hEvent, &hPipeNew);
+    // the handshake may wait for the client
+    ::CallbackMayRunLong(callbackInstance);
+    hr = pThis->CheckConnectedPipe(hPipe);
     if (FAILED(hr))
     {
         // TODO: error
-        pThis->Close();
+        ::CloseHandle(hPipe);
         return;
     }
-    pThis->m_hPipeCurrent = hPipeNew;
-
-    if (duplex)
-        pThis->m_pfnOnAccept(duplex, pThis->m_callbackData);
+    auto duplex = new PipeDuplex(hPipe, hPipe);
+    if (!duplex)
+    {
+        // TODO: error
+        ::CloseHandle(hPipe);
+        return;
+    }
+    pThis->m_pfnOnAccept(duplex, pThis->m_callbackData);
 }
@@ -2,14 +2,30 @@
 
 #include "listener.h"
 
+// the maximum count of pipe instances kept by NamedPipeListener
+constexpr DWORD NAMED_PIPE_LISTENER_MAX_INSTANCES = 64;
+// the count of pipe instances created on initializing by default
+constexpr DWORD NAMED_PIPE_LISTENER_DEFAULT_INSTANCES = 2;
+// the count of pipe instances that the listener can grow to under load by default
+constexpr DWORD NAMED_PIPE_LISTENER_DEFAULT_MAX_INSTANCES = 16;
+// the input/output buffer size of each pipe instance by default
+constexpr DWORD NAMED_PIPE_LISTENER_DEFAULT_BUFFER_SIZE = 4096;
+// the maximum input/output buffer size of each pipe instance
+constexpr DWORD NAMED_PIPE_LISTENER_MAX_BUFFER_SIZE = 1024 * 1024;
+
 class NamedPipeListener : public Listener
 {
 public:
     NamedPipeListener();
-    virtual ~NamedPipeListener() { Close(); }
+    virtual ~NamedPipeListener();
 
     virtual void Close();
 
+    // Sets the count of pipe instances waiting for clients on initializing, the count the listener
+    // can grow to when all instances are taken, and the input/output buffer size of each instance;
+    // must be called before initializing
+    void SetInstanceOptions(_In_ DWORD instanceCount, _In_ DWORD maxInstanceCount, _In_ DWORD bufferSize);
+
     _Check_return_
     HRESULT Initialize(
         _In_z_ PCWSTR pszPipeName,
@@ -23,17 +39,41 @@ protected:
     {
         return S_OK;
     }
-    _Check_return_
-    static HRESULT _CreatePipe(_In_z_ PCWSTR pszPipeName, _In_ HANDLE hEvent, _When_(SUCCEEDED(return), _Out_) HANDLE* outPipe);
+    bool IsListening() const { return m_instances != nullptr; }
 
 private:
-    static void CALLBACK EventListener(_In_ void* data);
+    struct PipeInstance;
+
+    // creates a new instance and starts waiting for the client (S_FALSE if the count has reached the maximum)
+    _Check_return_
+    HRESULT AddInstance();
+    // creates the pipe of the instance and starts waiting for the client
+    // (if failed, retried by the wait of the instance after PIPE_INSTANCE_RETRY_INTERVAL)
+    _Check_return_
+    HRESULT ConnectInstance(_Inout_ PipeInstance* instance);
+    // arms the wait of the instance as the timer to retry ConnectInstance
+    void ScheduleRetry(_Inout_ PipeInstance* instance);
+    void StopInstances();
+    static void CALLBACK WaitCallback(
+        _Inout_ PTP_CALLBACK_INSTANCE callbackInstance,
+        _Inout_opt_ PVOID context,
+        _Inout_ PTP_WAIT wait,
+        _In_ TP_WAIT_RESULT waitResult
+    );
 
-protected:
-    HANDLE m_hPipeCurrent;
 private:
-    HANDLE m_hEvent;
     PWSTR m_pszPipeName;
     PAcceptHandler m_pfnOnAccept;
     void* m_callbackData;
+    DWORD m_instanceCount;
+    DWORD m_maxInstanceCount;
+    DWORD m_bufferSize;
+    // (m_maxInstanceCount items; the first m_activeCount items are used)
+    PipeInstance** m_instances;
+    // guards m_isClosing, m_activeCount, and m_waitingCount
+    CRITICAL_SECTION m_csInstances;
+    bool m_isClosing;
+    DWORD m_activeCount;
+    // count of instances waiting for clients
+    DWORD m_waitingCount;
 };
@@ -3,74 +3,190 @@
 
 #include "socket_listener_base.h"
 
-#include "../util/event_handler.h"
+#include "../logger/logger.h"
 #include "../duplex/socket_duplex.h"
 
+// the size of each address written by AcceptEx (must be 16 bytes more than the maximum address size)
+constexpr DWORD ACCEPT_ADDRESS_LENGTH = sizeof(SOCKADDR_STORAGE) + 16;
+// interval to retry posting the accept after the failure
+constexpr DWORD ACCEPT_RETRY_INTERVAL = 1000;
+
+struct SocketListener::PendingAccept
+{
+    OVERLAPPED ol;
+    SocketListener* pThis;
+    // the timer to retry PostAccept after the failure
+    PTP_TIMER timer;
+    // the socket passed to AcceptEx (INVALID_SOCKET if not posted)
+    SOCKET sock;
+    // local and remote addresses written by AcceptEx
+    BYTE addresses[ACCEPT_ADDRESS_LENGTH * 2];
+};
+
 SocketListener::SocketListener()
     : m_socket(INVALID_SOCKET)
     , m_hEvent(nullptr)
+    , m_wait(nullptr)
     , m_pfnOnAccept(nullptr)
     , m_callbackData(nullptr)
+    , m_pendingAcceptCount(0)
+    , m_io(nullptr)
+    , m_pfnAcceptEx(nullptr)
+    , m_pfnDisconnectEx(nullptr)
+    , m_protocolInfo{}
+    , m_accepts(nullptr)
+    , m_isClosing(false)
+    , m_recycledSockets(nullptr)
+    , m_recycledCount(0)
 {
+    ::InitializeCriticalSection(&m_csAccepts);
+}
+
+SocketListener::~SocketListener()
+{
+    SocketListener::Close();
+    ::DeleteCriticalSection(&m_csAccepts);
 }
 
 void SocketListener::Close()
 {
+    // (the wait callback does not re-arm the wait after this)
+    ::EnterCriticalSection(&m_csAccepts);
+    m_isClosing = true;
+    ::LeaveCriticalSection(&m_csAccepts);
+    StopAccepts();
     if (m_socket != INVALID_SOCKET)
     {
         ::closesocket(m_socket);
         m_socket = INVALID_SOCKET;
     }
     _Analysis_assume_(m_socket == INVALID_SOCKET);
+    if (m_wait != nullptr)
+    {
+        ::SetThreadpoolWait(m_wait, nullptr, nullptr);
+        ::WaitForThreadpoolWaitCallbacks(m_wait, TRUE);
+        ::CloseThreadpoolWait(m_wait);
+        m_wait = nullptr;
+    }
     if (m_hEvent != nullptr)
     {
-        UnregisterEventHandler(m_hEvent);
         ::CloseHandle(m_hEvent);
         m_hEvent = nullptr;
     }
     _Analysis_assume_(m_hEvent == nullptr);
+    // wait for the handshakes and accept handlers in progress
+    m_executor.Shutdown();
 }
 
 _Use_decl_annotations_
 HRESULT SocketListener::InitSocketImpl(SOCKET sock, PAcceptHandler pfnOnAccept, void* callbackData)
 {
+    if (m_pendingAcceptCount > 0)
+    {
+        m_socket = sock;
+        m_pfnOnAccept = pfnOnAccept;
+        m_callbackData = callbackData;
+        auto hr = StartAccepts();
+        if (FAILED(hr))
+        {
+            // (the caller closes the socket)
+            m_socket = INVALID_SOCKET;
+            return hr;
+        }
+        return S_OK;
+    }
+
     auto hEvent = ::CreateEventW(nullptr, TRUE, FALSE, nullptr);
     if (hEvent == nullptr)
         return HRESULT_FROM_WIN32(::GetLastError());
+    auto hr = m_executor.Initialize();
+    if (FAILED(hr))
+    {
+        ::CloseHandle(hEvent);
+        return hr;
+    }
+    // accept in the thread pool, so that the window thread does only UI work
+    auto wait = ::CreateThreadpoolWait(AcceptWaitCallback, this, nullptr);
+    if (!wait)
+    {
+        auto err = ::GetLastError();
+        ::CloseHandle(hEvent);
+        return HRESULT_FROM_WIN32(err);
+    }
     if (::WSAEventSelect(sock, hEvent, FD_ACCEPT) == SOCKET_ERROR)
     {
+        hr = GetLastWSAErrorAsHResult();
+        ::CloseThreadpoolWait(wait);
         ::CloseHandle(hEvent);
-        return GetLastWSAErrorAsHResult();
+        return hr;
     }
     m_socket = sock;
     m_hEvent = hEvent;
+    m_wait = wait;
     m_pfnOnAccept = pfnOnAccept;
     m_callbackData = callbackData;
-    RegisterEventHandler(m_hEvent, SocketListener::EventHandler, this);
+    m_isClosing = false;
+    ::SetThreadpoolWait(m_wait, m_hEvent, nullptr);
     return S_OK;
 }
 
+namespace
+{
+    struct AcceptWorkData
+    {
+        SocketListener* pThis;
+        SOCKET sock;
+    };
+}
+
 _Use_decl_annotations_
-void SocketListener::EventHandler(void* data)
+void CALLBACK SocketListener::AcceptWaitCallback(PTP_CALLBACK_INSTANCE instance, PVOID context, PTP_WAIT wait, TP_WAIT_RESULT waitResult)
 {
-    SocketListener* pThis = static_cast<SocketListener*>(data);
+    UNREFERENCED_PARAMETER(instance);
+    UNREFERENCED_PARAMETER(waitResult);
+    auto pThis = static_cast<SocketListener*>(context);
     ::ResetEvent(pThis->m_hEvent);
+    pThis->DrainBacklog();
 
-    auto sock = ::accept(pThis->m_socket, nullptr, nullptr);
-    if (sock == INVALID_SOCKET)
-    {
-        return;
-    }
+    // re-arm under the lock so that Close does not miss the wait
+    ::EnterCriticalSection(&pThis->m_csAccepts);
+    if (!pThis->m_isClosing)
+        ::SetThreadpoolWait(wait, pThis->m_hEvent, nullptr);
+    ::LeaveCriticalSection(&pThis->m_csAccepts);
+}
 
-    if (pThis->m_pfnOnAccept)
+void SocketListener::DrainBacklog()
+{
+    // drain the backlog (the listening socket is non-blocking due to WSAEventSelect)
+    while (true)
     {
-        // reset m_hEvent
-        ::WSAEventSelect(sock, pThis->m_hEvent, 0);
-        auto hr = pThis->CheckAcceptedSocket(sock);
-        if (SUCCEEDED(hr))
+        auto sock = ::accept(m_socket, nullptr, nullptr);
+        if (sock == INVALID_SOCKET)
+        {
+            return;
+        }
+
+        if (m_pfnOnAccept)
         {
-            auto duplex = new SocketDuplex(sock);
-            pThis->m_pfnOnAccept(duplex, pThis->m_callbackData);
+            // reset m_hEvent
+            ::WSAEventSelect(sock, m_hEvent, 0);
+            // the accepted socket inherits the non-blocking mode from WSAEventSelect;
+            // make it blocking for send/WSASend in Write/WriteBuffers
+            u_long nonBlocking = 0;
+            ::ioctlsocket(sock, FIONBIO, &nonBlocking);
+
+            // the handshake may wait for the client, so do not block draining the backlog
+            auto work = static_cast<AcceptWorkData*>(malloc(sizeof(AcceptWorkData)));
+            if (work)
+            {
+                work->pThis = this;
+                work->sock = sock;
+                if (SUCCEEDED(m_executor.Submit(SocketListener::AcceptWork, work)))
+                    continue;
+                free(work);
+            }
+            // TODO: notify error
+            ::closesocket(sock);
         }
         else
         {
@@ -78,9 +194,300 @@ void SocketListener::EventHandler(void* data)
             ::closesocket(sock);
         }
     }
+}
+
+_Use_decl_annotations_
+void SocketListener::AcceptWork(void* context)
+{
+    auto work = static_cast<AcceptWorkData*>(context);
+    auto pThis = work->pThis;
+    auto sock = work->sock;
+    free(work);
+
+    auto hr = pThis->CheckAcceptedSocket(sock);
+    if (hr == E_PENDING)
+        return;
+    pThis->CompleteAcceptedSocket(sock, hr);
+}
+
+_Use_decl_annotations_
+void SocketListener::CompleteAcceptedSocket(SOCKET sock, HRESULT hr)
+{
+    // S_FALSE means that the client is rejected
+    if (hr == S_OK)
+    {
+        auto duplex = new SocketDuplex(sock);
+        if (!duplex)
+        {
+            ::closesocket(sock);
+            return;
+        }
+        m_pfnOnAccept(duplex, m_callbackData);
+    }
     else
     {
         // TODO: notify error
+        if (!RecycleSocket(sock))
+            ::closesocket(sock);
+    }
+}
+
+HRESULT SocketListener::StartAccepts()
+{
+    int len = sizeof(m_protocolInfo);
+    if (::getsockopt(m_socket, SOL_SOCKET, SO_PROTOCOL_INFOW, reinterpret_cast<char*>(&m_protocolInfo), &len) == SOCKET_ERROR)
+        return GetLastWSAErrorAsHResult();
+    GUID guidAcceptEx = WSAID_ACCEPTEX;
+    DWORD dw = 0;
+    if (::WSAIoctl(m_socket, SIO_GET_EXTENSION_FUNCTION_POINTER, &guidAcceptEx, sizeof(guidAcceptEx),
+        &m_pfnAcceptEx, sizeof(m_pfnAcceptEx), &dw, nullptr, nullptr) == SOCKET_ERROR)
+    {
+        return GetLastWSAErrorAsHResult();
+    }
+    // (optional; sockets of failed handshakes are closed if not available)
+    GUID guidDisconnectEx = WSAID_DISCONNECTEX;
+    if (::WSAIoctl(m_socket, SIO_GET_EXTENSION_FUNCTION_POINTER, &guidDisconnectEx, sizeof(guidDisconnectEx),
+        &m_pfnDisconnectEx, sizeof(m_pfnDisconnectEx), &dw, nullptr, nullptr) == SOCKET_ERROR)
+    {
+        m_pfnDisconnectEx = nullptr;
+    }
+
+    auto accepts = static_cast<PendingAccept*>(calloc(m_pendingAcceptCount, sizeof(PendingAccept)));
+    if (!accepts)
+        return E_OUTOFMEMORY;
+    auto recycledSockets = static_cast<SOCKET*>(malloc(sizeof(SOCKET) * m_pendingAcceptCount));
+    if (!recycledSockets)
+    {
+        free(accepts);
+        return E_OUTOFMEMORY;
+    }
+    for (DWORD i = 0; i < m_pendingAcceptCount; ++i)
+    {
+        accepts[i].pThis = this;
+        accepts[i].sock = INVALID_SOCKET;
+        accepts[i].timer = ::CreateThreadpoolTimer(RetryCallback, &accepts[i], nullptr);
+        if (!accepts[i].timer)
+        {
+            auto err = ::GetLastError();
+            while (i-- > 0)
+                ::CloseThreadpoolTimer(accepts[i].timer);
+            free(recycledSockets);
+            free(accepts);
+            return HRESULT_FROM_WIN32(err);
+        }
+    }
+    auto io = ::CreateThreadpoolIo(reinterpret_cast<HANDLE>(m_socket), AcceptCompletion, this, nullptr);
+    if (!io)
+    {
+        auto err = ::GetLastError();
+        for (DWORD i = 0; i < m_pendingAcceptCount; ++i)
+            ::CloseThreadpoolTimer(accepts[i].timer);
+        free(recycledSockets);
+        free(accepts);
+        return HRESULT_FROM_WIN32(err);
+    }
+    m_accepts = accepts;
+    m_recycledSockets = recycledSockets;
+    m_recycledCount = 0;
+    m_isClosing = false;
+    m_io = io;
+
+    for (DWORD i = 0; i < m_pendingAcceptCount; ++i)
+    {
+        auto hr = PostAccept(&accepts[i]);
+        if (FAILED(hr))
+        {
+            StopAccepts();
+            return hr;
+        }
+    }
+    return S_OK;
+}
+
+_Use_decl_annotations_
+HRESULT SocketListener::PostAccept(PendingAccept* accept)
+{
+    auto sock = INVALID_SOCKET;
+    ::EnterCriticalSection(&m_csAccepts);
+    if (m_isClosing)
+    {
+        ::LeaveCriticalSection(&m_csAccepts);
+        return E_ABORT;
+    }
+    if (m_recycledCount > 0)
+        sock = m_recycledSockets[--m_recycledCount];
+    ::LeaveCriticalSection(&m_csAccepts);
+    if (sock == INVALID_SOCKET)
+    {
+        sock = ::WSASocketW(m_protocolInfo.iAddressFamily, m_protocolInfo.iSocketType, m_protocolInfo.iProtocol,
+            nullptr, 0, WSA_FLAG_OVERLAPPED);
+        if (sock == INVALID_SOCKET)
+            return GetLastWSAErrorAsHResult();
+    }
+
+    ZeroMemory(&accept->ol, sizeof(accept->ol));
+    accept->sock = sock;
+    // post under the lock so that StopAccepts does not miss the operation
+    HRESULT hr = S_OK;
+    ::EnterCriticalSection(&m_csAccepts);
+    if (m_isClosing)
+        hr = E_ABORT;
+    else
+    {
+        ::StartThreadpoolIo(m_io);
+        DWORD received = 0;
+        // (receives no data, so that the accept completes without waiting for the client)
+        if (!m_pfnAcceptEx(m_socket, sock, accept->addresses, 0, ACCEPT_ADDRESS_LENGTH, ACCEPT_ADDRESS_LENGTH,
+            &received, &accept->ol))
+        {
+            auto err = ::WSAGetLastError();
+            if (err != ERROR_IO_PENDING)
+            {
+                ::CancelThreadpoolIo(m_io);
+                hr = GetWSAErrorAsHResult(err);
+            }
+        }
+    }
+    ::LeaveCriticalSection(&m_csAccepts);
+    if (FAILED(hr))
+    {
+        accept->sock = INVALID_SOCKET;
         ::closesocket(sock);
     }
+    return hr;
+}
+
+_Use_decl_annotations_
+void SocketListener::ScheduleRetry(PendingAccept* accept)
+{
+    // (negative for the relative time, in 100-nanosecond units)
+    LARGE_INTEGER due;
+    due.QuadPart = -static_cast<LONGLONG>(ACCEPT_RETRY_INTERVAL) * 10000;
+    FILETIME ftDue;
+    ftDue.dwLowDateTime = due.LowPart;
+    ftDue.dwHighDateTime = static_cast<DWORD>(due.HighPart);
+
+    // start the timer under the lock so that StopAccepts does not miss the timer
+    ::EnterCriticalSection(&m_csAccepts);
+    if (!m_isClosing)
+        ::SetThreadpoolTimer(accept->timer, &ftDue, 0, 0);
+    ::LeaveCriticalSection(&m_csAccepts);
+}
+
+_Use_decl_annotations_
+void CALLBACK SocketListener::RetryCallback(PTP_CALLBACK_INSTANCE instance, PVOID context, PTP_TIMER timer)
+{
+    UNREFERENCED_PARAMETER(instance);
+    UNREFERENCED_PARAMETER(timer);
+    auto accept = static_cast<PendingAccept*>(context);
+    auto pThis = accept->pThis;
+    auto hr = pThis->PostAccept(accept);
+    if (SUCCEEDED(hr))
+        AddLogFormatted(LogLevel::Info, L"[socket-listener] Re-posted accept");
+    else if (hr != E_ABORT)
+        pThis->ScheduleRetry(accept);
+}
+
+void SocketListener::StopAccepts()
+{
+    if (!m_io)
+        return;
+    ::EnterCriticalSection(&m_csAccepts);
+    m_isClosing = true;
+    ::LeaveCriticalSection(&m_csAccepts);
+    // stop the retry timers (no more timers are started after m_isClosing is set)
+    for (DWORD i = 0; i < m_pendingAcceptCount; ++i)
+    {
+        ::SetThreadpoolTimer(m_accepts[i].timer, nullptr, 0, 0);
+        ::WaitForThreadpoolTimerCallbacks(m_accepts[i].timer, TRUE);
+        ::CloseThreadpoolTimer(m_accepts[i].timer);
+    }
+    // abort the pending AcceptEx and wait for their completion (and the accept handlers)
+    ::CancelIoEx(reinterpret_cast<HANDLE>(m_socket), nullptr);
+    ::WaitForThreadpoolIoCallbacks(m_io, FALSE);
+    ::CloseThreadpoolIo(m_io);
+    m_io = nullptr;
+
+    for (DWORD i = 0; i < m_pendingAcceptCount; ++i)
+    {
+        if (m_accepts[i].sock != INVALID_SOCKET)
+            ::closesocket(m_accepts[i].sock);
+    }
+    free(m_accepts);
+    m_accepts = nullptr;
+    for (DWORD i = 0; i < m_recycledCount; ++i)
+        ::closesocket(m_recycledSockets[i]);
+    free(m_recycledSockets);
+    m_recycledSockets = nullptr;
+    m_recycledCount = 0;
+}
+
+_Use_decl_annotations_
+bool SocketListener::RecycleSocket(SOCKET sock)
+{
+    if (!m_pfnDisconnectEx)
+        return false;
+    ::EnterCriticalSection(&m_csAccepts);
+    auto canRecycle = !m_isClosing && m_recycledCount < m_pendingAcceptCount;
+    ::LeaveCriticalSection(&m_csAccepts);
+    if (!canRecycle)
+        return false;
+    if (!m_pfnDisconnectEx(sock, nullptr, TF_REUSE_SOCKET, 0))
+        return false;
+    ::EnterCriticalSection(&m_csAccepts);
+    // (check again because the lock was released)
+    canRecycle = !m_isClosing && m_recycledCount < m_pendingAcceptCount;
+    if (canRecycle)
+        m_recycledSockets[m_recycledCount++] = sock;
+    ::LeaveCriticalSection(&m_csAccepts);
+    return canRecycle;
+}
+
+_Use_decl_annotations_
+void CALLBACK SocketListener::AcceptCompletion(
+    PTP_CALLBACK_INSTANCE instance,
+    PVOID context,
+    PVOID overlapped,
+    ULONG ioResult,
+    ULONG_PTR bytesTransferred,
+    PTP_IO io
+)
+{
+    UNREFERENCED_PARAMETER(bytesTransferred);
+    UNREFERENCED_PARAMETER(io);
+    auto pThis = static_cast<SocketListener*>(context);
+    auto accept = CONTAINING_RECORD(static_cast<OVERLAPPED*>(overlapped), PendingAccept, ol);
+    auto sock = accept->sock;
+    accept->sock = INVALID_SOCKET;
+
+    HRESULT hr;
+    if (ioResult != NO_ERROR)
+    {
+        // aborted by StopAccepts, or the client has reset the connection before accepting
+        ::closesocket(sock);
+        hr = pThis->PostAccept(accept);
+        if (FAILED(hr) && hr != E_ABORT)
+        {
+            AddLogFormatted(LogLevel::Error, L"[socket-listener] Failed to post accept (will retry): [0x%08lX]", hr);
+            pThis->ScheduleRetry(accept);
+        }
+        return;
+    }
+    auto sockListen = pThis->m_socket;
+    ::setsockopt(sock, SOL_SOCKET, SO_UPDATE_ACCEPT_CONTEXT, reinterpret_cast<char*>(&sockListen), sizeof(sockListen));
+
+    // post the next accept first, so that the next client is accepted during the handshake
+    hr = pThis->PostAccept(accept);
+    if (FAILED(hr) && hr != E_ABORT)
+    {
+        AddLogFormatted(LogLevel::Error, L"[socket-listener] Failed to post accept (will retry): [0x%08lX]", hr);
+        pThis->ScheduleRetry(accept);
+    }
+
+    // the handshake may wait for the client
+    ::CallbackMayRunLong(instance);
+    hr = pThis->CheckAcceptedSocket(sock);
+    if (hr == E_PENDING)
+        return;
+    pThis->CompleteAcceptedSocket(sock, hr);
 }
@@ -1,15 +1,25 @@
 #pragma once
 
+#include <mswsock.h>
+
 #include "listener.h"
+#include "accept_executor.h"
+
+// the maximum count of AcceptEx operations kept posted by SocketListener
+constexpr DWORD SOCKET_LISTENER_MAX_PENDING_ACCEPTS = 64;
 
 class SocketListener : public Listener
 {
 public:
     SocketListener();
-    virtual ~SocketListener() {}
+    virtual ~SocketListener();
 
     virtual void Close();
 
+    // Sets the count of AcceptEx operations kept posted with pre-created sockets
+    // (0 to accept on the listener event); must be called before initializing
+    void SetPendingAcceptCount(_In_ DWORD count) { m_pendingAcceptCount = count; }
+
 protected:
     _Check_return_
     HRESULT InitSocketImpl(
@@ -17,15 +27,71 @@ protected:
         _In_ PAcceptHandler pfnOnAccept,
         _In_opt_ void* callbackData
     );
+    // Returns S_OK to accept the socket, S_FALSE to reject the client, or E_PENDING if the check
+    // continues asynchronously and CompleteAcceptedSocket will be called later
     _Check_return_
     virtual HRESULT CheckAcceptedSocket(_In_ SOCKET socket) { return S_OK; }
+    // Passes the socket to the accept handler if hr is S_OK, or closes (or recycles) the socket otherwise
+    void CompleteAcceptedSocket(_In_ SOCKET socket, _In_ HRESULT hr);
 
 private:
-    static void CALLBACK EventHandler(_In_ void* data);
+    struct PendingAccept;
+
+    static void CALLBACK AcceptWaitCallback(
+        _Inout_ PTP_CALLBACK_INSTANCE instance,
+        _Inout_opt_ PVOID context,
+        _Inout_ PTP_WAIT wait,
+        _In_ TP_WAIT_RESULT waitResult
+    );
+    // accepts all clients in the backlog (when m_pendingAcceptCount is 0)
+    void DrainBacklog();
+    static void CALLBACK AcceptWork(_In_ void* context);
+
+    _Check_return_
+    HRESULT StartAccepts();
+    _Check_return_
+    HRESULT PostAccept(_Inout_ PendingAccept* accept);
+    void StopAccepts();
+    // starts the timer of the accept to retry PostAccept after ACCEPT_RETRY_INTERVAL
+    void ScheduleRetry(_Inout_ PendingAccept* accept);
+    static void CALLBACK RetryCallback(
+        _Inout_ PTP_CALLBACK_INSTANCE instance,
+        _Inout_opt_ PVOID context,
+        _Inout_ PTP_TIMER timer
+    );
+    // disconnects the socket and keeps it for the next AcceptEx
+    _Check_return_
+    bool RecycleSocket(_In_ SOCKET socket);
+    static void CALLBACK AcceptCompletion(
+        _Inout_ PTP_CALLBACK_INSTANCE instance,
+        _Inout_opt_ PVOID context,
+        _Inout_opt_ PVOID overlapped,
+        _In_ ULONG ioResult,
+        _In_ ULONG_PTR bytesTransferred,
+        _Inout_ PTP_IO io
+    );
 
 protected:
     SOCKET m_socket;
     HANDLE m_hEvent;
+    // the thread pool wait for m_hEvent (when m_pendingAcceptCount is 0)
+    PTP_WAIT m_wait;
     PAcceptHandler m_pfnOnAccept;
     void* m_callbackData;
+    AcceptExecutor m_executor;
+private:
+    DWORD m_pendingAcceptCount;
+    // (the followings are used only if m_pendingAcceptCount > 0)
+    PTP_IO m_io;
+    LPFN_ACCEPTEX m_pfnAcceptEx;
+    // (nullptr if not available; sockets are not recycled)
+    LPFN_DISCONNECTEX m_pfnDisconnectEx;
+    WSAPROTOCOL_INFOW m_protocolInfo;
+    PendingAccept* m_accepts;
+    // guards m_isClosing and m_recycledSockets (m_isClosing also guards re-arming m_wait)
+    CRITICAL_SECTION m_csAccepts;
+    bool m_isClosing;
+    // disconnected sockets for reuse (up to m_pendingAcceptCount)
+    SOCKET* m_recycledSockets;
+    DWORD m_recycledCount;
 };
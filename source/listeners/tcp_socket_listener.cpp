@@ -3,6 +3,13 @@
 
 #include "tcp_socket_listener.h"
 
+#include "../logger/logger.h"
+
+TcpSocketListener::TcpSocketListener()
+    : m_socketOptions{}
+{
+}
+
 _Use_decl_annotations_
 HRESULT TcpSocketListener::InitializeSocket(USHORT port, bool isIPv6, PCWSTR pszBindAddress, PAcceptHandler pfnOnAccept, void* callbackData, USHORT* outPort)
 {
@@ -82,6 +89,20 @@ HRESULT TcpSocketListener::InitializeSocket(USHORT port, bool isIPv6, PCWSTR psz
             return hr;
         }
     }
+    if (m_socketOptions.receiveBufferSize || m_socketOptions.sendBufferSize)
+    {
+        // the accepted sockets inherit the buffer sizes, and the receive window scale is
+        // determined on the handshake, so the sizes must be set before listening
+        TcpSocketOptions bufferOptions = { 0 };
+        bufferOptions.receiveBufferSize = m_socketOptions.receiveBufferSize;
+        bufferOptions.sendBufferSize = m_socketOptions.sendBufferSize;
+        auto hr = ApplyTcpSocketOptions(socket, &bufferOptions);
+        if (FAILED(hr))
+        {
+            ::closesocket(socket);
+            return hr;
+        }
+    }
     if (::listen(socket, SOMAXCONN) == SOCKET_ERROR)
     {
         auto hr = GetLastWSAErrorAsHResult();
@@ -111,3 +132,15 @@ HRESULT TcpSocketListener::InitializeSocket(USHORT port, bool isIPv6, PCWSTR psz
     m_socket = socket;
     return S_OK;
 }
+
+_Use_decl_annotations_
+HRESULT TcpSocketListener::CheckAcceptedSocket(SOCKET sock)
+{
+    auto hr = ApplyTcpSocketOptions(sock, &m_socketOptions);
+    if (FAILED(hr))
+    {
+        // the connection is still usable with the default options
+        AddLogFormatted(LogLevel::Error, L"[tcp-socket] Failed to set socket options: [0x%08lX]", hr);
+    }
+    return S_OK;
+}
@@ -1,12 +1,17 @@
 #pragma once
 
 #include "socket_listener_base.h"
+#include "../util/socket.h"
 
 class TcpSocketListener : public SocketListener
 {
 public:
+    TcpSocketListener();
     virtual ~TcpSocketListener() { Close(); }
 
+    // Sets the options applied to the accepted sockets (must be called before InitializeSocket)
+    void SetSocketOptions(_In_ const TcpSocketOptions* options) { m_socketOptions = *options; }
+
     _Check_return_
     HRESULT InitializeSocket(
         _In_ USHORT port,
@@ -27,4 +32,11 @@ public:
     {
         return InitializeSocket(0, isIPv6, pszBindAddress, pfnOnAccept, callbackData, outPort);
     }
+
+protected:
+    _Check_return_
+    virtual HRESULT CheckAcceptedSocket(_In_ SOCKET socket);
+
+private:
+    TcpSocketOptions m_socketOptions;
 };
@@ -51,7 +51,6 @@ static HRESULT MakePipeId(_Out_ PWSTR* outPipeName, _Out_ PWSTR* outPipeId)
 //_Use_decl_annotations_
 WslSocatListenerBase::WslSocatListenerBase()
     : m_pszWslDistribution(nullptr)
-    , m_hEventTemp(INVALID_HANDLE_VALUE)
     , m_dwWslPid(0)
 {
 }
@@ -59,13 +58,13 @@ WslSocatListenerBase::WslSocatListenerBase()
 _Use_decl_annotations_
 HRESULT WslSocatListenerBase::InitializeBase(LPCWSTR pszDistributionName, LPCWSTR pszListen, PAcceptHandler pfnOnAccept, void* callbackData)
 {
-    if (m_hPipeCurrent != INVALID_HANDLE_VALUE)
+    if (IsListening())
         return S_OK;
     auto pszDistributionNameDup = _wcsdup(pszDistributionName);
     if (!pszDistributionNameDup)
         return E_OUTOFMEMORY;
     PWSTR pszCurrentProcessWslFileName;
-    auto hr = WslPath(pszDistributionName, GetCurrentProcessModuleName(),
+    auto hr = WslPathCached(pszDistributionName, GetCurrentProcessModuleName(),
         GetWslDefaultTimeout(), &pszCurrentProcessWslFileName);
     if (FAILED(hr))
     {
@@ -73,7 +72,7 @@ HRESULT WslSocatListenerBase::InitializeBase(LPCWSTR pszDistributionName, LPCWST
         return hr;
     }
     PWSTR pszSocatFileName;
-    hr = WslWhich(pszDistributionName, L"socat", GetWslDefaultTimeout(), &pszSocatFileName);
+    hr = WslWhichCached(pszDistributionName, L"socat", GetWslDefaultTimeout(), &pszSocatFileName);
     if (FAILED(hr))
     {
         free(pszCurrentProcessWslFileName);
@@ -105,27 +104,15 @@ HRESULT WslSocatListenerBase::InitializeBase(LPCWSTR pszDistributionName, LPCWST
         return hr;
     }
 
-    auto hTemp = ::CreateEventW(nullptr, TRUE, FALSE, nullptr);
-    if (!hTemp)
-    {
-        auto hr = HRESULT_FROM_WIN32(::GetLastError());
-        free(pszCommand);
-        free(pszPipeName);
-        free(pszDistributionNameDup);
-        return hr;
-    }
-
     hr = NamedPipeListener::Initialize(pszPipeName, pfnOnAccept, callbackData);
     free(pszPipeName);
     if (FAILED(hr))
     {
-        ::CloseHandle(hTemp);
         free(pszCommand);
         free(pszDistributionNameDup);
         return hr;
     }
 
-    m_hEventTemp = hTemp;
     m_pszWslDistribution = pszDistributionNameDup;
 
     hr = m_process.StartProcess(pszDistributionNameDup, pszCommand, this,
@@ -177,11 +164,6 @@ void WslSocatListenerBase::Close()
         m_dwWslPid = 0;
     }
     m_process.Close();
-    if (m_hEventTemp != INVALID_HANDLE_VALUE)
-    {
-        ::CloseHandle(m_hEventTemp);
-        m_hEventTemp = INVALID_HANDLE_VALUE;
-    }
     OnCleanup(m_pszWslDistribution);
     if (m_pszWslDistribution)
     {
@@ -207,10 +189,13 @@ HRESULT WslSocatListenerBase::CheckConnectedPipe(_In_ HANDLE hPipe)
     data.proxyVersion = PROXY_VERSION;
     data.logLevel = static_cast<BYTE>(GetLogLevel());
 
+    // (checks for several clients may run at the same time, so use an event per call)
     OVERLAPPED ol = { 0 };
-    ol.hEvent = m_hEventTemp;
-    ::ResetEvent(m_hEventTemp);
+    ol.hEvent = ::CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    if (!ol.hEvent)
+        return HRESULT_FROM_WIN32(::GetLastError());
     auto hr = WriteFileTimeout(hPipe, &data, sizeof(data), nullptr, &ol, 3000);
+    ::CloseHandle(ol.hEvent);
     if (FAILED(hr))
         return hr;
     ::FlushFileBuffers(hPipe);
@@ -223,6 +208,8 @@ _Use_decl_annotations_
 void CALLBACK WslSocatListenerBase::_ExitHandler(void* data, DWORD dwExitCode)
 {
     auto pThis = static_cast<WslSocatListenerBase*>(data);
+    // the distribution may have been terminated, so resolve WSL paths again on the next use
+    WslInvalidateCache(pThis->m_pszWslDistribution);
     pThis->Close();
 }
 
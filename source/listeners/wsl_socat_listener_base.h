@@ -33,7 +33,6 @@ private:
 
 private:
     WCHAR* m_pszWslDistribution;
-    HANDLE m_hEventTemp;
     WslProcess m_process;
     DWORD m_dwWslPid; // not Windows PID
     std::wstring m_strStdErrChunk;
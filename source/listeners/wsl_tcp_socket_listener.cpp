@@ -14,7 +14,7 @@ WslTcpSocketListener::WslTcpSocketListener()
 _Use_decl_annotations_
 HRESULT WslTcpSocketListener::Initialize(PCWSTR pszDistributionName, PCWSTR pszBindAddress, bool isIPv6, WORD port, PAcceptHandler pfnOnAccept, void* callbackData)
 {
-    if (m_hPipeCurrent != INVALID_HANDLE_VALUE)
+    if (IsListening())
         return S_OK;
 
     PWSTR pszListen;
@@ -17,7 +17,7 @@ WslUnixSocketListener::WslUnixSocketListener()
 _Use_decl_annotations_
 HRESULT WslUnixSocketListener::Initialize(LPCWSTR pszDistributionName, LPCWSTR pszSocketWslFilePath, bool isAbstract, PAcceptHandler pfnOnAccept, void* callbackData)
 {
-    if (m_hPipeCurrent != INVALID_HANDLE_VALUE)
+    if (IsListening())
         return S_OK;
     auto hr = WslTestIfWritable(pszDistributionName, pszSocketWslFilePath, GetWslDefaultTimeout());
     if (FAILED(hr))
@@ -0,0 +1,91 @@
+#include "../framework.h"
+
+#include "log_ring.h"
+
+LogRing::LogRing()
+    : m_records(nullptr)
+    , m_writeCount(0)
+    , m_startCount(0)
+{
+    ::InitializeCriticalSection(&m_cs);
+}
+
+LogRing::~LogRing()
+{
+    if (m_records)
+        free(m_records);
+    ::DeleteCriticalSection(&m_cs);
+}
+
+HRESULT LogRing::Initialize()
+{
+    if (m_records)
+        return E_UNEXPECTED;
+    m_records = static_cast<Record*>(malloc(sizeof(Record) * LOG_RING_CAPACITY));
+    if (!m_records)
+        return E_OUTOFMEMORY;
+    return S_OK;
+}
+
+_Use_decl_annotations_
+void LogRing::Push(PCWSTR pszLog)
+{
+    if (!m_records)
+        return;
+    auto len = wcslen(pszLog);
+    auto isTruncated = false;
+    if (len > LOG_RECORD_MAX_LENGTH)
+    {
+        // keep the room for the new line
+        len = LOG_RECORD_MAX_LENGTH - 1;
+        isTruncated = true;
+    }
+
+    ::EnterCriticalSection(&m_cs);
+    auto& record = m_records[m_writeCount % LOG_RING_CAPACITY];
+    memcpy(record.text, pszLog, sizeof(WCHAR) * len);
+    if (isTruncated)
+        record.text[len++] = L'\n';
+    record.length = static_cast<DWORD>(len);
+    ++m_writeCount;
+    ::LeaveCriticalSection(&m_cs);
+}
+
+_Use_decl_annotations_
+ULONGLONG LogRing::Read(ULONGLONG* inoutCursor, std::wstring& outText)
+{
+    if (!m_records)
+        return 0;
+    ::EnterCriticalSection(&m_cs);
+    auto start = *inoutCursor;
+    if (start < m_startCount)
+        start = m_startCount;
+    ULONGLONG dropped = 0;
+    if (m_writeCount > LOG_RING_CAPACITY && start < m_writeCount - LOG_RING_CAPACITY)
+    {
+        dropped = m_writeCount - LOG_RING_CAPACITY - start;
+        start = m_writeCount - LOG_RING_CAPACITY;
+    }
+    try
+    {
+        for (auto seq = start; seq < m_writeCount; ++seq)
+        {
+            auto& record = m_records[seq % LOG_RING_CAPACITY];
+            outText.append(record.text, record.length);
+        }
+    }
+    catch (...)
+    {
+        // the text is incomplete but the records cannot be read again
+    }
+    *inoutCursor = m_writeCount;
+    ::LeaveCriticalSection(&m_cs);
+    return dropped;
+}
+
+void LogRing::Clear()
+{
+    ::EnterCriticalSection(&m_cs);
+    m_startCount = m_writeCount;
+    ::LeaveCriticalSection(&m_cs);
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+// the count of log records kept by LogRing (older records are overwritten)
+constexpr DWORD LOG_RING_CAPACITY = 1024;
+// the maximum length of one log record including the new line (longer logs are truncated)
+constexpr DWORD LOG_RECORD_MAX_LENGTH = 512;
+
+// Fixed-capacity ring of log records; the memory is allocated once and never grows.
+// Writers only copy the text into the slot, and each reader drains the records after its own cursor.
+class LogRing
+{
+public:
+    LogRing();
+    ~LogRing();
+
+    _Check_return_
+    HRESULT Initialize();
+
+    void Push(_In_z_ PCWSTR pszLog);
+    // Appends the records written after *inoutCursor to outText and moves *inoutCursor to the end;
+    // returns the count of records overwritten before being read
+    ULONGLONG Read(_Inout_ ULONGLONG* inoutCursor, _Inout_ std::wstring& outText);
+    // Discards all records
+    void Clear();
+
+private:
+    struct Record
+    {
+        DWORD length;
+        WCHAR text[LOG_RECORD_MAX_LENGTH];
+    };
+
+    CRITICAL_SECTION m_cs;
+    Record* m_records;
+    // the total count of pushed records, and the sequence number of the first record after Clear
+    ULONGLONG m_writeCount;
+    ULONGLONG m_startCount;
+};
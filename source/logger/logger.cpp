@@ -6,6 +6,8 @@ Logger* logger = nullptr;
 _Use_decl_annotations_
 void Logger::AddLog(LogLevel level, PCWSTR pszLog)
 {
+    if (!IsEnabled(level))
+        return;
     auto len = wcslen(pszLog);
     if (!len)
         return;
@@ -27,6 +29,8 @@ void __cdecl Logger::AddLogFormatted(LogLevel level, PCWSTR pszLog, ...)
 _Use_decl_annotations_
 void Logger::AddLogFormattedV(LogLevel level, PCWSTR pszLog, va_list args)
 {
+    if (!IsEnabled(level))
+        return;
     auto r = _vscwprintf(pszLog, args);
     if (r <= 0)
         return;
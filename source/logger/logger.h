@@ -16,6 +16,13 @@ public:
     void AddLog(_In_ LogLevel level, _In_z_ PCWSTR pszLog);
     void __cdecl AddLogFormatted(_In_ LogLevel level, _In_z_ _Printf_format_string_ PCWSTR pszLog, ...);
     void AddLogFormattedV(_In_ LogLevel level, _In_z_ _Printf_format_string_ PCWSTR pszLog, va_list args);
+    // Returns false if the logs of the level are discarded
+    // (checked before formatting, so that disabled logs cost nothing)
+    virtual bool IsEnabled(_In_ LogLevel level) const
+    {
+        UNREFERENCED_PARAMETER(level);
+        return true;
+    }
 
 protected:
     virtual void OnLog(_In_ LogLevel level, _In_z_ PCWSTR pszLog) = 0;
@@ -23,6 +30,13 @@ protected:
 
 extern Logger* logger;
 
+// Returns true if the logs of the level are written; use this to skip
+// preparing the log arguments which are expensive to make
+inline bool IsLogEnabled(_In_ LogLevel level)
+{
+    return logger && logger->IsEnabled(level);
+}
+
 inline void AddLog(_In_ LogLevel level, _In_z_ PCWSTR pszLog)
 {
     if (!logger)
@@ -2,6 +2,10 @@
 #include "options.h"
 
 #include "app/simple_dialog.h"
+#include "connectors/pooled_connector.h"
+#include "duplex/relay_buffer.h"
+#include "listeners/namedpipe_listener.h"
+#include "listeners/socket_listener_base.h"
 #include "util/functions.h"
 
 #include <stdarg.h>
@@ -21,6 +25,13 @@ static void ShowHelp(_In_opt_z_ PCWSTR errorReason = nullptr)
         L"  --wsl-socat-log-level <level> : Set log level for WSL socat\n"
         L"    <level>: 0 (nothing), 1 (-d), 2 (-dd), 3 (-ddd), 4 (-dddd) (default: 0)\n"
         L"  --wsl-timeout <millisec> : Set timeout for WSL preparing (default: 30000)\n"
+        L"  --connect-timeout <millisec> : Set timeout for connecting with tcp-socket connector or waiting for busy pipe (default: 10000)\n"
+        L"  --engine <engine> : Set relay engine\n"
+        L"    <engine>: thread (one thread per connection), iocp (thread pool with I/O completion port) (default: thread)\n"
+        L"  --wsl-relay <mode> : Set how WSL connectors reach the target\n"
+        L"    <mode>: process (one WSL process per connection), persistent (shared WSL process via loopback TCP) (default: process)\n"
+        L"  --connector-pool <count> : Keep <count> connections made by the connector in advance (0 - 64, default: 0)\n"
+        L"  --metrics tcp-socket [-4 | -6] [<address>:]<port> : Serve statistics in Prometheus text format via HTTP\n"
         L"\n"
         L"<listener>:\n"
         L"  tcp-socket [-4 | -6] [<address>:]<port> : TCP socket listener (port num. can be 0 for auto-assign)\n"
@@ -35,9 +46,25 @@ static void ShowHelp(_In_opt_z_ PCWSTR errorReason = nullptr)
         L"    alias for 'wsl-tcp-socket': ws, wt\n"
         L"  wsl-unix-socket [-d <distribution>] <wsl-file-path> : Unix socket listener in WSL (listener with the socket file in WSL)\n"
         L"    alias for 'wsl-unix-socket': wu\n"
+        L"  (each listener can be followed by <listener-options>)\n"
+        L"\n"
+        L"<listener-options>:\n"
+        L"  --buffer-size <min>[:<max>] : Set the range of read buffer size in bytes ('k' suffix for KiB)\n"
+        L"    (default: 1k:256k, allowed: 256 - 1024k)\n"
+        L"  --coalesce <mode> : Set how received data is gathered before forwarding\n"
+        L"    <mode>: adaptive, latency (forward immediately), throughput (gather already-received data) (default: adaptive)\n"
+        L"  --coalesce-size <size> : Set the maximum size of gathered data in bytes ('k' suffix for KiB) (default: 64k)\n"
+        L"  --pending-accepts <count> : Keep <count> accepts posted in advance (0 - 64, default: 0)\n"
+        L"    (tcp-socket, unix-socket, and cygwin-sockfile only)\n"
+        L"  --socket-options <options> : Set options for accepted sockets (tcp-socket only)\n"
+        L"    <options>: comma-separated list of latency, bulk, nodelay, keepalive=<millisec>, rcvbuf=<size>, sndbuf=<size>\n"
+        L"  --pipe-instances <count>[:<max>] : Keep <count> pipe instances waiting for clients, growing up to <max> under load\n"
+        L"    (pipe only; default: 2:16, allowed: 1 - 64)\n"
+        L"  --pipe-buffer-size <size> : Set the input/output buffer size of each pipe instance in bytes ('k' suffix for KiB)\n"
+        L"    (pipe only; default: 4k, allowed: 0 - 1024k)\n"
         L"\n"
         L"<connector>:\n"
-        L"  tcp-socket <address>:<port> : TCP socket connector (port num. cannot be 0)\n"
+        L"  tcp-socket <address>:<port> [--socket-options <options>] : TCP socket connector (port num. cannot be 0)\n"
         L"  unix-socket [--abstract] <file-name> : Unix socket connector\n"
         L"  pipe <pipe-name> : Named-pipe connector\n"
         L"  wsl-tcp-socket [-d <distribution>] <address>:<port> : TCP socket connector in WSL (port num. cannot be 0)\n"
@@ -141,9 +168,110 @@ static HRESULT _ParseWslDistributionParam(
     return S_OK;
 }
 
-static HRESULT AddListener(
-    _Inout_ Option* options,
-    _In_z_ PCWSTR pszArg1,
+// parses '<num>' or '<num>k' (in KiB)
+static bool ParseSizeValue(_In_z_ PCWSTR psz, _Out_ DWORD* outSize)
+{
+    *outSize = 0;
+    PWSTR ptr = nullptr;
+    auto x = wcstoul(psz, &ptr, 10);
+    if (!ptr || ptr == psz)
+        return false;
+    if (*ptr == L'k' || *ptr == L'K')
+    {
+        if (x > 0xFFFFFFFFUL / 1024)
+            return false;
+        x *= 1024;
+        ++ptr;
+    }
+    if (*ptr != L'\0')
+        return false;
+    *outSize = static_cast<DWORD>(x);
+    return true;
+}
+
+// the buffer size set by 'bulk' profile of '--socket-options'
+constexpr DWORD SOCKET_OPTIONS_BULK_BUFFER_SIZE = 1024 * 1024;
+// the maximum of 'rcvbuf' and 'sndbuf' values of '--socket-options'
+constexpr DWORD SOCKET_OPTIONS_MAX_BUFFER_SIZE = 16 * 1024 * 1024;
+
+// parses '<item>[,<item>...]' for '--socket-options'
+// (<item>: default, latency, bulk, nodelay, keepalive=<millisec>, rcvbuf=<size>, sndbuf=<size>)
+static HRESULT ParseSocketOptions(
+    _In_z_ PCWSTR pszValue,
+    _Out_ TcpSocketOptions* outOptions,
+    _Outptr_result_maybenull_z_ PWSTR* outErrorReason
+)
+{
+    *outErrorReason = nullptr;
+    ZeroMemory(outOptions, sizeof(TcpSocketOptions));
+
+    auto pszDup = _wcsdup(pszValue);
+    if (!pszDup)
+        return E_OUTOFMEMORY;
+    HRESULT hr = S_OK;
+    PWSTR context = nullptr;
+    for (auto pszItem = wcstok_s(pszDup, L",", &context); pszItem; pszItem = wcstok_s(nullptr, L",", &context))
+    {
+        auto pszItemValue = wcschr(pszItem, L'=');
+        if (pszItemValue)
+            *pszItemValue++ = L'\0';
+        if (!pszItemValue && wcscmp(pszItem, L"default") == 0)
+        {
+            ZeroMemory(outOptions, sizeof(TcpSocketOptions));
+        }
+        else if (!pszItemValue && wcscmp(pszItem, L"latency") == 0)
+        {
+            outOptions->isNoDelay = true;
+        }
+        else if (!pszItemValue && wcscmp(pszItem, L"bulk") == 0)
+        {
+            outOptions->receiveBufferSize = SOCKET_OPTIONS_BULK_BUFFER_SIZE;
+            outOptions->sendBufferSize = SOCKET_OPTIONS_BULK_BUFFER_SIZE;
+        }
+        else if (!pszItemValue && wcscmp(pszItem, L"nodelay") == 0)
+        {
+            outOptions->isNoDelay = true;
+        }
+        else if (pszItemValue && wcscmp(pszItem, L"keepalive") == 0)
+        {
+            PWSTR ptr = nullptr;
+            auto x = wcstol(pszItemValue, &ptr, 10);
+            if (!ptr || ptr == pszItemValue || *ptr || x < 0 || x >= 7200000)
+            {
+                MakeFormattedString(outErrorReason, L"Keep-alive time is invalid (actual: %s)", pszItemValue);
+                hr = E_INVALIDARG;
+                break;
+            }
+            outOptions->keepAliveTime = static_cast<DWORD>(x);
+        }
+        else if (pszItemValue && (wcscmp(pszItem, L"rcvbuf") == 0 || wcscmp(pszItem, L"sndbuf") == 0))
+        {
+            DWORD size = 0;
+            if (!ParseSizeValue(pszItemValue, &size) || size > SOCKET_OPTIONS_MAX_BUFFER_SIZE)
+            {
+                MakeFormattedString(outErrorReason, L"Socket buffer size must be 0 - %luk (actual: %s)",
+                    SOCKET_OPTIONS_MAX_BUFFER_SIZE / 1024, pszItemValue);
+                hr = E_INVALIDARG;
+                break;
+            }
+            if (pszItem[0] == L'r')
+                outOptions->receiveBufferSize = size;
+            else
+                outOptions->sendBufferSize = size;
+        }
+        else
+        {
+            MakeFormattedString(outErrorReason, L"Socket option is invalid (actual: %s)", pszItem);
+            hr = E_INVALIDARG;
+            break;
+        }
+    }
+    free(pszDup);
+    return hr;
+}
+
+static HRESULT ParseListenerOptions(
+    _Inout_ ListenerData* listener,
     _In_reads_(argc) wchar_t** restArgs,
     _In_ int argc,
     _Out_ int* outArgReadCount,
@@ -153,83 +281,315 @@ static HRESULT AddListener(
     *outErrorReason = nullptr;
     *outArgReadCount = 0;
 
-    if (!options->listeners)
-    {
-        auto listeners = new std::vector<ListenerData*>();
-        if (!listeners)
-            return E_OUTOFMEMORY;
-        options->listeners = listeners;
-    }
+    listener->relay.bufferMinSize = RELAY_BUFFER_SIZE;
+    listener->relay.bufferMaxSize = RELAY_BUFFER_DEFAULT_MAX_SIZE;
+    listener->relay.coalesceMode = CoalesceMode::Adaptive;
+    listener->relay.coalesceSize = COALESCE_DEFAULT_SIZE;
+    listener->pendingAcceptCount = 0;
 
-    int c = 1;
-    if (wcscmp(pszArg1, L"s") == 0 || wcscmp(pszArg1, L"sock") == 0 || wcscmp(pszArg1, L"socket") == 0 ||
-        wcscmp(pszArg1, L"tcp") == 0 || wcscmp(pszArg1, L"tcp-socket") == 0)
+    int c = 0;
+    while (c < argc)
     {
-        if (argc < 1)
-            return E_INVALIDARG;
-        bool isIPv6 = false;
-        auto pszArg2 = restArgs[0];
-        ++c;
-        if (wcscmp(pszArg2, L"-4") == 0 || wcscmp(pszArg2, L"/4") == 0 ||
-            wcscmp(pszArg2, L"-6") == 0 || wcscmp(pszArg2, L"/6") == 0)
+        auto arg = restArgs[c];
+        if (wcscmp(arg, L"--buffer-size") == 0 || wcscmp(arg, L"/buffer-size") == 0)
         {
-            if (argc <= 1)
+            if (c + 1 >= argc)
+            {
+                *outErrorReason = _wcsdup(L"Buffer size value is missing");
                 return E_INVALIDARG;
-            isIPv6 = pszArg2[1] == L'6';
-            pszArg2 = restArgs[1];
-            ++c;
+            }
+            auto pszValue = restArgs[c + 1];
+            c += 2;
+            auto pszMax = wcschr(pszValue, L':');
+            DWORD minSize = 0;
+            DWORD maxSize = 0;
+            bool isValid;
+            if (pszMax)
+            {
+                *pszMax = L'\0';
+                isValid = ParseSizeValue(pszValue, &minSize) && ParseSizeValue(pszMax + 1, &maxSize);
+                *pszMax = L':';
+            }
+            else
+            {
+                isValid = ParseSizeValue(pszValue, &minSize);
+                maxSize = listener->relay.bufferMaxSize < minSize ? minSize : listener->relay.bufferMaxSize;
+            }
+            if (!isValid || minSize < RELAY_BUFFER_MIN_CAPACITY || maxSize > RELAY_BUFFER_MAX_CAPACITY || minSize > maxSize)
+            {
+                MakeFormattedString(outErrorReason, L"Buffer size must be '<min>' or '<min>:<max>' in %lu - %luk (actual: %s)",
+                    RELAY_BUFFER_MIN_CAPACITY, RELAY_BUFFER_MAX_CAPACITY / 1024, pszValue);
+                return E_INVALIDARG;
+            }
+            listener->relay.bufferMinSize = minSize;
+            listener->relay.bufferMaxSize = maxSize;
         }
-        else
+        else if (wcscmp(arg, L"--coalesce") == 0 || wcscmp(arg, L"/coalesce") == 0)
         {
-            isIPv6 = (pszArg2[0] == L'[');
+            if (c + 1 >= argc)
+            {
+                *outErrorReason = _wcsdup(L"Coalescing mode is missing");
+                return E_INVALIDARG;
+            }
+            auto pszValue = restArgs[c + 1];
+            c += 2;
+            if (wcscmp(pszValue, L"adaptive") == 0)
+                listener->relay.coalesceMode = CoalesceMode::Adaptive;
+            else if (wcscmp(pszValue, L"latency") == 0)
+                listener->relay.coalesceMode = CoalesceMode::Latency;
+            else if (wcscmp(pszValue, L"throughput") == 0)
+                listener->relay.coalesceMode = CoalesceMode::Throughput;
+            else
+            {
+                MakeFormattedString(outErrorReason, L"Coalescing mode is invalid (actual: %s)", pszValue);
+                return E_INVALIDARG;
+            }
         }
-        long portNum = -1;
-        auto pszPortStr = wcsrchr(pszArg2, L':');
-        if (!pszPortStr)
+        else if (wcscmp(arg, L"--coalesce-size") == 0 || wcscmp(arg, L"/coalesce-size") == 0)
         {
-            pszPortStr = pszArg2;
-            pszArg2 = nullptr;
+            if (c + 1 >= argc)
+            {
+                *outErrorReason = _wcsdup(L"Coalescing size value is missing");
+                return E_INVALIDARG;
+            }
+            auto pszValue = restArgs[c + 1];
+            c += 2;
+            DWORD size = 0;
+            if (!ParseSizeValue(pszValue, &size) || size == 0)
+            {
+                MakeFormattedString(outErrorReason, L"Coalescing size value is invalid (actual: %s)", pszValue);
+                return E_INVALIDARG;
+            }
+            listener->relay.coalesceSize = size;
         }
-        else
+        else if (wcscmp(arg, L"--pending-accepts") == 0 || wcscmp(arg, L"/pending-accepts") == 0)
         {
-            if (pszPortStr == pszArg2)
-                pszArg2 = nullptr;
-            ++pszPortStr;
+            if (listener->type != ListenerType::TcpSocket && listener->type != ListenerType::UnixSocket &&
+                listener->type != ListenerType::CygwinSockFile)
+            {
+                *outErrorReason = _wcsdup(L"Pending accepts can be specified only for tcp-socket, unix-socket, and cygwin-sockfile listeners");
+                return E_INVALIDARG;
+            }
+            if (c + 1 >= argc)
+            {
+                *outErrorReason = _wcsdup(L"Pending accept count is missing");
+                return E_INVALIDARG;
+            }
+            auto pszValue = restArgs[c + 1];
+            c += 2;
+            PWSTR ptr = nullptr;
+            auto x = wcstol(pszValue, &ptr, 10);
+            if (!ptr || ptr == pszValue || *ptr || x < 0 || x > static_cast<long>(SOCKET_LISTENER_MAX_PENDING_ACCEPTS))
+            {
+                MakeFormattedString(outErrorReason, L"Pending accept count is invalid (actual: %s, allowed: 0 - %lu)",
+                    pszValue, SOCKET_LISTENER_MAX_PENDING_ACCEPTS);
+                return E_INVALIDARG;
+            }
+            listener->pendingAcceptCount = static_cast<DWORD>(x);
         }
+        else if (wcscmp(arg, L"--socket-options") == 0 || wcscmp(arg, L"/socket-options") == 0)
         {
-            PWSTR ptr = nullptr;
-            portNum = wcstol(pszPortStr, &ptr, 10);
-            if (!ptr || *ptr != L'\0')
-                portNum = -1;
-            else if (portNum < 0 || portNum > 65535)
-                portNum = -1;
+            if (listener->type != ListenerType::TcpSocket)
+            {
+                *outErrorReason = _wcsdup(L"Socket options can be specified only for tcp-socket listener");
+                return E_INVALIDARG;
+            }
+            if (c + 1 >= argc)
+            {
+                *outErrorReason = _wcsdup(L"Socket options are missing");
+                return E_INVALIDARG;
+            }
+            auto pszValue = restArgs[c + 1];
+            c += 2;
+            auto hr = ParseSocketOptions(pszValue, &static_cast<TcpSocketListenerData*>(listener)->socketOptions, outErrorReason);
+            if (FAILED(hr))
+                return hr;
         }
-        if (portNum < 0)
+        else if (wcscmp(arg, L"--pipe-instances") == 0 || wcscmp(arg, L"/pipe-instances") == 0)
         {
-            MakeFormattedString(outErrorReason, L"Address format must be '<port>' or '<address>:<port>' (actual: %s)", pszArg2);
-            return E_INVALIDARG;
+            if (listener->type != ListenerType::Pipe)
+            {
+                *outErrorReason = _wcsdup(L"Pipe instances can be specified only for pipe listener");
+                return E_INVALIDARG;
+            }
+            if (c + 1 >= argc)
+            {
+                *outErrorReason = _wcsdup(L"Pipe instance count is missing");
+                return E_INVALIDARG;
+            }
+            auto pszValue = restArgs[c + 1];
+            c += 2;
+            auto d = static_cast<PipeListenerData*>(listener);
+            PWSTR ptr = nullptr;
+            auto count = wcstoul(pszValue, &ptr, 10);
+            auto maxCount = count > d->maxInstanceCount ? count : d->maxInstanceCount;
+            bool isValid = ptr && ptr != pszValue;
+            if (isValid && *ptr == L':')
+            {
+                auto pszMax = ptr + 1;
+                maxCount = wcstoul(pszMax, &ptr, 10);
+                isValid = ptr && ptr != pszMax;
+            }
+            if (!isValid || *ptr || count < 1 || maxCount > NAMED_PIPE_LISTENER_MAX_INSTANCES || count > maxCount)
+            {
+                MakeFormattedString(outErrorReason, L"Pipe instances must be '<count>' or '<count>:<max>' in 1 - %lu (actual: %s)",
+                    NAMED_PIPE_LISTENER_MAX_INSTANCES, pszValue);
+                return E_INVALIDARG;
+            }
+            d->instanceCount = static_cast<DWORD>(count);
+            d->maxInstanceCount = static_cast<DWORD>(maxCount);
         }
-        _Analysis_assume_(pszPortStr != nullptr);
-        _Analysis_assume_(portNum >= 0 && portNum <= 65535);
-
-        PWSTR pszAddress = nullptr;
-        if (pszArg2)
+        else if (wcscmp(arg, L"--pipe-buffer-size") == 0 || wcscmp(arg, L"/pipe-buffer-size") == 0)
         {
-            pszAddress = _wcsdup(pszArg2);
-            if (!pszAddress)
-                return E_OUTOFMEMORY;
-            pszAddress[(pszPortStr - 1) - pszArg2] = L'\0';
+            if (listener->type != ListenerType::Pipe)
+            {
+                *outErrorReason = _wcsdup(L"Pipe buffer size can be specified only for pipe listener");
+                return E_INVALIDARG;
+            }
+            if (c + 1 >= argc)
+            {
+                *outErrorReason = _wcsdup(L"Pipe buffer size value is missing");
+                return E_INVALIDARG;
+            }
+            auto pszValue = restArgs[c + 1];
+            c += 2;
+            DWORD size = 0;
+            if (!ParseSizeValue(pszValue, &size) || size > NAMED_PIPE_LISTENER_MAX_BUFFER_SIZE)
+            {
+                MakeFormattedString(outErrorReason, L"Pipe buffer size must be in 0 - %luk (actual: %s)",
+                    NAMED_PIPE_LISTENER_MAX_BUFFER_SIZE / 1024, pszValue);
+                return E_INVALIDARG;
+            }
+            static_cast<PipeListenerData*>(listener)->bufferSize = size;
         }
-        auto d = static_cast<TcpSocketListenerData*>(malloc(sizeof(TcpSocketListenerData)));
-        if (!d)
+        else
         {
-            free(pszAddress);
-            return E_OUTOFMEMORY;
+            break;
         }
-        d->type = ListenerType::TcpSocket;
-        d->pszAddress = pszAddress;
-        d->isIPv6 = isIPv6;
-        d->port = static_cast<WORD>(portNum);
+    }
+    *outArgReadCount = c;
+    return S_OK;
+}
+
+static bool IsTcpSocketListenerName(_In_z_ PCWSTR pszName)
+{
+    return wcscmp(pszName, L"s") == 0 || wcscmp(pszName, L"sock") == 0 || wcscmp(pszName, L"socket") == 0 ||
+        wcscmp(pszName, L"tcp") == 0 || wcscmp(pszName, L"tcp-socket") == 0;
+}
+
+// parses '[-4 | -6] [<address>:]<port>' (the result must be freed with 'free', including pszAddress)
+static HRESULT ParseTcpSocketListener(
+    _In_reads_(argc) wchar_t** restArgs,
+    _In_ int argc,
+    _Out_ int* outArgReadCount,
+    _When_(SUCCEEDED(return), _Outptr_) TcpSocketListenerData** outData,
+    _Outptr_result_maybenull_z_ PWSTR* outErrorReason
+)
+{
+    *outArgReadCount = 0;
+    if (argc < 1)
+        return E_INVALIDARG;
+    int c = 0;
+    bool isIPv6 = false;
+    auto pszArg2 = restArgs[0];
+    ++c;
+    if (wcscmp(pszArg2, L"-4") == 0 || wcscmp(pszArg2, L"/4") == 0 ||
+        wcscmp(pszArg2, L"-6") == 0 || wcscmp(pszArg2, L"/6") == 0)
+    {
+        if (argc <= 1)
+            return E_INVALIDARG;
+        isIPv6 = pszArg2[1] == L'6';
+        pszArg2 = restArgs[1];
+        ++c;
+    }
+    else
+    {
+        isIPv6 = (pszArg2[0] == L'[');
+    }
+    long portNum = -1;
+    auto pszPortStr = wcsrchr(pszArg2, L':');
+    if (!pszPortStr)
+    {
+        pszPortStr = pszArg2;
+        pszArg2 = nullptr;
+    }
+    else
+    {
+        if (pszPortStr == pszArg2)
+            pszArg2 = nullptr;
+        ++pszPortStr;
+    }
+    {
+        PWSTR ptr = nullptr;
+        portNum = wcstol(pszPortStr, &ptr, 10);
+        if (!ptr || *ptr != L'\0')
+            portNum = -1;
+        else if (portNum < 0 || portNum > 65535)
+            portNum = -1;
+    }
+    if (portNum < 0)
+    {
+        MakeFormattedString(outErrorReason, L"Address format must be '<port>' or '<address>:<port>' (actual: %s)", pszArg2);
+        return E_INVALIDARG;
+    }
+    _Analysis_assume_(pszPortStr != nullptr);
+    _Analysis_assume_(portNum >= 0 && portNum <= 65535);
+
+    PWSTR pszAddress = nullptr;
+    if (pszArg2)
+    {
+        pszAddress = _wcsdup(pszArg2);
+        if (!pszAddress)
+            return E_OUTOFMEMORY;
+        pszAddress[(pszPortStr - 1) - pszArg2] = L'\0';
+    }
+    auto d = static_cast<TcpSocketListenerData*>(malloc(sizeof(TcpSocketListenerData)));
+    if (!d)
+    {
+        free(pszAddress);
+        return E_OUTOFMEMORY;
+    }
+    d->type = ListenerType::TcpSocket;
+    d->id = 0;
+    d->pszAddress = pszAddress;
+    d->isIPv6 = isIPv6;
+    d->port = static_cast<WORD>(portNum);
+    ZeroMemory(&d->socketOptions, sizeof(d->socketOptions));
+    d->pendingAcceptCount = 0;
+    *outData = d;
+    *outArgReadCount = c;
+    return S_OK;
+}
+
+static HRESULT AddListener(
+    _Inout_ Option* options,
+    _In_z_ PCWSTR pszArg1,
+    _In_reads_(argc) wchar_t** restArgs,
+    _In_ int argc,
+    _Out_ int* outArgReadCount,
+    _Outptr_result_maybenull_z_ PWSTR* outErrorReason
+)
+{
+    *outErrorReason = nullptr;
+    *outArgReadCount = 0;
+
+    if (!options->listeners)
+    {
+        auto listeners = new std::vector<ListenerData*>();
+        if (!listeners)
+            return E_OUTOFMEMORY;
+        options->listeners = listeners;
+    }
+
+    int c = 1;
+    if (IsTcpSocketListenerName(pszArg1))
+    {
+        TcpSocketListenerData* d;
+        int x = 0;
+        auto hr = ParseTcpSocketListener(restArgs, argc, &x, &d, outErrorReason);
+        if (FAILED(hr))
+            return hr;
+        c += x;
         options->listeners->push_back(d);
         d->id = static_cast<WORD>(options->listeners->size());
     }
@@ -330,6 +690,9 @@ static HRESULT AddListener(
         }
         d->type = ListenerType::Pipe;
         d->pszPipeName = pszPath;
+        d->instanceCount = NAMED_PIPE_LISTENER_DEFAULT_INSTANCES;
+        d->maxInstanceCount = NAMED_PIPE_LISTENER_DEFAULT_MAX_INSTANCES;
+        d->bufferSize = NAMED_PIPE_LISTENER_DEFAULT_BUFFER_SIZE;
         options->listeners->push_back(d);
         d->id = static_cast<WORD>(options->listeners->size());
     }
@@ -462,6 +825,15 @@ static HRESULT AddListener(
         return E_INVALIDARG;
     }
 
+    {
+        // options common to all listeners follow (restArgs[c - 1] is the next argument)
+        int x = 0;
+        auto hr = ParseListenerOptions(options->listeners->back(), &restArgs[c - 1], argc - (c - 1), &x, outErrorReason);
+        if (FAILED(hr))
+            return hr;
+        c += x;
+    }
+
     *outArgReadCount = c;
     return S_OK;
 }
@@ -523,7 +895,21 @@ static HRESULT ParseConnector(
         d->type = ConnectorType::TcpSocket;
         d->pszAddress = pszAddress;
         d->port = static_cast<WORD>(portNum);
+        ZeroMemory(&d->socketOptions, sizeof(d->socketOptions));
         options->connector = d;
+        if (argc >= 2 && (wcscmp(restArgs[1], L"--socket-options") == 0 || wcscmp(restArgs[1], L"/socket-options") == 0))
+        {
+            if (argc < 3)
+            {
+                *outErrorReason = _wcsdup(L"Socket options are missing");
+                return E_INVALIDARG;
+            }
+            auto hr = ParseSocketOptions(restArgs[2], &d->socketOptions, outErrorReason);
+            if (FAILED(hr))
+                return hr;
+            // (the address and the options)
+            c += 3;
+        }
     }
     else if (wcscmp(pszArg1, L"u") == 0 || wcscmp(pszArg1, L"unix") == 0 || wcscmp(pszArg1, L"unix-socket") == 0)
     {
@@ -722,6 +1108,7 @@ HRESULT ParseOptions(Option* outOptions)
     ZeroMemory(outOptions, sizeof(Option));
     outOptions->logLevel = LogLevel::Error;
     outOptions->wslDefaultTimeout = WSL_DEFAULT_TIMEOUT;
+    outOptions->connectTimeout = CONNECT_DEFAULT_TIMEOUT;
     for (int i = 1; i < __argc;)
     {
         auto arg = __wargv[i];
@@ -971,6 +1358,35 @@ HRESULT ParseOptions(Option* outOptions)
                     }
                 }
             }
+            else if (isMultipleCharOption && wcscmp(arg, L"connect-timeout") == 0)
+            {
+                if (i >= __argc)
+                {
+                    hr = E_INVALIDARG;
+                    MakeFormattedString(
+                        &errorReason,
+                        L"Timeout value is missing"
+                    );
+                    break;
+                }
+                else
+                {
+                    auto arg1 = __wargv[i++];
+                    wchar_t* p;
+                    auto x = wcstol(arg1, &p, 10);
+                    if (!p || *p || x <= 0 || x >= 7200000)
+                    {
+                        hr = E_INVALIDARG;
+                        MakeFormattedString(
+                            &errorReason,
+                            L"Timeout value is invalid (actual: %s)",
+                            arg1
+                        );
+                        break;
+                    }
+                    outOptions->connectTimeout = static_cast<DWORD>(x);
+                }
+            }
             else if (isMultipleCharOption && (
                 wcscmp(arg, L"wsl-socat") == 0 ||
                 wcscmp(arg, L"wsl-socat-log") == 0 ||
@@ -1034,6 +1450,126 @@ HRESULT ParseOptions(Option* outOptions)
                     }
                 }
             }
+            else if (isMultipleCharOption && wcscmp(arg, L"engine") == 0)
+            {
+                if (i >= __argc)
+                {
+                    hr = E_INVALIDARG;
+                    MakeFormattedString(
+                        &errorReason,
+                        L"Engine name is missing"
+                    );
+                    break;
+                }
+                else
+                {
+                    auto arg1 = __wargv[i++];
+                    if (wcscmp(arg1, L"thread") == 0)
+                        outOptions->engine = RelayEngine::Thread;
+                    else if (wcscmp(arg1, L"iocp") == 0)
+                        outOptions->engine = RelayEngine::Iocp;
+                    else
+                    {
+                        hr = E_INVALIDARG;
+                        MakeFormattedString(
+                            &errorReason,
+                            L"Engine name is invalid (actual: %s)",
+                            arg1
+                        );
+                        break;
+                    }
+                }
+            }
+            else if (isMultipleCharOption && wcscmp(arg, L"wsl-relay") == 0)
+            {
+                if (i >= __argc)
+                {
+                    hr = E_INVALIDARG;
+                    MakeFormattedString(
+                        &errorReason,
+                        L"WSL relay mode is missing"
+                    );
+                    break;
+                }
+                else
+                {
+                    auto arg1 = __wargv[i++];
+                    if (wcscmp(arg1, L"process") == 0)
+                        outOptions->wslRelayMode = WslRelayMode::Process;
+                    else if (wcscmp(arg1, L"persistent") == 0)
+                        outOptions->wslRelayMode = WslRelayMode::Persistent;
+                    else
+                    {
+                        hr = E_INVALIDARG;
+                        MakeFormattedString(
+                            &errorReason,
+                            L"WSL relay mode is invalid (actual: %s)",
+                            arg1
+                        );
+                        break;
+                    }
+                }
+            }
+            else if (isMultipleCharOption && wcscmp(arg, L"connector-pool") == 0)
+            {
+                if (i >= __argc)
+                {
+                    hr = E_INVALIDARG;
+                    MakeFormattedString(
+                        &errorReason,
+                        L"Pool size is missing"
+                    );
+                    break;
+                }
+                else
+                {
+                    auto arg1 = __wargv[i++];
+                    wchar_t* p;
+                    auto x = wcstol(arg1, &p, 10);
+                    if (!p || *p || x < 0 || x > static_cast<long>(CONNECTOR_POOL_MAX_SIZE))
+                    {
+                        hr = E_INVALIDARG;
+                        MakeFormattedString(
+                            &errorReason,
+                            L"Pool size is invalid (actual: %s, allowed: 0 - %lu)",
+                            arg1,
+                            CONNECTOR_POOL_MAX_SIZE
+                        );
+                        break;
+                    }
+                    outOptions->connectorPoolSize = static_cast<DWORD>(x);
+                }
+            }
+            else if (isMultipleCharOption && wcscmp(arg, L"metrics") == 0)
+            {
+                if (i >= __argc || !IsTcpSocketListenerName(__wargv[i]))
+                {
+                    hr = E_INVALIDARG;
+                    MakeFormattedString(
+                        &errorReason,
+                        L"Metrics listener must be 'tcp-socket [-4 | -6] [<address>:]<port>' (actual: %s)",
+                        i < __argc ? __wargv[i] : L"(null)"
+                    );
+                    break;
+                }
+                else
+                {
+                    ++i;
+                    TcpSocketListenerData* d;
+                    int c = 0;
+                    hr = ParseTcpSocketListener(&__wargv[i], __argc - i, &c, &d, &errorReason);
+                    if (FAILED(hr))
+                        break;
+                    i += c;
+                    if (outOptions->metricsListener)
+                    {
+                        if (outOptions->metricsListener->pszAddress)
+                            free(outOptions->metricsListener->pszAddress);
+                        free(outOptions->metricsListener);
+                    }
+                    outOptions->metricsListener = d;
+                }
+            }
             else
             {
                 hr = E_INVALIDARG;
@@ -1070,6 +1606,13 @@ HRESULT ParseOptions(Option* outOptions)
 _Use_decl_annotations_
 void ClearOptions(Option* options)
 {
+    if (options->metricsListener)
+    {
+        if (options->metricsListener->pszAddress)
+            free(options->metricsListener->pszAddress);
+        free(options->metricsListener);
+        options->metricsListener = nullptr;
+    }
     if (options->listeners)
     {
         for (auto iter : *options->listeners)
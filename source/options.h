@@ -3,6 +3,7 @@
 #include <vector>
 
 #include "logger/logger.h"
+#include "util/socket.h"
 
 enum class ListenerType : WORD
 {
@@ -16,11 +17,39 @@ enum class ListenerType : WORD
 };
 
 #define WSL_DEFAULT_TIMEOUT  30000
+#define CONNECT_DEFAULT_TIMEOUT  10000
+
+#define COALESCE_DEFAULT_SIZE  (64 * 1024)
+
+enum class CoalesceMode : BYTE
+{
+    // gathers continuously received data while the inter-arrival time is short
+    Adaptive = 0,
+    // forwards each received data immediately
+    Latency,
+    // gathers already-received data up to the threshold size
+    Throughput,
+    _Count
+};
+
+// options for relaying the connections accepted by the listener
+struct RelayOptions
+{
+    // the range of the read buffer size (in bytes)
+    DWORD bufferMinSize;
+    DWORD bufferMaxSize;
+    CoalesceMode coalesceMode;
+    // the maximum size of gathered data before writing (in bytes)
+    DWORD coalesceSize;
+};
 
 struct ListenerData
 {
     ListenerType type;
     WORD id;
+    RelayOptions relay;
+    // count of AcceptEx operations kept posted (socket-based listeners only; 0 to accept on the event)
+    DWORD pendingAcceptCount;
 };
 
 struct TcpSocketListenerData : public ListenerData
@@ -28,6 +57,7 @@ struct TcpSocketListenerData : public ListenerData
     WORD port;
     bool isIPv6;
     _Field_z_ PWSTR pszAddress;
+    TcpSocketOptions socketOptions;
 };
 
 struct UnixSocketListenerData : public ListenerData
@@ -44,6 +74,11 @@ struct CygwinSockFileListenerData : public ListenerData
 struct PipeListenerData : public ListenerData
 {
     _Field_z_ PWSTR pszPipeName;
+    // count of pipe instances waiting for clients on start, and the count they can grow to under load
+    DWORD instanceCount;
+    DWORD maxInstanceCount;
+    // input/output buffer size of each pipe instance (in bytes)
+    DWORD bufferSize;
 };
 
 struct WslTcpSocketListenerData : public ListenerData
@@ -80,6 +115,7 @@ struct TcpSocketConnectorData : public ConnectorData
 {
     WORD port;
     _Field_z_ PWSTR pszAddress;
+    TcpSocketOptions socketOptions;
 };
 
 struct UnixSocketConnectorData : public ConnectorData
@@ -109,6 +145,24 @@ struct WslUnixSocketConnectorData : public ConnectorData
 
 typedef ListenerData* PListenerData;
 
+enum class RelayEngine : BYTE
+{
+    // one worker thread per connection
+    Thread = 0,
+    // fixed count of worker threads driven by the I/O completion port
+    Iocp,
+    _Count
+};
+
+enum class WslRelayMode : BYTE
+{
+    // one WSL socat process per connection
+    Process = 0,
+    // one long-lived WSL socat process reached via loopback TCP
+    Persistent,
+    _Count
+};
+
 struct Option
 {
     PWSTR proxyPipeId;
@@ -116,8 +170,16 @@ struct Option
     std::vector<ListenerData*>* listeners;
     ConnectorData* connector;
     DWORD wslDefaultTimeout;
+    // timeout for connecting with tcp-socket connector
+    DWORD connectTimeout;
     LogLevel logLevel;
     BYTE wslSocatLogLevel;
+    RelayEngine engine;
+    WslRelayMode wslRelayMode;
+    // count of the connections made in advance (0 to disable)
+    DWORD connectorPoolSize;
+    // listener serving the statistics (nullptr to disable)
+    TcpSocketListenerData* metricsListener;
 };
 
 _Check_return_
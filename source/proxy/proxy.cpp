@@ -23,12 +23,15 @@ public:
 #endif
     }
 
+    virtual bool IsEnabled(_In_ LogLevel level) const
+    {
+        return level <= m_logLevel;
+    }
+
 protected:
     virtual void OnLog(_In_ LogLevel level, _In_z_ PCWSTR pszLog)
     {
-        if (level > m_logLevel)
-            return;
-
+        UNREFERENCED_PARAMETER(level);
         auto r = ::WideCharToMultiByte(CP_UTF8, 0, pszLog, -1, nullptr, 0, nullptr, nullptr);
         if (!r)
             return;
@@ -140,7 +143,7 @@ int ProxyMain(const Option& options)
     PipeDuplex pipeTo(hPipe, hPipe);
 
     ::ResetEvent(hQuit);
-    hr = Transfer(hQuit, &pipeFrom, &pipeTo, AddLogFormatted);
+    hr = Transfer(hQuit, &pipeFrom, &pipeTo, nullptr, nullptr, AddLogFormatted);
 
     if (myLogger != nullptr)
     {
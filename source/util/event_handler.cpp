@@ -1,48 +1,129 @@
 #include "../framework.h"
 #include "event_handler.h"
 
+#include <unordered_map>
+
+// Each handle is waited by a thread pool wait, and the wait callback only pushes the handler
+// to the lock-free ready list; the handler is called on the thread calling ProcessEventHandlers
+// and the wait is re-armed after that. (so at most one entry for each handler is in the list)
 struct _EventHandlerData
 {
+    // must be the first member (for SLIST alignment)
+    SLIST_ENTRY entry;
     HANDLE hEvent;
     void (CALLBACK* pfnCallback)(void* data);
     void* data;
+    PTP_WAIT wait;
+    // one for the registration, and one while queued in the ready list
+    volatile LONG refs;
+    // held while the callback is called; UnregisterEventHandler acquires this to wait for the callback
+    CRITICAL_SECTION csDispatch;
+    // set to non-zero (with the interlocked operation) in g_csHandlers
+    volatile LONG isUnregistered;
 };
 
-std::vector<HANDLE>* g_pHandles = nullptr;
-std::vector<_EventHandlerData>* g_pHandlers = nullptr;
+static CRITICAL_SECTION g_csHandlers;
+static std::unordered_map<HANDLE, _EventHandlerData*>* g_pHandlers = nullptr;
+static SLIST_HEADER g_readyList;
+static HANDLE g_hEventReady = nullptr;
+
+static void _ReleaseHandlerData(_In_ _EventHandlerData* p)
+{
+    if (::InterlockedDecrement(&p->refs) == 0)
+    {
+        ::DeleteCriticalSection(&p->csDispatch);
+        _aligned_free(p);
+    }
+}
+
+static void CALLBACK _WaitCallback(PTP_CALLBACK_INSTANCE instance, void* context, PTP_WAIT wait, TP_WAIT_RESULT waitResult)
+{
+    UNREFERENCED_PARAMETER(instance);
+    UNREFERENCED_PARAMETER(wait);
+    UNREFERENCED_PARAMETER(waitResult);
+    auto p = static_cast<_EventHandlerData*>(context);
+    ::InterlockedIncrement(&p->refs);
+    ::InterlockedPushEntrySList(&g_readyList, &p->entry);
+    ::SetEvent(g_hEventReady);
+}
 
 _Check_return_ bool InitEventHandler()
 {
-    g_pHandles = new std::vector<HANDLE>();
-    if (!g_pHandles)
+    ::InitializeSListHead(&g_readyList);
+    g_hEventReady = ::CreateEventW(nullptr, FALSE, FALSE, nullptr);
+    if (!g_hEventReady)
         return false;
-    g_pHandlers = new std::vector<_EventHandlerData>();
+    g_pHandlers = new std::unordered_map<HANDLE, _EventHandlerData*>();
     if (!g_pHandlers)
         return false;
+    ::InitializeCriticalSection(&g_csHandlers);
     return true;
 }
 
 void CleanupEventHandler()
 {
-    if (g_pHandles)
-    {
-        delete g_pHandles;
-        g_pHandles = nullptr;
-    }
     if (g_pHandlers)
     {
+        while (!g_pHandlers->empty())
+            UnregisterEventHandler(g_pHandlers->begin()->first);
+        // release the handlers left in the ready list
+        auto entry = ::InterlockedFlushSList(&g_readyList);
+        while (entry)
+        {
+            auto next = entry->Next;
+            _ReleaseHandlerData(CONTAINING_RECORD(entry, _EventHandlerData, entry));
+            entry = next;
+        }
         delete g_pHandlers;
         g_pHandlers = nullptr;
+        ::DeleteCriticalSection(&g_csHandlers);
+    }
+    if (g_hEventReady)
+    {
+        ::CloseHandle(g_hEventReady);
+        g_hEventReady = nullptr;
     }
 }
 
 _Use_decl_annotations_
 void RegisterEventHandler(HANDLE hEvent, void (CALLBACK* pfnCallback)(void* data), void* data)
 {
-    _Analysis_assume_(g_pHandles != nullptr);
     _Analysis_assume_(g_pHandlers != nullptr);
-    g_pHandles->push_back(hEvent);
-    g_pHandlers->push_back({ hEvent, pfnCallback, data });
+    // replace the existing registration for the same handle
+    UnregisterEventHandler(hEvent);
+
+    auto p = static_cast<_EventHandlerData*>(_aligned_malloc(sizeof(_EventHandlerData), MEMORY_ALLOCATION_ALIGNMENT));
+    if (!p)
+        return;
+    p->entry.Next = nullptr;
+    p->hEvent = hEvent;
+    p->pfnCallback = pfnCallback;
+    p->data = data;
+    p->refs = 1;
+    p->isUnregistered = 0;
+    p->wait = ::CreateThreadpoolWait(_WaitCallback, p, nullptr);
+    if (!p->wait)
+    {
+        _aligned_free(p);
+        return;
+    }
+    ::InitializeCriticalSection(&p->csDispatch);
+
+    ::EnterCriticalSection(&g_csHandlers);
+    try
+    {
+        g_pHandlers->emplace(hEvent, p);
+    }
+    catch (...)
+    {
+        ::LeaveCriticalSection(&g_csHandlers);
+        ::CloseThreadpoolWait(p->wait);
+        ::DeleteCriticalSection(&p->csDispatch);
+        _aligned_free(p);
+        return;
+    }
+    ::SetThreadpoolWait(p->wait, hEvent, nullptr);
+    ::LeaveCriticalSection(&g_csHandlers);
 }
 
 _Use_decl_annotations_
@@ -50,23 +131,31 @@ void UnregisterEventHandler(HANDLE hEvent)
 {
     if (hEvent == INVALID_HANDLE_VALUE)
         return;
-    _Analysis_assume_(g_pHandles != nullptr);
     _Analysis_assume_(g_pHandlers != nullptr);
 
-    auto it1 = g_pHandles->begin();
-    auto it2 = g_pHandlers->begin();
-    while (true)
+    ::EnterCriticalSection(&g_csHandlers);
+    auto it = g_pHandlers->find(hEvent);
+    if (it == g_pHandlers->end())
     {
-        if (it1 == g_pHandles->end())
-            break;
-        if (*it1 == hEvent)
-        {
-            g_pHandles->erase(it1, it1 + 1);
-            g_pHandlers->erase(it2, it2 + 1);
-            break;
-        }
-        ++it1;
+        ::LeaveCriticalSection(&g_csHandlers);
+        return;
     }
+    auto p = it->second;
+    g_pHandlers->erase(it);
+    ::InterlockedExchange(&p->isUnregistered, 1);
+    ::SetThreadpoolWait(p->wait, nullptr, nullptr);
+    ::LeaveCriticalSection(&g_csHandlers);
+
+    // wait for the callback in progress on the dispatching thread; the callback checks
+    // isUnregistered in csDispatch, so it is never called after this
+    // (csDispatch is recursive, so this returns immediately when called in the callback itself)
+    ::EnterCriticalSection(&p->csDispatch);
+    ::LeaveCriticalSection(&p->csDispatch);
+
+    // the wait callback does not take g_csHandlers, so this never deadlocks
+    ::WaitForThreadpoolWaitCallbacks(p->wait, TRUE);
+    ::CloseThreadpoolWait(p->wait);
+    _ReleaseHandlerData(p);
 }
 
 //_Use_decl_annotations_
@@ -74,16 +163,38 @@ void ProcessEventHandlers()
 {
     while (true)
     {
-        auto size = static_cast<DWORD>(g_pHandles ? g_pHandles->size() : 0);
-        auto arr = size > 0 ? &g_pHandles->at(0) : nullptr;
-        auto r = ::MsgWaitForMultipleObjectsEx(size, arr, INFINITE, QS_ALLINPUT, MWMO_INPUTAVAILABLE);
-        if (r >= WAIT_OBJECT_0 && r < WAIT_OBJECT_0 + size)
+        auto r = ::MsgWaitForMultipleObjectsEx(1, &g_hEventReady, INFINITE, QS_ALLINPUT, MWMO_INPUTAVAILABLE);
+        if (r == WAIT_OBJECT_0)
         {
-            auto index = r - WAIT_OBJECT_0;
-            auto listener = g_pHandlers->cbegin() + index;
-            listener->pfnCallback(listener->data);
+            // the list is LIFO; reverse it to call handlers in signaled order
+            auto entry = ::InterlockedFlushSList(&g_readyList);
+            PSLIST_ENTRY ordered = nullptr;
+            while (entry)
+            {
+                auto next = entry->Next;
+                entry->Next = ordered;
+                ordered = entry;
+                entry = next;
+            }
+            while (ordered)
+            {
+                auto next = ordered->Next;
+                auto p = CONTAINING_RECORD(ordered, _EventHandlerData, entry);
+                // (isUnregistered may be set by other threads at any time, and UnregisterEventHandler
+                // waits for csDispatch after setting it)
+                ::EnterCriticalSection(&p->csDispatch);
+                if (!::InterlockedCompareExchange(&p->isUnregistered, 0, 0))
+                    p->pfnCallback(p->data);
+                ::LeaveCriticalSection(&p->csDispatch);
+                ::EnterCriticalSection(&g_csHandlers);
+                if (!p->isUnregistered)
+                    ::SetThreadpoolWait(p->wait, p->hEvent, nullptr);
+                ::LeaveCriticalSection(&g_csHandlers);
+                _ReleaseHandlerData(p);
+                ordered = next;
+            }
         }
-        else if (r == WAIT_OBJECT_0 + size)
+        else if (r == WAIT_OBJECT_0 + 1)
         {
             return;
         }
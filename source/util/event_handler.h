@@ -1,8 +1,16 @@
 #pragma once
 
+// Registers the callback called when hEvent is signaled.
+// This function and UnregisterEventHandler can be called from any thread,
+// but callbacks are always called on the thread calling ProcessEventHandlers.
+// (the number of handles is not limited by MAXIMUM_WAIT_OBJECTS)
 void RegisterEventHandler(_In_ HANDLE hEvent, _In_ void (CALLBACK* pfnCallback)(void* data), _In_opt_ void* data);
+// After returning, the callback for hEvent is not called and is not running; when called from
+// other threads, waits for the callback in progress on the dispatching thread (so must not be
+// called while holding locks taken by the callback). Can be called in the callback itself.
 void UnregisterEventHandler(_In_ HANDLE hEvent);
 
 _Check_return_ bool InitEventHandler();
 void CleanupEventHandler();
+// Calls the callbacks for signaled handles, and returns when any window message is available
 void ProcessEventHandlers();
@@ -76,10 +76,10 @@ void ReplaceReturnChars(std::wstring& string)
     }
 }
 
-static ULONGLONG s_dwPipeCount = 0;
+static volatile LONG64 s_dwPipeCount = 0;
 
 _Use_decl_annotations_
-HRESULT CreateOverlappedPipe(bool isOverlapped, HANDLE* outPipeRead, HANDLE* outPipeWrite, SECURITY_ATTRIBUTES* psa)
+HRESULT CreateOverlappedPipe(bool isOverlapped, bool isWriteOverlapped, HANDLE* outPipeRead, HANDLE* outPipeWrite, SECURITY_ATTRIBUTES* psa)
 {
     *outPipeRead = INVALID_HANDLE_VALUE;
     *outPipeWrite = INVALID_HANDLE_VALUE;
@@ -90,30 +90,33 @@ HRESULT CreateOverlappedPipe(bool isOverlapped, HANDLE* outPipeRead, HANDLE* out
         return S_OK;
     }
     PWSTR pName;
+    // (the name must be unique while the pipe is being created on other threads)
     auto hr = MakeFormattedString(&pName, PIPE_ANONYMOUS_NAME_FORMAT,
-        ::GetCurrentProcessId(), s_dwPipeCount);
+        ::GetCurrentProcessId(), static_cast<ULONGLONG>(::InterlockedIncrement64(&s_dwPipeCount)));
     if (FAILED(hr))
         return hr;
-    auto hRead = ::CreateNamedPipeW(pName, PIPE_ACCESS_INBOUND | FILE_FLAG_OVERLAPPED,
+    // the server end is opened for overlapped I/O, and the client end is synchronous
+    // (the client end is usually passed to the child process, which may not support overlapped I/O)
+    auto hServer = ::CreateNamedPipeW(pName, (isWriteOverlapped ? PIPE_ACCESS_OUTBOUND : PIPE_ACCESS_INBOUND) | FILE_FLAG_OVERLAPPED,
         PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT, 1, 4096, 4096, 0, psa);
-    if (hRead == INVALID_HANDLE_VALUE)
+    if (hServer == INVALID_HANDLE_VALUE)
     {
         auto err = ::GetLastError();
         free(pName);
         return HRESULT_FROM_WIN32(err);
     }
-    auto hWrite = ::CreateFileW(pName, GENERIC_WRITE, FILE_SHARE_READ, psa, OPEN_EXISTING, 0, nullptr);
-    if (hWrite == INVALID_HANDLE_VALUE)
+    auto hClient = ::CreateFileW(pName, isWriteOverlapped ? GENERIC_READ : GENERIC_WRITE,
+        isWriteOverlapped ? FILE_SHARE_WRITE : FILE_SHARE_READ, psa, OPEN_EXISTING, 0, nullptr);
+    if (hClient == INVALID_HANDLE_VALUE)
     {
         auto err = ::GetLastError();
-        ::CloseHandle(hRead);
+        ::CloseHandle(hServer);
         free(pName);
         return HRESULT_FROM_WIN32(err);
     }
     free(pName);
-    ++s_dwPipeCount;
-    *outPipeRead = hRead;
-    *outPipeWrite = hWrite;
+    *outPipeRead = isWriteOverlapped ? hClient : hServer;
+    *outPipeWrite = isWriteOverlapped ? hServer : hClient;
     return S_OK;
 }
 
@@ -225,6 +228,19 @@ void ResetOverlapped(OVERLAPPED* pol)
     pol->hEvent = h;
 }
 
+LONGLONG GetMicroseconds()
+{
+    static LONGLONG s_frequency = 0;
+    LARGE_INTEGER li;
+    if (!s_frequency)
+    {
+        ::QueryPerformanceFrequency(&li);
+        s_frequency = li.QuadPart;
+    }
+    ::QueryPerformanceCounter(&li);
+    return li.QuadPart / s_frequency * 1000000 + li.QuadPart % s_frequency * 1000000 / s_frequency;
+}
+
 static wchar_t* s_pszCurrentProcessModuleName = nullptr;
 
 static void __cdecl _CleanupCurrentProcessModuleName()
@@ -7,7 +7,10 @@ void ReplaceReturnChars(_Inout_ std::wstring& string);
 HRESULT GetErrorString(_In_ HRESULT hr, _Out_ PWSTR* outMessage);
 HRESULT LoadStringToObject(_In_ HINSTANCE hInstance, _In_ UINT id, _Out_ std::wstring& string);
 
-HRESULT CreateOverlappedPipe(_In_ bool isOverlapped, _Out_ HANDLE* outPipeRead, _Out_ HANDLE* outPipeWrite, _In_opt_ SECURITY_ATTRIBUTES* psa);
+// Creates the anonymous pipe; if isOverlapped is true, the write end (isWriteOverlapped = true) or the read end
+// (false) is opened for overlapped I/O, and the other end is opened for synchronous I/O
+HRESULT CreateOverlappedPipe(_In_ bool isOverlapped, _In_ bool isWriteOverlapped,
+    _Out_ HANDLE* outPipeRead, _Out_ HANDLE* outPipeWrite, _In_opt_ SECURITY_ATTRIBUTES* psa);
 
 HRESULT ReadFileTimeout(
     _In_ HANDLE hFile,
@@ -34,6 +37,9 @@ HRESULT ReadFileLineUtf8(
 );
 void ResetOverlapped(_Inout_ OVERLAPPED* pol);
 
+// Returns the monotonic time in microseconds (from QueryPerformanceCounter)
+LONGLONG GetMicroseconds();
+
 HRESULT InitCurrentProcessModuleName(_In_ HINSTANCE hInstance);
 PCWSTR GetCurrentProcessModuleName();
 
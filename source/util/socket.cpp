@@ -1,6 +1,8 @@
 #include "../framework.h"
 #include "socket.h"
 
+#include <mstcpip.h>
+
 _Use_decl_annotations_
 HRESULT GetWSAErrorAsHResult(int result)
 {
@@ -40,13 +42,13 @@ int recvTimeout(
             return SOCKET_ERROR;
         if (r == 0)
             break;
-        auto x = ::recv(s, curPtr, 1, 0);
-        if (r == SOCKET_ERROR)
+        auto x = ::recv(s, curPtr, len - recvBytes, flags);
+        if (x == SOCKET_ERROR)
             return SOCKET_ERROR;
-        if (r == 0)
+        if (x == 0)
             break;
-        ++curPtr;
-        ++recvBytes;
+        curPtr += x;
+        recvBytes += x;
         if (recvBytes == len)
             break;
 
@@ -58,3 +60,73 @@ int recvTimeout(
     }
     return recvBytes;
 }
+
+static volatile LONG64 s_socketOptionFailedCount = 0;
+
+_Use_decl_annotations_
+HRESULT ApplyTcpSocketOptions(SOCKET s, const TcpSocketOptions* options)
+{
+    HRESULT hr = S_OK;
+    if (options->isNoDelay)
+    {
+        BOOL value = TRUE;
+        if (::setsockopt(s, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&value), sizeof(value)) == SOCKET_ERROR)
+            hr = GetLastWSAErrorAsHResult();
+    }
+    if (options->keepAliveTime && SUCCEEDED(hr))
+    {
+        tcp_keepalive keepAlive;
+        keepAlive.onoff = 1;
+        keepAlive.keepalivetime = options->keepAliveTime;
+        keepAlive.keepaliveinterval = 1000;
+        DWORD dw = 0;
+        if (::WSAIoctl(s, SIO_KEEPALIVE_VALS, &keepAlive, sizeof(keepAlive), nullptr, 0, &dw, nullptr, nullptr) == SOCKET_ERROR)
+            hr = GetLastWSAErrorAsHResult();
+    }
+    if (options->receiveBufferSize && SUCCEEDED(hr))
+    {
+        int value = static_cast<int>(options->receiveBufferSize);
+        if (::setsockopt(s, SOL_SOCKET, SO_RCVBUF, reinterpret_cast<const char*>(&value), sizeof(value)) == SOCKET_ERROR)
+            hr = GetLastWSAErrorAsHResult();
+    }
+    if (options->sendBufferSize && SUCCEEDED(hr))
+    {
+        int value = static_cast<int>(options->sendBufferSize);
+        if (::setsockopt(s, SOL_SOCKET, SO_SNDBUF, reinterpret_cast<const char*>(&value), sizeof(value)) == SOCKET_ERROR)
+            hr = GetLastWSAErrorAsHResult();
+    }
+    if (FAILED(hr))
+        ::InterlockedIncrement64(&s_socketOptionFailedCount);
+    return hr;
+}
+
+LONG64 GetTcpSocketOptionFailedCount()
+{
+    return s_socketOptionFailedCount;
+}
+
+_Use_decl_annotations_
+void FormatTcpSocketOptions(const TcpSocketOptions* options, std::wstring& outString)
+{
+    auto length = outString.length();
+    WCHAR buf[32];
+    if (options->isNoDelay)
+        outString += L"nodelay";
+    if (options->keepAliveTime)
+    {
+        swprintf_s(buf, L"%skeepalive=%lu", outString.length() > length ? L", " : L"", options->keepAliveTime);
+        outString += buf;
+    }
+    if (options->receiveBufferSize)
+    {
+        swprintf_s(buf, L"%srcvbuf=%lu", outString.length() > length ? L", " : L"", options->receiveBufferSize);
+        outString += buf;
+    }
+    if (options->sendBufferSize)
+    {
+        swprintf_s(buf, L"%ssndbuf=%lu", outString.length() > length ? L", " : L"", options->sendBufferSize);
+        outString += buf;
+    }
+    if (outString.length() == length)
+        outString += L"default";
+}
@@ -1,5 +1,17 @@
 #pragma once
 
+// options applied to TCP sockets (zero-initialized options change nothing)
+struct TcpSocketOptions
+{
+    // whether to set TCP_NODELAY (disables Nagle's algorithm)
+    bool isNoDelay;
+    // idle time before sending keep-alive probes in milliseconds (0 to keep the system default)
+    DWORD keepAliveTime;
+    // SO_RCVBUF and SO_SNDBUF in bytes (0 to keep the system default, which is auto-tuned)
+    DWORD receiveBufferSize;
+    DWORD sendBufferSize;
+};
+
 _Post_satisfies_(FAILED(return))
 HRESULT GetWSAErrorAsHResult(_In_ int result);
 _Post_satisfies_(FAILED(return))
@@ -12,3 +24,11 @@ int recvTimeout(
     _In_ int flags,
     _In_ DWORD dwTimeoutMillisec
 );
+
+// Applies the options to the socket; the failure is also counted for GetTcpSocketOptionFailedCount
+_Check_return_
+HRESULT ApplyTcpSocketOptions(_In_ SOCKET s, _In_ const TcpSocketOptions* options);
+// Returns the count of sockets for which ApplyTcpSocketOptions has failed
+LONG64 GetTcpSocketOptionFailedCount();
+// Appends the human-readable text of the options (e.g. "nodelay, rcvbuf=1048576", or "default")
+void FormatTcpSocketOptions(_In_ const TcpSocketOptions* options, _Inout_ std::wstring& outString);
@@ -10,8 +10,47 @@
 static PWSTR s_pszWslExePath = nullptr;
 static PWSTR s_pszWslPathPath = nullptr;
 
+enum class WslCacheKind : BYTE
+{
+    Which = 0,
+    Path,
+};
+
+struct WslCacheEntry
+{
+    WslCacheEntry* next;
+    WslCacheKind kind;
+    // empty string for the default distribution
+    PWSTR pszDistribution;
+    PWSTR pszKey;
+    PWSTR pszValue;
+};
+
+static SRWLOCK s_lockCache = SRWLOCK_INIT;
+static WslCacheEntry* s_pCacheHead = nullptr;
+
+// statistics of WslExecute (the time is spent by CreateProcessW, in microseconds)
+static volatile LONG64 s_spawnCount = 0;
+static volatile LONG64 s_spawnTimeTotal = 0;
+
+static void _FreeCacheEntry(_In_ _Post_invalid_ WslCacheEntry* entry)
+{
+    free(entry->pszDistribution);
+    free(entry->pszKey);
+    free(entry->pszValue);
+    free(entry);
+}
+
 static void __cdecl _CleanupWsl()
 {
+    ::AcquireSRWLockExclusive(&s_lockCache);
+    while (s_pCacheHead)
+    {
+        auto next = s_pCacheHead->next;
+        _FreeCacheEntry(s_pCacheHead);
+        s_pCacheHead = next;
+    }
+    ::ReleaseSRWLockExclusive(&s_lockCache);
     if (s_pszWslPathPath)
     {
         free(s_pszWslPathPath);
@@ -334,13 +373,15 @@ HRESULT WslExecute(
     HANDLE hPipeStdInRead, hPipeStdInWrite;
     HANDLE hPipeStdOutRead, hPipeStdOutWrite;
     HANDLE hPipeStdErrRead, hPipeStdErrWrite;
-    hr = CreateOverlappedPipe(isPipeOverlapped , &hPipeStdInRead, &hPipeStdInWrite, &sa);
+    // the end used by this process is overlapped (this process writes to stdin, and reads stdout and stderr);
+    // the child process receives the synchronous ends
+    hr = CreateOverlappedPipe(isPipeOverlapped, true, &hPipeStdInRead, &hPipeStdInWrite, &sa);
     if (FAILED(hr))
     {
         free(psz);
         return hr;
     }
-    hr = CreateOverlappedPipe(isPipeOverlapped, &hPipeStdOutRead, &hPipeStdOutWrite, &sa);
+    hr = CreateOverlappedPipe(isPipeOverlapped, false, &hPipeStdOutRead, &hPipeStdOutWrite, &sa);
     if (FAILED(hr))
     {
         free(psz);
@@ -348,7 +389,7 @@ HRESULT WslExecute(
         ::CloseHandle(hPipeStdInWrite);
         return hr;
     }
-    hr = CreateOverlappedPipe(isPipeOverlapped, &hPipeStdErrRead, &hPipeStdErrWrite, &sa);
+    hr = CreateOverlappedPipe(isPipeOverlapped, false, &hPipeStdErrRead, &hPipeStdErrWrite, &sa);
     if (FAILED(hr))
     {
         free(psz);
@@ -381,8 +422,14 @@ HRESULT WslExecute(
     si.dwFlags = STARTF_USESTDHANDLES;
     PROCESS_INFORMATION pi = { 0 };
     auto oldMode = ::SetErrorMode(SEM_FAILCRITICALERRORS);
+    auto timeStart = GetMicroseconds();
     auto ret = ::CreateProcessW(nullptr, psz, nullptr, nullptr, TRUE, CREATE_NO_WINDOW | CREATE_NEW_PROCESS_GROUP, nullptr, nullptr, &si, &pi);
     ::SetErrorMode(oldMode);
+    if (ret)
+    {
+        ::InterlockedIncrement64(&s_spawnCount);
+        ::InterlockedAdd64(&s_spawnTimeTotal, GetMicroseconds() - timeStart);
+    }
     if (!ret)
     {
         auto dw = ::GetLastError();
@@ -518,6 +565,111 @@ HRESULT WslPath(PCWSTR pszDistribution, PCWSTR pszFile, DWORD dwTimeoutMillisec,
     return S_OK;
 }
 
+static PCWSTR _GetCacheDistributionName(_In_opt_z_ PCWSTR pszDistribution)
+{
+    return pszDistribution ? pszDistribution : L"";
+}
+
+// returns S_OK with the copied value if found, or S_FALSE if not cached
+static HRESULT _LookupCache(_In_ WslCacheKind kind, _In_opt_z_ PCWSTR pszDistribution, _In_z_ PCWSTR pszKey,
+    _When_(return == S_OK, _Outptr_) PWSTR* outValue)
+{
+    auto pszD = _GetCacheDistributionName(pszDistribution);
+    HRESULT hr = S_FALSE;
+    ::AcquireSRWLockShared(&s_lockCache);
+    for (auto entry = s_pCacheHead; entry; entry = entry->next)
+    {
+        // distribution name is case-insensitive
+        if (entry->kind == kind && _wcsicmp(entry->pszDistribution, pszD) == 0 && wcscmp(entry->pszKey, pszKey) == 0)
+        {
+            auto p = _wcsdup(entry->pszValue);
+            if (!p)
+                hr = E_OUTOFMEMORY;
+            else
+            {
+                *outValue = p;
+                hr = S_OK;
+            }
+            break;
+        }
+    }
+    ::ReleaseSRWLockShared(&s_lockCache);
+    return hr;
+}
+
+static void _AddCache(_In_ WslCacheKind kind, _In_opt_z_ PCWSTR pszDistribution, _In_z_ PCWSTR pszKey, _In_z_ PCWSTR pszValue)
+{
+    // failing to cache is not an error (the value will be resolved again)
+    auto entry = static_cast<WslCacheEntry*>(malloc(sizeof(WslCacheEntry)));
+    if (!entry)
+        return;
+    entry->kind = kind;
+    entry->pszDistribution = _wcsdup(_GetCacheDistributionName(pszDistribution));
+    entry->pszKey = _wcsdup(pszKey);
+    entry->pszValue = _wcsdup(pszValue);
+    if (!entry->pszDistribution || !entry->pszKey || !entry->pszValue)
+    {
+        _FreeCacheEntry(entry);
+        return;
+    }
+    ::AcquireSRWLockExclusive(&s_lockCache);
+    entry->next = s_pCacheHead;
+    s_pCacheHead = entry;
+    ::ReleaseSRWLockExclusive(&s_lockCache);
+}
+
+_Use_decl_annotations_
+HRESULT WslWhichCached(PCWSTR pszDistribution, PCWSTR pszExecutable, DWORD dwTimeoutMillisec, PWSTR* pszResult)
+{
+    auto hr = _LookupCache(WslCacheKind::Which, pszDistribution, pszExecutable, pszResult);
+    if (hr != S_FALSE)
+        return hr;
+    hr = WslWhich(pszDistribution, pszExecutable, dwTimeoutMillisec, pszResult);
+    // 'not found' is not cached (the executable may be installed later)
+    if (hr == S_OK)
+        _AddCache(WslCacheKind::Which, pszDistribution, pszExecutable, *pszResult);
+    return hr;
+}
+
+_Use_decl_annotations_
+HRESULT WslPathCached(PCWSTR pszDistribution, PCWSTR pszFile, DWORD dwTimeoutMillisec, PWSTR* pszResult)
+{
+    auto hr = _LookupCache(WslCacheKind::Path, pszDistribution, pszFile, pszResult);
+    if (hr != S_FALSE)
+        return hr;
+    hr = WslPath(pszDistribution, pszFile, dwTimeoutMillisec, pszResult);
+    if (SUCCEEDED(hr))
+        _AddCache(WslCacheKind::Path, pszDistribution, pszFile, *pszResult);
+    return hr;
+}
+
+_Use_decl_annotations_
+void WslInvalidateCache(PCWSTR pszDistribution)
+{
+    auto pszD = _GetCacheDistributionName(pszDistribution);
+    ::AcquireSRWLockExclusive(&s_lockCache);
+    auto pp = &s_pCacheHead;
+    while (*pp)
+    {
+        auto entry = *pp;
+        if (_wcsicmp(entry->pszDistribution, pszD) == 0)
+        {
+            *pp = entry->next;
+            _FreeCacheEntry(entry);
+        }
+        else
+            pp = &entry->next;
+    }
+    ::ReleaseSRWLockExclusive(&s_lockCache);
+}
+
+_Use_decl_annotations_
+void WslGetSpawnStats(LONG64* outCount, LONG64* outTotalMicroseconds)
+{
+    *outCount = s_spawnCount;
+    *outTotalMicroseconds = s_spawnTimeTotal;
+}
+
 _Use_decl_annotations_
 HRESULT WslTestIfWritable(PCWSTR pszDistribution, PCWSTR pszWslFile, DWORD dwTimeoutMillisec)
 {
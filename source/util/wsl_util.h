@@ -41,6 +41,31 @@ HRESULT WslPath(
     _When_(SUCCEEDED(return), _Outptr_) PWSTR* pszResult
 );
 
+// same as WslWhich/WslPath but the successful results are cached per distribution
+// (the result must be freed by the caller as well)
+_Check_return_
+HRESULT WslWhichCached(
+    _In_opt_z_ PCWSTR pszDistribution,
+    _In_z_ PCWSTR pszExecutable,
+    _In_ DWORD dwTimeoutMillisec,
+    _When_(return == S_OK, _Outptr_) _When_(return == S_FALSE, _Post_satisfies_(*pszResult == nullptr)) PWSTR* pszResult
+);
+
+_Check_return_
+HRESULT WslPathCached(
+    _In_opt_z_ PCWSTR pszDistribution,
+    _In_z_ PCWSTR pszFile,
+    _In_ DWORD dwTimeoutMillisec,
+    _When_(SUCCEEDED(return), _Outptr_) PWSTR* pszResult
+);
+
+// discards the cached results for the distribution (nullptr for the default distribution);
+// call this when the distribution may have been restarted or changed
+void WslInvalidateCache(_In_opt_z_ PCWSTR pszDistribution);
+
+// retrieves the count of processes started by WslExecute and the total time to start them (in microseconds)
+void WslGetSpawnStats(_Out_ LONG64* outCount, _Out_ LONG64* outTotalMicroseconds);
+
 // return S_OK if pszWslFile is writable file name (i.e. not dir) or S_FALSE otherwise
 _Check_return_
 HRESULT WslTestIfWritable(
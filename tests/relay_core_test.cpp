@@ -0,0 +1,531 @@
+// Tests of RelayCore (source/app/relay_core.cpp) driven by an epoll-based stand-in for the completion port.
+// Built with CMakeLists.txt on Linux; returns non-zero if any check fails.
+
+#include "relay_core.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+static int g_failedCount = 0;
+
+#define CHECK(expr) \
+    do { \
+        if (!(expr)) \
+        { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #expr); \
+            ++g_failedCount; \
+        } \
+    } while (0)
+
+// the capacity of chunks read by EpollRelayIo
+constexpr size_t CHUNK_CAPACITY = 4096;
+
+struct TestChunk
+{
+    size_t size;
+    unsigned char data[CHUNK_CAPACITY];
+};
+
+// Emulates overlapped reads and writes on two non-blocking sockets: each requested operation is performed
+// when epoll reports the socket ready, and its completion is reported to RelayCore from the loop thread
+class EpollRelayIo : public RelayCoreIo
+{
+public:
+    EpollRelayIo(int fd0, int fd1)
+        : m_fds{ fd0, fd1 }
+        , m_epoll(epoll_create1(0))
+        , m_wake(eventfd(0, EFD_NONBLOCK))
+    {
+        for (int i = 0; i < 2; ++i)
+        {
+            fcntl(m_fds[i], F_SETFL, fcntl(m_fds[i], F_GETFL) | O_NONBLOCK);
+            epoll_event ev = {};
+            ev.data.u32 = static_cast<uint32_t>(i);
+            epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_fds[i], &ev);
+        }
+        epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.u32 = 2;
+        epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_wake, &ev);
+        m_thread = std::thread([this]() { Loop(); });
+    }
+
+    ~EpollRelayIo()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            m_isStopping = true;
+        }
+        Wake();
+        m_thread.join();
+        close(m_wake);
+        close(m_epoll);
+    }
+
+    void SetCore(RelayCore* core) { m_core = core; }
+
+    virtual RelayStatus StartRead(int channel)
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        if (m_startReadFailure[channel] < 0)
+            return m_startReadFailure[channel];
+        m_reads[channel] = true;
+        ++m_readStartedCount[channel];
+        Wake();
+        return 0;
+    }
+
+    virtual RelayStatus StartWrite(int channel, void* const* chunks, size_t count, size_t offset)
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_writes[channel].assign(chunks, chunks + count);
+        m_writeOffsets[channel] = offset;
+        m_isWriting[channel] = true;
+        Wake();
+        return 0;
+    }
+
+    virtual void CancelAll()
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_isCancelRequested = true;
+        Wake();
+    }
+
+    virtual size_t GetChunkSize(void* chunk) { return static_cast<TestChunk*>(chunk)->size; }
+
+    virtual void ReleaseChunk(void* chunk)
+    {
+        delete static_cast<TestChunk*>(chunk);
+        ++m_releasedCount;
+    }
+
+    virtual void OnFinished(RelayStatus result)
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        ++m_finishedCount;
+        m_result = result;
+        m_hasReachedEnd[0] = m_core->HasReachedEnd(0);
+        m_hasReachedEnd[1] = m_core->HasReachedEnd(1);
+        m_finished.notify_all();
+    }
+
+    bool WaitFinished()
+    {
+        std::unique_lock<std::mutex> lock(m_lock);
+        return m_finished.wait_for(lock, std::chrono::seconds(10), [this]() { return m_finishedCount > 0; });
+    }
+
+    void SetStartReadFailure(int channel, RelayStatus status) { m_startReadFailure[channel] = status; }
+
+    // the followings are read after the relay is stalled or finished
+    int GetFinishedCount() { std::lock_guard<std::mutex> lock(m_lock); return m_finishedCount; }
+    RelayStatus GetResult() { std::lock_guard<std::mutex> lock(m_lock); return m_result; }
+    bool HasReachedEnd(int channel) { std::lock_guard<std::mutex> lock(m_lock); return m_hasReachedEnd[channel]; }
+    bool IsReading(int channel) { std::lock_guard<std::mutex> lock(m_lock); return m_reads[channel]; }
+    size_t GetReadStartedCount(int channel) { std::lock_guard<std::mutex> lock(m_lock); return m_readStartedCount[channel]; }
+    size_t GetReadBytes(int channel) { std::lock_guard<std::mutex> lock(m_lock); return m_readBytes[channel]; }
+    size_t GetWrittenBytes(int channel) { std::lock_guard<std::mutex> lock(m_lock); return m_writtenBytes[channel]; }
+    size_t GetPartialWriteCount() { std::lock_guard<std::mutex> lock(m_lock); return m_partialWriteCount; }
+    size_t GetAllocatedCount() const { return m_allocatedCount; }
+    size_t GetReleasedCount() const { return m_releasedCount; }
+
+private:
+    struct Completion
+    {
+        bool isWrite;
+        int channel;
+        RelayStatus status;
+        void* chunk;
+        size_t size;
+    };
+
+    void Wake()
+    {
+        uint64_t one = 1;
+        (void)!write(m_wake, &one, sizeof(one));
+    }
+
+    void Loop()
+    {
+        std::vector<Completion> completions;
+        while (true)
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_lock);
+                if (m_isStopping)
+                    break;
+                // endpoint i is read by channel i and written by channel 1 - i
+                for (int i = 0; i < 2; ++i)
+                {
+                    epoll_event ev = {};
+                    ev.events = (m_reads[i] ? static_cast<uint32_t>(EPOLLIN) : 0u) | (m_isWriting[1 - i] ? static_cast<uint32_t>(EPOLLOUT) : 0u);
+                    ev.data.u32 = static_cast<uint32_t>(i);
+                    epoll_ctl(m_epoll, EPOLL_CTL_MOD, m_fds[i], &ev);
+                }
+            }
+            epoll_event events[3];
+            auto n = epoll_wait(m_epoll, events, 3, -1);
+            if (n < 0 && errno != EINTR)
+                break;
+
+            std::unique_lock<std::mutex> lock(m_lock);
+            uint32_t readyEvents[2] = {};
+            for (int i = 0; i < n; ++i)
+            {
+                if (events[i].data.u32 == 2)
+                {
+                    uint64_t value;
+                    (void)!read(m_wake, &value, sizeof(value));
+                }
+                else
+                    readyEvents[events[i].data.u32] = events[i].events;
+            }
+            if (m_isCancelRequested)
+            {
+                // complete all pending operations as cancelled
+                m_isCancelRequested = false;
+                for (int i = 0; i < 2; ++i)
+                {
+                    if (m_reads[i])
+                    {
+                        m_reads[i] = false;
+                        completions.push_back({ false, i, -ECANCELED, nullptr, 0 });
+                    }
+                    if (m_isWriting[i])
+                    {
+                        m_isWriting[i] = false;
+                        completions.push_back({ true, i, -ECANCELED, nullptr, 0 });
+                    }
+                }
+            }
+            for (int i = 0; i < 2; ++i)
+            {
+                if (m_reads[i] && (readyEvents[i] & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+                    PerformRead(i, completions);
+                if (m_isWriting[1 - i] && (readyEvents[i] & (EPOLLOUT | EPOLLERR)))
+                    PerformWrite(1 - i, completions);
+            }
+            lock.unlock();
+
+            for (auto& c : completions)
+            {
+                if (c.isWrite)
+                    m_core->OnWriteCompleted(c.channel, c.status, c.size);
+                else
+                    m_core->OnReadCompleted(c.channel, c.status, c.chunk);
+            }
+            completions.clear();
+        }
+    }
+
+    void PerformRead(int channel, std::vector<Completion>& completions)
+    {
+        auto chunk = new TestChunk();
+        auto r = read(m_fds[channel], chunk->data, CHUNK_CAPACITY);
+        if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            delete chunk;
+            return;
+        }
+        m_reads[channel] = false;
+        if (r <= 0)
+        {
+            delete chunk;
+            completions.push_back({ false, channel, r < 0 ? -errno : 0, nullptr, 0 });
+            return;
+        }
+        ++m_allocatedCount;
+        chunk->size = static_cast<size_t>(r);
+        m_readBytes[channel] += chunk->size;
+        completions.push_back({ false, channel, 0, chunk, 0 });
+    }
+
+    void PerformWrite(int channel, std::vector<Completion>& completions)
+    {
+        iovec iov[RELAY_CORE_MAX_QUEUED_CHUNKS];
+        size_t total = 0;
+        auto& chunks = m_writes[channel];
+        for (size_t i = 0; i < chunks.size(); ++i)
+        {
+            auto chunk = static_cast<TestChunk*>(chunks[i]);
+            auto skip = i == 0 ? m_writeOffsets[channel] : 0;
+            iov[i].iov_base = chunk->data + skip;
+            iov[i].iov_len = chunk->size - skip;
+            total += iov[i].iov_len;
+        }
+        auto r = writev(m_fds[1 - channel], iov, static_cast<int>(chunks.size()));
+        if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        m_isWriting[channel] = false;
+        if (r < 0)
+        {
+            completions.push_back({ true, channel, -errno, nullptr, 0 });
+            return;
+        }
+        if (static_cast<size_t>(r) < total)
+            ++m_partialWriteCount;
+        m_writtenBytes[channel] += static_cast<size_t>(r);
+        completions.push_back({ true, channel, 0, nullptr, static_cast<size_t>(r) });
+    }
+
+    int m_fds[2];
+    int m_epoll;
+    int m_wake;
+    std::thread m_thread;
+    RelayCore* m_core = nullptr;
+    std::mutex m_lock;
+    std::condition_variable m_finished;
+    bool m_isStopping = false;
+    bool m_isCancelRequested = false;
+    bool m_reads[2] = {};
+    bool m_isWriting[2] = {};
+    std::vector<void*> m_writes[2];
+    size_t m_writeOffsets[2] = {};
+    RelayStatus m_startReadFailure[2] = {};
+    size_t m_readStartedCount[2] = {};
+    size_t m_readBytes[2] = {};
+    size_t m_writtenBytes[2] = {};
+    size_t m_partialWriteCount = 0;
+    std::atomic<size_t> m_allocatedCount{ 0 };
+    std::atomic<size_t> m_releasedCount{ 0 };
+    int m_finishedCount = 0;
+    RelayStatus m_result = 0;
+    bool m_hasReachedEnd[2] = {};
+};
+
+// the client and the server sockets, and the relay between them
+struct TestPair
+{
+    // [0] is used by the test as the client, and [1] by the relay as endpoint 0
+    int client[2];
+    // [0] is used by the test as the server, and [1] by the relay as endpoint 1
+    int server[2];
+
+    TestPair()
+    {
+        socketpair(AF_UNIX, SOCK_STREAM, 0, client);
+        socketpair(AF_UNIX, SOCK_STREAM, 0, server);
+    }
+    ~TestPair()
+    {
+        for (auto fd : { client[0], client[1], server[0], server[1] })
+            close(fd);
+    }
+};
+
+static unsigned char PatternByte(size_t position, unsigned seed)
+{
+    return static_cast<unsigned char>((position * 31 + seed) ^ (position >> 9));
+}
+
+static void WritePattern(int fd, size_t size, unsigned seed)
+{
+    std::vector<unsigned char> buffer(7000);
+    size_t position = 0;
+    while (position < size)
+    {
+        auto n = std::min(buffer.size(), size - position);
+        for (size_t i = 0; i < n; ++i)
+            buffer[i] = PatternByte(position + i, seed);
+        size_t sent = 0;
+        while (sent < n)
+        {
+            auto r = write(fd, buffer.data() + sent, n - sent);
+            if (r <= 0)
+                return;
+            sent += static_cast<size_t>(r);
+        }
+        position += n;
+    }
+}
+
+// Returns true if 'size' bytes of the pattern are received
+static bool ReadPattern(int fd, size_t size, unsigned seed)
+{
+    std::vector<unsigned char> buffer(5000);
+    size_t position = 0;
+    while (position < size)
+    {
+        auto r = read(fd, buffer.data(), std::min(buffer.size(), size - position));
+        if (r <= 0)
+            return false;
+        for (ssize_t i = 0; i < r; ++i)
+        {
+            if (buffer[static_cast<size_t>(i)] != PatternByte(position + static_cast<size_t>(i), seed))
+                return false;
+        }
+        position += static_cast<size_t>(r);
+    }
+    return true;
+}
+
+static void TestBidirectional()
+{
+    constexpr size_t SIZE = 4 * 1024 * 1024;
+    TestPair pair;
+    EpollRelayIo io(pair.client[1], pair.server[1]);
+    RelayCore core(&io);
+    io.SetCore(&core);
+    core.Start();
+
+    bool isUpstreamOk = false;
+    bool isDownstreamOk = false;
+    std::thread upWriter([&]() { WritePattern(pair.client[0], SIZE, 1); });
+    std::thread downWriter([&]() { WritePattern(pair.server[0], SIZE, 2); });
+    std::thread upReader([&]() { isUpstreamOk = ReadPattern(pair.server[0], SIZE, 1); });
+    std::thread downReader([&]() { isDownstreamOk = ReadPattern(pair.client[0], SIZE, 2); });
+    upWriter.join();
+    downWriter.join();
+    upReader.join();
+    downReader.join();
+    CHECK(isUpstreamOk);
+    CHECK(isDownstreamOk);
+
+    // EOF from the client closes the relay after the received data is written
+    shutdown(pair.client[0], SHUT_WR);
+    CHECK(io.WaitFinished());
+    CHECK(io.GetFinishedCount() == 1);
+    CHECK(io.GetResult() == 0);
+    CHECK(io.HasReachedEnd(0));
+    CHECK(!io.HasReachedEnd(1));
+    CHECK(io.GetAllocatedCount() == io.GetReleasedCount());
+}
+
+static void TestBackPressure()
+{
+    constexpr size_t SIZE = 8 * 1024 * 1024;
+    TestPair pair;
+    // small buffers so that the writes to the server are stalled (and finished partially) soon
+    int size = 4096;
+    setsockopt(pair.server[1], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    setsockopt(pair.server[0], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    EpollRelayIo io(pair.client[1], pair.server[1]);
+    RelayCore core(&io);
+    io.SetCore(&core);
+    core.Start();
+
+    std::thread writer([&]() { WritePattern(pair.client[0], SIZE, 3); });
+    // the server does not read, so the relay must stop reading from the client with the full queue
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    auto readStarted = io.GetReadStartedCount(0);
+    auto readBytes = io.GetReadBytes(0);
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    CHECK(!io.IsReading(0));
+    CHECK(io.GetReadStartedCount(0) == readStarted);
+    CHECK(io.GetReadBytes(0) == readBytes);
+    CHECK(readBytes < SIZE);
+    CHECK(io.GetReadBytes(0) - io.GetWrittenBytes(0) <= RELAY_CORE_MAX_QUEUED_CHUNKS * CHUNK_CAPACITY);
+
+    // reading resumes when the server drains
+    CHECK(ReadPattern(pair.server[0], SIZE, 3));
+    writer.join();
+    CHECK(io.GetWrittenBytes(0) == SIZE);
+    CHECK(io.GetPartialWriteCount() > 0);
+
+    shutdown(pair.client[0], SHUT_WR);
+    CHECK(io.WaitFinished());
+    CHECK(io.GetResult() == 0);
+    CHECK(io.GetAllocatedCount() == io.GetReleasedCount());
+}
+
+static void TestCloseCancelsPending()
+{
+    TestPair pair;
+    EpollRelayIo io(pair.client[1], pair.server[1]);
+    RelayCore core(&io);
+    io.SetCore(&core);
+    core.Start();
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    CHECK(io.GetFinishedCount() == 0);
+
+    core.Close(-5);
+    core.Close(-6);
+    CHECK(io.WaitFinished());
+    CHECK(io.GetFinishedCount() == 1);
+    CHECK(io.GetResult() == -5);
+    CHECK(!io.IsReading(0));
+    CHECK(!io.IsReading(1));
+}
+
+static void TestCloseBeforeStart()
+{
+    TestPair pair;
+    EpollRelayIo io(pair.client[1], pair.server[1]);
+    RelayCore core(&io);
+    io.SetCore(&core);
+    // (e.g. failed to connect) OnFinished is called only after the setup is finished
+    core.Close(-3);
+    CHECK(io.GetFinishedCount() == 0);
+    core.Start();
+    CHECK(io.GetFinishedCount() == 1);
+    CHECK(io.GetResult() == -3);
+    CHECK(io.GetReadStartedCount(0) == 0);
+    CHECK(io.GetReadStartedCount(1) == 0);
+}
+
+static void TestStartReadFailure()
+{
+    TestPair pair;
+    EpollRelayIo io(pair.client[1], pair.server[1]);
+    io.SetStartReadFailure(1, -7);
+    RelayCore core(&io);
+    io.SetCore(&core);
+    core.Start();
+    // the read started on channel 0 is cancelled
+    CHECK(io.WaitFinished());
+    CHECK(io.GetFinishedCount() == 1);
+    CHECK(io.GetResult() == -7);
+}
+
+static void TestWriteFailure()
+{
+    TestPair pair;
+    EpollRelayIo io(pair.client[1], pair.server[1]);
+    RelayCore core(&io);
+    io.SetCore(&core);
+    // the server has gone (but EOF of the server side is not read yet)
+    shutdown(pair.server[0], SHUT_RD);
+    core.Start();
+    unsigned char data[100] = {};
+    CHECK(write(pair.client[0], data, sizeof(data)) == static_cast<ssize_t>(sizeof(data)));
+    CHECK(io.WaitFinished());
+    CHECK(io.GetResult() == -EPIPE);
+    CHECK(io.GetAllocatedCount() == io.GetReleasedCount());
+}
+
+int main()
+{
+    // writing to the closed socket reports EPIPE instead
+    signal(SIGPIPE, SIG_IGN);
+
+    TestBidirectional();
+    TestBackPressure();
+    TestCloseCancelsPending();
+    TestCloseBeforeStart();
+    TestStartReadFailure();
+    TestWriteFailure();
+
+    if (g_failedCount > 0)
+    {
+        fprintf(stderr, "%d check(s) failed\n", g_failedCount);
+        return 1;
+    }
+    printf("all tests passed\n");
+    return 0;
+}